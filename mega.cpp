@@ -25,10 +25,19 @@
 
 /* Local includes */
 #include "src/cmd_parser.h"
+#include "src/comms.h"
 #include "src/domain.h"
 #include "src/engine.h"
+#include "src/graph.h"
+#include "src/halo_finder.h"
+#include "src/linker.h"
 #include "src/logging.h"
+#include "src/memory.h"
+#include "src/out_of_core.h"
 #include "src/params.h"
+#include "src/pipeline.h"
+#include "src/profiler.h"
+#include "src/properties.h"
 #include "src/talking.h"
 
 // Definition of the static instance pointer, this is required for the
@@ -44,6 +53,9 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  /* Start MPI (if running on several ranks). */
+  comms_init(&argc, &argv);
+
   CommandLineParser parser;
 
   /* Add runtime options with default values. */
@@ -51,6 +63,7 @@ int main(int argc, char *argv[]) {
   parser.AddOption(std::string("--verbose"), std::string("-v"), 2);
   int nthreads;
   parser.AddOption(std::string("--threads"), std::string("-t"), 8);
+  parser.AddOption(std::string("--restart"), std::string("-r"), 0);
 
   /* Parse command-line arguments and set options. */
   std::string param_file;
@@ -61,7 +74,7 @@ int main(int argc, char *argv[]) {
 
   } catch (std::exception &e) {
     std::cerr << "COMMAND LINE ARG ERROR: " << e.what() << std::endl;
-    return 1;
+    return comms_abort(1);
   }
 
   /* Set up the logging class for report to the user. */
@@ -69,6 +82,7 @@ int main(int argc, char *argv[]) {
   // Herafter, only a single instance exists which is accessed via the static
   // getInstance() method.
   Logging *log = Logging::getInstance(static_cast<LogLevel>(verbose));
+  log->setRank(comms_rank());
 
   // From here the log is setup so we can use the message, v_message,
   // error, report_error, tic, and toc macros.
@@ -79,46 +93,137 @@ int main(int argc, char *argv[]) {
     params.parseYAMLFile(param_file);
   } catch (std::exception &e) {
     report_error();
-    return 1;
+    return comms_abort(1);
   }
   // params.printAllParameters();
 
   /* With all that done... */
-  say_hello();
+  if (comms_rank() == 0) {
+    say_hello();
+  }
 
   /* Set up the Engine: attach parameters, set up output strings,
    * and instantiate the threadpool. */
+  Engine *engine;
   try {
-    Engine *engine = new Engine(params, parser, log);
+    engine = new Engine(params, parser, log);
   } catch (std::exception &e) {
     report_error();
-    return 1;
+    return comms_abort(1);
+  }
+
+  /* Binary catalogues from an earlier run already hold the halos, so there
+   * are no particles to load, just the halos to relink. */
+  if (engine->input_type == MEGA) {
+    try {
+      relink_catalogs(engine);
+    } catch (std::exception &e) {
+      report_error();
+      return comms_abort(1);
+    }
+    comms_finalize();
+    return 0;
   }
 
   /* Set up the Domain: attach useful parameters, allocate arrays,
    * and load simulation metadata. */
+  Domain *domain;
   try {
-    Domain *domain = new Domain(params, log);
+    domain = new Domain(params, log, engine->inputPath(0));
   } catch (std::exception &e) {
     report_error();
-    return 1;
+    return comms_abort(1);
   }
+  engine->domain = domain;
 
-  // engine->threadpool->map(function1, data2, 1000,
+  // engine->threadpool->map(function1, data2, 1000, sizeof(*data2),
   //                         engine->threadpool->threadpool_auto_chunk_size,
   //                         extraData);
 
-  /* The main loop of MEGA: loop over snapshots. */
-  for (int i = 0; i < 10; i++) {
-
-    /* Read the snapshot data. */
-
-    /* Construct the adaptive cell grid. */
-
-    /* Construct the tasks. */
-
-    /* Heigh-ho, heigh-ho, it's off to work we go... */
-
-    /* Clean up */
+  /* The main loop of MEGA: loop over snapshots. Snapshots are read ahead of
+   * (and written behind) the halo finding by the pipeline. */
+  try {
+    profiler_name_thread("main");
+    Pipeline pipeline(engine);
+    Generation slab_scratch;
+    Generation *prev = pipeline.restored;
+    for (int i = pipeline.first_snap; i < engine->n_generations; i++) {
+      {
+        ProfileScope profile("Snapshot");
+
+        /* Get the snapshot data (read in the background). */
+        memory_phase("Reading");
+        Generation *curr = pipeline.next();
+        engine->setSnapshot(i);
+
+        /* Heigh-ho, heigh-ho, it's off to work we go... */
+        memory_phase("Finding halos");
+        if (engine->out_of_core) {
+          find_halos_out_of_core(engine, slab_scratch, *curr);
+        } else {
+          curr->attach(domain);
+          find_halos(engine, curr->catalog);
+        }
+
+        /* (Out of core each slab's halos got their properties while the
+         * slab was in memory.) */
+        if (engine->calculate_props && !engine->out_of_core) {
+          memory_phase("Properties");
+          calculate_halo_properties(engine, curr->catalog);
+        }
+
+        /* Link to the previous generation, which is then done with and can
+         * be written out (in the background). Across ranks the halos are
+         * linked through the particle IDs each rank owns rather than an
+         * index. */
+        memory_phase("Linking");
+        if (engine->nranks > 1) {
+          if (prev != nullptr) {
+            link_halos_distributed(engine, *prev, *curr);
+            pipeline.retire(prev);
+          }
+        } else {
+          curr->index.build(engine, *curr);
+          if (prev != nullptr) {
+            link_halos(engine, *prev, *curr);
+            pipeline.retire(prev);
+          }
+        }
+        prev = curr;
+      }
+
+      /* What every thread did while this snapshot was processed. */
+      if (engine->cpu_prof) {
+        profiler_write(
+            engine->profilePath("cpu_profile_" + engine->snapshotTag(i)),
+            "CPU profile of snapshot " + engine->snapshotTag(i), false);
+      }
+      if (engine->mem_prof) {
+        memory_write(
+            engine->profilePath("mem_profile_" + engine->snapshotTag(i)),
+            "Memory profile of snapshot " + engine->snapshotTag(i));
+      }
+    }
+
+    /* Write out the last generation and wait for the writing to finish. */
+    memory_phase("Writing");
+    if (prev != nullptr) {
+      pipeline.retire(prev);
+    }
+    pipeline.finish();
+    if (engine->cpu_prof) {
+      profiler_write(engine->profilePath("cpu_profile_total"),
+                     "CPU profile of the whole run", true);
+    }
+    if (engine->mem_prof) {
+      memory_write(engine->profilePath("mem_profile_total"),
+                   "Memory profile of the end of the run");
+    }
+  } catch (std::exception &e) {
+    report_error();
+    return comms_abort(1);
   }
+
+  comms_finalize();
+  return 0;
 }
@@ -0,0 +1,293 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for checkpointing the snapshot loop.
+ *
+ * A checkpoint is written once a generation has been written out. It holds
+ * everything needed to carry on from the next snapshot: the halo members of
+ * the generation, which the next snapshot is linked against, and the state of
+ * the merger graph. Only the particles in a halo are kept, as rows of their
+ * ID and the halo they're in at each depth sorted by ID, and the ID index is
+ * rebuilt over them on restart. On several ranks each rank writes its own,
+ * also holding the memberships of the IDs it owns (see
+ * link_halos_distributed). The file is raw binary (scalars and
+ * length-prefixed arrays) so restarting only takes as long as reading it.
+ *
+ * The layout is:
+ *   magic, version, snapshot, nranks, nhalos, halo_offset, ndepths, ids,
+ *   halos, shared, min_id, max_id, owned_ndepths, owned_ids, owned_halos,
+ *   has_graph, [last_snap, nrecords, labels, frontier], magic
+ *
+ * where halos holds ndepths halos for each ID (and owned_halos
+ * owned_ndepths for each owned ID).
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+/* Local includes. */
+#include "checkpoint.h"
+#include "logging.h"
+#include "profiler.h"
+#include "radix_sort.h"
+
+/** @brief Write a scalar to a checkpoint.
+ *
+ * @param out The checkpoint.
+ * @param value The value.
+ */
+template <typename T> static void write_value(std::ofstream &out, T value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+/** @brief Write an array (prefixed by its length) to a checkpoint.
+ *
+ * @param out The checkpoint.
+ * @param vec The array.
+ */
+template <typename T, typename A>
+static void write_vector(std::ofstream &out, const std::vector<T, A> &vec) {
+  write_value<uint64_t>(out, vec.size());
+  out.write(reinterpret_cast<const char *>(vec.data()), vec.size() * sizeof(T));
+}
+
+/** @brief Read a scalar from a checkpoint.
+ *
+ * @param in The checkpoint.
+ */
+template <typename T> static T read_value(std::ifstream &in) {
+  T value;
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+  return value;
+}
+
+/** @brief Read an array (prefixed by its length) from a checkpoint.
+ *
+ * @param in The checkpoint.
+ * @param vec The array (resized).
+ */
+template <typename T, typename A>
+static void read_vector(std::ifstream &in, std::vector<T, A> &vec) {
+  uint64_t size = read_value<uint64_t>(in);
+  if (!in) {
+    return;
+  }
+  vec.resize(size);
+  in.read(reinterpret_cast<char *>(vec.data()), size * sizeof(T));
+}
+
+/** @brief Write the checkpoint after a generation has been written out.
+ *
+ * The checkpoint is written to a temporary file and moved into place, so the
+ * last complete checkpoint survives a crash while writing the next.
+ *
+ * @param engine The engine.
+ * @param gen The generation just written.
+ * @param graph The merger graph (nullptr if not outputting graphs).
+ */
+void write_checkpoint(const Engine *engine, const Generation &gen,
+                      const GraphBuilder *graph) {
+
+  tic();
+  ProfileScope profile("Checkpointing");
+
+  std::string path = engine->checkpointPath();
+  std::string tmp_path = path + ".tmp";
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+
+  write_value<uint64_t>(out, checkpoint_magic);
+  write_value<uint64_t>(out, checkpoint_version);
+  write_value<int64_t>(out, gen.snap);
+
+  /* The halo members (in a halo at any depth), sorted by ID. */
+  const HaloCatalog &catalog = gen.catalog;
+  size_t ndepths = catalog.halo_id.size();
+  member_vector<size_t> ids;
+  member_vector<size_t> order;
+  size_t lowest = SIZE_MAX, highest = 0;
+  for (size_t p = 0; ndepths > 0 && p < catalog.halo_id[0].size(); p++) {
+    for (size_t d = 0; d < ndepths; d++) {
+      if (catalog.halo_id[d][p] != halo_null) {
+        size_t id = gen.partId(p);
+        ids.push_back(id);
+        order.push_back(p);
+        lowest = std::min(lowest, id);
+        highest = std::max(highest, id);
+        break;
+      }
+    }
+  }
+  radix_sort<size_t, size_t>(engine->threadpool, ids.data(), order.data(),
+                             ids.size(), nullptr, nullptr, lowest, highest);
+
+  /* And the halo each is in at each depth. */
+  member_vector<int64_t> halos(ids.size() * ndepths);
+  for (size_t i = 0; i < ids.size(); i++) {
+    for (size_t d = 0; d < ndepths; d++) {
+      halos[i * ndepths + d] = catalog.halo_id[d][order[i]];
+    }
+  }
+
+  write_value<int64_t>(out, engine->nranks);
+  write_value<uint64_t>(out, catalog.nhalos);
+  write_value<uint64_t>(out, gen.halo_offset);
+  write_value<uint64_t>(out, ndepths);
+  write_vector(out, ids);
+  write_vector(out, halos);
+
+  /* The memberships of the IDs this rank owns. */
+  const OwnedMemberships &owned = gen.owned;
+  write_value<uint64_t>(out, owned.shared);
+  write_value<uint64_t>(out, owned.min_id);
+  write_value<uint64_t>(out, owned.max_id);
+  write_value<int64_t>(out, owned.ndepths);
+  write_vector(out, owned.ids);
+  write_vector(out, owned.halos);
+
+  /* The merger graph. */
+  write_value<uint64_t>(out, graph != nullptr);
+  if (graph != nullptr) {
+    write_value<int64_t>(out, graph->last_snap);
+    write_value<uint64_t>(out, graph->nrecords);
+    write_vector(out, graph->labels);
+    write_vector(out, graph->frontier);
+  }
+
+  write_value<uint64_t>(out, checkpoint_magic);
+  out.close();
+  if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    error("Failed to write the checkpoint %s!", path.c_str());
+  }
+
+  v_message("Wrote a checkpoint after snapshot %d (%zu halo members)",
+            gen.snap, ids.size());
+
+  toc("Writing a checkpoint");
+}
+
+/** @brief Restore the last generation written (and the graph) from the
+ * checkpoint.
+ *
+ * The generation is restored as already written, holding everything needed
+ * to link the next snapshot to it (but not its particles or properties). Its
+ * halo_id and ID index only cover the halo members, so the i-th member (in
+ * ID order) stands in for a particle.
+ *
+ * @param engine The engine.
+ * @param gen The generation to restore into.
+ * @param graph The merger graph (nullptr if not outputting graphs).
+ */
+void read_checkpoint(const Engine *engine, Generation &gen,
+                     GraphBuilder *graph) {
+
+  tic();
+  ProfileScope profile("Restoring");
+
+  std::string path = engine->checkpointPath();
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    error("There is no checkpoint to restart from (%s)!", path.c_str());
+  }
+
+  if (read_value<uint64_t>(in) != checkpoint_magic) {
+    error("%s is not a MEGA checkpoint!", path.c_str());
+  }
+  uint64_t version = read_value<uint64_t>(in);
+  if (version != checkpoint_version) {
+    error("The checkpoint %s is version %llu, expected %d!", path.c_str(),
+          static_cast<unsigned long long>(version), checkpoint_version);
+  }
+  gen.reset();
+  gen.snap = static_cast<int>(read_value<int64_t>(in));
+
+  int nranks = static_cast<int>(read_value<int64_t>(in));
+  if (in && nranks != engine->nranks) {
+    error("The checkpoint %s was written on %d ranks, restart on the same "
+          "number (not %d)!",
+          path.c_str(), nranks, engine->nranks);
+  }
+
+  /* The halo members. */
+  HaloCatalog &catalog = gen.catalog;
+  catalog.nhalos = read_value<uint64_t>(in);
+  gen.halo_offset = read_value<uint64_t>(in);
+  size_t ndepths = read_value<uint64_t>(in);
+  member_vector<size_t> ids;
+  member_vector<int64_t> halos;
+  read_vector(in, ids);
+  read_vector(in, halos);
+  if (!in || halos.size() != ids.size() * ndepths) {
+    error("The checkpoint %s is incomplete!", path.c_str());
+  }
+
+  /* The memberships of the IDs this rank owns, which the next snapshot is
+   * linked against across ranks (there are no particles to share out). */
+  OwnedMemberships &owned = gen.owned;
+  owned.shared = read_value<uint64_t>(in);
+  owned.min_id = read_value<uint64_t>(in);
+  owned.max_id = read_value<uint64_t>(in);
+  owned.ndepths = static_cast<int>(read_value<int64_t>(in));
+  read_vector(in, owned.ids);
+  read_vector(in, owned.halos);
+  if (in && nranks > 1 && !owned.shared) {
+    error("The checkpoint %s doesn't hold the memberships shared between "
+          "ranks, so can't be restarted on several ranks!",
+          path.c_str());
+  }
+
+  /* The merger graph. */
+  bool has_graph = read_value<uint64_t>(in);
+  if (has_graph != (graph != nullptr)) {
+    error("The checkpoint %s was written %s graph output!", path.c_str(),
+          has_graph ? "with" : "without");
+  }
+  if (graph != nullptr) {
+    graph->last_snap = static_cast<int>(read_value<int64_t>(in));
+    graph->nrecords = read_value<uint64_t>(in);
+    read_vector(in, graph->labels);
+    read_vector(in, graph->frontier);
+  }
+
+  if (!in || read_value<uint64_t>(in) != checkpoint_magic) {
+    error("The checkpoint %s is incomplete!", path.c_str());
+  }
+  if (graph != nullptr) {
+    graph->resume();
+  }
+
+  /* Rebuild the membership and index over the members. */
+  catalog.halo_id.resize(ndepths);
+  for (size_t d = 0; d < ndepths; d++) {
+    member_vector<int64_t> &halo_id = catalog.halo_id[d];
+    halo_id.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+      halo_id[i] = halos[i * ndepths + d];
+    }
+  }
+  halos = member_vector<int64_t>();
+  gen.index.buildSorted(ids.data(), ids.size());
+  gen.written = true;
+
+  message("Restarting after snapshot %d (%zu halos)", gen.snap,
+          catalog.nhalos);
+
+  toc("Reading the checkpoint");
+}
@@ -0,0 +1,42 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the prototypes for checkpointing the snapshot
+ * loop and restarting from a checkpoint.
+ ******************************************************************************/
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+/* Local includes. */
+#include "engine.h"
+#include "generation.h"
+#include "graph.h"
+
+/* The first and last 8 bytes of a checkpoint ("MEGACKPT"), the file is only
+ * complete if both are there. */
+#define checkpoint_magic 0x54504b4341474d45ull
+
+/* The version of the checkpoint layout. */
+#define checkpoint_version 3
+
+/* Prototypes */
+void write_checkpoint(const Engine *engine, const Generation &gen,
+                      const GraphBuilder *graph);
+void read_checkpoint(const Engine *engine, Generation &gen,
+                     GraphBuilder *graph);
+
+#endif // CHECKPOINT_H_
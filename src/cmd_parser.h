@@ -22,6 +22,7 @@
 #define COMMANDLINEPARSER_H
 
 /* Includes */
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <sstream>
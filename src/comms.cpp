@@ -0,0 +1,270 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for communicating between ranks.
+ *
+ * Only the main thread ever communicates (the pipeline's reader and writer
+ * and the threadpool never do), so MPI is initialised with
+ * MPI_THREAD_FUNNELED.
+ ******************************************************************************/
+
+/* Includes. */
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#ifdef WITH_MPI
+#include <mpi.h>
+#endif
+
+/* Local includes. */
+#include "comms.h"
+#include "logging.h"
+
+/** @brief Start MPI (if running with it).
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ */
+void comms_init(int *argc, char ***argv) {
+#ifdef WITH_MPI
+  int provided;
+  MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+  if (provided < MPI_THREAD_FUNNELED) {
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+#else
+  (void)argc;
+  (void)argv;
+#endif
+}
+
+/** @brief Stop MPI (if running with it).
+ */
+void comms_finalize() {
+#ifdef WITH_MPI
+  MPI_Finalize();
+#endif
+}
+
+/** @brief Give up after an error.
+ *
+ * With several ranks the others would wait on this one forever, so every
+ * rank is taken down.
+ *
+ * @param code The exit code.
+ *
+ * @return The exit code (if there's only one rank).
+ */
+int comms_abort(int code) {
+#ifdef WITH_MPI
+  if (comms_size() > 1) {
+    MPI_Abort(MPI_COMM_WORLD, code);
+  }
+  MPI_Finalize();
+#endif
+  return code;
+}
+
+/** @brief Get this process's rank.
+ */
+int comms_rank() {
+#ifdef WITH_MPI
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  return rank;
+#else
+  return 0;
+#endif
+}
+
+/** @brief Get the number of ranks.
+ */
+int comms_size() {
+#ifdef WITH_MPI
+  int nranks;
+  MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+  return nranks;
+#else
+  return 1;
+#endif
+}
+
+/** @brief Get the MPI library's version (empty without MPI).
+ */
+std::string comms_version() {
+#ifdef WITH_MPI
+  char version[MPI_MAX_LIBRARY_VERSION_STRING];
+  int len;
+  MPI_Get_library_version(version, &len);
+  std::string str(version, len);
+
+  /* Only the first line is of any interest. */
+  return str.substr(0, str.find_first_of("\r\n,"));
+#else
+  return "";
+#endif
+}
+
+/** @brief Sum a count over every rank.
+ *
+ * @param value This rank's count.
+ *
+ * @return The sum (on every rank).
+ */
+size_t sum_over_ranks(size_t value) {
+#ifdef WITH_MPI
+  uint64_t local = value, total;
+  MPI_Allreduce(&local, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+  return total;
+#else
+  return value;
+#endif
+}
+
+/** @brief Get the smallest of a value over every rank.
+ *
+ * @param value This rank's value.
+ *
+ * @return The smallest (on every rank).
+ */
+size_t min_over_ranks(size_t value) {
+#ifdef WITH_MPI
+  uint64_t local = value, min;
+  MPI_Allreduce(&local, &min, 1, MPI_UINT64_T, MPI_MIN, MPI_COMM_WORLD);
+  return min;
+#else
+  return value;
+#endif
+}
+
+/** @brief Get the largest of a value over every rank.
+ *
+ * @param value This rank's value.
+ *
+ * @return The largest (on every rank).
+ */
+size_t max_over_ranks(size_t value) {
+#ifdef WITH_MPI
+  uint64_t local = value, max;
+  MPI_Allreduce(&local, &max, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+  return max;
+#else
+  return value;
+#endif
+}
+
+/** @brief Sum a count over the ranks before this one.
+ *
+ * @param value This rank's count.
+ *
+ * @return The sum (0 on the first rank).
+ */
+size_t offset_over_ranks(size_t value) {
+#ifdef WITH_MPI
+  uint64_t local = value, offset = 0;
+  MPI_Exscan(&local, &offset, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+  return comms_rank() == 0 ? 0 : offset;
+#else
+  (void)value;
+  return 0;
+#endif
+}
+
+/** @brief Gather a value from every rank (onto every rank).
+ *
+ * @param value This rank's value.
+ *
+ * @return Every rank's value, in rank order.
+ */
+std::vector<size_t> gather_over_ranks(size_t value) {
+#ifdef WITH_MPI
+  uint64_t local = value;
+  std::vector<uint64_t> all(comms_size());
+  MPI_Allgather(&local, 1, MPI_UINT64_T, all.data(), 1, MPI_UINT64_T,
+                MPI_COMM_WORLD);
+  return std::vector<size_t>(all.begin(), all.end());
+#else
+  return {value};
+#endif
+}
+
+/** @brief Tell every rank how many elements this rank is sending it.
+ *
+ * @param send_counts The number of elements for each rank.
+ *
+ * @return The number of elements coming from each rank.
+ */
+std::vector<size_t> exchange_counts(const std::vector<size_t> &send_counts) {
+#ifdef WITH_MPI
+  std::vector<uint64_t> send(send_counts.begin(), send_counts.end());
+  std::vector<uint64_t> recv(send.size());
+  MPI_Alltoall(send.data(), 1, MPI_UINT64_T, recv.data(), 1, MPI_UINT64_T,
+               MPI_COMM_WORLD);
+  return std::vector<size_t>(recv.begin(), recv.end());
+#else
+  return send_counts;
+#endif
+}
+
+/** @brief Send every rank its elements, receiving this rank's from every
+ * rank (see exchange_between_ranks).
+ *
+ * The elements are sent as a contiguous type of elem_size bytes, so the
+ * counts (and offsets) MPI takes are in elements rather than bytes.
+ *
+ * @param send The elements to send, each rank's contiguous in rank order.
+ * @param send_counts The number of elements for each rank.
+ * @param recv Where the elements received go (room for all of them).
+ * @param recv_counts The number of elements coming from each rank.
+ * @param elem_size The size of an element in bytes.
+ */
+void exchange_bytes(const void *send, const std::vector<size_t> &send_counts,
+                    void *recv, const std::vector<size_t> &recv_counts,
+                    size_t elem_size) {
+#ifdef WITH_MPI
+  int nranks = comms_size();
+  std::vector<int> scounts(nranks), sdispls(nranks), rcounts(nranks),
+      rdispls(nranks);
+  size_t soffset = 0, roffset = 0;
+  for (int r = 0; r < nranks; r++) {
+    if (soffset + send_counts[r] > INT_MAX ||
+        roffset + recv_counts[r] > INT_MAX) {
+      error("Too many elements (%zu sent, %zu received) to exchange!",
+            soffset + send_counts[r], roffset + recv_counts[r]);
+    }
+    scounts[r] = static_cast<int>(send_counts[r]);
+    sdispls[r] = static_cast<int>(soffset);
+    rcounts[r] = static_cast<int>(recv_counts[r]);
+    rdispls[r] = static_cast<int>(roffset);
+    soffset += send_counts[r];
+    roffset += recv_counts[r];
+  }
+
+  MPI_Datatype type;
+  MPI_Type_contiguous(static_cast<int>(elem_size), MPI_BYTE, &type);
+  MPI_Type_commit(&type);
+  MPI_Alltoallv(send, scounts.data(), sdispls.data(), type, recv,
+                rcounts.data(), rdispls.data(), type, MPI_COMM_WORLD);
+  MPI_Type_free(&type);
+#else
+  (void)recv_counts;
+  if (!send_counts.empty() && send_counts[0] > 0) {
+    std::memcpy(recv, send, send_counts[0] * elem_size);
+  }
+#endif
+}
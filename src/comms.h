@@ -0,0 +1,70 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the prototypes for communicating between ranks.
+ * Without MPI (WITH_MPI) there is a single rank and these do nothing.
+ ******************************************************************************/
+#ifndef COMMS_H_
+#define COMMS_H_
+
+/* Includes */
+#include <cstddef>
+#include <numeric>
+#include <string>
+#include <vector>
+
+/* Prototypes */
+void comms_init(int *argc, char ***argv);
+void comms_finalize();
+int comms_abort(int code);
+int comms_rank();
+int comms_size();
+std::string comms_version();
+size_t sum_over_ranks(size_t value);
+size_t min_over_ranks(size_t value);
+size_t max_over_ranks(size_t value);
+size_t offset_over_ranks(size_t value);
+std::vector<size_t> gather_over_ranks(size_t value);
+std::vector<size_t> exchange_counts(const std::vector<size_t> &send_counts);
+void exchange_bytes(const void *send, const std::vector<size_t> &send_counts,
+                    void *recv, const std::vector<size_t> &recv_counts,
+                    size_t elem_size);
+
+/** @brief Send every rank its part of an array, receiving this rank's part
+ * from every rank (an all-to-all).
+ *
+ * The elements for each rank are contiguous, in rank order, and those
+ * received come back the same way.
+ *
+ * @param send The elements to send.
+ * @param send_counts The number of elements for each rank.
+ *
+ * @return The elements received.
+ */
+template <typename T, typename A>
+std::vector<T, A>
+exchange_between_ranks(const std::vector<T, A> &send,
+                       const std::vector<size_t> &send_counts) {
+  std::vector<size_t> recv_counts = exchange_counts(send_counts);
+  std::vector<T, A> recv(
+      std::accumulate(recv_counts.begin(), recv_counts.end(), size_t(0)));
+  exchange_bytes(send.data(), send_counts, recv.data(), recv_counts,
+                 sizeof(T));
+  return recv;
+}
+
+#endif // COMMS_H_
@@ -0,0 +1,29 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the physical constants used by MEGA++.
+ *
+ * All constants are in the internal units, which are the default SWIFT
+ * internal units: 10^10 Msun, Mpc, km/s.
+ ******************************************************************************/
+#ifndef CONSTANTS_H_
+#define CONSTANTS_H_
+
+/* The gravitational constant [Mpc (km/s)^2 / 10^10 Msun]. */
+#define grav_const 43.0091
+
+#endif // CONSTANTS_H_
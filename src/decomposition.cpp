@@ -0,0 +1,94 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for splitting the box between ranks.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cmath>
+
+/* Local includes. */
+#include "decomposition.h"
+#include "logging.h"
+
+/** @brief The constructor for the Decomposition, splitting the box between
+ * the ranks by the particles in each plane of the snapshot's cells.
+ *
+ * @param files The snapshot.
+ * @param boxsize The size of the box along x.
+ * @param nranks The number of ranks.
+ */
+Decomposition::Decomposition(const SnapshotFiles &files, double boxsize,
+                             int nranks)
+    : Decomposition(files.readCells(), boxsize, nranks) {}
+
+/** @brief The constructor for the Decomposition, splitting the box between
+ * the ranks by the particles in each plane of cells.
+ *
+ * @param cells The cell metadata.
+ * @param boxsize The size of the box along x.
+ * @param nranks The number of ranks.
+ */
+Decomposition::Decomposition(const SnapshotCells &cells, double boxsize,
+                             int nranks)
+    : nranks(nranks) {
+
+  /* The cost of each plane of cells (the particles in it). */
+  int nplanes = std::max(1, static_cast<int>(
+                                std::lround(boxsize / cells.width[0])));
+  if (nplanes < nranks) {
+    error("There are only %d planes of cells to split between %d ranks!",
+          nplanes, nranks);
+  }
+  std::vector<size_t> cost(nplanes, 0);
+  size_t total = 0;
+  for (size_t c = 0; c < cells.size(); c++) {
+    int plane = static_cast<int>(
+        std::floor(cells.centres[3 * c] / boxsize * nplanes));
+    cost[std::clamp(plane, 0, nplanes - 1)] += cells.counts[c];
+    total += cells.counts[c];
+  }
+
+  /* Give each rank planes until it has its share of the cost, leaving at
+   * least one plane for each of the ranks after it. */
+  std::vector<int> first(nranks + 1, 0);
+  first[nranks] = nplanes;
+  int plane = 0;
+  size_t taken = 0;
+  for (int rank = 1; rank < nranks; rank++) {
+    double share = static_cast<double>(total) * rank / nranks;
+    while (plane < nplanes - (nranks - rank) &&
+           (plane <= first[rank - 1] || taken + cost[plane] <= share)) {
+      taken += cost[plane++];
+    }
+    first[rank] = plane;
+  }
+
+  bounds.resize(nranks + 1);
+  counts.assign(nranks, 0);
+  for (int rank = 0; rank < nranks; rank++) {
+    bounds[rank] = boxsize * first[rank] / nplanes;
+    for (int p = first[rank]; p < first[rank + 1]; p++) {
+      counts[rank] += cost[p];
+    }
+    v_message("Rank %d has %d planes of cells, [%g, %g), with %zu particles",
+              rank, first[rank + 1] - first[rank], bounds[rank],
+              boxsize * first[rank + 1] / nplanes, counts[rank]);
+  }
+  bounds[nranks] = boxsize;
+}
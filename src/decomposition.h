@@ -0,0 +1,65 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definition of the domain decomposition,
+ * splitting the box between ranks.
+ ******************************************************************************/
+#ifndef DECOMPOSITION_H_
+#define DECOMPOSITION_H_
+
+/* Includes */
+#include <cstddef>
+#include <vector>
+
+/* Local includes. */
+#include "snapshot.h"
+
+/**
+ * @class Decomposition
+ * @brief Which part of the box each rank finds the halos in.
+ *
+ * The box is split along x at the boundaries of SWIFT's top level cells
+ * (/Cells), each rank taking a block of whole planes of cells. The blocks are
+ * weighted by cost, the number of particles in them, so each rank has as near
+ * as possible the same number of particles to search rather than the same
+ * volume. Every rank works out the same decomposition from the cell metadata
+ * alone, so nothing needs communicating.
+ *
+ * A rank reads its own particles straight from the snapshot, along with a
+ * buffer around them (see out_of_core.h), so halos crossing from one rank to
+ * the next are found whole by the rank their lowest ID particle is on.
+ *
+ * @param nranks The number of ranks.
+ * @param bounds The x boundaries of each rank's block (nranks + 1 of them).
+ * @param counts The number of particles in each rank's block.
+ */
+class Decomposition {
+public:
+  /* The number of ranks. */
+  int nranks;
+
+  /* The x boundaries of each rank's block (nranks + 1 of them). */
+  std::vector<double> bounds;
+
+  /* The number of particles in each rank's block. */
+  std::vector<size_t> counts;
+
+  Decomposition(const SnapshotFiles &files, double boxsize, int nranks);
+  Decomposition(const SnapshotCells &cells, double boxsize, int nranks);
+};
+
+#endif // DECOMPOSITION_H_
@@ -24,24 +24,32 @@
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 /* Local includes. */
 #include "cell.h"
 #include "domain.h"
+#include "memory.h"
 #include "params.h"
 #include "particles.h"
 #include "serial_io.h"
+#include "snapshot.h"
 
 /** @brief The constructor for the Domain.
  *
  * This will set all the parameters passed from the parameter file and attach
- * them to the Domain object. It will also allocate the arrays for Cells and
- * Particles which will live until MEGA is finished.
+ * them to the Domain object. It will also allocate the arrays for Cells
+ * which will live until MEGA is finished. The particle arrays belong to the
+ * generation being worked on and are attached as each snapshot is read.
  *
  * @param params An instance of the Parameters class containing the parameter
  *               file contents.
+ * @param first_snapshot The first snapshot, whose header the box and
+ *                       particle counts are read from.
  */
-Domain::Domain(Parameters params, Logging *log) {
+Domain::Domain(Parameters params, Logging *log,
+               const std::string &first_snapshot) {
+  (void)log;
 
   tic();
 
@@ -84,21 +92,37 @@ Domain::Domain(Parameters params, Logging *log) {
   ntop_cells = cdim[0] * cdim[1] * cdim[2];
   message("There are %d top level cells in total", ntop_cells);
 
-  /* Open the first snapshot and get some metadata. */
-  HDF5Helper *snap = new HDF5Helper(
-      "/Users/willroper/Documents/3D Printing/Python/ani_hydro_1379.hdf5");
+  /* Open the first snapshot (or the first of its files) and get some
+   * metadata. */
+  SnapshotFiles files(first_snapshot);
+  HDF5Helper snap(files.paths[0]);
 
-  /* Read the boxsize. */
-  if (!(snap->readAttribute("/Header", "BoxSize", boxsize))) {
-    error("Failed to read the BoxSize from the snapshot!");
+  /* Read the boxsize (a single value for a cubic box). */
+  std::vector<double> box;
+  if (!snap.readAttributeArray("/Header", "BoxSize", box) ||
+      (box.size() != 1 && box.size() != 3)) {
+    error("Failed to read the BoxSize from %s!", files.paths[0].c_str());
+  }
+  for (int i = 0; i < 3; i++) {
+    boxsize[i] = box[box.size() == 3 ? i : 0];
   }
   message("Read box dimensions from the first snapshot: [%.2f, %.2f, %.2f]",
           boxsize[0], boxsize[1], boxsize[2]);
 
-  /* Read the number of particles in total. */
-  if (!(snap->readAttribute("/Header", "NumPart_Total", npart_type))) {
-    error("Failed to read the NumPart_Total from the snapshot!");
+  /* Read the number of particles in total (if the header has them). Counts
+   * above 2^32 carry on in NumPart_Total_HighWord, and the dark matter is
+   * counted from the files themselves (see SnapshotFiles). */
+  std::vector<int64_t> npart_total, high_word;
+  snap.readAttributeArray("/Header", "NumPart_Total", npart_total);
+  snap.readAttributeArray("/Header", "NumPart_Total_HighWord", high_word);
+  for (int i = 0; i < num_part_species; i++) {
+    npart_type[i] = i < static_cast<int>(npart_total.size()) ? npart_total[i]
+                                                              : 0;
+    if (i < static_cast<int>(high_word.size())) {
+      npart_type[i] += high_word[i] << 32;
+    }
   }
+  npart_type[1] = files.nrows_total;
 
   /* Zero any particle counts not flagged for use in part_flags. */
   for (int i = 0; i < num_part_species; i++) {
@@ -116,7 +140,6 @@ Domain::Domain(Parameters params, Logging *log) {
   s_arr += "]";
   message("Read the number of particles from the first snapshot: %s",
           s_arr.c_str());
-  delete snap;
 
   // Set the total number of particles.
   npart_tot = 0;
@@ -128,7 +151,8 @@ Domain::Domain(Parameters params, Logging *log) {
         "The total number of particles is 0! Check your Particles:part_type_* "
         "parameters and ensure a non-zero particle species is flagged.");
   }
-  message("Total number of particles: %ld", npart_tot);
+  message("Total number of particles: %zu", npart_tot);
+  npart_dm_sim = npart_type[1];
 
   // Calculate the width of the top level cells.
   for (int ijk = 0; ijk < 3; ijk++) {
@@ -136,21 +160,55 @@ Domain::Domain(Parameters params, Logging *log) {
     iwidth[ijk] = 1 / width[ijk];
   }
 
-  // Allocate the array for dark matter particles.
-  dark_matter = (DMParticle *)std::aligned_alloc(
-      part_align, npart_type[1] * sizeof(DMParticle));
+  // The particles are owned by the Generation being worked on (see
+  // Pipeline), which points the Domain at them once they are read.
+  dark_matter = nullptr;
+  fof_group = nullptr;
 
 #ifndef DARK_MATTER_ONLY
   // Allocate the array for baryonic particles.
 #endif
 
-  // Allocate the array of top level cells
-  top_cells = (Cell *)std::aligned_alloc(cell_align, ntop_cells * sizeof(Cell));
+  // Allocate the array of top level cells (aligned_alloc needs a whole
+  // number of alignments)
+  size_t top_bytes = ntop_cells * sizeof(Cell);
+  top_bytes = (top_bytes + cell_align - 1) / cell_align * cell_align;
+  top_cells = (Cell *)memory_alloc(mem_cells, cell_align, top_bytes);
 
   // Allocate the array of subcells (starts with the entire first layer of the
   // tree as a guess)
-  sub_cells =
-      (Cell *)std::aligned_alloc(cell_align, 8 * ntop_cells * sizeof(Cell));
+  size_t sub_bytes = 8 * ntop_cells * sizeof(Cell);
+  sub_bytes = (sub_bytes + cell_align - 1) / cell_align * cell_align;
+  sub_cells = (Cell *)memory_alloc(mem_cells, cell_align, sub_bytes);
 
   toc("Initialising the Domain");
 }
+
+/** @brief Construct a Domain for particles already in memory.
+ *
+ * Only the box is set, there are no cells and no particles until they are
+ * attached (as a Generation does).
+ *
+ * @param box The size of the volume along each axis.
+ * @param is_periodic Is the volume periodic?
+ */
+Domain::Domain(const double *box, int is_periodic)
+    : periodic(is_periodic), is_zoom(0), npart_tot(0), npart_dm_sim(0),
+      ncells(0), ntop_cells(0), top_cells(nullptr), sub_cells(nullptr),
+      dark_matter(nullptr), fof_group(nullptr) {
+  for (int i = 0; i < 3; i++) {
+    boxsize[i] = box[i];
+    cdim[i] = 0;
+    width[i] = box[i];
+    iwidth[i] = 1 / box[i];
+  }
+  for (int i = 0; i < num_part_species; i++) {
+    npart_type[i] = 0;
+    part_flags[i] = 0;
+  }
+#ifndef DARK_MATTER_ONLY
+  gas = nullptr;
+  stars = nullptr;
+  black_holes = nullptr;
+#endif /* DARK_MATTER_ONLY */
+}
@@ -21,6 +21,10 @@
 #ifndef DOMAIN_H_
 #define DOMAIN_H_
 
+/* Includes */
+#include <cstdint>
+#include <string>
+
 /* Local includes. */
 #include "cell.h"
 #include "logging.h"
@@ -49,6 +53,7 @@
  * @param boxsize The size of the simulation volume along each axis.
  * @param npart_type The number of particles of each type (0-6).
  * @param npart_tot The total number of particles of any type.
+ * @param npart_dm_sim The number of dark matter particles in the simulation.
  * @param cdim The number of cells along an axis.
  * @param ncells The total number of cells.
  * @param ntop_cells The total number of top level cells.
@@ -69,11 +74,16 @@ public:
   double boxsize[3];
 
   /* Number of particles of each type. */
-  int npart_type[num_part_species];
+  int64_t npart_type[num_part_species];
 
   /* Total number of particles. */
   size_t npart_tot;
 
+  /* The number of dark matter particles in the whole simulation, the
+   * linking lengths are defined by their mean separation. This is more than
+   * npart_type[1] if only some were loaded (a region or FOF groups). */
+  size_t npart_dm_sim;
+
   /* Which particle types are we working on? */
   int part_flags[num_part_species];
 
@@ -98,9 +108,13 @@ public:
   /* The pool of cells for the cell tree. */
   Cell *sub_cells;
 
-  /* The dark matter particles array. */
+  /* The dark matter particles array (owned by the current Generation). */
   DMParticle *dark_matter;
 
+  /* The FOF group of each dark matter particle (owned by the current
+   * Generation, nullptr unless the input is FOF groups). */
+  const int64_t *fof_group;
+
 #ifndef DARK_MATTER_ONLY
 
   /* The gas particles array. */
@@ -113,7 +127,8 @@ public:
   BHParticle *black_holes;
 
 #endif /* DARK_MATTER_ONLY */
-  Domain(Parameters params, Logging *log);
+  Domain(Parameters params, Logging *log, const std::string &first_snapshot);
+  Domain(const double *box, int is_periodic);
   ~Domain();
 
 private:
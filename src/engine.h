@@ -23,6 +23,7 @@
 
 /* Includes */
 #include <algorithm>
+#include <cstdio>
 #include <map>
 #include <regex>
 #include <stdexcept>
@@ -31,16 +32,22 @@
 
 /* Local includes. */
 #include "cmd_parser.h"
+#include "comms.h"
 #include "domain.h"
+#include "load_plan.h"
 #include "logging.h"
+#include "memory.h"
 #include "params.h"
+#include "profiler.h"
+#include "property_registry.h"
+#include "serial_io.h"
 #include "threadpool.h"
 
 /* The input data types. */
 enum inputTypes { MEGA, SWIFT, FOF };
 
 /* Make a map to convert from strings to enum. */
-std::map<std::string, inputTypes> inputTypesMap{
+inline std::map<std::string, inputTypes> inputTypesMap{
     {"MEGA", MEGA}, {"SWIFT", SWIFT}, {"FOF", FOF}};
 
 class Engine {
@@ -106,6 +113,39 @@ public:
   // /* The threadpool instance. */
   ThreadPool *threadpool;
 
+  /* ===================== RANKS ===================== */
+
+  /* This process's rank and the number of ranks (1 without MPI). */
+  int rank;
+  int nranks;
+
+  /* ===================== PIPELINE ===================== */
+
+  /* The snapshots held beyond the current and previous ones (1 by default,
+   * to read the next snapshot ahead), and so the most held in memory at
+   * once. */
+  int prefetch_depth;
+  int max_generations;
+
+  /* The memory the generations may use between them in GB (0 for no
+   * limit). */
+  double generation_memory_gb;
+
+  /* ===================== MEMORY ===================== */
+
+  /* The memory (everything tracked) that may be held in GB, the box being
+   * processed a slab at a time to stay within it (0 for no limit, see
+   * out_of_core.cpp). */
+  double memory_budget_gb;
+
+  /* Is the box processed a slab at a time? (A memory budget or several
+   * ranks, each taking its own part of the box.) */
+  int out_of_core;
+
+  /* The width of the buffer loaded around each slab (at least the host
+   * linking length). */
+  double slab_buffer;
+
   /* ===================== INPUT ===================== */
 
   /* The type of input cataloge (MEGA/SWIFT/FOF). */
@@ -126,6 +166,17 @@ public:
   /* How many zeros are in the tag? */
   int tag_n_zero;
 
+  /* The number of threads reading each snapshot. */
+  int read_threads;
+
+  /* Are only the particles in a region loaded? And the region's corners. */
+  int load_region;
+  double region_lower[3];
+  double region_upper[3];
+
+  /* The FOF group ID of particles in no group (FOF inputs). */
+  int64_t fof_field_id;
+
   /* ===================== LOGGING ===================== */
 
   /* An instance of the Logging class to report to the user. */
@@ -137,6 +188,9 @@ public:
   /* Are we memory profiling? */
   int mem_prof;
 
+  /* The directory the profiles are written to. */
+  std::string profiling_dir;
+
   /* ===================== OUTPUT ===================== */
 
   /* The filepath to the directory for the outputs. */
@@ -154,6 +208,12 @@ public:
   /* Should we calculate halo properties? */
   int calculate_props;
 
+  /* Which halo properties are we calculating and outputting? */
+  PropertyRegistry prop_registry;
+
+  /* Which particle fields are read from each snapshot? */
+  LoadPlan load_plan;
+
   /* Should we output halo catalogues? (A file per snapshot with
    * each halo in it.) */
   int output_catalogs;
@@ -162,9 +222,26 @@ public:
    * graph) */
   int output_graph_format;
 
+  /* Should we output binary catalogues? (The catalogue as mappable raw
+   * columns, read back by a MEGA input run.) */
+  int output_binary;
+
+  /* The deflate level of the outputs (0 for uncompressed), the rows in a
+   * chunk, and the threads compressing them (the pipeline's compression
+   * pool). */
+  int output_compression;
+  int output_chunk_rows;
+  int write_threads;
+
   /* Should the unbound halos be kept in outputs? (PURELY FOR DEBUGGING) */
   int remove_not_real_halos;
 
+  /* Should a checkpoint be written after each generation? */
+  int write_checkpoints;
+
+  /* Are we restarting from the last checkpoint? */
+  int restart;
+
   /* ===================== DOMAIN ===================== */
 
   /* The domain. */
@@ -190,6 +267,19 @@ public:
     n_threads = parser.GetOption("--threads");
     message("Running on %d threads", n_threads);
 
+    /* Which rank are we? */
+    rank = comms_rank();
+    nranks = comms_size();
+    if (nranks > 1) {
+      message("Running on %d ranks", nranks);
+    }
+
+    /* Are we restarting? */
+    restart = parser.GetOption("--restart");
+    if (restart) {
+      message("Restarting from the last checkpoint");
+    }
+
     /* Are we reading the cosmology from the snapshot? */
     read_snap_cosmo = params.getParameter("Cosmology/read_from_file", 1);
     v_message("Will read cosmology from the snapshot");
@@ -254,6 +344,50 @@ public:
     }
     message("Reading inputs in %s mode", input_type_str.c_str());
 
+    /* FOF inputs are snapshots with the group of each particle, those in no
+     * group have this ID. */
+    fof_field_id = params.getParameter("Input/fof_field_id", 2147483647);
+
+    /* How many threads read each snapshot (alongside the threadpool)? */
+    read_threads = params.getParameter("Input/read_threads", 4);
+    if (read_threads < 1) {
+      error("Input/read_threads must be at least 1!");
+    }
+    v_message("Reading snapshots with %d threads", read_threads);
+
+    /* The reader and writer threads use HDF5 at once, which a library that
+     * wasn't built thread-safe only survives one call at a time. */
+    if (HDF5Lock::serialised()) {
+      v_message("HDF5 isn't thread-safe, HDF5 calls will be serialised");
+    }
+
+    /* Are we only loading a region (given by its corners, [x, y, z])? */
+    std::string lower_str =
+        params.getParameterString("Input/region_lower", "");
+    std::string upper_str =
+        params.getParameterString("Input/region_upper", "");
+    load_region = !lower_str.empty() || !upper_str.empty();
+    if (load_region) {
+      if (std::sscanf(lower_str.c_str(), " [ %lf , %lf , %lf ]",
+                      &region_lower[0], &region_lower[1],
+                      &region_lower[2]) != 3 ||
+          std::sscanf(upper_str.c_str(), " [ %lf , %lf , %lf ]",
+                      &region_upper[0], &region_upper[1],
+                      &region_upper[2]) != 3) {
+        error("Input/region_lower and Input/region_upper must both be given "
+              "as [x, y, z]!");
+      }
+      for (int k = 0; k < 3; k++) {
+        if (region_lower[k] >= region_upper[k]) {
+          error("The region to load is empty along axis %d!", k);
+        }
+      }
+      message("Only loading particles in the region [%g, %g, %g] - "
+              "[%g, %g, %g]",
+              region_lower[0], region_lower[1], region_lower[2],
+              region_upper[0], region_upper[1], region_upper[2]);
+    }
+
     // Read the input basename.
     input_basename =
         params.getParameterString("Input/input_basename", "snapshot_0000");
@@ -295,18 +429,60 @@ public:
       message("Running on %d snapshots", n_generations);
     }
 
+    /* The reading (and writing) of snapshots runs this many snapshots ahead
+     * of (and behind) the halo finding, on top of the current and previous
+     * snapshots. One is enough for the next snapshot to be read while the
+     * halos of this one are found, 0 holds only the two (and reads nothing
+     * ahead). Pipeline/memory_gb caps it. */
+    prefetch_depth = params.getParameter("Pipeline/prefetch_depth", 1);
+    generation_memory_gb = params.getParameter("Pipeline/memory_gb", 0.0);
+    if (prefetch_depth < 0) {
+      error("Pipeline/prefetch_depth can't be negative!");
+    }
+    max_generations = 2 + prefetch_depth;
+    v_message("Holding at most %d generations in memory", max_generations);
+    if (generation_memory_gb > 0) {
+      v_message("Generations may use at most %.2f GB between them",
+                generation_memory_gb);
+    }
+
+    /* Should the box be processed a slab at a time to fit in memory? */
+    memory_budget_gb = params.getParameter("Memory/budget_gb", 0.0);
+    slab_buffer = params.getParameter("Memory/slab_buffer", 0.0);
+    out_of_core = memory_budget_gb > 0 || nranks > 1;
+    if (out_of_core) {
+      if (load_region) {
+        error("Slabs (Memory/budget_gb or several ranks) can't be used with "
+              "a region to load!");
+      }
+      if (input_type == FOF) {
+        /* A slab only holds part of the groups crossing into it. */
+        error("Slabs (Memory/budget_gb or several ranks) need snapshot "
+              "(SWIFT) inputs!");
+      }
+    }
+    if (memory_budget_gb > 0) {
+      message("Processing snapshots in slabs, holding at most %.2f GB",
+              memory_budget_gb);
+    }
+
     /* Attach the log object. */
     log = log_;
 
     /* Set the profiling flags. */
     cpu_prof = params.getParameter("Profiling/cpu_profiling", 1);
     mem_prof = params.getParameter("Profiling/mem_profiling", 1);
+    profiling_dir = params.getParameterString("Profiling/profiling_directory",
+                                              "profiling");
+    profiler_enable(cpu_prof);
+    memory_enable(mem_prof);
     if (cpu_prof) {
-      message("Will profile CPU time. Outputs will be stored in profiling/");
+      message("Will profile CPU time. Outputs will be stored in %s/",
+              profiling_dir.c_str());
     }
     if (mem_prof) {
-      message(
-          "Will profile memory usage. Outputs will be stored in profiling/");
+      message("Will profile memory usage. Outputs will be stored in %s/",
+              profiling_dir.c_str());
     }
     /* Set up the output file parameters. */
     output_dir = params.getParameterString("Output/output_dir", "halos/");
@@ -315,34 +491,62 @@ public:
     message("Outputting in %s with basename %s", output_dir.c_str(),
             output_basename.c_str());
 
-    /* Set the current tag. */
-    std::string int_str = "0";
-    current_tag =
-        std::string(tag_n_zero - std::min(tag_n_zero,
-                                          static_cast<int>(int_str.length())),
-                    '0') +
-        int_str;
-
-    /* Construct the first output string. */
-    std::ostringstream out_oss;
-    out_oss << output_dir << "/" << output_basename << current_tag << ".hdf5";
-    current_output = out_oss.str();
+    /* Set the tag, input and output of the first snapshot. */
+    setSnapshot(0);
 
     /* Set output flags. */
     calculate_props = params.getParameter("Output/calculate_props", 1);
     output_catalogs = params.getParameter("Output/output_cataloges", 1);
     output_graph_format = params.getParameter("Output/output_graph_format", 0);
+    output_binary = params.getParameter("Output/output_binary", 0);
     remove_not_real_halos =
         params.getParameter("Halos/remove_not_real_halos", 1);
+    write_checkpoints = params.getParameter("Output/write_checkpoints", 1);
+    output_compression = params.getParameter("Output/compression", 4);
+    output_chunk_rows = params.getParameter("Output/chunk_size", 1 << 16);
+    write_threads = params.getParameter("Output/write_threads", 4);
+    if (output_compression < 0 || output_compression > 9) {
+      error("Output/compression must be a deflate level from 0 to 9!");
+    }
+    if (output_chunk_rows < 1 || write_threads < 1) {
+      error("Output/chunk_size and Output/write_threads must be at least 1!");
+    }
+    if (nranks > 1 && (output_graph_format || input_type == MEGA)) {
+      /* The graph is built from every halo, so needs them all in one
+       * place. */
+      error("Output/output_graph_format and MEGA inputs need a single rank!");
+    }
+    prop_registry = PropertyRegistry(params, calculate_props);
     if (calculate_props) {
-      message("Will calculate halo properties and output them");
+      message("Will calculate halo properties and output them: %s",
+              PropertyRegistry::describe(prop_registry.requested).c_str());
+      if (prop_registry.props != prop_registry.requested) {
+        v_message("Also calculating (but not outputting): %s",
+                  PropertyRegistry::describe(prop_registry.props &
+                                             ~prop_registry.requested)
+                      .c_str());
+      }
     }
+    load_plan = LoadPlan(input_type == FOF, n_sub_depths, out_of_core,
+                         prop_registry);
+    message("Will read the particle fields: %s",
+            LoadPlan::describe(load_plan.fields).c_str());
     if (output_catalogs) {
       message("Will output halo catalogs");
     }
     if (output_graph_format) {
       message("Will output graph files");
     }
+    if (output_binary) {
+      message("Will output binary halo catalogs");
+    }
+    if (write_checkpoints) {
+      message("Will write a checkpoint after each snapshot");
+    }
+    if (output_compression > 0) {
+      message("Will compress outputs (deflate level %d, chunks of %d rows)",
+              output_compression, output_chunk_rows);
+    }
     if (!remove_not_real_halos) {
       message("Will not remove unbound (not real) halos from the outputs. "
               "THIS IS FOR DEBUGGING PURPOSES ONLY!");
@@ -355,6 +559,83 @@ public:
     toc("Initialising the Engine");
   }
 
+  /** @brief Get the tag of a snapshot (of the form 00000).
+   *
+   * @param snap The snapshot number.
+   * */
+  std::string snapshotTag(int snap) const {
+    std::string int_str = std::to_string(snap);
+    return std::string(tag_n_zero - std::min(tag_n_zero, static_cast<int>(
+                                                             int_str.length())),
+                       '0') +
+           int_str;
+  }
+
+  /** @brief Get the suffix of this rank's outputs (.3 for rank 3, nothing
+   * on a single rank), like a distributed snapshot's files.
+   * */
+  std::string rankSuffix() const {
+    return nranks > 1 ? "." + std::to_string(rank) : "";
+  }
+
+  /** @brief Get the input file path of a snapshot.
+   *
+   * @param snap The snapshot number.
+   * */
+  std::string inputPath(int snap) const {
+    std::ostringstream in_oss;
+    in_oss << input_dir << "/" << input_basename << snapshotTag(snap)
+           << (input_type == MEGA ? ".mega" : ".hdf5");
+    return in_oss.str();
+  }
+
+  /** @brief Get the output file path of a snapshot.
+   *
+   * @param snap The snapshot number.
+   * */
+  std::string outputPath(int snap) const {
+    std::ostringstream out_oss;
+    out_oss << output_dir << "/" << output_basename << snapshotTag(snap)
+            << rankSuffix() << ".hdf5";
+    return out_oss.str();
+  }
+
+  /** @brief Get the binary catalogue path of a snapshot.
+   *
+   * @param snap The snapshot number.
+   * */
+  std::string binaryPath(int snap) const {
+    std::ostringstream out_oss;
+    out_oss << output_dir << "/" << output_basename << snapshotTag(snap)
+            << rankSuffix() << ".mega";
+    return out_oss.str();
+  }
+
+  /** @brief Get the path of a profile.
+   *
+   * @param name The profile's name.
+   * */
+  std::string profilePath(const std::string &name) const {
+    return profiling_dir + "/" + name + rankSuffix() + ".txt";
+  }
+
+  /** @brief Get the checkpoint file path.
+   * */
+  std::string checkpointPath() const {
+    return output_dir + "/" + output_basename + "checkpoint" + rankSuffix() +
+           ".bin";
+  }
+
+  /** @brief Set the tag, input and output file paths of a snapshot.
+   *
+   * @param snap The snapshot number.
+   * */
+  void setSnapshot(int snap) {
+    current_tag = snapshotTag(snap);
+    current_input = inputPath(snap);
+    current_output = outputPath(snap);
+  }
+
   /** @brief The destructor for the engine.
    *
    * Destroys the logger, threadpool and domain.
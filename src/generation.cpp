@@ -0,0 +1,383 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality of the generations (snapshots) held
+ * in memory while running over the snapshots.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+/* Local includes. */
+#include "generation.h"
+#include "logging.h"
+#include "mega_catalog.h"
+#include "memory.h"
+#include "profiler.h"
+#include "properties.h"
+#include "serial_io.h"
+#include "slab_io.h"
+#include "snapshot.h"
+
+/** @brief The bytes allocated for a number of particles (aligned_alloc
+ * needs a whole number of alignments).
+ *
+ * @param n The number of particles.
+ */
+static size_t particle_bytes(size_t n) {
+  size_t nbytes = n * sizeof(DMParticle);
+  return (nbytes + part_align - 1) / part_align * part_align;
+}
+
+/** @brief The destructor for a Generation, freeing the particles.
+ */
+Generation::~Generation() {
+  memory_free(mem_particles, dark_matter, particle_bytes(capacity));
+}
+
+/** @brief Make sure there is room for a number of particles.
+ *
+ * The particles are only reallocated if there isn't already room, so a slot
+ * grows to fit the largest snapshot read into it and then stays that size.
+ * Anything already held is lost when the particles are reallocated, unless
+ * it's asked to be kept.
+ *
+ * @param n The number of particles.
+ * @param keep Should the particles held be kept?
+ */
+void Generation::reserve(size_t n, bool keep) {
+
+  if (n <= capacity) {
+    return;
+  }
+
+  size_t nbytes = particle_bytes(n);
+
+  /* The old particles go first unless they're kept (so both are never held
+   * when they don't need to be). */
+  if (!keep) {
+    memory_free(mem_particles, dark_matter, particle_bytes(capacity));
+    dark_matter = nullptr;
+    capacity = 0;
+  }
+  DMParticle *parts = static_cast<DMParticle *>(
+      memory_alloc(mem_particles, part_align, nbytes));
+  if (parts == nullptr) {
+    error("Failed to allocate %zu particles!", n);
+  }
+  if (keep && npart > 0) {
+    std::memcpy(static_cast<void *>(parts), dark_matter,
+                npart * sizeof(DMParticle));
+  }
+  if (keep) {
+    memory_free(mem_particles, dark_matter, particle_bytes(capacity));
+  }
+  dark_matter = parts;
+  capacity = n;
+
+  v_message("Grew the generation's particles to %zu (%.2f GB)", capacity,
+            static_cast<double>(nbytes) / (1 << 30));
+}
+
+/** @brief Free the particles (the rest of the slot keeps its memory).
+ */
+void Generation::freeParticles() {
+  memory_free(mem_particles, dark_matter, particle_bytes(capacity));
+  dark_matter = nullptr;
+  capacity = 0;
+  npart = 0;
+}
+
+/** @brief Read a snapshot's particles into the slot.
+ *
+ * Each dataset is read in slabs on several threads, straight into the
+ * particles (see read_slabs). A snapshot distributed over several files is
+ * read a few files at a time, and if only a region is wanted (the engine's,
+ * or one given) only the cells overlapping it are read (see SnapshotFiles).
+ * For FOF inputs only the particles in groups above the particle threshold
+ * are read, along with their groups.
+ *
+ * @param engine The engine.
+ * @param snap_ The snapshot number.
+ * @param lower The lower corner of the region to read (nullptr for the
+ *              engine's region, if any).
+ * @param upper The upper corner of the region to read.
+ */
+void Generation::read(const Engine *engine, int snap_, const double *lower,
+                      const double *upper) {
+
+  tic();
+  ProfileScope profile("Reading");
+
+  /* Find the files and how many particles will be read. */
+  std::string filename = engine->inputPath(snap_);
+  if (lower == nullptr && engine->load_region) {
+    lower = engine->region_lower;
+    upper = engine->region_upper;
+  }
+  SnapshotFiles files(filename, lower, upper);
+  npart_snapshot = files.nrows_total;
+  if (engine->input_type == FOF) {
+    files.selectGroups(engine->part_threshold, engine->fof_field_id,
+                       engine->read_threads);
+  }
+  npart = files.npart();
+  reserve(std::max<size_t>(npart, 1));
+
+  /* Each dataset goes straight into its field of the particles (the first
+   * particle's field, then every sizeof(DMParticle) bytes). Only the fields
+   * the run needs are read (see LoadPlan), the rest are left unset. */
+  const LoadPlan &plan = engine->load_plan;
+  DMParticle &first = dark_matter[0];
+  auto field = [](void *member) { return static_cast<char *>(member); };
+  std::vector<SlabTarget> targets;
+  if (plan.reads(field_ids)) {
+    targets.push_back({"/PartType1/ParticleIDs", field(&first.id),
+                       sizeof(DMParticle), 1, &h5_type<decltype(first.id)>()});
+  }
+  if (plan.reads(field_masses)) {
+    targets.push_back({"/PartType1/Masses", field(&first.mass),
+                       sizeof(DMParticle), 1,
+                       &h5_type<decltype(first.mass)>()});
+  }
+  if (plan.reads(field_coordinates)) {
+    targets.push_back({"/PartType1/Coordinates", field(first.pos),
+                       sizeof(DMParticle), 3, &h5_type<double>()});
+  }
+  if (plan.reads(field_velocities)) {
+    targets.push_back({"/PartType1/Velocities", field(first.vel),
+                       sizeof(DMParticle), 3, &h5_type<double>()});
+  }
+  if (plan.reads(field_fof_groups) && files.groups.size() == npart) {
+    fof_group = std::move(files.groups);
+  } else if (plan.reads(field_fof_groups)) {
+    fof_group.resize(npart);
+    targets.push_back({"/PartType1/FOFGroupIDs",
+                       reinterpret_cast<char *>(fof_group.data()),
+                       sizeof(int64_t), 1, &h5_type<int64_t>()});
+  }
+  files.read(targets, engine->read_threads);
+
+  snap = snap_;
+  message("Read %zu particles from %s (%zu files)", npart, filename.c_str(),
+          files.paths.size());
+
+  toc("Reading a snapshot");
+}
+
+/** @brief Point the Domain at this generation's particles.
+ *
+ * @param domain The domain.
+ */
+void Generation::attach(Domain *domain) const {
+  domain->dark_matter = dark_matter;
+  domain->fof_group = fof_group.empty() ? nullptr : fof_group.data();
+  domain->npart_type[1] = static_cast<int64_t>(npart);
+  domain->npart_dm_sim = npart_snapshot;
+  domain->npart_tot = 0;
+  for (int i = 0; i < num_part_species; i++) {
+    domain->npart_tot += domain->npart_type[i];
+  }
+}
+
+/** @brief Write the generation's halo catalogue and links.
+ *
+ * Each halo's particles are written as their IDs, with the links to both the
+ * previous and next snapshots, so this should only be called once the next
+ * snapshot has been linked. Running on several ranks, the links are global
+ * halo indices, and each rank's file has the global index of its first halo
+ * (FirstHaloIndex).
+ *
+ * @param engine The engine.
+ * @param filename The file to write to.
+ * @param compressor The threads compressing the datasets (nullptr to
+ *                   compress them on this thread).
+ */
+void Generation::write(const Engine *engine, const std::string &filename,
+                       ThreadPool *compressor) const {
+
+  tic();
+  ProfileScope profile("Writing");
+
+  std::unique_ptr<HDF5Helper> catalogue;
+  try {
+    catalogue = std::make_unique<HDF5Helper>(filename, H5F_ACC_TRUNC);
+  } catch (H5::Exception &e) {
+    error("Failed to create the halo catalogue %s!", filename.c_str());
+  }
+  HDF5Helper &file = *catalogue;
+  file.setCompression(engine->output_compression, engine->output_chunk_rows,
+                      compressor);
+  bool success = file.createGroup("/Halos") && file.createGroup("/Links");
+
+  /* The hierarchy. */
+  success &= file.writeDataset("/Halos/Type", catalog.type);
+  success &= file.writeDataset("/Halos/Depth", catalog.depth);
+  success &= file.writeDataset("/Halos/Parent", catalog.parent);
+  success &= file.writeDataset("/Halos/NumberOfParticles", catalog.npart);
+  if (engine->nranks > 1) {
+    success &= file.writeDataset("/Halos/FirstHaloIndex",
+                                 std::vector<size_t>{halo_offset});
+  }
+
+  /* The particles in each halo. */
+  std::vector<size_t> offsets, ids;
+  memberIds(offsets, ids);
+  success &= file.writeDataset("/Halos/ParticleIDs", ids);
+  success &= file.writeDataset("/Halos/ParticleOffsets", offsets);
+
+  /* The properties. */
+  if (engine->calculate_props) {
+    success &=
+        write_halo_properties(file, "/Halos", catalog, engine->prop_registry);
+  }
+
+  /* The links. */
+  success &=
+      file.writeDataset("/Links/ProgenitorOffsets", catalog.prog_offsets);
+  success &= file.writeDataset("/Links/Progenitors", catalog.progs);
+  success &=
+      file.writeDataset("/Links/ProgenitorSharedParts", catalog.prog_shared);
+  success &=
+      file.writeDataset("/Links/DescendantOffsets", catalog.desc_offsets);
+  success &= file.writeDataset("/Links/Descendants", catalog.descs);
+  success &=
+      file.writeDataset("/Links/DescendantSharedParts", catalog.desc_shared);
+
+  if (!success) {
+    error("Failed to write the halo catalogue to %s!", filename.c_str());
+  }
+  message("Wrote %zu halos to %s", catalog.nhalos, filename.c_str());
+
+  toc("Writing a halo catalogue");
+}
+
+/** @brief Write the generation's halo catalogue and links as a binary
+ * catalogue (see mega_catalog.h).
+ *
+ * The columns are those of the HDF5 catalogue, so the same rules apply: this
+ * should only be called once the next snapshot has been linked.
+ *
+ * @param engine The engine.
+ * @param filename The file to write to.
+ */
+void Generation::writeBinary(const Engine *engine,
+                             const std::string &filename) const {
+
+  tic();
+  ProfileScope profile("Writing binary");
+
+  MegaCatalogWriter writer(filename, snap, catalog.nhalos);
+
+  /* The hierarchy. */
+  writer.addColumn("Type", catalog.type);
+  writer.addColumn("Depth", catalog.depth);
+  writer.addColumn("Parent", catalog.parent);
+  writer.addColumn("NumberOfParticles", catalog.npart);
+  if (engine->nranks > 1) {
+    writer.addColumn("FirstHaloIndex", std::vector<size_t>{halo_offset});
+  }
+
+  /* The particles in each halo. */
+  std::vector<size_t> offsets, ids;
+  memberIds(offsets, ids);
+  writer.addColumn("ParticleIDs", ids);
+  writer.addColumn("ParticleOffsets", offsets);
+
+  /* The properties. */
+  if (engine->calculate_props) {
+    add_halo_properties(writer, catalog, engine->prop_registry);
+  }
+
+  /* The links. */
+  writer.addColumn("ProgenitorOffsets", catalog.prog_offsets);
+  writer.addColumn("Progenitors", catalog.progs);
+  writer.addColumn("ProgenitorSharedParts", catalog.prog_shared);
+  writer.addColumn("DescendantOffsets", catalog.desc_offsets);
+  writer.addColumn("Descendants", catalog.descs);
+  writer.addColumn("DescendantSharedParts", catalog.desc_shared);
+
+  writer.finish();
+  message("Wrote %zu halos to %s", catalog.nhalos, filename.c_str());
+
+  toc("Writing a binary halo catalogue");
+}
+
+/** @brief Get the IDs of each halo's particles (only the live part of each
+ * row) as compressed sparse rows.
+ *
+ * @param offsets Where each halo's IDs start (nhalos + 1 entries).
+ * @param ids The IDs.
+ */
+void Generation::memberIds(std::vector<size_t> &offsets,
+                           std::vector<size_t> &ids) const {
+  offsets.assign(catalog.nhalos + 1, 0);
+  for (size_t i = 0; i < catalog.nhalos; i++) {
+    offsets[i + 1] = offsets[i] + catalog.npart[i];
+  }
+  ids.resize(offsets[catalog.nhalos]);
+  for (size_t i = 0; i < catalog.nhalos; i++) {
+    const size_t *parts = catalog.parts(i);
+    for (size_t j = 0; j < catalog.npart[i]; j++) {
+      ids[offsets[i] + j] = partId(parts[j]);
+    }
+  }
+}
+
+/** @brief Get the IDs of the particles held, wherever they are.
+ *
+ * @param stride The IDs are every stride-th element from the first (set).
+ *
+ * @return The first particle's ID.
+ */
+const size_t *Generation::partIds(size_t &stride) const {
+  static_assert(sizeof(DMParticle) % sizeof(size_t) == 0,
+                "DMParticle must be a whole number of size_ts");
+  if (dark_matter == nullptr) {
+    stride = 1;
+    return part_ids.data();
+  }
+  stride = sizeof(DMParticle) / sizeof(size_t);
+  return &dark_matter[0].id;
+}
+
+/** @brief Empty the slot, keeping its memory for the next snapshot.
+ */
+void Generation::reset() {
+  snap = -1;
+  written = false;
+  npart = 0;
+  npart_snapshot = 0;
+  part_ids.clear();
+  catalog.reset();
+  halo_offset = 0;
+  owned.shared = false;
+  owned.ids.clear();
+  owned.halos.clear();
+}
+
+/** @brief The memory held by the slot (including unused capacity).
+ */
+size_t Generation::nbytes() const {
+  return capacity * sizeof(DMParticle) +
+         fof_group.capacity() * sizeof(int64_t) +
+         part_ids.capacity() * sizeof(size_t) + catalog.nbytes() +
+         index.nbytes() + owned.ids.capacity() * sizeof(size_t) +
+         owned.halos.capacity() * sizeof(int64_t);
+}
@@ -0,0 +1,149 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definitions of the generations (snapshots)
+ * held in memory while running over the snapshots.
+ ******************************************************************************/
+#ifndef GENERATION_H_
+#define GENERATION_H_
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "domain.h"
+#include "engine.h"
+#include "halo.h"
+#include "id_index.h"
+#include "particles.h"
+
+/**
+ * @brief The particles in halos whose IDs a rank owns, and the halos they
+ * are in, for linking halos across ranks (see link_halos_distributed).
+ *
+ * @param shared Have the generation's particles been shared out?
+ * @param min_id, max_id The range of IDs split between the ranks.
+ * @param ndepths The number of depths each particle has a halo at.
+ * @param ids The IDs owned (sorted).
+ * @param halos The global index of the halo each particle is in at each
+ *              depth (ndepths per ID, halo_null if none).
+ */
+struct OwnedMemberships {
+  bool shared = false;
+  size_t min_id = 0;
+  size_t max_id = 0;
+  int ndepths = 0;
+  member_vector<size_t> ids;
+  member_vector<int64_t> halos;
+};
+
+/**
+ * @class Generation
+ * @brief Everything held in memory for a single snapshot.
+ *
+ * A Generation is a reusable slot (see Pipeline). Reading a snapshot into it
+ * overwrites the last one held, and the particle array is only reallocated
+ * when a snapshot has more particles than any before it. The halo catalogue
+ * and ID index likewise keep their storage between snapshots.
+ *
+ * @param snap The snapshot held (-1 if empty).
+ * @param written Has the generation been written out?
+ * @param npart The number of particles held.
+ * @param npart_snapshot The number of particles in the whole snapshot.
+ * @param capacity The number of particles there is room for.
+ * @param dark_matter The dark matter particles.
+ * @param part_ids The IDs of the particles, when only their IDs are held.
+ * @param fof_group The FOF group of each particle (FOF inputs only).
+ * @param catalog The halos found in the snapshot.
+ * @param index The particle ID index of the snapshot.
+ * @param halo_offset The global index of the first halo (on several ranks).
+ * @param owned The halo members this rank owns (on several ranks).
+ */
+class Generation {
+public:
+  /* The snapshot held (-1 if empty). */
+  int snap;
+
+  /* Has the generation been written out (and added to the graph)? */
+  bool written;
+
+  /* The number of particles held and the number there is room for. */
+  size_t npart;
+  size_t capacity;
+
+  /* The number of particles in the whole snapshot (more than npart if only
+   * some were read). */
+  size_t npart_snapshot;
+
+  /* The dark matter particles. */
+  DMParticle *dark_matter;
+
+  /* The IDs of the particles held, when nothing else of them is (out of
+   * core only the halo members' IDs are kept, see find_halos_out_of_core). */
+  member_vector<size_t> part_ids;
+
+  /* The FOF group of each particle (only read for FOF inputs). */
+  tracked_vector<int64_t, mem_particles> fof_group;
+
+  /* The halos found in the snapshot. */
+  HaloCatalog catalog;
+
+  /* The particle ID index of the snapshot. */
+  IdIndex index;
+
+  /* The global index of the first halo, the number of halos on the ranks
+   * before this one. */
+  size_t halo_offset;
+
+  /* The particles in halos (on any rank) whose IDs this rank owns. */
+  OwnedMemberships owned;
+
+  Generation()
+      : snap(-1), written(false), npart(0), capacity(0), npart_snapshot(0),
+        dark_matter(nullptr), halo_offset(0) {}
+  ~Generation();
+
+  /* A slot owns its particles, so can't be copied. */
+  Generation(const Generation &) = delete;
+  Generation &operator=(const Generation &) = delete;
+
+  /** @brief The ID of a particle held.
+   *
+   * @param p The particle's index.
+   */
+  size_t partId(size_t p) const {
+    return dark_matter == nullptr ? part_ids[p] : dark_matter[p].id;
+  }
+
+  void reserve(size_t n, bool keep = false);
+  void freeParticles();
+  void read(const Engine *engine, int snap_, const double *lower = nullptr,
+            const double *upper = nullptr);
+  void attach(Domain *domain) const;
+  void write(const Engine *engine, const std::string &filename,
+             ThreadPool *compressor = nullptr) const;
+  void writeBinary(const Engine *engine, const std::string &filename) const;
+  void memberIds(std::vector<size_t> &offsets, std::vector<size_t> &ids) const;
+  const size_t *partIds(size_t &stride) const;
+  void reset();
+  size_t nbytes() const;
+};
+
+#endif // GENERATION_H_
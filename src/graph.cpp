@@ -0,0 +1,432 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for building the merger graph output.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <utility>
+
+/* Local includes. */
+#include "graph.h"
+#include "logging.h"
+#include "profiler.h"
+#include "radix_sort.h"
+#include "serial_io.h"
+
+/* A halo without a label yet. */
+#define graph_no_label UINT64_MAX
+
+/** @brief The constructor for the GraphBuilder, opening the scratch file.
+ *
+ * When restarting the scratch file is left alone until resume().
+ *
+ * @param engine_ The engine.
+ */
+GraphBuilder::GraphBuilder(Engine *engine_)
+    : engine(engine_), nrecords(0), run_size(graph_run_size),
+      last_snap(-1), compressor(nullptr) {
+
+  std::string base = engine->output_dir + "/" + engine->output_basename;
+  scratch_path = base + "graph.scratch";
+  runs_path = base + "graph.runs";
+  output_path = base + "graph.hdf5";
+
+  if (engine->restart) {
+    return;
+  }
+  scratch.open(scratch_path, std::ios::binary | std::ios::trunc);
+  if (!scratch) {
+    error("Failed to open the graph scratch file %s!", scratch_path.c_str());
+  }
+}
+
+/** @brief Make a new label (its own graph).
+ */
+uint64_t GraphBuilder::newLabel() {
+  labels.push_back(labels.size());
+  return labels.size() - 1;
+}
+
+/** @brief Find the label a label has been united with (with path halving).
+ *
+ * @param label The label.
+ */
+uint64_t GraphBuilder::findLabel(uint64_t label) {
+  while (labels[label] != label) {
+    labels[label] = labels[labels[label]];
+    label = labels[label];
+  }
+  return label;
+}
+
+/** @brief Unite the graphs of two labels.
+ *
+ * The smallest label wins, so a label's parent is never larger than it.
+ *
+ * @param a The first label.
+ * @param b The second label.
+ *
+ * @return The label of the united graph.
+ */
+uint64_t GraphBuilder::uniteLabels(uint64_t a, uint64_t b) {
+  a = findLabel(a);
+  b = findLabel(b);
+  if (a > b) {
+    std::swap(a, b);
+  }
+  labels[b] = a;
+  return a;
+}
+
+/** @brief Label a generation's halos and stream them to the scratch file.
+ *
+ * Generations must be added in order, once they have been linked to the next
+ * snapshot (when they are written).
+ *
+ * @param gen The generation.
+ */
+void GraphBuilder::addGeneration(const Generation &gen) {
+  const HaloCatalog &catalog = gen.catalog;
+  addHalos(gen.snap, catalog.nhalos, catalog.parent.data(),
+           catalog.npart.data(),
+           catalog.prog_offsets.empty() ? nullptr
+                                        : catalog.prog_offsets.data(),
+           catalog.progs.data());
+}
+
+/** @brief Label a generation's halos and stream them to the scratch file.
+ *
+ * @param snap The snapshot.
+ * @param nhalos The number of halos.
+ * @param parent The parent of each halo (halo_null for hosts).
+ * @param npart The number of particles in each halo.
+ * @param prog_offsets Where each halo's progenitors start (nullptr if there
+ *                     are none).
+ * @param progs The progenitors.
+ */
+void GraphBuilder::addHalos(int snap, size_t nhalos, const int64_t *parent,
+                            const size_t *npart, const size_t *prog_offsets,
+                            const int64_t *progs) {
+
+  tic();
+  ProfileScope profile("Adding to the graph");
+
+  if (snap != last_snap + 1) {
+    error("Generations must be added to the graph in order (got %d after %d)!",
+          snap, last_snap);
+  }
+
+  std::vector<uint64_t> curr(nhalos);
+  std::vector<GraphRecord> records(nhalos);
+  for (size_t i = 0; i < nhalos; i++) {
+
+    /* Take the progenitors' labels. */
+    uint64_t label = graph_no_label;
+    if (prog_offsets != nullptr) {
+      for (size_t l = prog_offsets[i]; l < prog_offsets[i + 1]; l++) {
+        uint64_t prog = frontier[progs[l]];
+        label = label == graph_no_label ? findLabel(prog)
+                                        : uniteLabels(label, prog);
+      }
+    }
+
+    /* Subhalos are in their host's graph (parents come first). */
+    if (parent[i] != halo_null) {
+      uint64_t host = curr[parent[i]];
+      label = label == graph_no_label ? findLabel(host)
+                                      : uniteLabels(label, host);
+    }
+
+    /* Otherwise this is the start of a new graph. */
+    if (label == graph_no_label) {
+      label = newLabel();
+    }
+
+    curr[i] = label;
+    records[i] = {label, snap, static_cast<int64_t>(i), npart[i]};
+  }
+
+  scratch.write(reinterpret_cast<const char *>(records.data()),
+                records.size() * sizeof(GraphRecord));
+  scratch.flush();
+  if (!scratch) {
+    error("Failed to write to the graph scratch file %s!",
+          scratch_path.c_str());
+  }
+  nrecords += records.size();
+  frontier.swap(curr);
+  last_snap = snap;
+
+  toc("Adding a generation to the graph");
+}
+
+/** @brief Pick up the scratch file after the state has been restored from
+ * a checkpoint.
+ *
+ * Anything streamed after the checkpoint was written is discarded, those
+ * generations will be added again.
+ */
+void GraphBuilder::resume() {
+
+  scratch.close();
+  try {
+    std::filesystem::resize_file(scratch_path,
+                                 nrecords * sizeof(GraphRecord));
+  } catch (std::filesystem::filesystem_error &e) {
+    error("Failed to restore the graph scratch file %s (%s)!",
+          scratch_path.c_str(), e.what());
+  }
+  scratch.open(scratch_path, std::ios::binary | std::ios::app);
+  if (!scratch) {
+    error("Failed to open the graph scratch file %s!", scratch_path.c_str());
+  }
+}
+
+/** @brief Turn every label into the ID of its graph.
+ *
+ * Graphs are numbered in order of their smallest label (i.e. the order they
+ * first appeared). Since a label's parent is never larger than it, a single
+ * ascending pass resolves every label in place: a root takes the next graph
+ * ID and anything else takes its (already resolved) parent's.
+ *
+ * @return The number of graphs.
+ */
+size_t GraphBuilder::resolveLabels() {
+  size_t ngraphs = 0;
+  for (uint64_t l = 0; l < labels.size(); l++) {
+    labels[l] = labels[l] == l ? ngraphs++ : labels[labels[l]];
+  }
+  return ngraphs;
+}
+
+/** @brief Sort the scratch file by graph a run at a time.
+ *
+ * The records were streamed in (snapshot, halo) order, so a stable sort of a
+ * run by graph leaves it in (graph, snapshot, halo) order.
+ *
+ * @param ngraphs The number of graphs.
+ *
+ * @return Where each run starts in the runs file (plus the end).
+ */
+std::vector<size_t> GraphBuilder::writeRuns(size_t ngraphs) {
+
+  std::ifstream in(scratch_path, std::ios::binary);
+  std::ofstream out(runs_path, std::ios::binary | std::ios::trunc);
+  if (!in || !out) {
+    error("Failed to open the graph scratch files in %s!",
+          engine->output_dir.c_str());
+  }
+
+  std::vector<size_t> runs = {0};
+  std::vector<GraphRecord> run, sorted;
+  std::vector<uint64_t> keys;
+  std::vector<size_t> order;
+  while (runs.back() < nrecords) {
+    size_t n = std::min<size_t>(run_size, nrecords - runs.back());
+    run.resize(n);
+    sorted.resize(n);
+    keys.resize(n);
+    order.resize(n);
+    in.read(reinterpret_cast<char *>(run.data()), n * sizeof(GraphRecord));
+
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = labels[run[i].graph];
+      order[i] = i;
+    }
+    radix_sort<uint64_t, size_t>(engine->threadpool, keys.data(),
+                                 order.data(), n, nullptr, nullptr, 0,
+                                 ngraphs);
+    for (size_t i = 0; i < n; i++) {
+      sorted[i] = run[order[i]];
+      sorted[i].graph = keys[i];
+    }
+
+    out.write(reinterpret_cast<const char *>(sorted.data()),
+              n * sizeof(GraphRecord));
+    runs.push_back(runs.back() + n);
+  }
+
+  if (!in || !out) {
+    error("Failed to sort the graph scratch file %s!", scratch_path.c_str());
+  }
+  return runs;
+}
+
+/**
+ * @brief A sorted run being read back while merging.
+ */
+struct GraphRun {
+  std::ifstream in;
+  size_t remaining;
+  std::vector<GraphRecord> buffer;
+  size_t next;
+
+  /* The record at the head of the run. */
+  const GraphRecord &head() const { return buffer[next]; }
+
+  /* Move past the head, reading more of the run if needed. Returns whether
+   * the run has any records left. */
+  bool advance() {
+    if (++next < buffer.size()) {
+      return true;
+    }
+    size_t n = std::min<size_t>(graph_merge_buffer, remaining);
+    buffer.resize(n);
+    in.read(reinterpret_cast<char *>(buffer.data()), n * sizeof(GraphRecord));
+    remaining -= n;
+    next = 0;
+    return n > 0;
+  }
+};
+
+/** @brief Merge the sorted runs into the graph file.
+ *
+ * The halo columns are written a buffer at a time, along with where each
+ * graph starts and how many halos it has.
+ *
+ * @param runs Where each run starts in the runs file (plus the end).
+ * @param ngraphs The number of graphs.
+ */
+void GraphBuilder::mergeRuns(const std::vector<size_t> &runs,
+                             size_t ngraphs) {
+
+  std::unique_ptr<HDF5Helper> graph_file;
+  try {
+    graph_file = std::make_unique<HDF5Helper>(output_path, H5F_ACC_TRUNC);
+  } catch (H5::Exception &e) {
+    error("Failed to create the graph file %s!", output_path.c_str());
+  }
+  HDF5Helper &file = *graph_file;
+  file.setCompression(engine->output_compression, engine->output_chunk_rows,
+                      compressor);
+
+  bool success = file.createGroup("/Halos") && file.createGroup("/Graphs");
+  success &= file.createDataset<uint64_t>("/Halos/GraphID", nrecords);
+  success &= file.createDataset<int64_t>("/Halos/Snapshot", nrecords);
+  success &= file.createDataset<int64_t>("/Halos/HaloIndex", nrecords);
+  success &= file.createDataset<uint64_t>("/Halos/NumberOfParticles", nrecords);
+  success &= file.createDataset<uint64_t>("/Graphs/Offsets", ngraphs);
+  success &= file.createDataset<uint64_t>("/Graphs/NumberOfHalos", ngraphs);
+
+  /* Open each run at its start. */
+  size_t nruns = runs.size() - 1;
+  std::vector<GraphRun> readers(nruns);
+  using RunHead = std::pair<uint64_t, size_t>;
+  std::priority_queue<RunHead, std::vector<RunHead>, std::greater<RunHead>>
+      heads;
+  for (size_t r = 0; r < nruns; r++) {
+    readers[r].in.open(runs_path, std::ios::binary);
+    readers[r].in.seekg(runs[r] * sizeof(GraphRecord));
+    readers[r].remaining = runs[r + 1] - runs[r];
+    readers[r].next = 0;
+    if (readers[r].advance()) {
+      heads.push({readers[r].head().graph, r});
+    }
+  }
+
+  /* Take the smallest graph from the heads (runs hold consecutive stretches
+   * of snapshots, so ties go to the earliest run). */
+  std::vector<uint64_t> graph_ids, halo_npart, graph_offsets, graph_nhalos;
+  std::vector<int64_t> halo_snaps, halo_inds;
+  size_t nwritten = 0, ngraphs_written = 0;
+  auto flush_halos = [&]() {
+    success &= file.writeDatasetSlice("/Halos/GraphID", graph_ids, nwritten);
+    success &= file.writeDatasetSlice("/Halos/Snapshot", halo_snaps, nwritten);
+    success &= file.writeDatasetSlice("/Halos/HaloIndex", halo_inds, nwritten);
+    success &= file.writeDatasetSlice("/Halos/NumberOfParticles", halo_npart,
+                                      nwritten);
+    nwritten += graph_ids.size();
+    graph_ids.clear();
+    halo_snaps.clear();
+    halo_inds.clear();
+    halo_npart.clear();
+  };
+  auto flush_graphs = [&]() {
+    success &= file.writeDatasetSlice("/Graphs/Offsets", graph_offsets,
+                                      ngraphs_written);
+    success &= file.writeDatasetSlice("/Graphs/NumberOfHalos", graph_nhalos,
+                                      ngraphs_written);
+    ngraphs_written += graph_offsets.size();
+    graph_offsets.clear();
+    graph_nhalos.clear();
+  };
+  size_t nmerged = 0;
+  while (!heads.empty()) {
+    size_t r = heads.top().second;
+    heads.pop();
+    const GraphRecord &rec = readers[r].head();
+
+    /* Is this the start of a new graph? (The ones before are complete.) */
+    if (rec.graph == ngraphs_written + graph_offsets.size()) {
+      if (graph_offsets.size() == graph_merge_buffer) {
+        flush_graphs();
+      }
+      graph_offsets.push_back(nmerged);
+      graph_nhalos.push_back(0);
+    }
+    graph_nhalos.back()++;
+
+    graph_ids.push_back(rec.graph);
+    halo_snaps.push_back(rec.snap);
+    halo_inds.push_back(rec.halo);
+    halo_npart.push_back(rec.npart);
+    nmerged++;
+    if (graph_ids.size() == graph_merge_buffer) {
+      flush_halos();
+    }
+
+    if (readers[r].advance()) {
+      heads.push({readers[r].head().graph, r});
+    }
+  }
+  flush_halos();
+  flush_graphs();
+
+  if (!success || nwritten != nrecords || ngraphs_written != ngraphs) {
+    error("Failed to write the graph file %s!", output_path.c_str());
+  }
+}
+
+/** @brief Write the graph file.
+ *
+ * Called once every generation has been added.
+ */
+void GraphBuilder::finish() {
+
+  tic();
+  ProfileScope profile("Finishing the graph");
+
+  scratch.close();
+  size_t ngraphs = resolveLabels();
+  std::vector<size_t> runs = writeRuns(ngraphs);
+  mergeRuns(runs, ngraphs);
+
+  std::remove(scratch_path.c_str());
+  std::remove(runs_path.c_str());
+
+  message("Wrote %zu halos in %zu graphs to %s (merged from %zu runs)",
+          nrecords, ngraphs, output_path.c_str(), runs.size() - 1);
+
+  toc("Writing the graph file");
+}
@@ -0,0 +1,130 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definitions for building the merger graph
+ * output (every halo in every snapshot, sorted by graph).
+ ******************************************************************************/
+#ifndef GRAPH_H_
+#define GRAPH_H_
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "engine.h"
+#include "generation.h"
+
+/* The number of halo records sorted in memory at once. */
+#define graph_run_size (1 << 22)
+
+/* The number of halo records buffered from each sorted run while merging, and
+ * written to the graph file at once. */
+#define graph_merge_buffer (1 << 16)
+
+/**
+ * @brief A halo's entry in the graph, as held on disk until the graph file is
+ * written.
+ */
+struct GraphRecord {
+  uint64_t graph;
+  int64_t snap;
+  int64_t halo;
+  uint64_t npart;
+};
+
+/**
+ * @class GraphBuilder
+ * @brief Builds the merger graph file as the snapshots are written.
+ *
+ * A graph is every halo connected by links (or by the hierarchy, a subhalo is
+ * in its host's graph). Graphs are found with a union-find over labels. A
+ * halo with no progenitors starts a new label, otherwise it takes its
+ * progenitors' labels, uniting them if they differ (the smallest label wins).
+ * Only the labels of the last generation added are held, so halos are labelled
+ * as each generation completes and streamed to a scratch file.
+ *
+ * Labels united after their halos were streamed out are resolved at the end.
+ * The records are then sorted by graph out-of-core: the scratch file is
+ * sorted a run at a time and the runs are merged straight into the graph
+ * file. Memory depends on the size of a generation (plus one entry per label)
+ * and never on the number of snapshots.
+ *
+ * @param engine The engine.
+ * @param scratch_path The file the records are streamed to.
+ * @param runs_path The file the sorted runs are written to.
+ * @param output_path The graph file.
+ * @param scratch The scratch file.
+ * @param nrecords The number of records streamed.
+ * @param run_size The number of records sorted in memory at once.
+ * @param labels The union-find over labels (each label's parent).
+ * @param frontier The label of each halo in the last generation added.
+ * @param last_snap The last snapshot added.
+ * @param compressor The threads compressing the graph file.
+ */
+class GraphBuilder {
+public:
+  /* The engine. */
+  Engine *engine;
+
+  /* The scratch files and the graph file. */
+  std::string scratch_path;
+  std::string runs_path;
+  std::string output_path;
+
+  /* The records streamed so far. */
+  std::ofstream scratch;
+  size_t nrecords;
+
+  /* The number of records sorted in memory at once (graph_run_size). */
+  size_t run_size;
+
+  /* The union-find over labels (each label's parent). */
+  std::vector<uint64_t> labels;
+
+  /* The label of each halo in the last generation added. */
+  std::vector<uint64_t> frontier;
+
+  /* The last snapshot added. */
+  int last_snap;
+
+  /* The threads compressing the graph file (nullptr to compress it on the
+   * thread writing it). */
+  ThreadPool *compressor;
+
+  GraphBuilder(Engine *engine);
+
+  void addGeneration(const Generation &gen);
+  void addHalos(int snap, size_t nhalos, const int64_t *parent,
+                const size_t *npart, const size_t *prog_offsets,
+                const int64_t *progs);
+  void resume();
+  void finish();
+
+private:
+  uint64_t newLabel();
+  uint64_t findLabel(uint64_t label);
+  uint64_t uniteLabels(uint64_t a, uint64_t b);
+  size_t resolveLabels();
+  std::vector<size_t> writeRuns(size_t ngraphs);
+  void mergeRuns(const std::vector<size_t> &runs, size_t ngraphs);
+};
+
+#endif // GRAPH_H_
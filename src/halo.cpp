@@ -0,0 +1,627 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality of the halo catalogue.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <numeric>
+#include <tuple>
+#include <utility>
+
+/* Local includes. */
+#include "halo.h"
+#include "logging.h"
+
+/* Don't split the membership counting into chunks smaller than this. */
+#define membership_min_chunk 65536
+
+/** @brief Add a halo to the block.
+ *
+ * Only the thread owning the block may call this.
+ *
+ * @param halo_type The type of the halo.
+ * @param halo_depth The depth of the halo in the overdensity heirarchy.
+ * @param parent_handle The provisional handle of the parent (or halo_null).
+ * @param halo_npart The number of particles in the halo.
+ * @param halo_first_part The lowest index of the halo's particles.
+ *
+ * @return The provisional handle of the new halo.
+ */
+int64_t HaloBlock::append(enum halo_types halo_type, int halo_depth,
+                          int64_t parent_handle, size_t halo_npart,
+                          size_t halo_first_part) {
+  int64_t handle = (static_cast<int64_t>(block_id) << halo_block_shift) |
+                   static_cast<int64_t>(type.size());
+  type.push_back(halo_type);
+  depth.push_back(halo_depth);
+  parent.push_back(parent_handle);
+  npart.push_back(halo_npart);
+  first_part.push_back(halo_first_part);
+  return handle;
+}
+
+/**
+ * @brief The data needed to turn provisional handles into final indices.
+ */
+struct HandleMap {
+  const size_t *block_start;
+  const size_t *final_index;
+  int64_t local_mask;
+};
+
+/** @brief Replace the provisional handles in a chunk of halo_id.
+ *
+ * @param map_data The chunk of halo_id (int64_t).
+ * @param num_elements The number of particles in the chunk.
+ * @param extra_data The HandleMap.
+ */
+static void remap_handles_mapper(void *map_data, int num_elements,
+                                 void *extra_data) {
+
+  int64_t *ids = static_cast<int64_t *>(map_data);
+  HandleMap *map = static_cast<HandleMap *>(extra_data);
+
+  for (int i = 0; i < num_elements; i++) {
+    int64_t h = ids[i];
+    if (h != halo_null) {
+      ids[i] = map->final_index[map->block_start[h >> halo_block_shift] +
+                                (h & map->local_mask)];
+    }
+  }
+}
+
+/** @brief Replace the catalogue with the halos in a set of blocks.
+ *
+ * The provisional handles are turned into final indices one depth at a time:
+ * once every parent has its final index its children can be ordered by
+ * (parent, decreasing size, first particle) and numbered in turn. The blocks
+ * are emptied.
+ *
+ * @param threadpool The threadpool.
+ * @param blocks The blocks (one per thread).
+ * @param part_halos The provisional handle of the halo each particle belongs
+ *                   to at each depth (moved into halo_id).
+ */
+void HaloCatalog::compact(ThreadPool *threadpool,
+                          std::vector<HaloBlock> &blocks,
+                          std::vector<member_vector<int64_t>> &&part_halos) {
+
+  reset();
+
+  /* Where each block starts in the flattened list of provisional halos. */
+  std::vector<size_t> block_start(blocks.size() + 1, 0);
+  for (size_t b = 0; b < blocks.size(); b++) {
+    block_start[b + 1] = block_start[b] + blocks[b].size();
+  }
+  size_t n = block_start.back();
+  const int64_t local_mask = (static_cast<int64_t>(1) << halo_block_shift) - 1;
+
+  /* Flatten the blocks, converting the parent handles as we go. */
+  std::vector<HaloBlock *> flat_block(n);
+  std::vector<size_t> flat_local(n);
+  std::vector<int64_t> flat_parent(n);
+  int max_depth = -1;
+  for (size_t b = 0; b < blocks.size(); b++) {
+    HaloBlock &block = blocks[b];
+    for (size_t i = 0; i < block.size(); i++) {
+      size_t f = block_start[b] + i;
+      int64_t p = block.parent[i];
+      flat_block[f] = &block;
+      flat_local[f] = i;
+      flat_parent[f] =
+          p == halo_null
+              ? halo_null
+              : static_cast<int64_t>(block_start[p >> halo_block_shift] +
+                                     (p & local_mask));
+      max_depth = std::max(max_depth, block.depth[i]);
+    }
+  }
+
+  /* Bin the halos by depth. */
+  std::vector<std::vector<size_t>> levels(max_depth + 1);
+  for (size_t f = 0; f < n; f++) {
+    levels[flat_block[f]->depth[flat_local[f]]].push_back(f);
+  }
+
+  /* Number each depth in turn. */
+  std::vector<size_t> final_index(n);
+  std::vector<size_t> order;
+  order.reserve(n);
+  depth_offsets.assign(1, 0);
+  for (std::vector<size_t> &level : levels) {
+    auto key = [&](size_t f) {
+      size_t p = flat_parent[f] == halo_null ? 0 : final_index[flat_parent[f]];
+      const HaloBlock *block = flat_block[f];
+      return std::make_tuple(p, ~block->npart[flat_local[f]],
+                             block->first_part[flat_local[f]]);
+    };
+    std::sort(level.begin(), level.end(),
+              [&](size_t a, size_t b) { return key(a) < key(b); });
+    for (size_t f : level) {
+      final_index[f] = order.size();
+      order.push_back(f);
+    }
+    depth_offsets.push_back(order.size());
+  }
+
+  /* Fill the catalogue in the final order. */
+  nhalos = n;
+  type.resize(n);
+  depth.resize(n);
+  parent.resize(n);
+  npart.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    size_t f = order[i];
+    HaloBlock *block = flat_block[f];
+    size_t local = flat_local[f];
+    type[i] = block->type[local];
+    depth[i] = block->depth[local];
+    parent[i] = flat_parent[f] == halo_null
+                    ? halo_null
+                    : static_cast<int64_t>(final_index[flat_parent[f]]);
+    npart[i] = block->npart[local];
+  }
+
+  /* Children are contiguous, so the links fall straight out. */
+  first_child.assign(n, halo_null);
+  n_child.assign(n, 0);
+  next_sibling.assign(n, halo_null);
+  for (size_t i = 0; i < n; i++) {
+    int64_t p = parent[i];
+    if (p == halo_null) {
+      continue;
+    }
+    if (first_child[p] == halo_null) {
+      first_child[p] = i;
+    }
+    n_child[p]++;
+    if (i + 1 < n && parent[i + 1] == p) {
+      next_sibling[i] = i + 1;
+    }
+  }
+
+  /* The particles now point at the final indices (depths without any halos
+   * are dropped). */
+  halo_id = std::move(part_halos);
+  halo_id.resize(max_depth + 1);
+  HandleMap map = {block_start.data(), final_index.data(), local_mask};
+  for (member_vector<int64_t> &ids : halo_id) {
+    threadpool->map(remap_handles_mapper, ids.data(), ids.size(),
+                    sizeof(int64_t), ThreadPool::threadpool_auto_chunk_size,
+                    &map);
+  }
+  buildMembership(threadpool);
+
+  /* The properties are only sized when calculated (see
+   * calculate_halo_properties), so those not requested cost nothing. */
+  x.clear();
+  v.clear();
+  mass.clear();
+  vel_disp.clear();
+  spin.clear();
+  r_half.clear();
+  vmax.clear();
+  rmax.clear();
+
+  /* Empty the blocks. */
+  for (HaloBlock &block : blocks) {
+    block = HaloBlock(block.block_id);
+  }
+}
+
+/**
+ * @brief The data shared by the threads building the membership rows of a
+ * depth.
+ *
+ * The particles are split into nchunks contiguous chunks and the passes map
+ * over the chunk numbers (as in radix_sort), so every chunk writes its own
+ * part of each row and the rows come out in ascending order for any number
+ * of threads.
+ */
+struct MembershipData {
+
+  /* The halo each particle is in at this depth, and the number of
+   * particles. */
+  const int64_t *ids;
+  size_t npart;
+  int nchunks;
+
+  /* The halos at this depth. */
+  size_t first_halo;
+  size_t nhalos;
+
+  /* The rows. */
+  const size_t *offsets;
+  size_t *members;
+
+  /* Each chunk's count of each halo's particles, then where it writes them
+   * (chunk major). */
+  size_t *cursors;
+
+  /* The particles in a halo not at this depth, and the halos whose count
+   * doesn't match their size. */
+  std::atomic<size_t> nstray;
+  std::atomic<size_t> nmismatched;
+
+  /* The first particle in a chunk. */
+  size_t chunkStart(int chunk) const { return npart * chunk / nchunks; }
+};
+
+/** @brief Count the particles of each halo in a chunk.
+ *
+ * @param map_data The chunk number (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The MembershipData.
+ */
+static void count_members_mapper(void *map_data, int num_elements,
+                                 void *extra_data) {
+  (void)num_elements;
+
+  int chunk = *static_cast<int *>(map_data);
+  MembershipData *data = static_cast<MembershipData *>(extra_data);
+  size_t *counts = data->cursors + chunk * data->nhalos;
+
+  std::fill(counts, counts + data->nhalos, 0);
+  size_t nstray = 0;
+  for (size_t p = data->chunkStart(chunk); p < data->chunkStart(chunk + 1);
+       p++) {
+    if (data->ids[p] == halo_null) {
+      continue;
+    }
+    size_t halo = static_cast<size_t>(data->ids[p]) - data->first_halo;
+    if (halo < data->nhalos) {
+      counts[halo]++;
+    } else {
+      nstray++;
+    }
+  }
+  if (nstray > 0) {
+    data->nstray += nstray;
+  }
+}
+
+/** @brief Turn a run of halos' counts into where each chunk writes them.
+ *
+ * @param map_data The run of part_offsets (size_t).
+ * @param num_elements The number of halos in the run.
+ * @param extra_data The MembershipData.
+ */
+static void members_offsets_mapper(void *map_data, int num_elements,
+                                   void *extra_data) {
+
+  MembershipData *data = static_cast<MembershipData *>(extra_data);
+  const size_t *offsets = static_cast<size_t *>(map_data);
+  size_t first = offsets - data->offsets - data->first_halo;
+
+  for (int i = 0; i < num_elements; i++) {
+    size_t cursor = offsets[i];
+    for (int c = 0; c < data->nchunks; c++) {
+      size_t &count = data->cursors[c * data->nhalos + first + i];
+      size_t start = cursor;
+      cursor += count;
+      count = start;
+    }
+    if (cursor != offsets[i + 1]) {
+      data->nmismatched++;
+    }
+  }
+}
+
+/** @brief Scatter a chunk's particles into their halos' rows.
+ *
+ * @param map_data The chunk number (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The MembershipData.
+ */
+static void scatter_members_mapper(void *map_data, int num_elements,
+                                   void *extra_data) {
+  (void)num_elements;
+
+  int chunk = *static_cast<int *>(map_data);
+  MembershipData *data = static_cast<MembershipData *>(extra_data);
+  size_t *cursors = data->cursors + chunk * data->nhalos;
+
+  for (size_t p = data->chunkStart(chunk); p < data->chunkStart(chunk + 1);
+       p++) {
+    if (data->ids[p] == halo_null) {
+      continue;
+    }
+    size_t halo = static_cast<size_t>(data->ids[p]) - data->first_halo;
+    if (halo < data->nhalos) {
+      data->members[cursors[halo]++] = p;
+    }
+  }
+}
+
+/** @brief Build the membership rows from halo_id with a counting sort.
+ *
+ * The row sizes are the halo sizes, so the offsets are a prefix sum over
+ * npart. Each depth is then sorted on its own: every chunk of particles
+ * counts its particles in each halo at the depth, the counts are turned into
+ * where each chunk writes in each row, and the chunks scatter their
+ * particles. A chunk only ever writes its own slots, so there are no atomics,
+ * and the rows are in ascending order with nothing left to sort.
+ *
+ * @param threadpool The threadpool.
+ */
+void HaloCatalog::buildMembership(ThreadPool *threadpool) {
+
+  part_offsets.assign(nhalos + 1, 0);
+  for (size_t i = 0; i < nhalos; i++) {
+    part_offsets[i + 1] = part_offsets[i] + npart[i];
+  }
+  part_members.resize(part_offsets[nhalos]);
+
+  member_vector<size_t> cursors;
+  std::vector<int> chunks;
+  size_t nstray = 0, nmismatched = 0;
+  for (size_t d = 0; d < halo_id.size(); d++) {
+    MembershipData data;
+    data.ids = halo_id[d].data();
+    data.npart = halo_id[d].size();
+    data.first_halo = d + 1 < depth_offsets.size() ? depth_offsets[d] : nhalos;
+    data.nhalos =
+        d + 1 < depth_offsets.size() ? depth_offsets[d + 1] - data.first_halo
+                                     : 0;
+    data.offsets = part_offsets.data();
+    data.members = part_members.data();
+    data.nstray = 0;
+    data.nmismatched = 0;
+
+    /* No more chunks than threads, and never more counts than
+     * particles. */
+    data.nchunks = static_cast<int>(std::min<size_t>(
+        {static_cast<size_t>(threadpool->getNumThreads()),
+         std::max<size_t>(data.npart / membership_min_chunk, 1),
+         std::max<size_t>(data.npart / std::max<size_t>(data.nhalos, 1),
+                          1)}));
+    cursors.resize(data.nchunks * data.nhalos);
+    data.cursors = cursors.data();
+    chunks.resize(data.nchunks);
+    std::iota(chunks.begin(), chunks.end(), 0);
+
+    threadpool->map(count_members_mapper, chunks.data(), data.nchunks,
+                    sizeof(int), 1, &data);
+    threadpool->map(members_offsets_mapper, &part_offsets[data.first_halo],
+                    data.nhalos, sizeof(size_t),
+                    ThreadPool::threadpool_auto_chunk_size, &data);
+    threadpool->map(scatter_members_mapper, chunks.data(), data.nchunks,
+                    sizeof(int), 1, &data);
+    nstray += data.nstray;
+    nmismatched += data.nmismatched;
+  }
+
+  /* Make sure every particle found its way into a row. */
+  if (nstray > 0 || nmismatched > 0) {
+    error("halo_id doesn't match the halos (%zu particles in a halo at "
+          "another depth, %zu halos with the wrong number of particles)!",
+          nstray, nmismatched);
+  }
+}
+
+/** @brief Remove particles from halos in place (e.g. when unbinding).
+ *
+ * One pass over the rows: each halo's surviving particles are shuffled down
+ * (keeping their order) to close the gaps left by those removed from it and
+ * from the rows before it, and the offsets move with them. So the rows stay
+ * exactly npart long and back to back, and nothing is reallocated. The
+ * removed particles no longer belong to any halo at the depth of the halo
+ * they were removed from. A halo's children are untouched, it's up to the
+ * caller to remove the particles from them too.
+ *
+ * @param remove Should a particle (index in the Domain) be removed from a
+ *               halo? Called with the halo and the particle.
+ *
+ * @return The number of particles removed.
+ */
+size_t HaloCatalog::removeParticles(
+    const std::function<bool(size_t, size_t)> &remove) {
+
+  size_t nkept = 0;
+  for (size_t ihalo = 0; ihalo < nhalos; ihalo++) {
+    member_vector<int64_t> &ids = halo_id[depth[ihalo]];
+    size_t start = nkept;
+    for (size_t j = part_offsets[ihalo]; j < part_offsets[ihalo + 1]; j++) {
+      size_t p = part_members[j];
+      if (remove(ihalo, p)) {
+        ids[p] = halo_null;
+      } else {
+        part_members[nkept++] = p;
+      }
+    }
+    part_offsets[ihalo] = start;
+    npart[ihalo] = nkept - start;
+  }
+
+  size_t nremoved = nhalos > 0 ? part_offsets[nhalos] - nkept : 0;
+  if (nhalos > 0) {
+    part_offsets[nhalos] = nkept;
+  }
+  part_members.resize(nkept);
+  return nremoved;
+}
+
+/** @brief Remove every halo from the catalogue (freeing the memory).
+ */
+void HaloCatalog::clear() { *this = HaloCatalog(); }
+
+/** @brief Remove every halo from the catalogue, keeping the memory.
+ *
+ * The arrays keep their capacity (including each depth of halo_id), so
+ * filling the catalogue with the next snapshot's halos only allocates if
+ * that snapshot needs more room.
+ */
+void HaloCatalog::reset() {
+  nhalos = 0;
+  depth_offsets.clear();
+  type.clear();
+  depth.clear();
+  parent.clear();
+  first_child.clear();
+  n_child.clear();
+  next_sibling.clear();
+  npart.clear();
+  for (member_vector<int64_t> &ids : halo_id) {
+    ids.clear();
+  }
+  part_offsets.clear();
+  part_members.clear();
+  x.clear();
+  v.clear();
+  mass.clear();
+  vel_disp.clear();
+  spin.clear();
+  r_half.clear();
+  vmax.clear();
+  rmax.clear();
+  prog_offsets.clear();
+  progs.clear();
+  prog_shared.clear();
+  desc_offsets.clear();
+  descs.clear();
+  desc_shared.clear();
+}
+
+/** @brief The memory allocated for a vector's elements.
+ *
+ * @param vec The vector.
+ */
+template <typename T, typename A>
+static size_t vector_nbytes(const std::vector<T, A> &vec) {
+  return vec.capacity() * sizeof(T);
+}
+
+/** @brief The memory held by the catalogue (including unused capacity).
+ */
+size_t HaloCatalog::nbytes() const {
+  size_t total = vector_nbytes(depth_offsets) + vector_nbytes(type) +
+                 vector_nbytes(depth) + vector_nbytes(parent) +
+                 vector_nbytes(first_child) + vector_nbytes(n_child) +
+                 vector_nbytes(next_sibling) + vector_nbytes(npart) +
+                 vector_nbytes(part_offsets) + vector_nbytes(part_members) +
+                 vector_nbytes(x) + vector_nbytes(v) + vector_nbytes(mass) +
+                 vector_nbytes(vel_disp) + vector_nbytes(spin) +
+                 vector_nbytes(r_half) + vector_nbytes(vmax) +
+                 vector_nbytes(rmax) + vector_nbytes(prog_offsets) +
+                 vector_nbytes(progs) + vector_nbytes(prog_shared) +
+                 vector_nbytes(desc_offsets) + vector_nbytes(descs) +
+                 vector_nbytes(desc_shared);
+  for (const member_vector<int64_t> &ids : halo_id) {
+    total += vector_nbytes(ids);
+  }
+  return total;
+}
+
+/** @brief Build one side of the links as compressed sparse rows.
+ *
+ * The links are sorted so each halo's list is in decreasing order of shared
+ * particles (the main progenitor or descendant first).
+ *
+ * @param links The links (reordered).
+ * @param nhalos The number of halos on this side.
+ * @param by_desc Are the rows the descendants (giving the progenitors)?
+ * @param offsets The row offsets.
+ * @param ids The halos on the other side.
+ * @param shared The number of shared particles.
+ */
+static void build_link_rows(std::vector<HaloLink> &links, size_t nhalos,
+                            bool by_desc, halo_vector<size_t> &offsets,
+                            halo_vector<int64_t> &ids,
+                            halo_vector<size_t> &shared) {
+
+  auto row = [by_desc](const HaloLink &l) { return by_desc ? l.desc : l.prog; };
+  auto col = [by_desc](const HaloLink &l) { return by_desc ? l.prog : l.desc; };
+  std::sort(links.begin(), links.end(),
+            [&](const HaloLink &a, const HaloLink &b) {
+              if (row(a) != row(b)) {
+                return row(a) < row(b);
+              }
+              if (a.shared != b.shared) {
+                return a.shared > b.shared;
+              }
+              return col(a) < col(b);
+            });
+
+  offsets.assign(nhalos + 1, 0);
+  ids.resize(links.size());
+  shared.resize(links.size());
+  for (size_t l = 0; l < links.size(); l++) {
+    offsets[row(links[l]) + 1]++;
+    ids[l] = col(links[l]);
+    shared[l] = links[l].shared;
+  }
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+}
+
+/** @brief Store the links between two consecutive catalogues.
+ *
+ * Fills the progenitors of curr and the descendants of prev.
+ *
+ * @param prev The earlier catalogue.
+ * @param curr The later catalogue.
+ * @param links The links between them (reordered).
+ */
+void link_catalogs(HaloCatalog &prev, HaloCatalog &curr,
+                   std::vector<HaloLink> &links) {
+  for (const HaloLink &l : links) {
+    if (l.prog < 0 || static_cast<size_t>(l.prog) >= prev.nhalos ||
+        l.desc < 0 || static_cast<size_t>(l.desc) >= curr.nhalos) {
+      error("Link (%lld -> %lld) is outside the catalogues!",
+            static_cast<long long>(l.prog), static_cast<long long>(l.desc));
+    }
+  }
+  build_link_rows(links, curr.nhalos, true, curr.prog_offsets, curr.progs,
+                  curr.prog_shared);
+  build_link_rows(links, prev.nhalos, false, prev.desc_offsets, prev.descs,
+                  prev.desc_shared);
+}
+
+/** @brief Store the links to one rank's catalogue, when linking across ranks.
+ *
+ * The links hold global halo indices (see link_halos_distributed), and the
+ * rows are this rank's halos, while the halos they link to may be on any
+ * rank, so stay global.
+ *
+ * @param catalog This rank's catalogue.
+ * @param first The global index of its first halo.
+ * @param links The links to its halos (reordered, and their rows made local).
+ * @param descendants Are its halos the descendants (filling its progenitors)
+ *                    rather than the progenitors (filling its descendants)?
+ */
+void link_rank_catalog(HaloCatalog &catalog, size_t first,
+                       std::vector<HaloLink> &links, bool descendants) {
+  for (HaloLink &l : links) {
+    int64_t &row = descendants ? l.desc : l.prog;
+    if (row < static_cast<int64_t>(first) ||
+        static_cast<size_t>(row) - first >= catalog.nhalos) {
+      error("Link (%lld -> %lld) is outside the catalogue!",
+            static_cast<long long>(l.prog), static_cast<long long>(l.desc));
+    }
+    row -= static_cast<int64_t>(first);
+  }
+  if (descendants) {
+    build_link_rows(links, catalog.nhalos, true, catalog.prog_offsets,
+                    catalog.progs, catalog.prog_shared);
+  } else {
+    build_link_rows(links, catalog.nhalos, false, catalog.desc_offsets,
+                    catalog.descs, catalog.desc_shared);
+  }
+}
@@ -15,15 +15,33 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
- * This file define the prototypes for a Halo object.
+ * This file define the prototypes for the halo catalogue.
  ******************************************************************************/
 #ifndef HALO_H_
 #define HALO_H_
 
 /* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <vector>
 
-using namespace std;
+/* Local includes. */
+#include "memory.h"
+#include "threadpool.h"
+
+/* The index used for a missing halo (no parent, child, sibling...). */
+#define halo_null -1
+
+/* Provisional halo handles hold the block in the bits above this one and the
+ * index within the block below it. */
+#define halo_block_shift 40
+
+/*! An array with an entry (or a few) per halo. */
+template <typename T> using halo_vector = tracked_vector<T, mem_halos>;
+
+/*! An array with an entry per particle in a halo. */
+template <typename T> using member_vector = tracked_vector<T, mem_membership>;
 
 /*! @brief The various types of halo.
  *
@@ -36,71 +54,240 @@ enum halo_types {
   halo_type_count,
 };
 
-/*! @brief The Halo object.
+/**
+ * @class HaloBlock
+ * @brief The halos found by a single thread, before compaction.
+ *
+ * Every thread appends the halos it finds to its own block, so halos can be
+ * created concurrently without any locking. A halo in a block is referred to
+ * by a provisional handle, (block << halo_block_shift) | index, which is what
+ * the parent links hold until HaloCatalog::compact turns them into final
+ * indices.
  *
- * This is the basic unit of MEGA. Any collection of particles to be tested as
- * a halo will intialise a Halo object and use the associated properties and
- * methods to derive its reality, children, propertites, progentiors and
- * (evenutally) descendants. */
-class Halo {
+ * The blocks only hold what is needed to order the halos, the particles
+ * record which halo they are in through the per-depth halo_id arrays (see
+ * HaloCatalog), which are filled with the provisional handles.
+ *
+ * @param block_id The index of this block.
+ * @param type The type of each halo.
+ * @param depth The depth of each halo in the overdensity heirarchy.
+ * @param parent The provisional handle of each halo's parent (or halo_null).
+ * @param npart The number of particles in each halo.
+ * @param first_part The lowest index of each halo's particles.
+ */
+class HaloBlock {
+public:
+  /* The index of this block. */
+  int block_id;
+
+  /* The type of each halo. */
+  halo_vector<enum halo_types> type;
+
+  /* The depth of each halo. */
+  halo_vector<int> depth;
+
+  /* The provisional handle of each halo's parent. */
+  halo_vector<int64_t> parent;
 
+  /* The number of particles in each halo. */
+  halo_vector<size_t> npart;
+
+  /* The lowest index of each halo's particles. */
+  halo_vector<size_t> first_part;
+
+  HaloBlock(int block_id) : block_id(block_id) {}
+
+  /* The number of halos in the block. */
+  size_t size() const { return type.size(); }
+
+  int64_t append(enum halo_types halo_type, int halo_depth,
+                 int64_t parent_handle, size_t halo_npart,
+                 size_t halo_first_part);
+};
+
+/**
+ * @class HaloCatalog
+ * @brief Every halo found in a snapshot, stored as a structure of arrays.
+ *
+ * Halos are referred to by their index in the catalogue. The hierarchy is
+ * held as indices (parent, first_child, next_sibling) and the progenitors
+ * and descendants as compressed sparse rows: halo i's progenitors are
+ * progs[prog_offsets[i]] to progs[prog_offsets[i + 1] - 1], indices into the
+ * previous snapshot's catalogue (global indices over every rank's catalogue
+ * when running on several ranks), with the number of particles shared with
+ * each in prog_shared. Nothing holds a pointer, so a catalogue can be
+ * relocated, written out or read back as flat arrays.
+ *
+ * Halos are ordered by depth, hosts first. Within a depth halos are grouped
+ * by parent (so each halo's children are contiguous) and then ordered by
+ * decreasing size. The order only depends on the halos themselves, never on
+ * which thread found them.
+ *
+ * Particle membership is held both ways. halo_id[d][p] is the halo particle
+ * p belongs to at depth d (or halo_null), and the halos' particles are
+ * compressed sparse rows: halo i's particles are part_members[part_offsets[i]]
+ * onwards, in ascending order. Since halos are ordered by depth, each depth's
+ * members are contiguous too. A row is always npart[i] long, removing
+ * particles (e.g. when unbinding, see removeParticles) closes up the rows in
+ * place.
+ *
+ * @param nhalos The number of halos.
+ * @param depth_offsets Where each depth starts (n_depths + 1 entries).
+ * @param type The type of each halo.
+ * @param depth The depth of each halo in the overdensity heirarchy.
+ * @param parent The parent of each halo (halo_null for hosts).
+ * @param first_child The first child of each halo (halo_null if none).
+ * @param n_child The number of children of each halo.
+ * @param next_sibling The next halo with the same parent (halo_null if none).
+ * @param npart The number of particles in each halo.
+ * @param halo_id The halo each particle belongs to at each depth.
+ * @param part_offsets Where each halo's particles start in part_members.
+ * @param part_members The indices of each halo's particles in the Domain.
+ * @param x, v, mass, vel_disp, spin, r_half, vmax, rmax The properties.
+ * @param prog_offsets, progs, prog_shared The progenitors.
+ * @param desc_offsets, descs, desc_shared The descendants.
+ */
+class HaloCatalog {
 public:
-  /* Below we define all data members of a halo (attributes) */
+  /* The number of halos. */
+  size_t nhalos;
+
+  /* Where each depth starts. */
+  halo_vector<size_t> depth_offsets;
 
   /* Internal properties used in the running of MEGA. */
 
-  /*! The type of the halo (host or substructure). */
-  enum halo_types type;
+  /*! The type of each halo (host or substructure). */
+  halo_vector<enum halo_types> type;
+
+  /*! The depth of each halo in the overdensity heirarchy. */
+  halo_vector<int> depth;
+
+  /*! The halo each halo was derived from. */
+  halo_vector<int64_t> parent;
 
-  /*! A pointer to the parent halo from which this halo was derived. */
-  Halo *parent;
+  /*! The first substructure child derived from each halo. */
+  halo_vector<int64_t> first_child;
 
-  /*! A pointer to the first substructure child derived from this halo. */
-  Halo *child;
+  /*! The number of child halos each halo has. */
+  halo_vector<int> n_child;
 
-  /*! The number of child halos this halo has. */
-  int n_child;
+  /*! The next halo derived from each halo's parent. */
+  halo_vector<int64_t> next_sibling;
 
-  /*! A pointer to the next halo derived from this halo's parent. */
-  Halo *sibling;
+  /*! The number of particles in each halo. */
+  halo_vector<size_t> npart;
 
-  /*! The number of siblings this halo has. */
-  int n_sibling;
+  /*! The halo each particle belongs to at each depth (halo_null if none). */
+  std::vector<member_vector<int64_t>> halo_id;
 
-  /*! The depth of the halo in the overdensity heirarchy. */
-  int overden_depth;
+  /*! Where each halo's particles start in part_members (nhalos + 1 entries). */
+  member_vector<size_t> part_offsets;
+
+  /*! The indices of each halo's particles in the Domain particle arrays. */
+  member_vector<size_t> part_members;
 
   /* Physically meaninful properties. */
 
-  /*! The position of the halo (defined by centre of mass). */
-  double x[3];
+  /*! The position of each halo (defined by centre of mass, 3 per halo). */
+  halo_vector<double> x;
+
+  /*! The bulk velocity of each halo (mass weighted average, 3 per halo). */
+  halo_vector<double> v;
+
+  /*! The total mass of each halo. */
+  halo_vector<double> mass;
+
+  /*! The 3D velocity dispersion about the bulk velocity. */
+  halo_vector<double> vel_disp;
+
+  /*! The Bullock spin parameter (measured at the outermost particle). */
+  halo_vector<double> spin;
+
+  /*! The radius enclosing half the mass of each halo. */
+  halo_vector<double> r_half;
+
+  /*! The maximum circular velocity. */
+  halo_vector<double> vmax;
 
-  /*! The bulk velocity of the halo (mass weighted average). */
-  double v[3];
+  /*! The radius at which the maximum circular velocity is reached. */
+  halo_vector<double> rmax;
 
   /* Linking properties. */
 
-  /*! A pointer to this halo's progenitors. */
-  vector<Halo> *progs;
+  /*! Where each halo's progenitors start in progs (nhalos + 1 entries). */
+  halo_vector<size_t> prog_offsets;
 
-  /*! The number of progenitors this halo has. */
-  int n_progs;
+  /*! The progenitors (indices into the previous catalogue). */
+  halo_vector<int64_t> progs;
 
-  /*! A pointer to this halo's descendants. */
-  Halo *descs;
+  /*! The number of particles shared with each progenitor. */
+  halo_vector<size_t> prog_shared;
 
-  /*! The number of descendants this halo has. */
-  int n_descs;
+  /*! Where each halo's descendants start in descs (nhalos + 1 entries). */
+  halo_vector<size_t> desc_offsets;
 
-  /* Below we define all member functions of a halo. */
+  /*! The descendants (indices into the next catalogue). */
+  halo_vector<int64_t> descs;
 
-  /* Constructor and destructor. */
-  Halo();
-  ~Halo();
+  /*! The number of particles shared with each descendant. */
+  halo_vector<size_t> desc_shared;
 
-  /* Methods related to finding structures. */
+  HaloCatalog() : nhalos(0) {}
+
+  /* The number of host halos (they come first). */
+  size_t nhosts() const {
+    return depth_offsets.size() > 1 ? depth_offsets[1] : nhalos;
+  }
+
+  /* The particles of a halo (npart[ihalo] of them). */
+  size_t *parts(size_t ihalo) { return &part_members[part_offsets[ihalo]]; }
+  const size_t *parts(size_t ihalo) const {
+    return &part_members[part_offsets[ihalo]];
+  }
+
+  /* The number of progenitors of a halo. */
+  size_t nprogs(size_t ihalo) const {
+    return prog_offsets.empty()
+               ? 0
+               : prog_offsets[ihalo + 1] - prog_offsets[ihalo];
+  }
+
+  /* The number of descendants of a halo. */
+  size_t ndescs(size_t ihalo) const {
+    return desc_offsets.empty()
+               ? 0
+               : desc_offsets[ihalo + 1] - desc_offsets[ihalo];
+  }
+
+  void compact(ThreadPool *threadpool, std::vector<HaloBlock> &blocks,
+               std::vector<member_vector<int64_t>> &&part_halos);
+  size_t removeParticles(const std::function<bool(size_t, size_t)> &remove);
+  void clear();
+  void reset();
+  size_t nbytes() const;
+
+private:
+  void buildMembership(ThreadPool *threadpool);
+};
+
+/**
+ * @brief A link between a halo and its descendant in the next snapshot.
+ *
+ * @param prog The progenitor's index in the earlier catalogue.
+ * @param desc The descendant's index in the later catalogue.
+ * @param shared The number of particles they share.
+ */
+struct HaloLink {
+  int64_t prog;
+  int64_t desc;
+  size_t shared;
+};
 
-  /* Methods related to linking structures. */
-}
+/* Prototypes */
+void link_catalogs(HaloCatalog &prev, HaloCatalog &curr,
+                   std::vector<HaloLink> &links);
+void link_rank_catalog(HaloCatalog &catalog, size_t first,
+                       std::vector<HaloLink> &links, bool descendants);
 
 #endif // HALO_H_
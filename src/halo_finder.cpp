@@ -0,0 +1,877 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for finding halos, both hosts and
+ * the substructure nested within them.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <unordered_map>
+#include <utility>
+
+/* Local includes. */
+#include "domain.h"
+#include "halo_finder.h"
+#include "logging.h"
+#include "particles.h"
+#include "profiler.h"
+
+/* The number of cells in each chunk of the friends-of-friends. Dense cells
+ * cost far more than sparse ones, so keep the chunks small for the threads
+ * to balance them. */
+#define fof_cells_per_chunk 16
+
+/** @brief The constructor for the HaloGrid.
+ *
+ * Bins the particles into cells at least min_width wide. The number of cells
+ * is capped at the number of particles so sparse sets (e.g. a single halo)
+ * don't produce huge, mostly empty, grids.
+ *
+ * @param pos The positions of the particles.
+ * @param stride The number of doubles between consecutive particle positions.
+ * @param npart The number of particles.
+ * @param min_width The minimum cell width (the linking length).
+ * @param boxsize The periodic box size, or nullptr if the grid shouldn't wrap.
+ */
+HaloGrid::HaloGrid(const double *pos, size_t stride, size_t npart,
+                   double min_width, const double *boxsize) {
+
+  ProfileScope profile("Sorting into cells");
+
+  /* Define the extent of the grid. */
+  periodic = boxsize != nullptr;
+  double extent[3];
+  if (periodic) {
+    for (int k = 0; k < 3; k++) {
+      origin[k] = 0;
+      extent[k] = boxsize[k];
+      dim[k] = boxsize[k];
+    }
+  } else {
+    double max_pos[3];
+    for (int k = 0; k < 3; k++) {
+      origin[k] = npart > 0 ? pos[k] : 0;
+      max_pos[k] = origin[k];
+    }
+    for (size_t i = 1; i < npart; i++) {
+      for (int k = 0; k < 3; k++) {
+        origin[k] = std::min(origin[k], pos[i * stride + k]);
+        max_pos[k] = std::max(max_pos[k], pos[i * stride + k]);
+      }
+    }
+    for (int k = 0; k < 3; k++) {
+      extent[k] = max_pos[k] - origin[k];
+      dim[k] = extent[k];
+    }
+  }
+
+  /* How many cells can we fit along each axis? */
+  for (int k = 0; k < 3; k++) {
+    if (min_width > 0 && extent[k] > 0) {
+      cdim[k] = static_cast<int>(
+          std::min(std::floor(extent[k] / min_width), 1024.0));
+      cdim[k] = std::max(cdim[k], 1);
+    } else {
+      cdim[k] = 1;
+    }
+  }
+
+  /* Don't make more cells than particles. */
+  double max_cells = std::max<size_t>(npart, 1);
+  double ncells_wanted = static_cast<double>(cdim[0]) * cdim[1] * cdim[2];
+  if (ncells_wanted > max_cells) {
+    double shrink = std::cbrt(ncells_wanted / max_cells);
+    for (int k = 0; k < 3; k++) {
+      cdim[k] = std::max(static_cast<int>(cdim[k] / shrink), 1);
+    }
+  }
+
+  /* A periodic grid needs at least 3 cells along an axis for the neighbours
+   * to be distinct, otherwise just use a single cell along that axis. */
+  if (periodic) {
+    for (int k = 0; k < 3; k++) {
+      if (cdim[k] < 3) {
+        cdim[k] = 1;
+      }
+    }
+  }
+
+  /* Set the cell widths. */
+  for (int k = 0; k < 3; k++) {
+    width[k] = extent[k] > 0 ? extent[k] / cdim[k] : std::max(min_width, 1.0);
+    iwidth[k] = 1.0 / width[k];
+  }
+
+  /* Find the cell of each particle and count the particles in each cell. */
+  int ncells = cdim[0] * cdim[1] * cdim[2];
+  part_cells.resize(npart);
+  cell_offsets.assign(ncells + 1, 0);
+  for (size_t i = 0; i < npart; i++) {
+    int ijk[3];
+    for (int k = 0; k < 3; k++) {
+      double x = pos[i * stride + k] - origin[k];
+      if (periodic) {
+        x -= dim[k] * std::floor(x / dim[k]);
+      }
+      ijk[k] = std::min(std::max(static_cast<int>(x * iwidth[k]), 0),
+                        cdim[k] - 1);
+    }
+    part_cells[i] = getCellIndex(ijk[0], ijk[1], ijk[2]);
+    cell_offsets[part_cells[i] + 1]++;
+  }
+
+  /* Convert the counts to offsets and sort the particle indices by cell. */
+  for (int c = 0; c < ncells; c++) {
+    cell_offsets[c + 1] += cell_offsets[c];
+  }
+  cell_parts.resize(npart);
+  std::vector<size_t> cell_fill(cell_offsets.begin(), cell_offsets.end() - 1);
+  for (size_t i = 0; i < npart; i++) {
+    cell_parts[cell_fill[part_cells[i]]++] = i;
+  }
+}
+
+/** @brief Get the neighbouring cell indices along an axis.
+ *
+ * @param grid The grid.
+ * @param k The axis.
+ * @param c The cell's index along the axis.
+ * @param nbrs The (up to 3) neighbouring indices (including c).
+ *
+ * @return The number of neighbours.
+ */
+static int get_neighbours(const HaloGrid &grid, int k, int c, int *nbrs) {
+  int n = 0;
+  for (int d = -1; d <= 1; d++) {
+    int nc = c + d;
+    if (grid.periodic) {
+      if (grid.cdim[k] == 1 && d != 0) {
+        continue;
+      }
+      nc = (nc + grid.cdim[k]) % grid.cdim[k];
+    } else if (nc < 0 || nc >= grid.cdim[k]) {
+      continue;
+    }
+    nbrs[n++] = nc;
+  }
+  return n;
+}
+
+/** @brief Compute the squared separation of two particles.
+ *
+ * Uses the nearest periodic image if the grid is periodic.
+ */
+static inline double get_r2(const HaloGrid &grid, const double *pi,
+                            const double *pj) {
+  double r2 = 0;
+  for (int k = 0; k < 3; k++) {
+    double dx = pj[k] - pi[k];
+    if (grid.periodic) {
+      dx -= grid.dim[k] * std::nearbyint(dx / grid.dim[k]);
+    }
+    r2 += dx * dx;
+  }
+  return r2;
+}
+
+/** @brief Calculate the spatial linking length at a depth in the heirarchy.
+ *
+ * The host linking length is llcoeff times the mean interparticle
+ * separation. Each level below the host has sub_ratio times the overdensity of
+ * the level above, so the linking length shrinks by sub_ratio^(1/3) per level.
+ *
+ * @param engine The engine.
+ * @param depth The depth in the overdensity heirarchy (host = 0).
+ */
+double linking_length(Engine *engine, int depth) {
+  Domain *domain = engine->domain;
+
+  if (domain->npart_dm_sim == 0) {
+    error("Can't define a linking length without dark matter particles!");
+  }
+
+  double volume = domain->boxsize[0] * domain->boxsize[1] * domain->boxsize[2];
+  double mean_sep = std::cbrt(volume / domain->npart_dm_sim);
+
+  return engine->ll_coeff * mean_sep /
+         std::pow(static_cast<double>(engine->sub_ratio), depth / 3.0);
+}
+
+/** @brief Find the root of a particle in the union-find array.
+ *
+ * Uses path halving to keep the trees flat.
+ */
+size_t fof_find(size_t *uf, size_t i) {
+  while (uf[i] != i) {
+    uf[i] = uf[uf[i]];
+    i = uf[i];
+  }
+  return i;
+}
+
+/** @brief Join the groups containing two particles.
+ *
+ * The lowest root always wins so the result is independent of the order
+ * particles are linked in.
+ */
+void fof_union(size_t *uf, size_t i, size_t j) {
+  i = fof_find(uf, i);
+  j = fof_find(uf, j);
+  if (i < j) {
+    uf[j] = i;
+  } else if (j < i) {
+    uf[i] = j;
+  }
+}
+
+/** @brief Get the indices of the cells neighbouring a cell.
+ *
+ * @param grid The grid.
+ * @param c The cell.
+ * @param nbrs The (up to 27) neighbouring cells (including c).
+ *
+ * @return The number of neighbours.
+ */
+static int get_cell_neighbours(const HaloGrid &grid, int c, int *nbrs) {
+  int cdim_jk = grid.cdim[1] * grid.cdim[2];
+  int ni[3], nj[3], nk[3];
+  int nni = get_neighbours(grid, 0, c / cdim_jk, ni);
+  int nnj = get_neighbours(grid, 1, (c / grid.cdim[2]) % grid.cdim[1], nj);
+  int nnk = get_neighbours(grid, 2, c % grid.cdim[2], nk);
+
+  int n = 0;
+  for (int a = 0; a < nni; a++) {
+    for (int b = 0; b < nnj; b++) {
+      for (int d = 0; d < nnk; d++) {
+        nbrs[n++] = grid.getCellIndex(ni[a], nj[b], nk[d]);
+      }
+    }
+  }
+  return n;
+}
+
+/**
+ * @brief The working arrays of a thread searching pairs of cells for the
+ * links between their groups.
+ */
+struct FOFScratch {
+
+  /* Where each group of the lower and the higher cell starts in by_group
+   * (with the end of the last group). */
+  std::vector<size_t> starts;
+  std::vector<size_t> nbr_starts;
+
+  /* The union-find over the two cells' groups. */
+  std::vector<size_t> uf;
+
+  /* The links found between groups in different cells. */
+  std::vector<std::pair<size_t, size_t>> links;
+};
+
+/**
+ * @brief The data shared by the threads running the friends-of-friends over
+ * a grid.
+ */
+struct FOFData {
+
+  /* The particle positions and the number of doubles between them. */
+  const double *pos;
+  size_t stride;
+
+  /* The grid and the squared linking length. */
+  const HaloGrid *grid;
+  double ll2;
+
+  /* The union-find array. */
+  size_t *uf;
+
+  /* Each cell's particles sorted by group (laid out as grid->cell_parts). */
+  size_t *by_group;
+
+  /* The threadpool (for the thread IDs). */
+  ThreadPool *threadpool;
+
+  /* Each thread's working arrays. */
+  std::vector<FOFScratch> scratch;
+
+  /* Are two particles closer than the linking length? */
+  bool linked(size_t i, size_t j) const {
+    return get_r2(*grid, &pos[i * stride], &pos[j * stride]) < ll2;
+  }
+};
+
+/** @brief Link the particles within each of a run of cells.
+ *
+ * A cell's particles are only linked to each other, so every tree in the
+ * union-find stays inside its cell and cells can be linked concurrently.
+ * Each particle is then pointed straight at its root, which the cross-cell
+ * pass reads without touching the trees, and the cell's particles are sorted
+ * by group.
+ *
+ * @param map_data The run of cell indices (int).
+ * @param num_elements The number of cells in the run.
+ * @param extra_data The FOFData.
+ */
+static void fof_cells_mapper(void *map_data, int num_elements,
+                             void *extra_data) {
+
+  const int *cells = static_cast<int *>(map_data);
+  FOFData *data = static_cast<FOFData *>(extra_data);
+  const HaloGrid &grid = *data->grid;
+  size_t *uf = data->uf;
+
+  for (int n = 0; n < num_elements; n++) {
+    size_t first = grid.cell_offsets[cells[n]];
+    size_t last = grid.cell_offsets[cells[n] + 1];
+
+    for (size_t pi = first; pi < last; pi++) {
+      size_t i = grid.cell_parts[pi];
+      for (size_t pj = pi + 1; pj < last; pj++) {
+        size_t j = grid.cell_parts[pj];
+
+        /* Skip pairs already in the same group (the bulk of pairs in dense
+         * halos). */
+        if (fof_find(uf, i) != fof_find(uf, j) && data->linked(i, j)) {
+          fof_union(uf, i, j);
+        }
+      }
+    }
+
+    size_t *by_group = data->by_group;
+    for (size_t p = first; p < last; p++) {
+      size_t i = grid.cell_parts[p];
+      uf[i] = fof_find(uf, i);
+      by_group[p] = i;
+    }
+    std::sort(by_group + first, by_group + last, [uf](size_t a, size_t b) {
+      return uf[a] < uf[b] || (uf[a] == uf[b] && a < b);
+    });
+  }
+}
+
+/** @brief Append where each of a cell's groups starts in by_group.
+ *
+ * @param data The FOFData.
+ * @param c The cell.
+ * @param starts The starts (appended to, with the end of the last group).
+ */
+static void get_group_starts(const FOFData &data, int c,
+                             std::vector<size_t> &starts) {
+  size_t first = data.grid->cell_offsets[c];
+  size_t last = data.grid->cell_offsets[c + 1];
+  for (size_t p = first; p < last; p++) {
+    if (p == first || data.uf[data.by_group[p]] !=
+                          data.uf[data.by_group[p - 1]]) {
+      starts.push_back(p);
+    }
+  }
+  starts.push_back(last);
+}
+
+/** @brief Find the links between the groups of each of a run of cells and
+ * the groups of its neighbours.
+ *
+ * Each pair of neighbouring cells is searched once, from the lower cell,
+ * a pair of groups at a time. The search of a pair of groups stops at the
+ * first pair of particles close enough, and pairs of groups already joined
+ * through the others in the two cells aren't searched at all, so a dense
+ * halo spread over many cells yields a handful of links rather than every
+ * pair of particles.
+ *
+ * @param map_data The run of cell indices (int).
+ * @param num_elements The number of cells in the run.
+ * @param extra_data The FOFData.
+ */
+static void fof_cross_cells_mapper(void *map_data, int num_elements,
+                                   void *extra_data) {
+
+  const int *cells = static_cast<int *>(map_data);
+  FOFData *data = static_cast<FOFData *>(extra_data);
+  const size_t *by_group = data->by_group;
+  FOFScratch &scratch = data->scratch[data->threadpool->getThreadId()];
+  std::vector<size_t> &starts = scratch.starts;
+  std::vector<size_t> &nbr_starts = scratch.nbr_starts;
+  std::vector<size_t> &uf = scratch.uf;
+
+  for (int n = 0; n < num_elements; n++) {
+    int c = cells[n];
+    if (data->grid->cell_offsets[c] == data->grid->cell_offsets[c + 1]) {
+      continue;
+    }
+
+    int nbrs[27];
+    int nnbrs = get_cell_neighbours(*data->grid, c, nbrs);
+
+    starts.clear();
+    get_group_starts(*data, c, starts);
+    size_t ngroups = starts.size() - 1;
+
+    for (int b = 0; b < nnbrs; b++) {
+      int nc = nbrs[b];
+      if (nc <= c ||
+          data->grid->cell_offsets[nc] == data->grid->cell_offsets[nc + 1]) {
+        continue;
+      }
+
+      /* Number the groups of both cells, those of c first. */
+      nbr_starts.clear();
+      get_group_starts(*data, nc, nbr_starts);
+      size_t nnbr_groups = nbr_starts.size() - 1;
+      uf.resize(ngroups + nnbr_groups);
+      std::iota(uf.begin(), uf.end(), 0);
+
+      for (size_t g = 0; g < ngroups; g++) {
+        for (size_t h = 0; h < nnbr_groups; h++) {
+          if (fof_find(uf.data(), g) == fof_find(uf.data(), ngroups + h)) {
+            continue;
+          }
+
+          /* Is any pair of their particles close enough? */
+          bool found = false;
+          for (size_t pi = starts[g]; pi < starts[g + 1] && !found; pi++) {
+            for (size_t pj = nbr_starts[h]; pj < nbr_starts[h + 1] && !found;
+                 pj++) {
+              found = data->linked(by_group[pi], by_group[pj]);
+            }
+          }
+          if (found) {
+            fof_union(uf.data(), g, ngroups + h);
+            scratch.links.emplace_back(data->uf[by_group[starts[g]]],
+                                       data->uf[by_group[nbr_starts[h]]]);
+          }
+        }
+      }
+    }
+  }
+}
+
+/** @brief Link every pair of particles in a grid closer than ll.
+ *
+ * The particles within each cell are linked first, the cells running
+ * concurrently. Every pair of neighbouring cells is then searched, again
+ * concurrently, for the links between their groups, and these are joined in
+ * a final serial union pass. Since the lowest root always wins the groups
+ * (and their roots) are the same for any number of threads.
+ *
+ * @param threadpool The threadpool.
+ * @param pos The particle positions.
+ * @param stride The number of doubles between consecutive positions.
+ * @param grid The grid the particles have been binned into.
+ * @param ll The linking length.
+ * @param uf The union-find array (initialised by the caller so that every
+ *           particle is its own root).
+ */
+void fof_link_all(ThreadPool *threadpool, const double *pos, size_t stride,
+                  const HaloGrid &grid, double ll, size_t *uf) {
+
+  tracked_vector<size_t, mem_cells> by_group(grid.cell_parts.size());
+
+  FOFData data;
+  data.pos = pos;
+  data.stride = stride;
+  data.grid = &grid;
+  data.ll2 = ll * ll;
+  data.uf = uf;
+  data.by_group = by_group.data();
+  data.threadpool = threadpool;
+  data.scratch.resize(threadpool->getNumThreads());
+
+  std::vector<int> cells(grid.cell_offsets.size() - 1);
+  std::iota(cells.begin(), cells.end(), 0);
+
+  /* Link within the cells. */
+  threadpool->map(fof_cells_mapper, cells.data(), cells.size(), sizeof(int),
+                  fof_cells_per_chunk, &data);
+
+  /* Find the links between neighbouring cells. */
+  threadpool->map(fof_cross_cells_mapper, cells.data(), cells.size(),
+                  sizeof(int), fof_cells_per_chunk, &data);
+
+  /* And join the groups they link. */
+  size_t nlinks = 0;
+  for (const FOFScratch &scratch : data.scratch) {
+    for (const std::pair<size_t, size_t> &link : scratch.links) {
+      fof_union(uf, link.first, link.second);
+    }
+    nlinks += scratch.links.size();
+  }
+
+  v_message("Joined the groups of %zu cells with %zu cross-cell links",
+            cells.size(), nlinks);
+}
+
+/** @brief Link pairs of particles within a halo closer than ll.
+ *
+ * Only particles carrying the halo's label are linked. Other particles in
+ * the neighbouring cells belong to different halos, possibly being searched
+ * concurrently, and are ignored.
+ *
+ * @param pos The particle positions (contiguous, 3 per particle).
+ * @param grid The grid the particles have been binned into.
+ * @param members The indices of the halo's particles.
+ * @param labels The label of each particle.
+ * @param label The label of the halo being searched.
+ * @param ll The linking length.
+ * @param uf The union-find array (initialised for members by the caller).
+ */
+void fof_link_subset(const double *pos, const HaloGrid &grid,
+                     const std::vector<size_t> &members,
+                     const std::atomic<int> *labels, int label, double ll,
+                     size_t *uf) {
+
+  double ll2 = ll * ll;
+  int cdim_jk = grid.cdim[1] * grid.cdim[2];
+
+  for (size_t i : members) {
+
+    /* Get this particle's cell and its neighbours. */
+    int c = grid.part_cells[i];
+    int ni[3], nj[3], nk[3];
+    int nni = get_neighbours(grid, 0, c / cdim_jk, ni);
+    int nnj = get_neighbours(grid, 1, (c / grid.cdim[2]) % grid.cdim[1], nj);
+    int nnk = get_neighbours(grid, 2, c % grid.cdim[2], nk);
+
+    for (int a = 0; a < nni; a++) {
+      for (int b = 0; b < nnj; b++) {
+        for (int d = 0; d < nnk; d++) {
+          int nc = grid.getCellIndex(ni[a], nj[b], nk[d]);
+
+          for (size_t pj = grid.cell_offsets[nc];
+               pj < grid.cell_offsets[nc + 1]; pj++) {
+            size_t j = grid.cell_parts[pj];
+
+            /* Only consider each pair once, only within this halo, and
+             * skip pairs already in the same group. */
+            if (j <= i || labels[j].load(std::memory_order_relaxed) != label ||
+                fof_find(uf, i) == fof_find(uf, j)) {
+              continue;
+            }
+
+            if (get_r2(grid, &pos[i * 3], &pos[j * 3]) < ll2) {
+              fof_union(uf, i, j);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/** @brief The constructor for a SubstructureSearch.
+ *
+ * Unwraps the host's particle positions relative to its first particle and
+ * builds the grid over them at the first substructure linking length.
+ *
+ * @param engine The engine.
+ * @param queue The queue the substructure tasks will be run from.
+ * @param blocks The blocks to append the found halos to.
+ * @param part_halos The halo each particle belongs to at each depth.
+ * @param host_id The provisional handle of the host halo to search.
+ * @param host_parts The indices of the host's particles.
+ */
+SubstructureSearch::SubstructureSearch(
+    Engine *engine, TaskQueue *queue, std::vector<HaloBlock> *blocks,
+    std::vector<member_vector<int64_t>> *part_halos, int64_t host_id,
+    const member_vector<size_t> *host_parts)
+    : engine(engine), queue(queue), blocks(blocks), host_id(host_id),
+      host_parts(host_parts), part_halos(part_halos), next_label(1) {
+
+  Domain *domain = engine->domain;
+  size_t npart = host_parts->size();
+
+  /* Unwrap the positions so the host is contiguous. */
+  pos.resize(3 * npart);
+  const double *ref = domain->dark_matter[(*host_parts)[0]].pos;
+  for (size_t i = 0; i < npart; i++) {
+    const double *x = domain->dark_matter[(*host_parts)[i]].pos;
+    for (int k = 0; k < 3; k++) {
+      double dx = x[k] - ref[k];
+      if (domain->periodic) {
+        dx -= domain->boxsize[k] * std::nearbyint(dx / domain->boxsize[k]);
+      }
+      pos[3 * i + k] = dx;
+    }
+  }
+
+  /* Build the grid at the largest substructure linking length. */
+  grid = std::make_unique<HaloGrid>(pos.data(), 3, npart,
+                                    linking_length(engine, 1), nullptr);
+
+  /* Every particle starts in the host (label 0). */
+  labels = std::make_unique<std::atomic<int>[]>(npart);
+  for (size_t i = 0; i < npart; i++) {
+    labels[i].store(0, std::memory_order_relaxed);
+  }
+  uf.resize(npart);
+}
+
+/** @brief Search a single halo for substructure at the next depth.
+ *
+ * Runs the friends-of-friends over the halo's particles at the linking length
+ * of the depth being searched. Every group above the particle threshold
+ * becomes a child of the halo, appended to this thread's block, and
+ * immediately spawns its own search at the next depth. The child's particles
+ * are marked with its handle at this depth.
+ *
+ * @param search The search of the host this halo lives in.
+ * @param halo_id The provisional handle of the halo to search.
+ * @param label The label of the halo's particles.
+ * @param members The indices of the halo's particles within the host.
+ * @param depth The depth being searched for.
+ */
+static void substructure_task(std::shared_ptr<SubstructureSearch> search,
+                              int64_t halo_id, int label,
+                              const std::vector<size_t> &members, int depth) {
+
+  ProfileScope profile("Substructure search");
+
+  Engine *engine = search->engine;
+  size_t *uf = search->uf.data();
+  const member_vector<size_t> &host_parts = *search->host_parts;
+  member_vector<int64_t> &part_halos = (*search->part_halos)[depth];
+  HaloBlock &block = (*search->blocks)[engine->threadpool->getThreadId()];
+
+  /* Link the halo's particles. */
+  for (size_t i : members) {
+    uf[i] = i;
+  }
+  fof_link_subset(search->pos.data(), *search->grid, members,
+                  search->labels.get(), label, linking_length(engine, depth),
+                  uf);
+
+  /* Sort the particles by group. */
+  std::vector<std::pair<size_t, size_t>> roots;
+  roots.reserve(members.size());
+  for (size_t i : members) {
+    roots.emplace_back(fof_find(uf, i), i);
+  }
+  std::sort(roots.begin(), roots.end());
+
+  /* Make a halo out of every group above the threshold. */
+  std::vector<std::pair<int64_t, std::vector<size_t>>> children;
+  size_t start = 0;
+  while (start < roots.size()) {
+    size_t end = start;
+    while (end < roots.size() && roots[end].first == roots[start].first) {
+      end++;
+    }
+
+    if (end - start >= static_cast<size_t>(engine->part_threshold)) {
+      int sub_label = search->next_label.fetch_add(1);
+      std::vector<size_t> sub_members(end - start);
+
+      /* The particles are in ascending order so the first is the lowest. */
+      int64_t sub = block.append(substructure, depth, halo_id, end - start,
+                                 host_parts[roots[start].second]);
+
+      for (size_t p = start; p < end; p++) {
+        size_t i = roots[p].second;
+        sub_members[p - start] = i;
+        part_halos[host_parts[i]] = sub;
+        search->labels[i].store(sub_label, std::memory_order_relaxed);
+      }
+
+      children.emplace_back(sub, std::move(sub_members));
+    }
+
+    start = end;
+  }
+
+  /* Spawn the search one level deeper. */
+  if (depth < engine->n_sub_depths) {
+    for (auto &child : children) {
+      int64_t sub = child.first;
+      int sub_label = search->labels[child.second[0]].load();
+      search->queue->push([search, sub, sub_label,
+                           sub_members = std::move(child.second), depth]() {
+        substructure_task(search, sub, sub_label, sub_members, depth + 1);
+      });
+    }
+  }
+}
+
+/** @brief Start the substructure search within a finished host halo.
+ *
+ * Builds the host's SubstructureSearch and pushes the task for the first
+ * level of substructure. The search is shared by every task below the host
+ * and freed when the last of them finishes.
+ *
+ * @param engine The engine.
+ * @param queue The queue to push the tasks to.
+ * @param blocks The blocks to append the found halos to.
+ * @param part_halos The halo each particle belongs to at each depth.
+ * @param host_id The provisional handle of the host halo to search.
+ * @param host_parts The indices of the host's particles (must stay put until
+ *                   the queue has run).
+ */
+void spawn_substructure_search(Engine *engine, TaskQueue *queue,
+                               std::vector<HaloBlock> *blocks,
+                               std::vector<member_vector<int64_t>> *part_halos,
+                               int64_t host_id,
+                               const member_vector<size_t> *host_parts) {
+
+  if (engine->n_sub_depths < 1 || host_parts->empty()) {
+    return;
+  }
+
+  auto search = std::make_shared<SubstructureSearch>(
+      engine, queue, blocks, part_halos, host_id, host_parts);
+
+  /* The first level searches every particle in the host. */
+  std::vector<size_t> members(host_parts->size());
+  std::iota(members.begin(), members.end(), 0);
+  queue->push([search, host_id, members = std::move(members)]() {
+    substructure_task(search, host_id, 0, members, 1);
+  });
+}
+
+/** @brief Find the host halos and all the substructure within them.
+ *
+ * First the spatial friends-of-friends is run over the whole domain at the
+ * host linking length (or, for FOF inputs, the groups read with the
+ * particles are taken as they are). Each group above the particle threshold
+ * then becomes a task which finishes its host halo and spawns the
+ * substructure search within it, so the substructure search in one host
+ * never waits on another host.
+ *
+ * Each thread appends the halos it finds to its own HaloBlock and marks the
+ * halo's particles with its provisional handle. The blocks are compacted
+ * into the catalogue, with its membership rows, once every task has run.
+ *
+ * @param engine The engine.
+ * @param catalog The catalogue of found halos (replaced).
+ */
+void find_halos(Engine *engine, HaloCatalog &catalog) {
+
+  tic();
+  ProfileScope profile("Finding halos");
+
+  Domain *domain = engine->domain;
+  size_t npart = domain->npart_type[1];
+  static_assert(sizeof(DMParticle) % sizeof(double) == 0,
+                "DMParticle must be a whole number of doubles");
+  size_t stride = sizeof(DMParticle) / sizeof(double);
+  const double *pos = domain->dark_matter[0].pos;
+
+  /* Run the friends-of-friends over the whole domain, unless the groups
+   * came with the particles (FOF inputs), in which case each particle is
+   * joined to the first particle of its group. */
+  member_vector<size_t> uf(npart);
+  std::iota(uf.begin(), uf.end(), 0);
+  if (domain->fof_group != nullptr) {
+    std::unordered_map<int64_t, size_t> group_root;
+    for (size_t i = 0; i < npart; i++) {
+      uf[i] = group_root.emplace(domain->fof_group[i], i).first->second;
+    }
+  } else {
+    ProfileScope fof_profile("FOF");
+    double ll = linking_length(engine, 0);
+    HaloGrid grid(pos, stride, npart, ll,
+                  domain->periodic ? domain->boxsize : nullptr);
+    fof_link_all(engine->threadpool, pos, stride, grid, ll, uf.data());
+  }
+
+  /* Count the particles in each group (stored at the root). */
+  member_vector<size_t> group_size(npart, 0);
+  for (size_t i = 0; i < npart; i++) {
+    uf[i] = fof_find(uf.data(), i);
+    group_size[uf[i]]++;
+  }
+
+  /* Find the groups above the threshold, removing the rest. */
+  size_t threshold = engine->part_threshold;
+  std::vector<size_t> roots;
+  for (size_t i = 0; i < npart; i++) {
+    if (uf[i] != i) {
+      continue;
+    }
+    if (group_size[i] >= threshold) {
+      roots.push_back(i);
+    } else {
+      group_size[i] = 0;
+    }
+  }
+
+  /* Order them smallest first, the task queue is LIFO so the biggest host
+   * (and the most substructure) will start first. */
+  std::stable_sort(roots.begin(), roots.end(), [&](size_t a, size_t b) {
+    return group_size[a] < group_size[b];
+  });
+
+  /* Collect the members of each group (the root now holds the group
+   * index + 1). */
+  std::vector<member_vector<size_t>> members(roots.size());
+  for (size_t g = 0; g < roots.size(); g++) {
+    members[g].reserve(group_size[roots[g]]);
+    group_size[roots[g]] = g + 1;
+  }
+  for (size_t i = 0; i < npart; i++) {
+    size_t g = group_size[uf[i]];
+    if (g > 0) {
+      members[g - 1].push_back(i);
+    }
+  }
+
+  /* Make a task for each host. */
+  TaskQueue queue(engine->threadpool);
+  std::vector<HaloBlock> blocks;
+  for (int b = 0; b < engine->threadpool->getNumThreads(); b++) {
+    blocks.emplace_back(b);
+  }
+
+  /* The halo each particle is in at each depth, reusing the storage of the
+   * catalogue being replaced. */
+  std::vector<member_vector<int64_t>> part_halos = std::move(catalog.halo_id);
+  part_halos.resize(std::max(engine->n_sub_depths, 0) + 1);
+  for (member_vector<int64_t> &ids : part_halos) {
+    ids.assign(npart, halo_null);
+  }
+  for (size_t g = 0; g < roots.size(); g++) {
+    queue.push([engine, &queue, &blocks, &part_halos, &members, g]() {
+      HaloBlock &block = blocks[engine->threadpool->getThreadId()];
+      int64_t host_id =
+          block.append(host, 0, halo_null, members[g].size(), members[g][0]);
+      for (size_t i : members[g]) {
+        part_halos[0][i] = host_id;
+      }
+
+      /* This host is done, search it for substructure. */
+      spawn_substructure_search(engine, &queue, &blocks, &part_halos, host_id,
+                                &members[g]);
+    });
+  }
+
+  /* Heigh-ho, heigh-ho, it's off to work we go... */
+  {
+    ProfileScope sub_profile("Substructure");
+    queue.run();
+  }
+
+  /* Turn the provisional halos into the catalogue. */
+  {
+    ProfileScope compact_profile("Compacting");
+    catalog.compact(engine->threadpool, blocks, std::move(part_halos));
+  }
+
+  message("Found %zu host halos and %zu subhalos (%zu tasks)",
+          catalog.nhosts(), catalog.nhalos - catalog.nhosts(), queue.nrun());
+
+  toc("Finding halos");
+}
@@ -0,0 +1,172 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the prototypes for finding halos, both hosts and
+ * the substructure nested within them.
+ ******************************************************************************/
+#ifndef HALO_FINDER_H_
+#define HALO_FINDER_H_
+
+/* Includes */
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* Local includes. */
+#include "engine.h"
+#include "halo.h"
+#include "tasks.h"
+
+/**
+ * @class HaloGrid
+ * @brief A cell grid over a set of particle positions for neighbour searches.
+ *
+ * The cells are at least as wide as the linking length they were built for, so
+ * all neighbours of a particle are within the 27 cells surrounding it. Since
+ * linking lengths only shrink with depth in the overdensity heirarchy, a grid
+ * built for one depth can be reused for every depth below it.
+ *
+ * The particles are not moved, instead the grid holds the indices of the
+ * particles sorted by cell (cell_parts) and the offset of each cell into that
+ * array (cell_offsets).
+ *
+ * @param periodic Does the grid wrap around (the whole periodic volume)?
+ * @param dim The size of the periodic volume (only used if periodic).
+ * @param origin The position of the lower corner of the grid.
+ * @param width The width of a cell along each axis.
+ * @param iwidth The inverse width of a cell along each axis.
+ * @param cdim The number of cells along each axis.
+ * @param cell_offsets Where each cell's particles start in cell_parts.
+ * @param cell_parts The particle indices sorted by cell.
+ * @param part_cells The cell each particle is in.
+ */
+class HaloGrid {
+public:
+  /* Is the grid periodic? */
+  int periodic;
+
+  /* The size of the periodic volume. */
+  double dim[3];
+
+  /* The lower corner of the grid. */
+  double origin[3];
+
+  /* The width of a cell. */
+  double width[3];
+
+  /* The inverse width of a cell. */
+  double iwidth[3];
+
+  /* The number of cells along each axis. */
+  int cdim[3];
+
+  /* The offset of each cell into cell_parts (ncells + 1 entries). */
+  tracked_vector<size_t, mem_cells> cell_offsets;
+
+  /* The particle indices sorted by cell. */
+  tracked_vector<size_t, mem_cells> cell_parts;
+
+  /* The cell each particle is in. */
+  tracked_vector<int, mem_cells> part_cells;
+
+  HaloGrid(const double *pos, size_t stride, size_t npart, double min_width,
+           const double *boxsize);
+
+  /* Get the flattened index of a cell. */
+  int getCellIndex(int i, int j, int k) const {
+    return (i * cdim[1] + j) * cdim[2] + k;
+  }
+};
+
+/**
+ * @class SubstructureSearch
+ * @brief The state shared by every substructure task within a single host.
+ *
+ * Each host halo gets its own search containing the host's particle
+ * positions (unwrapped so the host is compact), a grid built only over those
+ * particles at the first substructure linking length, and the working arrays
+ * used by the friends-of-friends at each depth. The grid is reused at every
+ * depth below the host.
+ *
+ * Every particle carries a label identifying the deepest halo it currently
+ * belongs to. A task searching a halo only links particles carrying that
+ * halo's label, so tasks working on different halos within the same host can
+ * run concurrently on disjoint particles.
+ *
+ * The search is freed once the last task referencing it completes.
+ */
+class SubstructureSearch {
+public:
+  /* The engine (for the parameters and threadpool). */
+  Engine *engine;
+
+  /* The queue the substructure tasks are run from. */
+  TaskQueue *queue;
+
+  /* The blocks the found halos are appended to (one per thread). */
+  std::vector<HaloBlock> *blocks;
+
+  /* The provisional handle of the host halo at the top of this search. */
+  int64_t host_id;
+
+  /* The indices of the host's particles in the Domain. */
+  const member_vector<size_t> *host_parts;
+
+  /* The halo each particle belongs to at each depth (provisional handles). */
+  std::vector<member_vector<int64_t>> *part_halos;
+
+  /* The unwrapped positions of the host's particles (3 * npart). */
+  std::vector<double> pos;
+
+  /* The cell grid over the host's particles. */
+  std::unique_ptr<HaloGrid> grid;
+
+  /* The label of the deepest halo each particle currently belongs to. */
+  std::unique_ptr<std::atomic<int>[]> labels;
+
+  /* The union-find array for the friends-of-friends. */
+  std::vector<size_t> uf;
+
+  /* The next free halo label. */
+  std::atomic<int> next_label;
+
+  SubstructureSearch(Engine *engine, TaskQueue *queue,
+                     std::vector<HaloBlock> *blocks,
+                     std::vector<member_vector<int64_t>> *part_halos,
+                     int64_t host_id, const member_vector<size_t> *host_parts);
+};
+
+/* Prototypes */
+double linking_length(Engine *engine, int depth);
+size_t fof_find(size_t *uf, size_t i);
+void fof_union(size_t *uf, size_t i, size_t j);
+void fof_link_all(ThreadPool *threadpool, const double *pos, size_t stride,
+                  const HaloGrid &grid, double ll, size_t *uf);
+void fof_link_subset(const double *pos, const HaloGrid &grid,
+                     const std::vector<size_t> &members,
+                     const std::atomic<int> *labels, int label, double ll,
+                     size_t *uf);
+void spawn_substructure_search(Engine *engine, TaskQueue *queue,
+                               std::vector<HaloBlock> *blocks,
+                               std::vector<member_vector<int64_t>> *part_halos,
+                               int64_t host_id,
+                               const member_vector<size_t> *host_parts);
+void find_halos(Engine *engine, HaloCatalog &catalog);
+
+#endif // HALO_FINDER_H_
@@ -0,0 +1,219 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality of the particle ID index.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <numeric>
+
+/* Local includes. */
+#include "generation.h"
+#include "id_index.h"
+#include "logging.h"
+#include "profiler.h"
+#include "radix_sort.h"
+
+/**
+ * @brief The data shared by the threads building the index.
+ *
+ * The particles are split into nchunks contiguous chunks and the map is over
+ * the chunk numbers, so each chunk's results land in a fixed place. The
+ * particles' IDs are every stride-th element from ids (see
+ * Generation::partIds).
+ */
+struct IdIndexData {
+  IdIndex *index;
+  const size_t *ids;
+  size_t stride;
+  size_t npart;
+  int nchunks;
+
+  /* The ID range of each chunk. */
+  std::vector<size_t> min_ids, max_ids;
+
+  /* The first particle in a chunk. */
+  size_t chunkStart(int chunk) const { return npart * chunk / nchunks; }
+};
+
+/** @brief Find the range of IDs in a chunk of particles.
+ *
+ * @param map_data The chunk number (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The IdIndexData.
+ */
+static void id_range_mapper(void *map_data, int num_elements,
+                            void *extra_data) {
+  (void)num_elements;
+
+  int chunk = *static_cast<int *>(map_data);
+  IdIndexData *data = static_cast<IdIndexData *>(extra_data);
+
+  size_t lo = SIZE_MAX, hi = 0;
+  for (size_t i = data->chunkStart(chunk); i < data->chunkStart(chunk + 1);
+       i++) {
+    lo = std::min(lo, data->ids[i * data->stride]);
+    hi = std::max(hi, data->ids[i * data->stride]);
+  }
+  data->min_ids[chunk] = lo;
+  data->max_ids[chunk] = hi;
+}
+
+/** @brief Fill the direct-mapped table for a chunk of particles.
+ *
+ * @param map_data The chunk number (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The IdIndexData.
+ */
+static void id_table_mapper(void *map_data, int num_elements,
+                            void *extra_data) {
+  (void)num_elements;
+
+  int chunk = *static_cast<int *>(map_data);
+  IdIndexData *data = static_cast<IdIndexData *>(extra_data);
+  IdIndex *index = data->index;
+
+  for (size_t i = data->chunkStart(chunk); i < data->chunkStart(chunk + 1);
+       i++) {
+    index->table[data->ids[i * data->stride] - index->min_id] = i;
+  }
+}
+
+/** @brief Write the (ID - min_id, index) pairs for a chunk of particles.
+ *
+ * @param map_data The chunk number (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The IdIndexData.
+ */
+static void id_pairs_mapper(void *map_data, int num_elements,
+                            void *extra_data) {
+  (void)num_elements;
+
+  int chunk = *static_cast<int *>(map_data);
+  IdIndexData *data = static_cast<IdIndexData *>(extra_data);
+
+  for (size_t i = data->chunkStart(chunk); i < data->chunkStart(chunk + 1);
+       i++) {
+    data->index->sorted_ids[i] =
+        data->ids[i * data->stride] - data->index->min_id;
+    data->index->sorted_inds[i] = i;
+  }
+}
+
+/** @brief Build the index over a snapshot's particles.
+ *
+ * @param engine The engine.
+ * @param gen The snapshot's generation.
+ */
+void IdIndex::build(Engine *engine, const Generation &gen) {
+
+  tic();
+  ProfileScope profile("Indexing IDs");
+
+  ThreadPool *threadpool = engine->threadpool;
+
+  IdIndexData data;
+  data.index = this;
+  data.ids = gen.partIds(data.stride);
+  data.npart = gen.npart;
+  data.nchunks = threadpool->getNumThreads();
+  std::vector<int> chunks(data.nchunks);
+  std::iota(chunks.begin(), chunks.end(), 0);
+
+  nids = data.npart;
+  table.clear();
+  sorted_ids.clear();
+  sorted_inds.clear();
+  if (nids == 0) {
+    toc("Building the ID index");
+    return;
+  }
+
+  /* Get the range of the IDs. */
+  data.min_ids.resize(data.nchunks);
+  data.max_ids.resize(data.nchunks);
+  threadpool->map(id_range_mapper, chunks.data(), data.nchunks, sizeof(int),
+                  1, &data);
+  min_id = *std::min_element(data.min_ids.begin(), data.min_ids.end());
+  max_id = *std::max_element(data.max_ids.begin(), data.max_ids.end());
+  size_t span = max_id - min_id;
+
+  /* Dense IDs get a direct-mapped table. */
+  dense = span / id_index_dense_ratio < nids;
+  if (dense) {
+    table.assign(span + 1, id_index_none);
+    threadpool->map(id_table_mapper, chunks.data(), data.nchunks, sizeof(int),
+                    1, &data);
+
+    v_message("Built a direct-mapped ID index over %zu IDs (%zu slots)", nids,
+              span + 1);
+    toc("Building the ID index");
+    return;
+  }
+
+  /* Otherwise radix sort the pairs, only sorting the bits the IDs span. */
+  sorted_ids.resize(nids);
+  sorted_inds.resize(nids);
+  threadpool->map(id_pairs_mapper, chunks.data(), data.nchunks, sizeof(int), 1,
+                  &data);
+  radix_sort<size_t, size_t>(threadpool, sorted_ids.data(), sorted_inds.data(),
+                             nids, nullptr, nullptr, 0, span);
+
+  v_message("Built a sorted ID index over %zu IDs (span %zu)", nids, span);
+
+  toc("Building the ID index");
+}
+
+/** @brief Build the index over IDs already sorted, the i-th ID having index
+ * i (used when restoring a checkpoint, which holds sorted halo members).
+ *
+ * @param ids The IDs (sorted, without repeats).
+ * @param n The number of IDs.
+ */
+void IdIndex::buildSorted(const size_t *ids, size_t n) {
+
+  nids = n;
+  table.clear();
+  sorted_ids.clear();
+  sorted_inds.clear();
+  if (nids == 0) {
+    return;
+  }
+
+  min_id = ids[0];
+  max_id = ids[n - 1];
+  size_t span = max_id - min_id;
+
+  /* Dense IDs get a direct-mapped table, as in build. */
+  dense = span / id_index_dense_ratio < nids;
+  if (dense) {
+    table.assign(span + 1, id_index_none);
+    for (size_t i = 0; i < n; i++) {
+      table[ids[i] - min_id] = i;
+    }
+    return;
+  }
+
+  /* Otherwise they're already in order. */
+  sorted_ids.resize(n);
+  sorted_inds.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    sorted_ids[i] = ids[i] - min_id;
+    sorted_inds[i] = i;
+  }
+}
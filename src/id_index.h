@@ -0,0 +1,122 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the prototypes for the particle ID index.
+ ******************************************************************************/
+#ifndef ID_INDEX_H_
+#define ID_INDEX_H_
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Local includes. */
+#include "domain.h"
+#include "engine.h"
+#include "memory.h"
+
+/* Use a direct-mapped table if the IDs span at most this many times the
+ * number of particles. */
+#define id_index_dense_ratio 2
+
+/* The index returned for an ID that isn't in the snapshot. */
+#define id_index_none SIZE_MAX
+
+class Generation;
+
+/**
+ * @class IdIndex
+ * @brief A map from particle ID to the particle's index in the Domain.
+ *
+ * The strategy is chosen from the IDs themselves. If they are dense (as in
+ * SWIFT initial conditions) the index is a table with an entry for every ID
+ * between the smallest and largest, giving a lookup of a single load.
+ * Otherwise the (ID, index) pairs are radix sorted and looked up with a
+ * branch-free binary search.
+ *
+ * An index is built once per snapshot and shared by everything needing to
+ * find particles by ID (linking, tracking and output).
+ *
+ * @param dense Is the index a direct-mapped table?
+ * @param min_id The smallest ID.
+ * @param max_id The largest ID.
+ * @param nids The number of IDs indexed.
+ * @param table The index of each ID from min_id (only if dense).
+ * @param sorted_ids The sorted IDs less min_id (only if not dense).
+ * @param sorted_inds The index of each sorted ID (only if not dense).
+ */
+class IdIndex {
+public:
+  /* Is the index a direct-mapped table? */
+  bool dense;
+
+  /* The smallest and largest IDs. */
+  size_t min_id, max_id;
+
+  /* The number of IDs indexed. */
+  size_t nids;
+
+  /* The index of each ID from min_id (id_index_none for gaps). */
+  tracked_vector<size_t, mem_index> table;
+
+  /* The sorted IDs (less min_id, so fewer radix passes are needed) and their
+   * indices. */
+  tracked_vector<size_t, mem_index> sorted_ids;
+  tracked_vector<size_t, mem_index> sorted_inds;
+
+  IdIndex() : dense(true), min_id(0), max_id(0), nids(0) {}
+
+  void build(Engine *engine, const Generation &gen);
+  void buildSorted(const size_t *ids, size_t n);
+
+  /* The memory held by the index (including unused capacity). */
+  size_t nbytes() const {
+    return (table.capacity() + sorted_ids.capacity() +
+            sorted_inds.capacity()) *
+           sizeof(size_t);
+  }
+
+  /** @brief Find a particle by its ID.
+   *
+   * @param id The particle ID.
+   *
+   * @return The particle's index in the Domain, or id_index_none.
+   */
+  size_t find(size_t id) const {
+    if (nids == 0 || id < min_id || id > max_id) {
+      return id_index_none;
+    }
+    if (dense) {
+      return table[id - min_id];
+    }
+
+    /* Halve the range without branching on the comparison. */
+    size_t key = id - min_id;
+    const size_t *base = sorted_ids.data();
+    size_t n = nids;
+    while (n > 1) {
+      size_t half = n / 2;
+      base = base[half] <= key ? base + half : base;
+      n -= half;
+    }
+    return *base == key ? sorted_inds[base - sorted_ids.data()]
+                        : id_index_none;
+  }
+};
+
+#endif // ID_INDEX_H_
@@ -0,0 +1,863 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for linking halos between snapshots.
+ *
+ * Linking is a hash-join on particle ID. The earlier snapshot's IdIndex finds
+ * where each particle was, and so (through halo_id) the halos it was in. The
+ * particles in halos in the later snapshot are streamed through it in
+ * parallel, counting the particles shared by each (progenitor, descendant)
+ * pair. Halos are only linked to halos at the same depth.
+ *
+ * Running on several ranks, a halo's progenitors may be on any rank, so each
+ * rank owns a contiguous range of particle IDs instead. Every rank sends the
+ * particles in its halos, with the halos they're in, to the ranks owning
+ * their IDs in one all-to-all, so each rank holds both snapshots' halos for
+ * its own IDs and counts the shared particles without asking anyone. The
+ * counts are then summed on the rank holding the descendant, and the links
+ * sent on to the rank holding the progenitor. Nothing is ever gathered on a
+ * single rank.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+
+/* Local includes. */
+#include "comms.h"
+#include "graph.h"
+#include "linker.h"
+#include "mega_catalog.h"
+#include "logging.h"
+#include "profiler.h"
+#include "radix_sort.h"
+
+/**
+ * @brief A (progenitor, descendant) pair, the key of the shared counts.
+ */
+struct LinkKey {
+  int64_t prog;
+  int64_t desc;
+
+  bool operator==(const LinkKey &other) const {
+    return prog == other.prog && desc == other.desc;
+  }
+};
+
+/**
+ * @brief The hash of a LinkKey.
+ */
+struct LinkKeyHash {
+  size_t operator()(const LinkKey &key) const {
+    /* The splitmix64 finaliser over both halves. */
+    uint64_t h = static_cast<uint64_t>(key.prog) * 0x9e3779b97f4a7c15ULL ^
+                 static_cast<uint64_t>(key.desc);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+  }
+};
+
+/* The number of particles shared by each pair. */
+using LinkCounts = std::unordered_map<LinkKey, size_t, LinkKeyHash>;
+
+/**
+ * @brief The data shared by the threads probing the index.
+ */
+struct ProbeData {
+  const IdIndex *prev_index;
+  const HaloCatalog *prev;
+  const HaloCatalog *curr;
+  const size_t *ids;
+  size_t id_stride;
+  ThreadPool *threadpool;
+  std::vector<LinkCounts> *counts;
+  int ndepths;
+};
+
+/** @brief Probe the index with a chunk of the later snapshot's particles.
+ *
+ * Every thread counts into its own map, so there is no locking at all.
+ *
+ * @param map_data The chunk of host particle indices (size_t).
+ * @param num_elements The number of particles in the chunk.
+ * @param extra_data The ProbeData.
+ */
+static void index_probe_mapper(void *map_data, int num_elements,
+                               void *extra_data) {
+
+  const size_t *parts = static_cast<size_t *>(map_data);
+  ProbeData *data = static_cast<ProbeData *>(extra_data);
+  LinkCounts &counts = (*data->counts)[data->threadpool->getThreadId()];
+
+  for (int i = 0; i < num_elements; i++) {
+    size_t p = parts[i];
+    size_t prev_p = data->prev_index->find(data->ids[p * data->id_stride]);
+    if (prev_p == id_index_none) {
+      continue;
+    }
+    for (int d = 0; d < data->ndepths; d++) {
+      int64_t prog = data->prev->halo_id[d][prev_p];
+      int64_t desc = data->curr->halo_id[d][p];
+      if (prog != halo_null && desc != halo_null) {
+        counts[{prog, desc}]++;
+      }
+    }
+  }
+}
+
+/**
+ * @brief The data shared by the threads merging the counts.
+ *
+ * The pairs are partitioned by hash, each thread first splitting its own
+ * counts into the partitions and then merging one partition from every
+ * thread. No pair is in more than one partition, so nothing is shared.
+ */
+struct MergeData {
+
+  /* Each thread's counts. */
+  std::vector<LinkCounts> *counts;
+
+  /* Each thread's pairs in each partition (thread major). */
+  std::vector<std::vector<HaloLink>> *split;
+
+  /* The merged pairs sharing enough particles in each partition. */
+  std::vector<std::vector<HaloLink>> *links;
+
+  int nparts;
+  size_t threshold;
+
+  /* The partition of a pair (from the top of the hash, the map uses the
+   * bottom). */
+  int partition(const LinkKey &key) const {
+    return static_cast<int>((LinkKeyHash()(key) >> 32) % nparts);
+  }
+};
+
+/** @brief Split a thread's counts into the partitions.
+ *
+ * @param map_data The thread (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The MergeData.
+ */
+static void split_counts_mapper(void *map_data, int num_elements,
+                                void *extra_data) {
+  (void)num_elements;
+
+  int t = *static_cast<int *>(map_data);
+  MergeData *data = static_cast<MergeData *>(extra_data);
+  LinkCounts &counts = (*data->counts)[t];
+  std::vector<HaloLink> *split = &(*data->split)[t * data->nparts];
+
+  for (const auto &pair : counts) {
+    split[data->partition(pair.first)].push_back(
+        {pair.first.prog, pair.first.desc, pair.second});
+  }
+  counts = LinkCounts();
+}
+
+/** @brief Merge a partition of every thread's counts.
+ *
+ * @param map_data The partition (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The MergeData.
+ */
+static void merge_counts_mapper(void *map_data, int num_elements,
+                                void *extra_data) {
+  (void)num_elements;
+
+  int part = *static_cast<int *>(map_data);
+  MergeData *data = static_cast<MergeData *>(extra_data);
+  size_t nthreads = data->counts->size();
+
+  size_t npairs = 0;
+  for (size_t t = 0; t < nthreads; t++) {
+    npairs += (*data->split)[t * data->nparts + part].size();
+  }
+  LinkCounts merged;
+  merged.reserve(npairs);
+  for (size_t t = 0; t < nthreads; t++) {
+    std::vector<HaloLink> &split = (*data->split)[t * data->nparts + part];
+    for (const HaloLink &l : split) {
+      merged[{l.prog, l.desc}] += l.shared;
+    }
+    split = std::vector<HaloLink>();
+  }
+
+  std::vector<HaloLink> &links = (*data->links)[part];
+  for (const auto &pair : merged) {
+    if (pair.second >= data->threshold) {
+      links.push_back({pair.first.prog, pair.first.desc, pair.second});
+    }
+  }
+}
+
+/** @brief Merge the threads' counts, keeping the pairs sharing enough
+ * particles.
+ *
+ * @param threadpool The threadpool.
+ * @param counts Each thread's counts (emptied).
+ * @param threshold The fewest particles a pair can share and be kept.
+ *
+ * @return The pairs kept, in no particular order.
+ */
+static std::vector<HaloLink> merge_counts(ThreadPool *threadpool,
+                                          std::vector<LinkCounts> &counts,
+                                          size_t threshold) {
+
+  int nthreads = static_cast<int>(counts.size());
+  std::vector<std::vector<HaloLink>> split(nthreads * nthreads);
+  std::vector<std::vector<HaloLink>> links(nthreads);
+  MergeData data = {&counts, &split, &links, nthreads, threshold};
+  std::vector<int> parts(nthreads);
+  std::iota(parts.begin(), parts.end(), 0);
+  threadpool->map(split_counts_mapper, parts.data(), nthreads, sizeof(int), 1,
+                  &data);
+  threadpool->map(merge_counts_mapper, parts.data(), nthreads, sizeof(int), 1,
+                  &data);
+
+  size_t nlinks = 0;
+  for (const std::vector<HaloLink> &part : links) {
+    nlinks += part.size();
+  }
+  std::vector<HaloLink> merged;
+  merged.reserve(nlinks);
+  for (const std::vector<HaloLink> &part : links) {
+    merged.insert(merged.end(), part.begin(), part.end());
+  }
+  return merged;
+}
+
+/** @brief Link the halos in two consecutive snapshots.
+ *
+ * A progenitor and descendant are linked if they share at least
+ * Engine::link_threshold particles. The links are stored in prev's
+ * descendants and curr's progenitors.
+ *
+ * @param engine The engine.
+ * @param prev_gen The earlier snapshot (its ID index built).
+ * @param curr_gen The later snapshot.
+ */
+void link_halos(Engine *engine, Generation &prev_gen, Generation &curr_gen) {
+
+  tic();
+  ProfileScope profile("Linking");
+
+  ThreadPool *threadpool = engine->threadpool;
+  HaloCatalog &prev = prev_gen.catalog;
+  HaloCatalog &curr = curr_gen.catalog;
+
+  /* Count the shared particles, one map per thread. */
+  std::vector<LinkCounts> counts(threadpool->getNumThreads());
+  size_t id_stride;
+  const size_t *ids = curr_gen.partIds(id_stride);
+  ProbeData data = {&prev_gen.index,
+                    &prev,
+                    &curr,
+                    ids,
+                    id_stride,
+                    threadpool,
+                    &counts,
+                    static_cast<int>(
+                        std::min(prev.halo_id.size(), curr.halo_id.size()))};
+  size_t nprobe =
+      curr.nhosts() > 0 ? curr.part_offsets[curr.nhosts()] : 0;
+  threadpool->map(index_probe_mapper,
+                  const_cast<size_t *>(curr.part_members.data()), nprobe,
+                  sizeof(size_t), ThreadPool::threadpool_auto_chunk_size,
+                  &data);
+
+  /* Keep the pairs sharing enough particles. */
+  std::vector<HaloLink> links =
+      merge_counts(threadpool, counts, engine->link_threshold);
+  link_catalogs(prev, curr, links);
+
+  message("Found %zu links between %zu progenitors and %zu descendants",
+          links.size(), prev.nhalos, curr.nhalos);
+
+  toc("Linking halos");
+}
+
+/**
+ * @brief The data shared by the threads counting the shared particles of the
+ * IDs a rank owns.
+ */
+struct OwnedProbeData {
+  const OwnedMemberships *prev;
+  const OwnedMemberships *curr;
+  ThreadPool *threadpool;
+  std::vector<LinkCounts> *counts;
+  int ndepths;
+};
+
+/** @brief Count the shared particles of a chunk of the later snapshot's IDs.
+ *
+ * Both snapshots' IDs are sorted, so the chunk is merged with the earlier
+ * snapshot's from where its first ID would be.
+ *
+ * @param map_data The chunk of the later snapshot's owned IDs (size_t).
+ * @param num_elements The number of IDs in the chunk.
+ * @param extra_data The OwnedProbeData.
+ */
+static void owned_probe_mapper(void *map_data, int num_elements,
+                               void *extra_data) {
+
+  if (num_elements == 0) {
+    return;
+  }
+  const size_t *ids = static_cast<size_t *>(map_data);
+  OwnedProbeData *data = static_cast<OwnedProbeData *>(extra_data);
+  LinkCounts &counts = (*data->counts)[data->threadpool->getThreadId()];
+  const OwnedMemberships &prev = *data->prev;
+  const OwnedMemberships &curr = *data->curr;
+  size_t first = ids - curr.ids.data();
+
+  size_t q = std::lower_bound(prev.ids.begin(), prev.ids.end(), ids[0]) -
+             prev.ids.begin();
+  for (int i = 0; i < num_elements && q < prev.ids.size(); i++) {
+    while (q < prev.ids.size() && prev.ids[q] < ids[i]) {
+      q++;
+    }
+    if (q == prev.ids.size() || prev.ids[q] != ids[i]) {
+      continue;
+    }
+    for (int d = 0; d < data->ndepths; d++) {
+      int64_t prog = prev.halos[q * prev.ndepths + d];
+      int64_t desc = curr.halos[(first + i) * curr.ndepths + d];
+      if (prog != halo_null && desc != halo_null) {
+        counts[{prog, desc}]++;
+      }
+    }
+  }
+}
+
+/** @brief Send the particles in a generation's halos to the ranks owning
+ * their IDs.
+ *
+ * The range of IDs is split evenly between the ranks (any outside it go to
+ * the first or last rank). Each particle is sent with the global index of
+ * the halo it's in at each depth, and the particles this rank owns are
+ * received into the generation sorted by ID.
+ *
+ * @param engine The engine.
+ * @param gen The generation (its halo_offset set).
+ * @param min_id, max_id The range of IDs split between the ranks.
+ */
+static void share_memberships(Engine *engine, Generation &gen, size_t min_id,
+                              size_t max_id) {
+
+  ProfileScope profile("Sharing memberships");
+
+  const HaloCatalog &catalog = gen.catalog;
+  int nranks = engine->nranks;
+  int ndepths = static_cast<int>(catalog.halo_id.size());
+  size_t width = (max_id - min_id) / nranks + 1;
+  auto owner = [&](size_t id) {
+    return id <= min_id
+               ? 0
+               : static_cast<int>(std::min<size_t>((id - min_id) / width,
+                                                   nranks - 1));
+  };
+
+  /* The particles in hosts, in the order of the ranks they're going to. */
+  size_t nmembers =
+      catalog.nhosts() > 0 ? catalog.part_offsets[catalog.nhosts()] : 0;
+  const size_t *members = catalog.part_members.data();
+  std::vector<size_t> send_counts(nranks, 0);
+  for (size_t j = 0; j < nmembers; j++) {
+    send_counts[owner(gen.partId(members[j]))]++;
+  }
+  std::vector<size_t> next(nranks, 0);
+  std::partial_sum(send_counts.begin(), send_counts.end() - 1,
+                   next.begin() + 1);
+  member_vector<size_t> ids(nmembers);
+  member_vector<int64_t> halos(nmembers * ndepths);
+  for (size_t j = 0; j < nmembers; j++) {
+    size_t p = members[j];
+    size_t id = gen.partId(p);
+    size_t slot = next[owner(id)]++;
+    ids[slot] = id;
+    for (int d = 0; d < ndepths; d++) {
+      int64_t halo = catalog.halo_id[d][p];
+      halos[slot * ndepths + d] =
+          halo == halo_null ? halo_null
+                            : halo + static_cast<int64_t>(gen.halo_offset);
+    }
+  }
+
+  /* Swap them for the particles this rank owns. */
+  std::vector<size_t> halo_counts(send_counts);
+  for (size_t &count : halo_counts) {
+    count *= ndepths;
+  }
+  member_vector<size_t> recv_ids = exchange_between_ranks(ids, send_counts);
+  member_vector<int64_t> recv_halos =
+      exchange_between_ranks(halos, halo_counts);
+  ids = member_vector<size_t>();
+  halos = member_vector<int64_t>();
+
+  /* And sort them by ID. */
+  size_t nrecv = recv_ids.size();
+  size_t lowest = std::numeric_limits<size_t>::max(), highest = 0;
+  for (size_t id : recv_ids) {
+    lowest = std::min(lowest, id);
+    highest = std::max(highest, id);
+  }
+  member_vector<size_t> order(nrecv);
+  std::iota(order.begin(), order.end(), 0);
+  radix_sort<size_t, size_t>(engine->threadpool, recv_ids.data(), order.data(),
+                             nrecv, nullptr, nullptr, lowest, highest);
+
+  OwnedMemberships &owned = gen.owned;
+  owned.shared = true;
+  owned.min_id = min_id;
+  owned.max_id = max_id;
+  owned.ndepths = ndepths;
+  owned.ids = std::move(recv_ids);
+  owned.halos.resize(nrecv * ndepths);
+  for (size_t i = 0; i < nrecv; i++) {
+    for (int d = 0; d < ndepths; d++) {
+      owned.halos[i * ndepths + d] = recv_halos[order[i] * ndepths + d];
+    }
+  }
+}
+
+/** @brief Send links to the ranks holding their progenitors or descendants.
+ *
+ * @param links The links (global halo indices).
+ * @param first The global index of each rank's first halo (and the total).
+ * @param by_desc Send them to the descendant's rank (else the progenitor's)?
+ *
+ * @return The links received.
+ */
+static std::vector<HaloLink> send_links(const std::vector<HaloLink> &links,
+                                        const std::vector<size_t> &first,
+                                        bool by_desc) {
+  ProfileScope profile("Sending links");
+  int nranks = static_cast<int>(first.size()) - 1;
+  auto owner = [&](const HaloLink &l) {
+    size_t halo = static_cast<size_t>(by_desc ? l.desc : l.prog);
+    return static_cast<int>(
+        std::upper_bound(first.begin(), first.end() - 1, halo) -
+        first.begin() - 1);
+  };
+
+  std::vector<size_t> send_counts(nranks, 0);
+  for (const HaloLink &l : links) {
+    send_counts[owner(l)]++;
+  }
+  std::vector<size_t> next(nranks, 0);
+  std::partial_sum(send_counts.begin(), send_counts.end() - 1,
+                   next.begin() + 1);
+  std::vector<HaloLink> sorted(links.size());
+  for (const HaloLink &l : links) {
+    sorted[next[owner(l)]++] = l;
+  }
+  return exchange_between_ranks(sorted, send_counts);
+}
+
+/** @brief Where each rank's halos start in the global numbering.
+ *
+ * @param nhalos The number of halos on this rank.
+ *
+ * @return The global index of each rank's first halo, and the total.
+ */
+static std::vector<size_t> halo_starts(size_t nhalos) {
+  std::vector<size_t> counts = gather_over_ranks(nhalos);
+  std::vector<size_t> first(counts.size() + 1, 0);
+  std::partial_sum(counts.begin(), counts.end(), first.begin() + 1);
+  return first;
+}
+
+/** @brief Link the halos in two consecutive snapshots, each spread over the
+ * ranks.
+ *
+ * Each rank owns a contiguous range of particle IDs, and is sent the
+ * particles with IDs in it (with the halos they're in) by every rank. The
+ * IDs are split once, over the range in the first two snapshots linked, and
+ * kept for the rest of the run, so the particles a rank owns in one snapshot
+ * are kept for linking it to the next and only the new snapshot's are ever
+ * sent. The earlier snapshot's are sent again if they weren't kept (on the
+ * first link or after a restart).
+ *
+ * The shared particles are counted by each rank for its own IDs. The same
+ * pair can be counted on several ranks, so the counts are summed on the rank
+ * holding the descendant, which keeps those of at least
+ * Engine::link_threshold (as link_halos does) as its halos' progenitors and
+ * sends them on to the progenitor's rank as its halos' descendants.
+ *
+ * Halos are linked by their global index, their index in their own rank's
+ * catalogue plus the halos on the ranks before it (Generation::halo_offset).
+ *
+ * @param engine The engine.
+ * @param prev The earlier snapshot.
+ * @param curr The later snapshot.
+ */
+void link_halos_distributed(Engine *engine, Generation &prev,
+                            Generation &curr) {
+
+  tic();
+  ProfileScope profile("Linking across ranks");
+
+  ThreadPool *threadpool = engine->threadpool;
+
+  /* The global numbering of both snapshots' halos. */
+  std::vector<size_t> prev_first = halo_starts(prev.catalog.nhalos);
+  std::vector<size_t> curr_first = halo_starts(curr.catalog.nhalos);
+  prev.halo_offset = prev_first[engine->rank];
+  curr.halo_offset = curr_first[engine->rank];
+
+  /* Share out the earlier snapshot's particles if they weren't kept, over the
+   * range of IDs in both, then the later snapshot's over the same range. */
+  if (!prev.owned.shared) {
+    size_t min_id = std::numeric_limits<size_t>::max(), max_id = 0;
+    for (const Generation *gen : {&prev, &curr}) {
+      const HaloCatalog &catalog = gen->catalog;
+      size_t nmembers =
+          catalog.nhosts() > 0 ? catalog.part_offsets[catalog.nhosts()] : 0;
+      for (size_t j = 0; j < nmembers; j++) {
+        size_t id = gen->partId(catalog.part_members[j]);
+        min_id = std::min(min_id, id);
+        max_id = std::max(max_id, id);
+      }
+    }
+    min_id = min_over_ranks(min_id);
+    max_id = max_over_ranks(max_id);
+    if (min_id > max_id) {
+      min_id = max_id = 0;
+    }
+    share_memberships(engine, prev, min_id, max_id);
+  }
+  share_memberships(engine, curr, prev.owned.min_id, prev.owned.max_id);
+
+  /* Count the shared particles of the IDs this rank owns, one map per
+   * thread. */
+  std::vector<HaloLink> partial;
+  {
+    ProfileScope count_profile("Counting shared particles");
+    std::vector<LinkCounts> counts(threadpool->getNumThreads());
+    OwnedProbeData data = {&prev.owned, &curr.owned, threadpool, &counts,
+                           std::min(prev.owned.ndepths, curr.owned.ndepths)};
+    threadpool->map(owned_probe_mapper, curr.owned.ids.data(),
+                    curr.owned.ids.size(), sizeof(size_t),
+                    ThreadPool::threadpool_auto_chunk_size, &data);
+    partial = merge_counts(threadpool, counts, 0);
+  }
+
+  /* Sum the counts on the descendants' ranks, keeping the pairs sharing
+   * enough particles. */
+  LinkCounts summed;
+  for (const HaloLink &l : send_links(partial, curr_first, true)) {
+    summed[{l.prog, l.desc}] += l.shared;
+  }
+  partial = std::vector<HaloLink>();
+  std::vector<HaloLink> links;
+  for (const auto &pair : summed) {
+    if (pair.second >= static_cast<size_t>(engine->link_threshold)) {
+      links.push_back({pair.first.prog, pair.first.desc, pair.second});
+    }
+  }
+
+  /* The descendants' ranks have their progenitors, the progenitors' ranks
+   * get their descendants. */
+  std::vector<HaloLink> prog_links = send_links(links, prev_first, false);
+  size_t nlinks = sum_over_ranks(links.size());
+  link_rank_catalog(curr.catalog, curr.halo_offset, links, true);
+  link_rank_catalog(prev.catalog, prev.halo_offset, prog_links, false);
+
+  /* The earlier snapshot's particles are done with, unless they're kept for
+   * its checkpoint (a restart links the next snapshot against them). */
+  if (!engine->write_checkpoints) {
+    prev.owned.ids = member_vector<size_t>();
+    prev.owned.halos = member_vector<int64_t>();
+  }
+
+  message("Found %zu links between %zu progenitors and %zu descendants "
+          "across %d ranks",
+          nlinks, prev_first[engine->nranks], curr_first[engine->nranks],
+          engine->nranks);
+
+  toc("Linking halos across ranks");
+}
+
+/**
+ * @brief The members of a mapped binary catalogue, found by their IDs.
+ *
+ * This is the catalogue's halo_id over its members only: the i-th ID in the
+ * index has the halo it's in at each depth in halos[i * ndepths + d].
+ *
+ * @param index The index over the member IDs.
+ * @param ndepths The number of depths.
+ * @param halos The halo each member is in at each depth (halo_null if none).
+ */
+struct CatalogMembers {
+  IdIndex index;
+  int ndepths = 0;
+  member_vector<int64_t> halos;
+};
+
+/** @brief Index the members of a mapped binary catalogue by ID.
+ *
+ * @param engine The engine.
+ * @param catalog The catalogue.
+ * @param members The members (overwritten).
+ */
+static void index_catalog_members(Engine *engine, const MegaCatalog &catalog,
+                                  CatalogMembers &members) {
+
+  ProfileScope profile("Indexing members");
+
+  size_t nhalos = catalog.nhalos(), ndepth_rows, noffsets, nids;
+  const int *depth = catalog.column<int>("Depth", &ndepth_rows);
+  const size_t *offsets =
+      catalog.column<size_t>("ParticleOffsets", &noffsets);
+  const size_t *part_ids = catalog.column<size_t>("ParticleIDs", &nids);
+  if (ndepth_rows != nhalos || noffsets != nhalos + 1 ||
+      offsets[nhalos] != nids) {
+    error("%s is missing the halo depths or members!", catalog.path.c_str());
+  }
+
+  /* Every (ID, halo) pair, sorted by ID. */
+  member_vector<size_t> ids(part_ids, part_ids + nids);
+  member_vector<size_t> owners(nids);
+  int max_depth = -1;
+  size_t lowest = SIZE_MAX, highest = 0;
+  for (size_t i = 0; i < nhalos; i++) {
+    max_depth = std::max(max_depth, depth[i]);
+    for (size_t k = offsets[i]; k < offsets[i + 1]; k++) {
+      owners[k] = i;
+      lowest = std::min(lowest, ids[k]);
+      highest = std::max(highest, ids[k]);
+    }
+  }
+  radix_sort<size_t, size_t>(engine->threadpool, ids.data(), owners.data(),
+                             nids, nullptr, nullptr, lowest, highest);
+
+  /* One row per ID, holding its halo at each depth. */
+  int ndepths = max_depth + 1;
+  size_t nunique = 0;
+  members.halos.clear();
+  for (size_t k = 0; k < nids; k++) {
+    if (k == 0 || ids[k] != ids[k - 1]) {
+      ids[nunique++] = ids[k];
+      members.halos.resize(nunique * ndepths, halo_null);
+    }
+    members.halos[(nunique - 1) * ndepths + depth[owners[k]]] = owners[k];
+  }
+  members.ndepths = ndepths;
+  members.index.buildSorted(ids.data(), nunique);
+}
+
+/**
+ * @brief The data shared by the threads probing a catalogue's members.
+ */
+struct CatalogProbeData {
+  const CatalogMembers *prev;
+  const int *depth;
+  const size_t *offsets;
+  const size_t *ids;
+  ThreadPool *threadpool;
+  std::vector<LinkCounts> *counts;
+};
+
+/** @brief Probe the earlier catalogue's members with the members of a chunk
+ * of the later catalogue's halos.
+ *
+ * @param map_data The chunk of halo indices (size_t).
+ * @param num_elements The number of halos in the chunk.
+ * @param extra_data The CatalogProbeData.
+ */
+static void catalog_probe_mapper(void *map_data, int num_elements,
+                                 void *extra_data) {
+
+  const size_t *halos = static_cast<size_t *>(map_data);
+  CatalogProbeData *data = static_cast<CatalogProbeData *>(extra_data);
+  const CatalogMembers &prev = *data->prev;
+  LinkCounts &counts = (*data->counts)[data->threadpool->getThreadId()];
+
+  for (int i = 0; i < num_elements; i++) {
+    size_t desc = halos[i];
+    int d = data->depth[desc];
+    if (d >= prev.ndepths) {
+      continue;
+    }
+    for (size_t k = data->offsets[desc]; k < data->offsets[desc + 1]; k++) {
+      size_t row = prev.index.find(data->ids[k]);
+      if (row == id_index_none) {
+        continue;
+      }
+      int64_t prog = prev.halos[row * prev.ndepths + d];
+      if (prog != halo_null) {
+        counts[{prog, static_cast<int64_t>(desc)}]++;
+      }
+    }
+  }
+}
+
+/** @brief Link a mapped binary catalogue to the one before it.
+ *
+ * The pairs are counted at each depth through the members' IDs, so give the
+ * same links as link_halos did for the snapshots.
+ *
+ * @param engine The engine.
+ * @param prev The earlier catalogue's members.
+ * @param curr The later catalogue.
+ *
+ * @return The links.
+ */
+static std::vector<HaloLink> link_catalog_members(Engine *engine,
+                                                  const CatalogMembers &prev,
+                                                  const MegaCatalog &curr) {
+
+  ThreadPool *threadpool = engine->threadpool;
+
+  std::vector<size_t> halos(curr.nhalos());
+  std::iota(halos.begin(), halos.end(), 0);
+  std::vector<LinkCounts> counts(threadpool->getNumThreads());
+  CatalogProbeData data = {&prev,
+                           curr.column<int>("Depth"),
+                           curr.column<size_t>("ParticleOffsets"),
+                           curr.column<size_t>("ParticleIDs"),
+                           threadpool,
+                           &counts};
+  threadpool->map(catalog_probe_mapper, halos.data(), halos.size(),
+                  sizeof(size_t), ThreadPool::threadpool_auto_chunk_size,
+                  &data);
+
+  return merge_counts(threadpool, counts, engine->link_threshold);
+}
+
+/** @brief Write out a relinked binary catalogue (and add it to the graph).
+ *
+ * Everything but the links is copied from the mapped catalogue as it is.
+ *
+ * @param engine The engine.
+ * @param catalog The mapped catalogue.
+ * @param links Its new links (the links of a HaloCatalog).
+ * @param graph The merger graph (nullptr if not outputting graphs).
+ */
+static void write_relinked(Engine *engine, const MegaCatalog &catalog,
+                           const HaloCatalog &links, GraphBuilder *graph) {
+
+  if (engine->output_binary) {
+    MegaCatalogWriter writer(engine->binaryPath(catalog.snap()),
+                             catalog.snap(), catalog.nhalos());
+    for (uint64_t i = 0; i < catalog.header->ncolumns; i++) {
+      std::string name = catalog.columns[i].name;
+      if (name.rfind("Progenitor", 0) != 0 &&
+          name.rfind("Descendant", 0) != 0) {
+        writer.copyColumn(catalog, catalog.columns[i]);
+      }
+    }
+    writer.addColumn("ProgenitorOffsets", links.prog_offsets);
+    writer.addColumn("Progenitors", links.progs);
+    writer.addColumn("ProgenitorSharedParts", links.prog_shared);
+    writer.addColumn("DescendantOffsets", links.desc_offsets);
+    writer.addColumn("Descendants", links.descs);
+    writer.addColumn("DescendantSharedParts", links.desc_shared);
+    writer.finish();
+    message("Wrote %zu halos to %s", catalog.nhalos(),
+            writer.path.c_str());
+  }
+
+  if (graph != nullptr) {
+    size_t nparents, nnparts;
+    const int64_t *parent = catalog.column<int64_t>("Parent", &nparents);
+    const size_t *npart =
+        catalog.column<size_t>("NumberOfParticles", &nnparts);
+    if (nparents != catalog.nhalos() || nnparts != catalog.nhalos()) {
+      error("%s is missing the halo hierarchy!", catalog.path.c_str());
+    }
+    graph->addHalos(catalog.snap(), catalog.nhalos(), parent, npart,
+                    links.prog_offsets.empty() ? nullptr
+                                               : links.prog_offsets.data(),
+                    links.progs.data());
+  }
+}
+
+/** @brief Relink the binary catalogues written by an earlier run (a MEGA
+ * input run).
+ *
+ * Each catalogue is mapped in turn and linked to the one before it with this
+ * run's Engine::link_threshold, so nothing is parsed and no halos are found.
+ * The relinked catalogues are written out as binary catalogues and/or fed to
+ * the merger graph. The halo properties are carried over as they are, they
+ * can't be recalculated as the catalogues don't hold the particles.
+ *
+ * @param engine The engine.
+ */
+void relink_catalogs(Engine *engine) {
+
+  tic();
+  ProfileScope profile("Relinking");
+
+  if (!engine->output_binary && !engine->output_graph_format) {
+    error("A MEGA input run relinks binary catalogues, set "
+          "Output/output_binary and/or Output/output_graph_format!");
+  }
+  std::unique_ptr<GraphBuilder> graph;
+  if (engine->output_graph_format) {
+    graph = std::make_unique<GraphBuilder>(engine);
+
+    /* Nothing else runs by the time the graph is written. */
+    graph->compressor = engine->threadpool;
+  }
+
+  /* The earlier catalogue is written once linked to the later one. */
+  std::unique_ptr<MegaCatalog> prev;
+  HaloCatalog prev_links;
+  CatalogMembers prev_members;
+  for (int snap = 0; snap < engine->n_generations; snap++) {
+    auto curr = std::make_unique<MegaCatalog>(engine->inputPath(snap));
+    if (curr->snap() != snap) {
+      error("%s holds snapshot %d, expected %d!", curr->path.c_str(),
+            curr->snap(), snap);
+    }
+    if (curr->findColumn("FirstHaloIndex") != nullptr) {
+      error("%s is one rank's catalogue, only catalogues from a single rank "
+            "can be relinked!",
+            curr->path.c_str());
+    }
+    HaloCatalog curr_links;
+    curr_links.nhalos = curr->nhalos();
+
+    if (prev != nullptr) {
+      std::vector<HaloLink> links =
+          link_catalog_members(engine, prev_members, *curr);
+      link_catalogs(prev_links, curr_links, links);
+      message("Found %zu links between %zu progenitors and %zu descendants",
+              links.size(), prev->nhalos(), curr->nhalos());
+      write_relinked(engine, *prev, prev_links, graph.get());
+    }
+
+    index_catalog_members(engine, *curr, prev_members);
+    prev = std::move(curr);
+    prev_links = std::move(curr_links);
+  }
+  if (prev != nullptr) {
+    write_relinked(engine, *prev, prev_links, graph.get());
+  }
+  if (graph != nullptr) {
+    graph->finish();
+  }
+
+  toc("Relinking binary catalogues");
+}
@@ -0,0 +1,40 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the prototypes for linking halos between
+ * snapshots.
+ ******************************************************************************/
+#ifndef LINKER_H_
+#define LINKER_H_
+
+/* Includes */
+#include <cstddef>
+
+/* Local includes. */
+#include "domain.h"
+#include "engine.h"
+#include "generation.h"
+#include "halo.h"
+#include "id_index.h"
+
+/* Prototypes */
+void link_halos(Engine *engine, Generation &prev, Generation &curr);
+void link_halos_distributed(Engine *engine, Generation &prev,
+                            Generation &curr);
+void relink_catalogs(Engine *engine);
+
+#endif // LINKER_H_
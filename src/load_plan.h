@@ -0,0 +1,136 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the plan of which particle fields are read from
+ * each snapshot.
+ ******************************************************************************/
+#ifndef LOAD_PLAN_H_
+#define LOAD_PLAN_H_
+
+/* Includes */
+#include <string>
+
+/* Local includes. */
+#include "property_registry.h"
+
+/*! @brief The particle fields which can be read.
+ *
+ * Each field is a bit so a set of fields is a mask (like the halo
+ * properties, see property_registry.h). */
+enum particle_fields : unsigned {
+  field_ids = 1u << 0,
+  field_masses = 1u << 1,
+  field_coordinates = 1u << 2,
+  field_velocities = 1u << 3,
+  field_fof_groups = 1u << 4,
+};
+
+/*! @brief The definition of a particle field. */
+struct FieldDef {
+
+  /*! The dataset (in /PartType1). */
+  const char *dataset;
+
+  /*! The field's bit. */
+  unsigned flag;
+};
+
+/*! The particle fields. */
+inline constexpr FieldDef particle_field_defs[] = {
+    {"ParticleIDs", field_ids},
+    {"Masses", field_masses},
+    {"Coordinates", field_coordinates},
+    {"Velocities", field_velocities},
+    {"FOFGroupIDs", field_fof_groups},
+};
+
+/**
+ * @class LoadPlan
+ * @brief The particle fields this run reads from each snapshot.
+ *
+ * The fields are worked out from the stages the run will do, anything no
+ * stage uses is never read:
+ *   - IDs are always read (the ID index, linking and the outputs).
+ *   - FOF groups are read for FOF inputs, and replace the spatial search.
+ *   - Coordinates are read for the spatial search (snapshot inputs), the
+ *     substructure search, processing in slabs (which slab a halo is in), or
+ *     any property needing positions.
+ *   - Masses are read if any property is calculated.
+ *   - Velocities are read for properties needing them.
+ * So a FOF input run without substructure or properties (linking only) reads
+ * just the IDs and groups.
+ *
+ * Only the dark matter (PartType1) is used by any stage, so nothing of the
+ * other species is read whatever Particles/part_type_* says.
+ *
+ * @param fields The fields to read.
+ */
+class LoadPlan {
+public:
+  /* The fields to read. */
+  unsigned fields;
+
+  LoadPlan() : fields(0) {}
+
+  /** @brief Plan the fields from the stages being run.
+   *
+   * @param fof_input Are the inputs FOF groups (no spatial search)?
+   * @param n_sub_depths The depths of substructure searched for.
+   * @param out_of_core Is the box processed a slab at a time?
+   * @param registry The properties being calculated.
+   */
+  LoadPlan(bool fof_input, int n_sub_depths, bool out_of_core,
+           const PropertyRegistry &registry)
+      : fields(field_ids) {
+    if (fof_input) {
+      fields |= field_fof_groups;
+    }
+    if (!fof_input || n_sub_depths > 0 || out_of_core ||
+        registry.has(prop_com)) {
+      fields |= field_coordinates;
+    }
+    if (registry.props != 0) {
+      fields |= field_masses;
+    }
+    if (registry.has(prop_vel)) {
+      fields |= field_velocities;
+    }
+  }
+
+  /** @brief Is a field read?
+   *
+   * @param flag The field's bit.
+   */
+  bool reads(unsigned flag) const { return (fields & flag) == flag; }
+
+  /** @brief Get a comma separated list of the fields in a set.
+   *
+   * @param set The set of fields.
+   */
+  static std::string describe(unsigned set) {
+    std::string names;
+    for (const FieldDef &def : particle_field_defs) {
+      if (set & def.flag) {
+        names += names.empty() ? def.dataset
+                               : std::string(", ") + def.dataset;
+      }
+    }
+    return names.empty() ? "none" : names;
+  }
+};
+
+#endif // LOAD_PLAN_H_
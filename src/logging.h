@@ -8,6 +8,7 @@
 #include <stdarg.h>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 // Log levels
 enum LogLevel { ERROR, LOG, VERBOSE };
@@ -34,8 +35,12 @@ enum LogLevel { ERROR, LOG, VERBOSE };
 class Logging {
 private:
   LogLevel _level; ///< The specified log level threshold.
-  std::chrono::high_resolution_clock::time_point _tic; ///< Timer start point.
-  std::chrono::high_resolution_clock::time_point _toc; ///< Timer end point.
+  int _rank;       ///< The rank logging (shown on every message).
+  /// Timer start points (per thread, the pipeline stages time themselves),
+  /// a stack so timings can nest.
+  inline static thread_local std::vector<
+      std::chrono::high_resolution_clock::time_point>
+      _tics;
   std::string error_message_;                          ///< The error message.
   char *error_file_;                                   ///< The error file.
   char *error_func_;                                   ///< The error function.
@@ -45,7 +50,7 @@ private:
   static Logging *instance;
 
   // Private constructor to prevent direct instantiation
-  Logging(LogLevel level) : _level(level) {}
+  Logging(LogLevel level) : _level(level), _rank(0) {}
 
 public:
   // Static method to get the singleton instance
@@ -56,6 +61,9 @@ public:
     return instance;
   }
 
+  // Set the rank shown on every message
+  void setRank(int rank) { _rank = rank; }
+
   // Static method to destroy the singleton instance
   static void destroyInstance() {
     if (instance) {
@@ -128,17 +136,24 @@ public:
   }
 
   /**
-   * @brief Start measuring time.
+   * @brief Start measuring time (within any measurement already started).
    */
-  void tic() { _tic = std::chrono::high_resolution_clock::now(); }
+  void tic() { _tics.push_back(std::chrono::high_resolution_clock::now()); }
 
   /**
    * @brief Stop measuring time, log the duration, and print the log message.
    *
+   * Stops the measurement started most recently on this thread.
+   *
    * @param message The message indicating the operation being measured.
    */
   void toc(const char *file, const char *func, const char *message) {
-    _toc = std::chrono::high_resolution_clock::now();
+    auto _toc = std::chrono::high_resolution_clock::now();
+    auto _tic = _toc;
+    if (!_tics.empty()) {
+      _tic = _tics.back();
+      _tics.pop_back();
+    }
 
     // Calculate the duration...
     auto duration =
@@ -187,11 +202,15 @@ private:
   }
 
   /**
-   * @brief Get the current step of the simulation.
+   * @brief Get the rank logging.
    *
-   * @return The current step of the simulation.
+   * @return The rank, of the form [0000].
    */
-  std::string getStep() { return "[0000]"; }
+  std::string getStep() {
+    char step[16];
+    snprintf(step, sizeof(step), "[%04d]", _rank);
+    return step;
+  }
 
   /**
    * @brief Log a formatted message.
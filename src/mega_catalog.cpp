@@ -0,0 +1,218 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for writing and mapping the native
+ * (MEGA) binary halo catalogue.
+ *
+ * The catalogue holds the same columns as the HDF5 catalogue, as raw arrays
+ * in the machine's byte order. The layout is:
+ *   MegaHeader, MegaColumn[ncolumns], then each column's values
+ * with every column starting on a mega_catalog_align byte boundary, so a
+ * mapped column can be used in place as an array (and vectorised over).
+ * Halo properties are columns of nhalos rows, the membership and links are
+ * compressed sparse rows (an offsets column of nhalos + 1 rows and the
+ * values it indexes).
+ ******************************************************************************/
+
+/* Includes. */
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Local includes. */
+#include "mega_catalog.h"
+
+/** @brief Round an offset up to the column alignment.
+ *
+ * @param offset The offset.
+ */
+static uint64_t align_offset(uint64_t offset) {
+  return (offset + mega_catalog_align - 1) / mega_catalog_align *
+         mega_catalog_align;
+}
+
+/** @brief Record a column to be written.
+ *
+ * @param name The column's name.
+ * @param data The values.
+ * @param nrows The number of rows.
+ * @param ncomp The number of values in a row.
+ * @param elem_size The size of a value.
+ * @param kind The kind of value.
+ */
+void MegaCatalogWriter::add(const std::string &name, const void *data,
+                            size_t nrows, size_t ncomp, size_t elem_size,
+                            uint32_t kind) {
+  if (name.size() >= mega_column_name_len) {
+    error("The column name %s is too long for a binary catalogue!",
+          name.c_str());
+  }
+  MegaColumn col = {};
+  std::strncpy(col.name, name.c_str(), mega_column_name_len - 1);
+  col.nrows = nrows;
+  col.ncomp = ncomp;
+  col.elem_size = elem_size;
+  col.kind = kind;
+  columns.push_back(col);
+  sources.push_back(data);
+}
+
+/** @brief Add a column of a mapped catalogue as it is (its values are
+ * written straight from the mapping).
+ *
+ * @param catalog The catalogue.
+ * @param col The column (from the catalogue's directory).
+ */
+void MegaCatalogWriter::copyColumn(const MegaCatalog &catalog,
+                                   const MegaColumn &col) {
+  add(col.name, catalog.data + col.offset, col.nrows, col.ncomp,
+      col.elem_size, col.kind);
+}
+
+/** @brief Write the catalogue.
+ */
+void MegaCatalogWriter::finish() {
+
+  /* Lay out the columns after the directory. */
+  uint64_t offset = align_offset(sizeof(MegaHeader) +
+                                 columns.size() * sizeof(MegaColumn));
+  for (MegaColumn &col : columns) {
+    col.offset = offset;
+    offset = align_offset(offset + col.nrows * col.ncomp * col.elem_size);
+  }
+
+  MegaHeader header = {};
+  header.magic = mega_catalog_magic;
+  header.version = mega_catalog_version;
+  header.snap = snap;
+  header.nhalos = nhalos;
+  header.ncolumns = columns.size();
+  header.nbytes = offset;
+
+  std::string tmp_path = path + ".tmp";
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(columns.data()),
+            columns.size() * sizeof(MegaColumn));
+
+  /* The columns, padded out to their offsets. */
+  const char padding[mega_catalog_align] = {};
+  uint64_t written = sizeof(MegaHeader) + columns.size() * sizeof(MegaColumn);
+  for (size_t i = 0; i < columns.size(); i++) {
+    out.write(padding, columns[i].offset - written);
+    uint64_t nbytes = columns[i].nrows * columns[i].ncomp *
+                      columns[i].elem_size;
+    out.write(static_cast<const char *>(sources[i]), nbytes);
+    written = columns[i].offset + nbytes;
+  }
+  out.write(padding, header.nbytes - written);
+
+  out.close();
+  if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    error("Failed to write the binary catalogue %s!", path.c_str());
+  }
+}
+
+/** @brief The constructor for MegaCatalog, mapping a binary catalogue and
+ * checking its header and column directory.
+ *
+ * @param path The catalogue.
+ */
+MegaCatalog::MegaCatalog(const std::string &path)
+    : path(path), data(nullptr), size(0), header(nullptr), columns(nullptr) {
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error("Failed to open the binary catalogue %s!", path.c_str());
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    error("Failed to get the size of %s!", path.c_str());
+  }
+  size = info.st_size;
+  if (size < sizeof(MegaHeader)) {
+    close(fd);
+    error("%s is not a MEGA binary catalogue!", path.c_str());
+  }
+
+  /* The mapping keeps the file open, the descriptor isn't needed. */
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    error("Failed to map the binary catalogue %s!", path.c_str());
+  }
+  data = static_cast<const char *>(mapping);
+
+  /* Check the header and directory (unmapping before any error, the
+   * destructor won't run). */
+  header = reinterpret_cast<const MegaHeader *>(data);
+  columns = reinterpret_cast<const MegaColumn *>(data + sizeof(MegaHeader));
+  const char *problem = nullptr;
+  if (header->magic != mega_catalog_magic) {
+    problem = "is not a MEGA binary catalogue";
+  } else if (header->version != mega_catalog_version) {
+    problem = "is from a different version of MEGA";
+  } else if (header->nbytes != size ||
+             sizeof(MegaHeader) + header->ncolumns * sizeof(MegaColumn) >
+                 size) {
+    problem = "is incomplete";
+  }
+  for (uint64_t i = 0; problem == nullptr && i < header->ncolumns; i++) {
+    const MegaColumn &col = columns[i];
+    if (col.name[mega_column_name_len - 1] != '\0' ||
+        col.offset % mega_catalog_align != 0 ||
+        col.offset + col.nrows * col.ncomp * col.elem_size > size) {
+      problem = "has a corrupt column directory";
+    }
+  }
+  if (problem != nullptr) {
+    munmap(mapping, size);
+    data = nullptr;
+    error("The binary catalogue %s %s!", path.c_str(), problem);
+  }
+
+  v_message("Mapped %s (%zu halos, %llu columns)", path.c_str(), nhalos(),
+            static_cast<unsigned long long>(header->ncolumns));
+}
+
+/** @brief The destructor for MegaCatalog, unmapping the catalogue.
+ */
+MegaCatalog::~MegaCatalog() {
+  if (data != nullptr) {
+    munmap(const_cast<char *>(data), size);
+  }
+}
+
+/** @brief Find a column in the directory.
+ *
+ * @param name The column's name.
+ *
+ * @return The column (nullptr if there isn't one).
+ */
+const MegaColumn *MegaCatalog::findColumn(const std::string &name) const {
+  for (uint64_t i = 0; i < header->ncolumns; i++) {
+    if (name == columns[i].name) {
+      return &columns[i];
+    }
+  }
+  return nullptr;
+}
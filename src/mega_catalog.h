@@ -0,0 +1,251 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definitions for writing and mapping the
+ * native (MEGA) binary halo catalogue.
+ ******************************************************************************/
+#ifndef MEGA_CATALOG_H_
+#define MEGA_CATALOG_H_
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/* Local includes. */
+#include "logging.h"
+
+/* The first 8 bytes of a binary catalogue ("MEGACATL"). */
+#define mega_catalog_magic 0x4c54414341474d45ull
+
+/* The version of the binary catalogue layout. */
+#define mega_catalog_version 1
+
+/* The alignment of every column in the file (a cache line). */
+#define mega_catalog_align 64
+
+/* The longest column name (including the terminator). */
+#define mega_column_name_len 48
+
+/*! @brief The kinds of value a column can hold. */
+enum mega_column_kinds : uint32_t {
+  mega_column_int,
+  mega_column_uint,
+  mega_column_float,
+};
+
+/**
+ * @brief The header at the start of a binary catalogue.
+ *
+ * @param magic The magic number (mega_catalog_magic).
+ * @param version The layout version (mega_catalog_version).
+ * @param snap The snapshot the halos were found in.
+ * @param nhalos The number of halos.
+ * @param ncolumns The number of columns.
+ * @param nbytes The size of the whole file (to catch truncated files).
+ */
+struct MegaHeader {
+  uint64_t magic;
+  uint64_t version;
+  int64_t snap;
+  uint64_t nhalos;
+  uint64_t ncolumns;
+  uint64_t nbytes;
+  uint64_t reserved[2];
+};
+
+/**
+ * @brief A column's entry in the directory following the header.
+ *
+ * @param name The column's name (the dataset name in the HDF5 catalogue).
+ * @param offset Where the column starts in the file (aligned).
+ * @param nrows The number of rows.
+ * @param ncomp The number of values in a row.
+ * @param elem_size The size of a value.
+ * @param kind The kind of value (see mega_column_kinds).
+ */
+struct MegaColumn {
+  char name[mega_column_name_len];
+  uint64_t offset;
+  uint64_t nrows;
+  uint32_t ncomp;
+  uint32_t elem_size;
+  uint32_t kind;
+  uint32_t reserved;
+};
+
+/** @brief The kind of value a C++ type is stored as (enums as their
+ * underlying type).
+ */
+template <typename T> constexpr uint32_t mega_column_kind() {
+  if constexpr (std::is_enum_v<T>) {
+    return mega_column_kind<std::underlying_type_t<T>>();
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return mega_column_float;
+  } else if constexpr (std::is_signed_v<T>) {
+    return mega_column_int;
+  } else {
+    return mega_column_uint;
+  }
+}
+
+class MegaCatalog;
+
+/**
+ * @class MegaCatalogWriter
+ * @brief Writes a binary catalogue, a column at a time.
+ *
+ * Columns are only recorded as they're added (so their data must outlive
+ * the writer), and the whole file is written by finish: the header, the
+ * column directory, then each column at the next aligned offset. The file is
+ * written to a temporary path and moved into place, so a binary catalogue is
+ * never seen half written.
+ *
+ * @param path The catalogue.
+ * @param snap The snapshot the halos were found in.
+ * @param nhalos The number of halos.
+ * @param columns The directory of the columns added.
+ * @param sources Where each column's data is.
+ */
+class MegaCatalogWriter {
+public:
+  /* The catalogue. */
+  std::string path;
+
+  /* The snapshot and number of halos. */
+  int snap;
+  size_t nhalos;
+
+  /* The columns added, and where their data is. */
+  std::vector<MegaColumn> columns;
+  std::vector<const void *> sources;
+
+  MegaCatalogWriter(const std::string &path, int snap, size_t nhalos)
+      : path(path), snap(snap), nhalos(nhalos) {}
+
+  /** @brief Add a column.
+   *
+   * @param name The column's name.
+   * @param data The values (nrows * ncomp of them).
+   * @param nrows The number of rows.
+   * @param ncomp The number of values in a row.
+   */
+  template <typename T>
+  void addColumn(const std::string &name, const T *data, size_t nrows,
+                 size_t ncomp = 1) {
+    static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>,
+                  "Binary catalogue columns must hold numbers");
+    add(name, data, nrows, ncomp, sizeof(T), mega_column_kind<T>());
+  }
+
+  /** @brief Add a column from a vector (the rows are inferred).
+   *
+   * @param name The column's name.
+   * @param vec The values.
+   * @param ncomp The number of values in a row.
+   */
+  template <typename T, typename A>
+  void addColumn(const std::string &name, const std::vector<T, A> &vec,
+                 size_t ncomp = 1) {
+    addColumn(name, vec.data(), vec.size() / ncomp, ncomp);
+  }
+
+  void copyColumn(const MegaCatalog &catalog, const MegaColumn &col);
+  void finish();
+
+private:
+  void add(const std::string &name, const void *data, size_t nrows,
+           size_t ncomp, size_t elem_size, uint32_t kind);
+};
+
+/**
+ * @class MegaCatalog
+ * @brief A binary catalogue mapped (read only) into memory.
+ *
+ * Nothing is read or parsed beyond the header and column directory, a
+ * column is a pointer straight into the mapping, so opening a catalogue is
+ * instant and only the pages of the columns actually used are ever read
+ * from disk. The mapping is shared by every process mapping the same file.
+ *
+ * @param path The catalogue.
+ * @param data The mapping.
+ * @param size The size of the mapping.
+ * @param header The header.
+ * @param columns The column directory.
+ */
+class MegaCatalog {
+public:
+  /* The catalogue. */
+  std::string path;
+
+  /* The mapping. */
+  const char *data;
+  size_t size;
+
+  /* The header and column directory. */
+  const MegaHeader *header;
+  const MegaColumn *columns;
+
+  MegaCatalog(const std::string &path);
+  ~MegaCatalog();
+
+  /* A catalogue owns its mapping, so can't be copied. */
+  MegaCatalog(const MegaCatalog &) = delete;
+  MegaCatalog &operator=(const MegaCatalog &) = delete;
+
+  /** @brief The snapshot the halos were found in. */
+  int snap() const { return static_cast<int>(header->snap); }
+
+  /** @brief The number of halos. */
+  size_t nhalos() const { return header->nhalos; }
+
+  const MegaColumn *findColumn(const std::string &name) const;
+
+  /** @brief Get a column.
+   *
+   * @param name The column's name.
+   * @param nrows The number of rows (set if not nullptr).
+   * @param ncomp The number of values in a row expected.
+   *
+   * @return The values (nullptr if there is no such column, e.g. a property
+   *         that wasn't output).
+   */
+  template <typename T>
+  const T *column(const std::string &name, size_t *nrows = nullptr,
+                  size_t ncomp = 1) const {
+    const MegaColumn *col = findColumn(name);
+    if (col == nullptr) {
+      if (nrows != nullptr) {
+        *nrows = 0;
+      }
+      return nullptr;
+    }
+    if (col->elem_size != sizeof(T) || col->kind != mega_column_kind<T>() ||
+        col->ncomp != ncomp) {
+      error("The column %s in %s doesn't hold the type asked for!",
+            name.c_str(), path.c_str());
+    }
+    if (nrows != nullptr) {
+      *nrows = col->nrows;
+    }
+    return reinterpret_cast<const T *>(data + col->offset);
+  }
+};
+
+#endif // MEGA_CATALOG_H_
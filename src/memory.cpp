@@ -0,0 +1,271 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for tracking the memory each part of
+ * MEGA holds.
+ *
+ * Every tracked allocation and free adjusts its tag's count (and the total),
+ * raising the tag's high-water marks for the run and for the phase the main
+ * loop is in. The counts are always kept (a couple of atomic adds per
+ * allocation, and only large arrays are tracked), the phases are only
+ * recorded when memory profiling is on. A memory profile is a table of the
+ * high-water marks of each phase since the last, along with the resident set
+ * size from /proc/self/status, which also covers everything not tracked.
+ ******************************************************************************/
+
+/* Includes. */
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "logging.h"
+#include "memory.h"
+
+/**
+ * @brief The high-water marks of a phase of the main loop.
+ *
+ * @param name The phase.
+ * @param high_water The most held under each tag (and in total, the last).
+ * @param rss The resident set size at the end of the phase.
+ */
+struct MemoryPhase {
+  std::string name;
+  size_t high_water[memory_tag_count + 1];
+  size_t rss;
+};
+
+/* The bytes held under each tag, and in total (the last). */
+static std::atomic<size_t> held[memory_tag_count + 1];
+
+/* The most ever held under each tag, and in total. */
+static std::atomic<size_t> run_peak[memory_tag_count + 1];
+
+/* The most held under each tag, and in total, in the current phase. */
+static std::atomic<size_t> phase_peak[memory_tag_count + 1];
+
+/* Are the phases being recorded (Profiling/mem_profiling)? */
+static std::atomic<bool> recording(false);
+
+/* The phases finished since the last profile, and the current phase (empty
+ * if there isn't one). */
+static std::mutex phase_lock;
+static std::vector<MemoryPhase> phases;
+static std::string phase_name;
+
+/** @brief Raise a high-water mark to a value (if it's higher).
+ *
+ * @param mark The high-water mark.
+ * @param value The value.
+ */
+static void raise_mark(std::atomic<size_t> &mark, size_t value) {
+  size_t old = mark.load(std::memory_order_relaxed);
+  while (value > old &&
+         !mark.compare_exchange_weak(old, value, std::memory_order_relaxed)) {
+  }
+}
+
+/** @brief Count an allocation or free against a tag.
+ *
+ * @param tag The tag.
+ * @param nbytes The size of the allocation.
+ * @param allocated Was it allocated (or freed)?
+ */
+void memory_track(enum memory_tags tag, size_t nbytes, bool allocated) {
+  if (!allocated) {
+    held[tag].fetch_sub(nbytes, std::memory_order_relaxed);
+    held[memory_tag_count].fetch_sub(nbytes, std::memory_order_relaxed);
+    return;
+  }
+  size_t tag_bytes =
+      held[tag].fetch_add(nbytes, std::memory_order_relaxed) + nbytes;
+  size_t total_bytes =
+      held[memory_tag_count].fetch_add(nbytes, std::memory_order_relaxed) +
+      nbytes;
+  raise_mark(run_peak[tag], tag_bytes);
+  raise_mark(phase_peak[tag], tag_bytes);
+  raise_mark(run_peak[memory_tag_count], total_bytes);
+  raise_mark(phase_peak[memory_tag_count], total_bytes);
+}
+
+/** @brief Allocate aligned memory, counted against a tag.
+ *
+ * @param tag The tag.
+ * @param alignment The alignment.
+ * @param nbytes The size (a whole number of alignments).
+ *
+ * @return The memory (nullptr if it couldn't be allocated).
+ */
+void *memory_alloc(enum memory_tags tag, size_t alignment, size_t nbytes) {
+  void *ptr = std::aligned_alloc(alignment, nbytes);
+  if (ptr != nullptr) {
+    memory_track(tag, nbytes, true);
+  }
+  return ptr;
+}
+
+/** @brief Free memory from memory_alloc.
+ *
+ * @param tag The tag it was allocated with.
+ * @param ptr The memory (may be nullptr).
+ * @param nbytes The size it was allocated with.
+ */
+void memory_free(enum memory_tags tag, void *ptr, size_t nbytes) {
+  if (ptr == nullptr) {
+    return;
+  }
+  std::free(ptr);
+  memory_track(tag, nbytes, false);
+}
+
+/** @brief Read a size from /proc/self/status.
+ *
+ * @param field The field (e.g. VmRSS).
+ *
+ * @return The size in bytes (0 if it can't be read).
+ */
+static size_t proc_status_bytes(const char *field) {
+  std::ifstream status("/proc/self/status");
+  std::string line, key = std::string(field) + ":";
+  while (std::getline(status, line)) {
+    if (line.compare(0, key.size(), key) == 0) {
+      return std::strtoull(line.c_str() + key.size(), nullptr, 10) * 1024;
+    }
+  }
+  return 0;
+}
+
+/** @brief The bytes held under every tag (what's tracked of what's resident
+ * right now).
+ */
+size_t memory_held() {
+  return held[memory_tag_count].load(std::memory_order_relaxed);
+}
+
+/** @brief Turn the recording of phases on or off.
+ *
+ * @param enabled Should phases be recorded?
+ */
+void memory_enable(bool enabled) { recording.store(enabled); }
+
+/** @brief Finish the current phase (if there is one), recording its
+ * high-water marks, and start the next.
+ *
+ * Must be called with the phase lock held.
+ *
+ * @param name The next phase (empty for none).
+ */
+static void next_phase(const std::string &name) {
+  MemoryPhase phase;
+  phase.name = phase_name;
+  for (int i = 0; i <= memory_tag_count; i++) {
+    phase.high_water[i] =
+        phase_peak[i].exchange(held[i].load(std::memory_order_relaxed));
+  }
+  phase.rss = proc_status_bytes("VmRSS");
+  if (!phase_name.empty()) {
+    phases.push_back(phase);
+  }
+  phase_name = name;
+}
+
+/** @brief Start a phase of the main loop, finishing the last.
+ *
+ * @param name The phase.
+ */
+void memory_phase(const char *name) {
+  if (!recording.load()) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(phase_lock);
+  next_phase(name);
+}
+
+/** @brief Write a row of the memory profile.
+ *
+ * @param out The profile.
+ * @param name The row's name.
+ * @param bytes The bytes under each tag, and in total.
+ * @param rss The resident set size.
+ */
+static void write_row(std::ofstream &out, const std::string &name,
+                      const size_t *bytes, size_t rss) {
+  char row[64];
+  snprintf(row, sizeof(row), "%-24s", name.c_str());
+  out << row;
+  for (int i = 0; i <= memory_tag_count; i++) {
+    snprintf(row, sizeof(row), " %12.2f", bytes[i] / 1048576.0);
+    out << row;
+  }
+  snprintf(row, sizeof(row), " %12.2f\n", rss / 1048576.0);
+  out << row;
+}
+
+/** @brief Write the memory profile, finishing the current phase.
+ *
+ * The profile has the high-water marks of each phase finished since it was
+ * last written (so one is written per snapshot), what is held now and the
+ * most held over the run. Memory not tracked only shows up in the resident
+ * set size.
+ *
+ * @param filename The file to write to (its directory is made if needed).
+ * @param title The profile's title.
+ */
+void memory_write(const std::string &filename, const std::string &title) {
+
+  std::lock_guard<std::mutex> guard(phase_lock);
+  next_phase("");
+
+  std::filesystem::path path(filename);
+  if (path.has_parent_path()) {
+    std::filesystem::create_directories(path.parent_path());
+  }
+  std::ofstream out(filename, std::ios::trunc);
+  if (!out) {
+    error("Failed to open the memory profile %s!", filename.c_str());
+  }
+
+  out << "# " << title << "\n";
+  out << "# High-water marks in MB. RSS is the resident set size at the end "
+         "of a phase, its peak over the run on the last row.\n";
+  char row[64];
+  snprintf(row, sizeof(row), "%-24s", "# Phase");
+  out << row;
+  for (int i = 0; i < memory_tag_count; i++) {
+    snprintf(row, sizeof(row), " %12s", memory_tag_names[i]);
+    out << row;
+  }
+  out << "        Total          RSS\n";
+
+  for (const MemoryPhase &phase : phases) {
+    write_row(out, phase.name, phase.high_water, phase.rss);
+  }
+  phases.clear();
+
+  size_t now[memory_tag_count + 1], peak[memory_tag_count + 1];
+  for (int i = 0; i <= memory_tag_count; i++) {
+    now[i] = held[i].load(std::memory_order_relaxed);
+    peak[i] = run_peak[i].load(std::memory_order_relaxed);
+  }
+  write_row(out, "Now", now, proc_status_bytes("VmRSS"));
+  write_row(out, "Peak over the run", peak, proc_status_bytes("VmHWM"));
+}
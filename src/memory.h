@@ -0,0 +1,106 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definitions for tracking the memory each
+ * part of MEGA holds (Profiling/mem_profiling).
+ ******************************************************************************/
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+/* Includes */
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*! @brief What tracked memory is used for.
+ *
+ * Every large allocation is tagged with the part of MEGA it belongs to. */
+enum memory_tags {
+  mem_particles,
+  mem_cells,
+  mem_halos,
+  mem_membership,
+  mem_io,
+  mem_index,
+  mem_sort,
+  mem_properties,
+  memory_tag_count,
+};
+
+/*! The names of the tags (in the memory profile). */
+inline constexpr const char *memory_tag_names[memory_tag_count] = {
+    "Particles",   "Cells",    "Halos",        "Membership",
+    "I/O buffers", "ID index", "Sort scratch", "Property scratch",
+};
+
+/* Prototypes */
+void memory_track(enum memory_tags tag, size_t nbytes, bool allocated);
+void *memory_alloc(enum memory_tags tag, size_t alignment, size_t nbytes);
+void memory_free(enum memory_tags tag, void *ptr, size_t nbytes);
+size_t memory_held();
+void memory_enable(bool enabled);
+void memory_phase(const char *name);
+void memory_write(const std::string &filename, const std::string &title);
+
+/**
+ * @class TrackedAllocator
+ * @brief A standard allocator counting what it holds against a tag.
+ *
+ * Containers using it allocate just as std::allocator would, so a
+ * tracked_vector behaves exactly like a std::vector, apart from its memory
+ * showing up in the memory profile under its tag.
+ */
+template <typename T, enum memory_tags Tag> class TrackedAllocator {
+public:
+  using value_type = T;
+
+  /* Rebound allocators count against the same tag. */
+  template <typename U> struct rebind {
+    using other = TrackedAllocator<U, Tag>;
+  };
+
+  TrackedAllocator() = default;
+  template <typename U>
+  TrackedAllocator(const TrackedAllocator<U, Tag> &) noexcept {}
+
+  T *allocate(size_t n) {
+    T *ptr = std::allocator<T>().allocate(n);
+    memory_track(Tag, n * sizeof(T), true);
+    return ptr;
+  }
+
+  void deallocate(T *ptr, size_t n) noexcept {
+    std::allocator<T>().deallocate(ptr, n);
+    memory_track(Tag, n * sizeof(T), false);
+  }
+
+  template <typename U>
+  bool operator==(const TrackedAllocator<U, Tag> &) const noexcept {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const TrackedAllocator<U, Tag> &) const noexcept {
+    return false;
+  }
+};
+
+/*! A vector whose memory is counted against a tag. */
+template <typename T, enum memory_tags Tag>
+using tracked_vector = std::vector<T, TrackedAllocator<T, Tag>>;
+
+#endif // MEMORY_H_
@@ -0,0 +1,406 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for finding halos in a box too big
+ * for memory, a slab at a time.
+ *
+ * The box is cut into slabs along x. Running on several ranks, each rank
+ * only takes the slabs in its own part of the box (see Decomposition), so
+ * the ranks find the halos of the whole box between them without ever
+ * communicating particles. Each slab is read with a buffer
+ * around it (at least a linking length wide, see SnapshotFiles for reading a
+ * region) and searched for halos as a box of its own. A host belongs to the
+ * slab its lowest ID particle is in, so every host is kept exactly once.
+ *
+ * A host a slab keeps is complete unless it comes within a linking length
+ * of the edge of what was read, in which case it may carry on beyond it.
+ * The slab is then read again with twice the buffer, until every host it
+ * keeps is complete, so halos crossing slab boundaries are found whole
+ * (however big they are) and never need stitching back together.
+ *
+ * The properties of the halos kept are calculated while their slab is in
+ * memory, and only the IDs of their particles and the halos they're in stay
+ * (the generation's part_ids). Once every slab is done the halos kept are
+ * compacted into its catalogue as if they had been found in one go, so the
+ * linking and outputs don't know the difference.
+ *
+ * With a Memory/budget_gb, everything tracked (see memory.h) is held within
+ * it: what's already resident (the previous snapshot and any being written),
+ * the IDs and halos of every particle that could be kept, with the ID index
+ * over them, and a slab. There are as many slabs as it takes for that to
+ * fit, planning for the particles being spread evenly along x, and a slab
+ * that turns out not to fit is an error rather than going over. Without a
+ * budget (several ranks alone) the whole of a rank's part of the box is one
+ * slab, and nothing bounds the memory but the number of ranks.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/* Local includes. */
+#include "comms.h"
+#include "decomposition.h"
+#include "halo_finder.h"
+#include "logging.h"
+#include "memory.h"
+#include "out_of_core.h"
+#include "profiler.h"
+#include "properties.h"
+#include "snapshot.h"
+
+/**
+ * @brief A slab, the x range it owns and the x range read around it.
+ *
+ * @param lower The lower edge of the slab.
+ * @param upper The upper edge of the slab.
+ * @param buffer The width read either side of the slab.
+ * @param whole Was the whole box read (the buffers meet)?
+ */
+struct Slab {
+  double lower;
+  double upper;
+  double buffer;
+  bool whole;
+};
+
+/** @brief The most memory each particle kept can need once every slab is
+ * done: its ID, its halo at each depth (in halo_id and the membership rows)
+ * and either the ID index over it or, on several ranks, the memberships
+ * shared out and owned (see link_halos_distributed).
+ *
+ * @param engine The engine.
+ */
+static double kept_part_bytes(const Engine *engine) {
+  size_t ndepths = std::max(engine->n_sub_depths, 0) + 1;
+  size_t membership = sizeof(size_t) + ndepths * sizeof(int64_t);
+  double bytes = membership + ndepths * sizeof(size_t);
+  return bytes + (engine->nranks > 1 ? 2 * membership : kept_index_overhead);
+}
+
+/** @brief How many slabs must the box be cut into to fit in the memory
+ * budget?
+ *
+ * Every particle could be in a halo, so room is left for keeping them all,
+ * and the slabs share what's left. Each slab is read with a buffer either
+ * side, which the slabs getting thinner doesn't shrink, so a budget only
+ * leaving room for the buffers is an error.
+ *
+ * @param engine The engine.
+ * @param npart The number of particles in the part of the box to cut up.
+ * @param width The width of the part of the box to cut up.
+ * @param resident The memory already held, other than the slabs and the
+ *                 generation the halos are found for.
+ */
+int slab_count(Engine *engine, size_t npart, double width,
+               size_t resident) {
+  if (engine->memory_budget_gb <= 0) {
+    return 1;
+  }
+  double budget = engine->memory_budget_gb * (1ull << 30);
+  double kept = npart * kept_part_bytes(engine);
+  double part_bytes = sizeof(DMParticle) + slab_part_overhead +
+                      (std::max(engine->n_sub_depths, 0) + 1) *
+                          sizeof(int64_t);
+  double buffer = std::max(engine->slab_buffer, linking_length(engine, 0));
+  double buffers = npart * part_bytes * std::min(2 * buffer / width, 1.0);
+  double available = budget - resident - kept - buffers;
+  if (available <= 0) {
+    error("Memory/budget_gb (%.3f GB) is too small for %zu particles: %.3f "
+          "GB is held already, keeping them could take %.3f GB and a slab's "
+          "buffers alone %.3f GB!",
+          engine->memory_budget_gb, npart,
+          static_cast<double>(resident) / (1ull << 30), kept / (1ull << 30),
+          buffers / (1ull << 30));
+  }
+  return std::max(1, static_cast<int>(std::ceil(npart * part_bytes /
+                                                available)));
+}
+
+/** @brief Is a particle too close to the edge of what was read for its
+ * halo to be certainly complete?
+ *
+ * @param x The particle's x position.
+ * @param slab The slab.
+ * @param ll The linking length.
+ * @param box The box's width (0 if not periodic).
+ */
+static bool near_edge(double x, const Slab &slab, double ll, double box) {
+  double lower = slab.lower - slab.buffer, upper = slab.upper + slab.buffer;
+  if (box > 0) {
+    double centre = 0.5 * (lower + upper);
+    double dx = x - centre;
+    dx -= box * std::round(dx / box);
+    return std::fabs(dx) > 0.5 * (upper - lower) - ll;
+  }
+  return (lower > 0 && x < lower + ll) || x > upper - ll;
+}
+
+/** @brief Work out which halos found in a slab it keeps.
+ *
+ * A slab keeps the hosts whose lowest ID particle is in it, along with their
+ * substructure.
+ *
+ * @param slab_gen The particles and halos of the slab.
+ * @param slab The slab.
+ * @param ll The linking length.
+ * @param box The box's width (0 if not periodic).
+ * @param kept Whether each halo is kept (set).
+ *
+ * @return Whether every host kept is certainly complete.
+ */
+static bool keep_halos(const Generation &slab_gen, const Slab &slab,
+                       double ll, double box, std::vector<char> &kept) {
+
+  const HaloCatalog &catalog = slab_gen.catalog;
+  const DMParticle *parts = slab_gen.dark_matter;
+  kept.assign(catalog.nhalos, 0);
+  bool complete = true;
+
+  for (size_t h = 0; h < catalog.nhosts(); h++) {
+    const size_t *members = catalog.parts(h);
+    size_t first = members[0];
+    for (size_t j = 1; j < catalog.npart[h]; j++) {
+      if (parts[members[j]].id < parts[first].id) {
+        first = members[j];
+      }
+    }
+    double x = parts[first].pos[0];
+    if (box > 0) {
+      x -= box * std::floor(x / box);
+    }
+    if (x < slab.lower || x >= slab.upper) {
+      continue;
+    }
+    kept[h] = 1;
+
+    if (slab.whole) {
+      continue;
+    }
+    for (size_t j = 0; j < catalog.npart[h] && complete; j++) {
+      complete = !near_edge(parts[members[j]].pos[0], slab, ll, box);
+    }
+  }
+
+  /* Substructure goes with its host (parents come first). */
+  for (size_t i = catalog.nhosts(); i < catalog.nhalos; i++) {
+    kept[i] = kept[catalog.parent[i]];
+  }
+
+  return complete;
+}
+
+/** @brief Find the halos in a snapshot too big for memory, a slab at a time.
+ *
+ * The generation holds nothing but its snapshot number going in, and the
+ * IDs of the particles of every halo found and the halos themselves (with
+ * their properties) coming out, attached to the Domain without any
+ * particles. The scratch generation is what each slab is read into, its
+ * particles are freed once every slab is done.
+ *
+ * @param engine The engine.
+ * @param scratch The generation slabs are read into.
+ * @param gen The generation the halos are found for.
+ */
+void find_halos_out_of_core(Engine *engine, Generation &scratch,
+                            Generation &gen) {
+
+  tic();
+  ProfileScope profile("Finding halos out of core");
+
+  Domain *domain = engine->domain;
+  std::string filename = engine->inputPath(gen.snap);
+  SnapshotFiles files(filename);
+  size_t npart_snapshot = files.nrows_total;
+  domain->npart_dm_sim = npart_snapshot;
+  double ll = linking_length(engine, 0);
+  double box = domain->periodic ? domain->boxsize[0] : 0;
+
+  /* The part of the box this rank takes. */
+  double x_lower = 0, x_upper = domain->boxsize[0];
+  size_t npart_rank = npart_snapshot;
+  if (engine->nranks > 1) {
+    Decomposition decomp(files, domain->boxsize[0], engine->nranks);
+    x_lower = decomp.bounds[engine->rank];
+    x_upper = decomp.bounds[engine->rank + 1];
+    npart_rank = decomp.counts[engine->rank];
+  }
+
+  /* Everything held besides the slabs and this generation (both of which
+   * are reused) counts against the budget. */
+  size_t reused = scratch.nbytes() + gen.nbytes();
+  size_t held = memory_held();
+  size_t resident = held > reused ? held - reused : 0;
+  int nslabs = slab_count(engine, npart_rank, x_upper - x_lower, resident);
+  double budget = engine->memory_budget_gb * (1ull << 30);
+  message("Finding halos in %d slabs of %s, x in [%g, %g)", nslabs,
+          filename.c_str(), x_lower, x_upper);
+
+  /* The IDs of the particles of the halos kept go straight into the
+   * generation, with the halo they're in at each depth (provisional handles
+   * into the block). There's room for them all, as the budget allows. */
+  gen.npart = 0;
+  gen.npart_snapshot = npart_snapshot;
+  gen.fof_group.clear();
+  gen.part_ids.clear();
+  gen.part_ids.reserve(npart_rank);
+  std::vector<member_vector<int64_t>> part_halos(
+      std::max(engine->n_sub_depths, 0) + 1);
+  for (member_vector<int64_t> &halos : part_halos) {
+    halos.reserve(npart_rank);
+  }
+  std::vector<HaloBlock> blocks;
+  blocks.emplace_back(0);
+  HaloBlock &block = blocks[0];
+
+  /* The properties of the halos kept, in the order they're kept. */
+  unsigned props = engine->calculate_props ? engine->prop_registry.props : 0;
+  HaloCatalog kept_props;
+
+  std::vector<char> kept;
+  std::vector<size_t> kept_index;
+  std::vector<int64_t> handle;
+  for (int s = 0; s < nslabs; s++) {
+    Slab slab;
+    slab.lower = x_lower + (x_upper - x_lower) * s / nslabs;
+    slab.upper = s + 1 == nslabs
+                     ? x_upper
+                     : x_lower + (x_upper - x_lower) * (s + 1) / nslabs;
+    slab.buffer = std::max(engine->slab_buffer, ll);
+
+    /* Read and search the slab, widening the buffer until every host it
+     * keeps is complete. */
+    while (true) {
+      slab.whole = slab.upper - slab.lower + 2 * slab.buffer >=
+                   domain->boxsize[0];
+      double lower[3] = {slab.lower - slab.buffer, 0, 0};
+      double upper[3] = {slab.upper + slab.buffer, domain->boxsize[1],
+                         domain->boxsize[2]};
+      if (box == 0) {
+        lower[0] = std::max(lower[0], 0.0);
+        upper[0] = std::min(upper[0], domain->boxsize[0]);
+      }
+      scratch.read(engine, gen.snap, slab.whole ? nullptr : lower,
+                   slab.whole ? nullptr : upper);
+      scratch.attach(domain);
+      find_halos(engine, scratch.catalog);
+      if (keep_halos(scratch, slab, ll, box, kept)) {
+        break;
+      }
+      slab.buffer *= 2;
+      v_message("A halo reaches beyond slab %d's buffer, widening it to %g",
+                s, slab.buffer);
+    }
+
+    /* The properties need the particles, so are calculated while they're
+     * here. */
+    if (props != 0) {
+      calculate_halo_properties(engine, scratch.catalog);
+    }
+
+    /* The IDs of the particles of the hosts kept stay (subhalos are within
+     * them). */
+    const HaloCatalog &catalog = scratch.catalog;
+    const DMParticle *parts = scratch.dark_matter;
+    size_t first_member = gen.npart;
+    kept_index.assign(scratch.npart, 0);
+    for (size_t h = 0; h < catalog.nhosts(); h++) {
+      if (!kept[h]) {
+        continue;
+      }
+      const size_t *host_parts = catalog.parts(h);
+      for (size_t j = 0; j < catalog.npart[h]; j++) {
+        kept_index[host_parts[j]] = gen.npart++;
+        gen.part_ids.push_back(parts[host_parts[j]].id);
+      }
+    }
+
+    /* Then the halos kept (parents first, so their handles are known). */
+    handle.assign(catalog.nhalos, halo_null);
+    size_t nkept = 0;
+    for (size_t i = 0; i < catalog.nhalos; i++) {
+      if (!kept[i]) {
+        continue;
+      }
+      int64_t parent = catalog.parent[i] == halo_null
+                           ? halo_null
+                           : handle[catalog.parent[i]];
+      handle[i] =
+          block.append(catalog.type[i], catalog.depth[i], parent,
+                       catalog.npart[i], kept_index[catalog.parts(i)[0]]);
+      copy_halo_properties(props, catalog, i, kept_props, block.size() - 1);
+      nkept++;
+    }
+
+    /* And which of them each particle kept is in. */
+    for (size_t h = 0; h < catalog.nhosts(); h++) {
+      if (!kept[h]) {
+        continue;
+      }
+      const size_t *host_parts = catalog.parts(h);
+      for (size_t j = 0; j < catalog.npart[h]; j++) {
+        for (size_t d = 0; d < part_halos.size(); d++) {
+          int64_t halo = catalog.halo_id[d][host_parts[j]];
+          part_halos[d].push_back(halo == halo_null ? halo_null
+                                                    : handle[halo]);
+        }
+      }
+    }
+
+    v_message("Kept %zu halos (%zu particles) from slab %d", nkept,
+              gen.npart - first_member, s);
+
+    /* Everything the slab needed is held right now. */
+    held = memory_held();
+    if (budget > 0 && held > budget) {
+      error("Slab %d of %s (x in [%g, %g) read with a buffer of %g) took "
+            "the memory held to %.3f GB, over Memory/budget_gb (%.3f GB)!",
+            s, filename.c_str(), slab.lower, slab.upper, slab.buffer,
+            static_cast<double>(held) / (1ull << 30),
+            engine->memory_budget_gb);
+    }
+  }
+  scratch.freeParticles();
+
+  /* Turn the halos kept into the catalogue of the particles kept, each
+   * halo's properties going to where it ends up (found through its first
+   * particle). */
+  halo_vector<int> kept_depth = block.depth;
+  halo_vector<size_t> kept_first = block.first_part;
+  gen.attach(domain);
+  gen.catalog.compact(engine->threadpool, blocks, std::move(part_halos));
+  for (size_t k = 0; props != 0 && k < kept_depth.size(); k++) {
+    size_t ihalo = gen.catalog.halo_id[kept_depth[k]][kept_first[k]];
+    copy_halo_properties(props, kept_props, k, gen.catalog, ihalo);
+  }
+
+  message("Found %zu host halos and %zu subhalos in %d slabs (keeping %zu of "
+          "%zu particles)",
+          gen.catalog.nhosts(), gen.catalog.nhalos - gen.catalog.nhosts(),
+          nslabs, gen.npart, npart_snapshot);
+  if (engine->nranks > 1) {
+    gen.halo_offset = offset_over_ranks(gen.catalog.nhalos);
+    size_t nhosts = sum_over_ranks(gen.catalog.nhosts());
+    size_t nhalos = sum_over_ranks(gen.catalog.nhalos);
+    message("Found %zu host halos and %zu subhalos across %d ranks", nhosts,
+            nhalos - nhosts, engine->nranks);
+  }
+
+  toc("Finding halos out of core");
+}
@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the prototypes for finding halos in a box too
+ * big for memory, a slab at a time.
+ ******************************************************************************/
+#ifndef OUT_OF_CORE_H_
+#define OUT_OF_CORE_H_
+
+/* Includes */
+#include <cstddef>
+
+/* Local includes. */
+#include "engine.h"
+#include "generation.h"
+
+/* The working memory for each particle while finding halos in a slab (the
+ * union-find, group sizes, members and grid), on top of the particle itself
+ * and its halo_id entries. */
+#define slab_part_overhead 48
+
+/* The ID index over each particle kept, its sorted (ID, index) pairs and
+ * their radix sort scratch. */
+#define kept_index_overhead 32
+
+/* Prototypes */
+int slab_count(Engine *engine, size_t npart, double width,
+               size_t resident);
+void find_halos_out_of_core(Engine *engine, Generation &scratch,
+                            Generation &gen);
+
+#endif // OUT_OF_CORE_H_
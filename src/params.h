@@ -152,6 +152,13 @@ public:
           valueStr.erase(0, valueStr.find_first_not_of(" \t"));
           valueStr.erase(valueStr.find_last_not_of(" \t") + 1);
 
+          /* Strip the quotes from a quoted string. */
+          if (valueStr.size() >= 2 &&
+              (valueStr.front() == '"' || valueStr.front() == '\'') &&
+              valueStr.back() == valueStr.front()) {
+            valueStr = valueStr.substr(1, valueStr.size() - 2);
+          }
+
           /* Convert the value string to a variant containing the correct
            * data type. */
           Param value = stringToVariant(valueStr);
@@ -0,0 +1,288 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality of the pipeline running the reading
+ * and writing of snapshots alongside the halo finding.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <stdexcept>
+
+/* Local includes. */
+#include "checkpoint.h"
+#include "logging.h"
+#include "pipeline.h"
+#include "profiler.h"
+
+/** @brief The constructor for the Pipeline, starting the reader and writer.
+ *
+ * If restarting, the last generation written is restored first.
+ *
+ * @param engine_ The engine.
+ */
+Pipeline::Pipeline(Engine *engine_)
+    : engine(engine_), first_snap(0), restored(nullptr), retiring(true) {
+  if (engine->output_compression > 0) {
+    compressor = std::make_unique<ThreadPool>(engine->write_threads);
+  }
+  if (engine->output_graph_format) {
+    graph = std::make_unique<GraphBuilder>(engine);
+    graph->compressor = compressor.get();
+  }
+
+  /* Pick up from the checkpoint if restarting. */
+  if (engine->restart) {
+    slots.emplace_back();
+    restored = &slots.back();
+    read_checkpoint(engine, *restored, graph.get());
+    footprint[restored] = restored->nbytes();
+    first_snap = restored->snap + 1;
+  }
+  reader = std::thread(&Pipeline::readSnapshots, this);
+  writer = std::thread(&Pipeline::writeSnapshots, this);
+}
+
+/** @brief The destructor for the Pipeline.
+ *
+ * If the pipeline wasn't finished (e.g. the halo finding threw) the reader
+ * and writer are stopped without finishing their work.
+ */
+Pipeline::~Pipeline() {
+  if (reader.joinable() || writer.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!failure) {
+        failure = std::make_exception_ptr(
+            std::runtime_error("The pipeline was abandoned"));
+      }
+    }
+    changed.notify_all();
+    stop();
+  }
+}
+
+/** @brief Get the next snapshot for the halo finding, waiting if it's still
+ * being read.
+ *
+ * @return The next generation (in snapshot order).
+ */
+Generation *Pipeline::next() {
+  ProfileScope profile("Waiting for a snapshot");
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this] { return failure || !read_slots.empty(); });
+  if (failure) {
+    std::rethrow_exception(failure);
+  }
+  Generation *gen = read_slots.front();
+  read_slots.pop_front();
+  return gen;
+}
+
+/** @brief Hand a generation the halo finding is done with to the writer.
+ *
+ * A generation is only done with once the next snapshot has been linked to
+ * it (so its descendants are known).
+ *
+ * @param gen The generation.
+ */
+void Pipeline::retire(Generation *gen) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    write_slots.push_back(gen);
+  }
+  changed.notify_all();
+}
+
+/** @brief Wait for the reader and writer to finish, then write the graph.
+ *
+ * Rethrows the first error raised by either of them.
+ */
+void Pipeline::finish() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    retiring = false;
+  }
+  changed.notify_all();
+  stop();
+  if (failure) {
+    std::rethrow_exception(failure);
+  }
+  if (graph) {
+    graph->finish();
+  }
+}
+
+/** @brief Can another slot be made?
+ *
+ * Called with the lock held.
+ */
+bool Pipeline::canGrow() const {
+
+  if (slots.size() < pipeline_min_slots) {
+    return true;
+  }
+  if (slots.size() >= static_cast<size_t>(engine->max_generations)) {
+    return false;
+  }
+  if (engine->generation_memory_gb <= 0) {
+    return true;
+  }
+
+  /* Assume a new slot will need as much as the largest so far. */
+  size_t used = 0, largest = 0;
+  for (const auto &pair : footprint) {
+    used += pair.second;
+    largest = std::max(largest, pair.second);
+  }
+  return used + largest <= engine->generation_memory_gb * (1ull << 30);
+}
+
+/** @brief Get a slot to read into, waiting until one is free (or can be
+ * made).
+ *
+ * @param guard The held lock.
+ *
+ * @return The slot (or nullptr if the pipeline has failed).
+ */
+Generation *Pipeline::acquire(std::unique_lock<std::mutex> &guard) {
+  changed.wait(guard,
+               [this] { return failure || !free_slots.empty() || canGrow(); });
+  if (failure) {
+    return nullptr;
+  }
+  if (!free_slots.empty()) {
+    Generation *gen = free_slots.front();
+    free_slots.pop_front();
+    return gen;
+  }
+  slots.emplace_back();
+  footprint[&slots.back()] = 0;
+  v_message("Made generation slot %zu", slots.size());
+  return &slots.back();
+}
+
+/** @brief The reader, reading every snapshot in order into free slots.
+ */
+void Pipeline::readSnapshots() {
+  profiler_name_thread("reader");
+  try {
+    for (int snap = first_snap; snap < engine->n_generations; snap++) {
+      Generation *gen;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        gen = acquire(guard);
+        if (gen == nullptr) {
+          return;
+        }
+      }
+
+      /* Out of core the halo finding reads the snapshot a slab at a time,
+       * there's nothing to read ahead. */
+      if (engine->out_of_core) {
+        gen->reset();
+        gen->snap = snap;
+      } else {
+        gen->read(engine, snap);
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        footprint[gen] = gen->nbytes();
+        read_slots.push_back(gen);
+      }
+      changed.notify_all();
+    }
+  } catch (...) {
+    fail(std::current_exception());
+  }
+}
+
+/** @brief The writer, writing the retired slots in order and freeing them.
+ */
+void Pipeline::writeSnapshots() {
+  profiler_name_thread("writer");
+  try {
+    while (true) {
+      Generation *gen;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this] {
+          return failure || !write_slots.empty() || !retiring;
+        });
+        if (failure || write_slots.empty()) {
+          return;
+        }
+        gen = write_slots.front();
+        write_slots.pop_front();
+      }
+
+      /* A restored generation was written before the restart. */
+      if (!gen->written) {
+        if (engine->output_catalogs) {
+          gen->write(engine, engine->outputPath(gen->snap),
+                     compressor.get());
+        }
+        if (engine->output_binary) {
+          gen->writeBinary(engine, engine->binaryPath(gen->snap));
+        }
+        if (graph) {
+          graph->addGeneration(*gen);
+        }
+        gen->written = true;
+        if (engine->write_checkpoints) {
+          write_checkpoint(engine, *gen, graph.get());
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        footprint[gen] = gen->nbytes();
+        gen->reset();
+        free_slots.push_back(gen);
+      }
+      changed.notify_all();
+    }
+  } catch (...) {
+    fail(std::current_exception());
+  }
+}
+
+/** @brief Record a stage's error, stopping the others.
+ *
+ * @param err The error.
+ */
+void Pipeline::fail(std::exception_ptr err) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!failure) {
+      failure = err;
+    }
+  }
+  changed.notify_all();
+}
+
+/** @brief Join the reader and writer.
+ */
+void Pipeline::stop() {
+  if (reader.joinable()) {
+    reader.join();
+  }
+  if (writer.joinable()) {
+    writer.join();
+  }
+}
@@ -0,0 +1,152 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definition of the pipeline running the
+ * reading and writing of snapshots alongside the halo finding.
+ ******************************************************************************/
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+/* Includes */
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+/* Local includes. */
+#include "engine.h"
+#include "generation.h"
+#include "graph.h"
+#include "threadpool.h"
+
+/* The fewest generations a pipeline can run with (the current and previous
+ * snapshots). */
+#define pipeline_min_slots 2
+
+/**
+ * @class Pipeline
+ * @brief Runs the reading and writing of snapshots alongside halo finding.
+ *
+ * Each snapshot is read, has its halos found and linked to the previous
+ * snapshot, and is written out once the next snapshot has been linked to it.
+ * The pipeline runs the three stages together: while the halos of snapshot N
+ * are found (on the threadpool) a reader thread reads snapshot N + 1 and a
+ * writer thread writes snapshot N - 1 once N has been linked to it. Reading
+ * ahead takes a third slot, snapshot N - 1 being held until then.
+ *
+ * The stages hand Generation slots between them. The reader takes a free
+ * slot and fills it, the halo finding takes the filled slots in order and
+ * retires them once they are linked, and the writer writes the retired slots
+ * and frees them again. A slot is only made when there isn't a free one, and
+ * never more than Engine::max_generations of them (the current and previous
+ * snapshots, plus Pipeline/prefetch_depth, 1 by default), or more than fit in
+ * Engine::generation_memory_gb (judged by the largest slot so far). So the
+ * reader can only get as far ahead of the halo finding, and the writer as far
+ * behind, as the memory allows. Once made a slot is reused until the end.
+ *
+ * If graph output is on, the writer also streams each generation into the
+ * GraphBuilder, and the graph file is written when the pipeline finishes.
+ *
+ * Compressed outputs (the catalogues and the graph) are compressed on a pool
+ * of Engine::write_threads threads, made once with the pipeline and used for
+ * every file written.
+ *
+ * The writer also writes a checkpoint after each generation it writes. When
+ * restarting, the last generation written is restored from the checkpoint
+ * (ready for the next snapshot to be linked to it) and reading starts from the
+ * snapshot after it.
+ *
+ * If any stage fails the others stop and the error is rethrown by the halo
+ * finding's next call to next() (or finish()).
+ *
+ * @param engine The engine.
+ * @param slots The generations.
+ * @param footprint The memory used by each slot when last handed over.
+ * @param free_slots The slots waiting to be read into.
+ * @param read_slots The read slots, waiting for the halo finding.
+ * @param write_slots The retired slots, waiting to be written.
+ * @param graph The merger graph being built (if outputting graphs).
+ * @param compressor The threads compressing the outputs (if compressing).
+ * @param first_snap The first snapshot to read.
+ * @param restored The generation restored from the checkpoint.
+ * @param retiring Will more slots be retired?
+ * @param failure The first error raised by any stage.
+ */
+class Pipeline {
+public:
+  /* The engine. */
+  Engine *engine;
+
+  /* The generations (a deque so making a slot never moves the others). */
+  std::deque<Generation> slots;
+
+  /* The memory used by each slot when last handed over. */
+  std::unordered_map<const Generation *, size_t> footprint;
+
+  /* The slots waiting at each stage. */
+  std::deque<Generation *> free_slots;
+  std::deque<Generation *> read_slots;
+  std::deque<Generation *> write_slots;
+
+  /* The merger graph being built (if outputting graphs). */
+  std::unique_ptr<GraphBuilder> graph;
+
+  /* The threads compressing the outputs (nullptr if not compressing). */
+  std::unique_ptr<ThreadPool> compressor;
+
+  /* The first snapshot to read (after the checkpoint if restarting). */
+  int first_snap;
+
+  /* The generation restored from the checkpoint (nullptr if not
+   * restarting). */
+  Generation *restored;
+
+  /* Will more slots be retired? */
+  bool retiring;
+
+  /* The first error raised by any stage. */
+  std::exception_ptr failure;
+
+  Pipeline(Engine *engine);
+  ~Pipeline();
+
+  Generation *next();
+  void retire(Generation *gen);
+  void finish();
+
+private:
+  /* Guards everything above, waited on for any change. */
+  std::mutex lock;
+  std::condition_variable changed;
+
+  /* The reader and writer threads. */
+  std::thread reader;
+  std::thread writer;
+
+  Generation *acquire(std::unique_lock<std::mutex> &guard);
+  bool canGrow() const;
+  void readSnapshots();
+  void writeSnapshots();
+  void fail(std::exception_ptr err);
+  void stop();
+};
+
+#endif // PIPELINE_H_
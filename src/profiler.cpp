@@ -0,0 +1,267 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for profiling the CPU time spent in
+ * each stage of the run.
+ *
+ * Each thread's call tree is made the first time it opens a scope and lives
+ * until the end of the run (in a registry, so the profile can be written from
+ * any thread). A profile is a table for each thread, the scopes indented
+ * under the scope they were opened in.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/* Local includes. */
+#include "logging.h"
+#include "profiler.h"
+
+/**
+ * @brief The times a scope was run.
+ *
+ * @param count The number of times it was run.
+ * @param total, min, max The total, shortest and longest time (seconds).
+ */
+struct ProfileStats {
+  size_t count = 0;
+  double total = 0;
+  double min = 0;
+  double max = 0;
+
+  void add(double seconds) {
+    min = count == 0 ? seconds : std::min(min, seconds);
+    max = count == 0 ? seconds : std::max(max, seconds);
+    total += seconds;
+    count++;
+  }
+};
+
+/**
+ * @brief A scope in a thread's call tree.
+ *
+ * @param name The scope's name.
+ * @param parent The scope it was opened within (-1 for the root).
+ * @param children The scopes opened within it.
+ * @param recent The times since the profile was last written.
+ * @param run The times over the whole run.
+ */
+struct ProfileNode {
+  std::string name;
+  int parent;
+  std::vector<int> children;
+  ProfileStats recent;
+  ProfileStats run;
+};
+
+/**
+ * @brief A thread's call tree (the root, node 0, is the thread itself).
+ *
+ * @param thread The thread's name.
+ * @param lock Guards the nodes from the profile being written.
+ * @param nodes The scopes.
+ * @param current The scope the thread is in.
+ */
+struct ProfileTree {
+  std::string thread;
+  std::mutex lock;
+  std::vector<ProfileNode> nodes;
+  int current;
+};
+
+/* Is CPU profiling on? */
+static std::atomic<bool> profiling(false);
+
+/* Every thread's call tree, in the order the threads first opened a scope. */
+static std::mutex registry_lock;
+static std::vector<std::unique_ptr<ProfileTree>> registry;
+
+/* The calling thread's call tree. */
+static thread_local ProfileTree *local_tree = nullptr;
+
+/** @brief Get the calling thread's call tree, making it if it's new.
+ */
+static ProfileTree &thread_tree() {
+  if (local_tree == nullptr) {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    registry.push_back(std::make_unique<ProfileTree>());
+    local_tree = registry.back().get();
+    local_tree->thread = "thread " + std::to_string(registry.size() - 1);
+    local_tree->nodes.push_back({"", -1, {}, {}, {}});
+    local_tree->current = 0;
+  }
+  return *local_tree;
+}
+
+/** @brief Open a scope, as a child of the scope the thread is in.
+ *
+ * @param name The scope's name.
+ */
+ProfileScope::ProfileScope(const char *name) : node(-1) {
+  if (!profiling.load(std::memory_order_relaxed)) {
+    return;
+  }
+  ProfileTree &tree = thread_tree();
+  std::lock_guard<std::mutex> guard(tree.lock);
+  for (int child : tree.nodes[tree.current].children) {
+    if (tree.nodes[child].name == name) {
+      node = child;
+      break;
+    }
+  }
+  if (node < 0) {
+    node = static_cast<int>(tree.nodes.size());
+    tree.nodes.push_back({name, tree.current, {}, {}, {}});
+    tree.nodes[tree.current].children.push_back(node);
+  }
+  tree.current = node;
+  start = std::chrono::steady_clock::now();
+}
+
+/** @brief Close the scope, adding its time to its node.
+ */
+ProfileScope::~ProfileScope() {
+  if (node < 0) {
+    return;
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  ProfileTree &tree = *local_tree;
+  std::lock_guard<std::mutex> guard(tree.lock);
+  tree.nodes[node].recent.add(seconds);
+  tree.nodes[node].run.add(seconds);
+  tree.current = tree.nodes[node].parent;
+}
+
+/** @brief Turn CPU profiling on or off.
+ *
+ * @param enabled Should scopes be timed?
+ */
+void profiler_enable(bool enabled) { profiling.store(enabled); }
+
+/** @brief Name the calling thread in the profile.
+ *
+ * @param name The thread's name.
+ */
+void profiler_name_thread(const std::string &name) {
+  ProfileTree &tree = thread_tree();
+  std::lock_guard<std::mutex> guard(tree.lock);
+  tree.thread = name;
+}
+
+/** @brief Was a scope (or any scope within it) run?
+ *
+ * @param tree The call tree.
+ * @param node The scope.
+ * @param whole_run Over the whole run (or since the profile was last
+ *                  written)?
+ */
+static bool was_run(const ProfileTree &tree, int node, bool whole_run) {
+  const ProfileNode &n = tree.nodes[node];
+  if ((whole_run ? n.run : n.recent).count > 0) {
+    return true;
+  }
+  for (int child : n.children) {
+    if (was_run(tree, child, whole_run)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** @brief Write a scope, and the scopes within it, as rows of the table.
+ *
+ * @param out The profile.
+ * @param tree The call tree.
+ * @param node The scope.
+ * @param indent The indent of its name.
+ * @param whole_run Over the whole run (or since the profile was last
+ *                  written)?
+ */
+static void write_rows(std::ofstream &out, const ProfileTree &tree, int node,
+                       int indent, bool whole_run) {
+  const ProfileNode &n = tree.nodes[node];
+  const ProfileStats &stats = whole_run ? n.run : n.recent;
+  std::string name = std::string(indent, ' ') + n.name;
+  char row[256];
+  snprintf(row, sizeof(row), "%-40s %10zu %12.3f %12.3f %12.3f %12.3f\n",
+           name.c_str(), stats.count, stats.total * 1e3,
+           stats.count > 0 ? stats.total / stats.count * 1e3 : 0.0,
+           stats.min * 1e3, stats.max * 1e3);
+  out << row;
+  for (int child : n.children) {
+    if (was_run(tree, child, whole_run)) {
+      write_rows(out, tree, child, indent + 2, whole_run);
+    }
+  }
+}
+
+/** @brief Write the profile, a table of every thread's scopes.
+ *
+ * The profile is either of the scopes finished since it was last written,
+ * which are then cleared (so one is written per snapshot), or of the whole
+ * run. Scopes still open when it's written count towards the next.
+ *
+ * @param filename The file to write to (its directory is made if needed).
+ * @param title The profile's title.
+ * @param whole_run Write the whole run (or since it was last written)?
+ */
+void profiler_write(const std::string &filename, const std::string &title,
+                    bool whole_run) {
+
+  std::filesystem::path path(filename);
+  if (path.has_parent_path()) {
+    std::filesystem::create_directories(path.parent_path());
+  }
+  std::ofstream out(filename, std::ios::trunc);
+  if (!out) {
+    error("Failed to open the profile %s!", filename.c_str());
+  }
+
+  char header[256];
+  snprintf(header, sizeof(header), "%-40s %10s %12s %12s %12s %12s\n",
+           "# Scope", "Calls", "Total [ms]", "Mean [ms]", "Min [ms]",
+           "Max [ms]");
+  out << "# " << title << "\n";
+
+  std::lock_guard<std::mutex> registry_guard(registry_lock);
+  for (const std::unique_ptr<ProfileTree> &tree : registry) {
+    std::lock_guard<std::mutex> guard(tree->lock);
+    if (!was_run(*tree, 0, whole_run)) {
+      continue;
+    }
+    out << "#\n# Thread: " << tree->thread << "\n" << header;
+    for (int child : tree->nodes[0].children) {
+      if (was_run(*tree, child, whole_run)) {
+        write_rows(out, *tree, child, 0, whole_run);
+      }
+    }
+    if (!whole_run) {
+      for (ProfileNode &node : tree->nodes) {
+        node.recent = ProfileStats();
+      }
+    }
+  }
+}
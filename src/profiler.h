@@ -0,0 +1,68 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definitions for profiling the CPU time
+ * spent in each stage of the run (Profiling/cpu_profiling).
+ ******************************************************************************/
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+/* Includes */
+#include <chrono>
+#include <string>
+
+/**
+ * @class ProfileScope
+ * @brief Times a scope as a node in the call tree of the thread it's on.
+ *
+ * Every thread has its own tree of the scopes it has been in, each scope a
+ * child of the scope it was opened within, so the same stage reached from two
+ * places is timed twice over rather than lumped together. Each node counts
+ * the times its scope was run and their total, shortest and longest, both
+ * since the profile was last written and over the whole run.
+ *
+ * Scopes are meant for stages (reading, finding, linking, writing...) not
+ * inner loops: opening one takes a lock only its own thread (or the
+ * profile being written) ever takes. Nothing is timed unless CPU profiling is
+ * on.
+ *
+ * @param node The scope's node in its thread's tree (-1 if not profiling).
+ * @param start When the scope was opened.
+ */
+class ProfileScope {
+public:
+  /* The scope's node in its thread's tree (-1 if not profiling). */
+  int node;
+
+  /* When the scope was opened. */
+  std::chrono::steady_clock::time_point start;
+
+  explicit ProfileScope(const char *name);
+  ~ProfileScope();
+
+  /* A scope is tied to where it was opened. */
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+};
+
+/* Prototypes */
+void profiler_enable(bool enabled);
+void profiler_name_thread(const std::string &name);
+void profiler_write(const std::string &filename, const std::string &title,
+                    bool whole_run);
+
+#endif // PROFILER_H_
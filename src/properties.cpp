@@ -0,0 +1,853 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for calculating halo properties.
+ *
+ * Properties are derived from a single fused pass over each halo's particles
+ * accumulating the mass weighted moments, followed by a pass over the
+ * gathered (contiguous) particle data for the radial profile.
+ *
+ * Every kernel is templated on the mask of properties being calculated (see
+ * property_registry.h). The mask is resolved once per call to
+ * calculate_halo_properties, after which anything not requested (including
+ * the loads feeding it) is compiled out.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <mutex>
+#include <utility>
+
+/* Local includes. */
+#include "constants.h"
+#include "logging.h"
+#include "particles.h"
+#include "profiler.h"
+#include "properties.h"
+
+/**
+ * @brief What a set of properties needs from the particles.
+ */
+template <unsigned props> struct PropertyNeeds {
+
+  /* Positions (anything involving the centre of mass). */
+  static constexpr bool pos = props & prop_com;
+
+  /* Velocities. */
+  static constexpr bool vel = props & prop_vel;
+
+  /* Squared speeds. */
+  static constexpr bool vel2 = props & prop_vel_disp;
+
+  /* Angular momenta. */
+  static constexpr bool angmom = props & prop_spin;
+
+  /* Radii about the centre of mass. */
+  static constexpr bool shells = props & (prop_spin | prop_r_half | prop_vmax);
+
+  /* The radial mass profile. */
+  static constexpr bool profile = props & (prop_r_half | prop_vmax);
+};
+
+/** @brief Add another set of moments to these.
+ *
+ * @param other The moments to add.
+ */
+void HaloMoments::add(const HaloMoments &other) {
+  mass += other.mass;
+  mv2 += other.mv2;
+  for (int k = 0; k < 3; k++) {
+    mx[k] += other.mx[k];
+    mv[k] += other.mv[k];
+    mrxv[k] += other.mrxv[k];
+  }
+}
+
+/** @brief Make sure there is room for n particles in the scratch arrays.
+ *
+ * @param n The number of particles.
+ * @param with_pos Do we need the positions?
+ * @param with_vel Do we need the velocities?
+ * @param with_shells Do we need the shells?
+ */
+void PropertyScratch::resize(size_t n, bool with_pos, bool with_vel,
+                             bool with_shells) {
+  if (m.size() < n) {
+    m.resize(n);
+  }
+  if (with_pos && x.size() < n) {
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+  }
+  if (with_vel && vx.size() < n) {
+    vx.resize(n);
+    vy.resize(n);
+    vz.resize(n);
+  }
+  if (with_shells && shells.size() < n) {
+    shells.resize(n);
+  }
+}
+
+/** @brief Gather a halo's particles into the scratch arrays.
+ *
+ * Positions are stored relative to the halo's first particle, wrapped to the
+ * nearest periodic image, so halos straddling the box edge stay contiguous.
+ *
+ * @param domain The domain containing the particles.
+ * @param part_inds The indices of the halo's particles.
+ * @param scratch The scratch arrays (already sized for the halo).
+ * @param start The first particle (within the halo) to gather.
+ * @param end One past the last particle to gather.
+ */
+template <unsigned props>
+static void gather_halo_particles(Domain *domain, const size_t *part_inds,
+                                  PropertyScratch &scratch, size_t start,
+                                  size_t end) {
+
+  using needs = PropertyNeeds<props>;
+
+  const DMParticle *parts = domain->dark_matter;
+  const double *ref = parts[part_inds[0]].pos;
+
+  double box[3], ibox[3];
+  for (int k = 0; k < 3; k++) {
+    box[k] = domain->periodic ? domain->boxsize[k] : 0;
+    ibox[k] = domain->periodic ? 1.0 / domain->boxsize[k] : 0;
+  }
+
+  for (size_t i = start; i < end; i++) {
+    const DMParticle &p = parts[part_inds[i]];
+    if constexpr (needs::pos) {
+      double dx = p.pos[0] - ref[0];
+      double dy = p.pos[1] - ref[1];
+      double dz = p.pos[2] - ref[2];
+      scratch.x[i] = dx - box[0] * std::nearbyint(dx * ibox[0]);
+      scratch.y[i] = dy - box[1] * std::nearbyint(dy * ibox[1]);
+      scratch.z[i] = dz - box[2] * std::nearbyint(dz * ibox[2]);
+    }
+    if constexpr (needs::vel) {
+      scratch.vx[i] = p.vel[0];
+      scratch.vy[i] = p.vel[1];
+      scratch.vz[i] = p.vel[2];
+    }
+    scratch.m[i] = p.mass;
+  }
+}
+
+/** @brief Accumulate the moments of a single particle into a lane.
+ */
+template <unsigned props>
+static inline void accumulate_particle(const PropertyScratch &scratch,
+                                       size_t i, int l, double *l_m,
+                                       double (*l_mx)[prop_simd_width],
+                                       double (*l_mv)[prop_simd_width],
+                                       double *l_mv2,
+                                       double (*l_j)[prop_simd_width]) {
+
+  using needs = PropertyNeeds<props>;
+
+  double mi = scratch.m[i];
+  l_m[l] += mi;
+  if constexpr (needs::pos) {
+    l_mx[0][l] += mi * scratch.x[i];
+    l_mx[1][l] += mi * scratch.y[i];
+    l_mx[2][l] += mi * scratch.z[i];
+  }
+  if constexpr (needs::vel) {
+    l_mv[0][l] += mi * scratch.vx[i];
+    l_mv[1][l] += mi * scratch.vy[i];
+    l_mv[2][l] += mi * scratch.vz[i];
+  }
+  if constexpr (needs::vel2) {
+    l_mv2[l] += mi * (scratch.vx[i] * scratch.vx[i] +
+                      scratch.vy[i] * scratch.vy[i] +
+                      scratch.vz[i] * scratch.vz[i]);
+  }
+  if constexpr (needs::angmom) {
+    l_j[0][l] +=
+        mi * (scratch.y[i] * scratch.vz[i] - scratch.z[i] * scratch.vy[i]);
+    l_j[1][l] +=
+        mi * (scratch.z[i] * scratch.vx[i] - scratch.x[i] * scratch.vz[i]);
+    l_j[2][l] +=
+        mi * (scratch.x[i] * scratch.vy[i] - scratch.y[i] * scratch.vx[i]);
+  }
+}
+
+/** @brief Accumulate the mass weighted moments over gathered particles.
+ *
+ * The sums are split over prop_simd_width independent lanes so the loop
+ * vectorises without changing the order of any individual sum.
+ *
+ * @param scratch The gathered particles.
+ * @param start The first particle to include.
+ * @param end One past the last particle to include.
+ * @param moments The moments to add to.
+ */
+template <unsigned props>
+static void accumulate_moments(const PropertyScratch &scratch, size_t start,
+                               size_t end, HaloMoments &moments) {
+
+  /* The lanes. */
+  double l_m[prop_simd_width] = {0};
+  double l_mx[3][prop_simd_width] = {{0}};
+  double l_mv[3][prop_simd_width] = {{0}};
+  double l_mv2[prop_simd_width] = {0};
+  double l_j[3][prop_simd_width] = {{0}};
+
+  /* Handle the leftovers first so the main loop has whole blocks. */
+  size_t n = end - start;
+  size_t block_start = start + n % prop_simd_width;
+  for (size_t i = start; i < block_start; i++) {
+    accumulate_particle<props>(scratch, i, 0, l_m, l_mx, l_mv, l_mv2, l_j);
+  }
+  for (size_t b = block_start; b < end; b += prop_simd_width) {
+    for (int l = 0; l < prop_simd_width; l++) {
+      accumulate_particle<props>(scratch, b + l, l, l_m, l_mx, l_mv, l_mv2,
+                                 l_j);
+    }
+  }
+
+  /* Reduce the lanes. */
+  for (int l = 0; l < prop_simd_width; l++) {
+    moments.mass += l_m[l];
+    moments.mv2 += l_mv2[l];
+    for (int k = 0; k < 3; k++) {
+      moments.mx[k] += l_mx[k][l];
+      moments.mv[k] += l_mv[k][l];
+      moments.mrxv[k] += l_j[k][l];
+    }
+  }
+}
+
+/** @brief Compute the squared radius of each particle about the centre.
+ *
+ * @param scratch The gathered particles, the shells are written here.
+ * @param com The centre of mass (relative to the reference particle).
+ * @param start The first particle to include.
+ * @param end One past the last particle to include.
+ *
+ * @return The largest squared radius.
+ */
+static double accumulate_shells(PropertyScratch &scratch, const double *com,
+                                size_t start, size_t end) {
+
+  double l_max[prop_simd_width] = {0};
+
+  for (size_t i = start; i < end; i++) {
+    double dx = scratch.x[i] - com[0];
+    double dy = scratch.y[i] - com[1];
+    double dz = scratch.z[i] - com[2];
+    double r2 = dx * dx + dy * dy + dz * dz;
+    scratch.shells[i] = {r2, scratch.m[i]};
+    l_max[i % prop_simd_width] = std::max(l_max[i % prop_simd_width], r2);
+  }
+
+  return *std::max_element(l_max, l_max + prop_simd_width);
+}
+
+/** @brief Partition the shells so every segment boundary is in place.
+ *
+ * After this every shell in a segment is further out than every shell in
+ * the segments before it, but segments themselves are unsorted. This costs
+ * O(n log nseg) rather than the O(n log n) of a full sort.
+ */
+static void partition_segments(std::pair<double, double> *shells,
+                               const size_t *bounds, int klo, int khi) {
+  if (khi - klo <= 1) {
+    return;
+  }
+  int kmid = (klo + khi) / 2;
+  std::nth_element(shells + bounds[klo], shells + bounds[kmid],
+                   shells + bounds[khi]);
+  partition_segments(shells, bounds, klo, kmid);
+  partition_segments(shells, bounds, kmid, khi);
+}
+
+/** @brief Derive the half mass radius and Vmax from the radial mass profile.
+ *
+ * The shells are partitioned into prop_profile_nseg segments with
+ * nth_element, giving the exact enclosed mass at each segment boundary. Only
+ * the segment containing the half mass radius is sorted. For Vmax, the
+ * circular velocity at the outermost particle of each segment is a value the
+ * profile actually reaches, while G M(<r_out) / r_in bounds it from above
+ * within the segment. Only segments whose bound beats the best value found
+ * are sorted and walked.
+ *
+ * @param shells The (squared radius, mass) of each particle (reordered).
+ * @param n The number of particles.
+ * @param mass The total mass.
+ * @param catalog The catalogue to store r_half, vmax and rmax in.
+ * @param ihalo The halo's index in the catalogue.
+ */
+template <unsigned props>
+static void mass_profile(std::pair<double, double> *shells, size_t n,
+                         double mass, HaloCatalog *catalog, size_t ihalo) {
+
+  if (n == 0) {
+    return;
+  }
+
+  /* Define the segments, small halos are just one segment. */
+  int nseg = n > 4 * prop_profile_nseg ? prop_profile_nseg : 1;
+  std::vector<size_t> bounds(nseg + 1);
+  for (int s = 0; s <= nseg; s++) {
+    bounds[s] = (n * s) / nseg;
+  }
+  partition_segments(shells, bounds.data(), 0, nseg);
+
+  /* Get the mass within, and the inner and outer radii of, each segment. */
+  std::vector<double> cum_mass(nseg + 1, 0);
+  std::vector<double> r2_in(nseg), r2_out(nseg);
+  for (int s = 0; s < nseg; s++) {
+    double seg_mass = 0;
+    double r2_lo = shells[bounds[s]].first;
+    double r2_hi = r2_lo;
+    for (size_t i = bounds[s]; i < bounds[s + 1]; i++) {
+      seg_mass += shells[i].second;
+      r2_lo = std::min(r2_lo, shells[i].first);
+      r2_hi = std::max(r2_hi, shells[i].first);
+    }
+    cum_mass[s + 1] = cum_mass[s] + seg_mass;
+    r2_in[s] = r2_lo;
+    r2_out[s] = r2_hi;
+  }
+
+  std::vector<bool> sorted(nseg, false);
+  auto sort_segment = [&](int s) {
+    if (!sorted[s]) {
+      std::sort(shells + bounds[s], shells + bounds[s + 1]);
+      sorted[s] = true;
+    }
+  };
+
+  /* Find the half mass radius. */
+  if constexpr (static_cast<bool>(props & prop_r_half)) {
+    double half_mass = 0.5 * mass;
+    for (int s = 0; s < nseg; s++) {
+      if (cum_mass[s + 1] < half_mass) {
+        continue;
+      }
+      sort_segment(s);
+
+      /* Summed in a different order, the walk can fall just short of the
+       * segment's mass, so it stops at the segment's last particle. */
+      size_t i = bounds[s];
+      double enclosed = cum_mass[s] + shells[i].second;
+      while (enclosed < half_mass && i + 1 < bounds[s + 1]) {
+        enclosed += shells[++i].second;
+      }
+      catalog->r_half[ihalo] = std::sqrt(shells[i].first);
+      break;
+    }
+  }
+
+  if constexpr (static_cast<bool>(props & prop_vmax)) {
+
+    /* Get a lower bound on Vmax^2 from the segment edges. */
+    double best_v2 = 0;
+    double best_r2 = 0;
+    for (int s = 0; s < nseg; s++) {
+      if (r2_out[s] > 0) {
+        double v2 = grav_const * cum_mass[s + 1] / std::sqrt(r2_out[s]);
+        if (v2 > best_v2) {
+          best_v2 = v2;
+          best_r2 = r2_out[s];
+        }
+      }
+    }
+
+    /* Walk any segment that could beat it. */
+    for (int s = 0; s < nseg; s++) {
+      double upper = r2_in[s] > 0
+                         ? grav_const * cum_mass[s + 1] / std::sqrt(r2_in[s])
+                         : HUGE_VAL;
+      if (upper <= best_v2) {
+        continue;
+      }
+      sort_segment(s);
+      double enclosed = cum_mass[s];
+      for (size_t i = bounds[s]; i < bounds[s + 1]; i++) {
+        enclosed += shells[i].second;
+        if (shells[i].first > 0) {
+          double v2 = grav_const * enclosed / std::sqrt(shells[i].first);
+          if (v2 > best_v2) {
+            best_v2 = v2;
+            best_r2 = shells[i].first;
+          }
+        }
+      }
+    }
+
+    catalog->vmax[ihalo] = std::sqrt(best_v2);
+    catalog->rmax[ihalo] = std::sqrt(best_r2);
+  }
+}
+
+/** @brief Turn a halo's moments and shells into its properties.
+ *
+ * @param domain The domain.
+ * @param catalog The catalogue.
+ * @param ihalo The halo's index in the catalogue.
+ * @param moments The halo's moments.
+ * @param scratch The gathered particles with their shells computed.
+ * @param com The centre of mass relative to the reference particle.
+ * @param r2_outer The largest squared radius.
+ */
+template <unsigned props>
+static void finish_halo_properties(Domain *domain, HaloCatalog *catalog,
+                                   size_t ihalo, const HaloMoments &moments,
+                                   PropertyScratch &scratch, const double *com,
+                                   double r2_outer) {
+
+  using needs = PropertyNeeds<props>;
+
+  double mass = moments.mass;
+  catalog->mass[ihalo] = mass;
+
+  /* Centre of mass (back in the box). */
+  if constexpr (needs::pos) {
+    const double *ref = domain->dark_matter[catalog->parts(ihalo)[0]].pos;
+    for (int k = 0; k < 3; k++) {
+      double xk = ref[k] + com[k];
+      if (domain->periodic) {
+        xk -= domain->boxsize[k] * std::floor(xk / domain->boxsize[k]);
+      }
+      catalog->x[3 * ihalo + k] = xk;
+    }
+  }
+
+  /* Bulk velocity. */
+  double v[3] = {0, 0, 0};
+  double v2_bulk = 0;
+  if constexpr (needs::vel) {
+    for (int k = 0; k < 3; k++) {
+      v[k] = moments.mv[k] / mass;
+      v2_bulk += v[k] * v[k];
+      catalog->v[3 * ihalo + k] = v[k];
+    }
+  }
+
+  /* Velocity dispersion about the bulk velocity. */
+  if constexpr (needs::vel2) {
+    catalog->vel_disp[ihalo] =
+        std::sqrt(std::max(moments.mv2 / mass - v2_bulk, 0.0));
+  }
+
+  /* Angular momentum about the centre of mass in the bulk frame,
+   * J = sum(m r x v) - M (R x V), and from it the Bullock spin,
+   * lambda = J / (sqrt(2) M V R) with V^2 = G M / R. */
+  if constexpr (needs::angmom) {
+    double j[3];
+    j[0] = moments.mrxv[0] - mass * (com[1] * v[2] - com[2] * v[1]);
+    j[1] = moments.mrxv[1] - mass * (com[2] * v[0] - com[0] * v[2]);
+    j[2] = moments.mrxv[2] - mass * (com[0] * v[1] - com[1] * v[0]);
+    double jmag = std::sqrt(j[0] * j[0] + j[1] * j[1] + j[2] * j[2]);
+
+    double r_outer = std::sqrt(r2_outer);
+    catalog->spin[ihalo] =
+        r_outer > 0
+            ? jmag / (mass * std::sqrt(2.0 * grav_const * mass * r_outer))
+            : 0;
+  }
+
+  /* The radial profile. */
+  if constexpr (needs::profile) {
+    mass_profile<props>(scratch.shells.data(), catalog->npart[ihalo], mass,
+                        catalog, ihalo);
+  }
+}
+
+/** @brief Size a scratch for a halo, allocating only what props needs.
+ */
+template <unsigned props>
+static void resize_scratch(PropertyScratch &scratch, size_t npart) {
+  using needs = PropertyNeeds<props>;
+  scratch.resize(npart, needs::pos, needs::vel, needs::shells);
+}
+
+/** @brief Calculate the properties of a single halo on this thread.
+ *
+ * @param domain The domain.
+ * @param catalog The catalogue.
+ * @param ihalo The halo's index in the catalogue.
+ * @param scratch The scratch arrays to work in.
+ */
+template <unsigned props>
+static void calculate_single_halo(Domain *domain, HaloCatalog *catalog,
+                                  size_t ihalo, PropertyScratch &scratch) {
+
+  size_t npart = catalog->npart[ihalo];
+  resize_scratch<props>(scratch, npart);
+
+  /* The fused pass over the particles. */
+  HaloMoments moments;
+  gather_halo_particles<props>(domain, catalog->parts(ihalo),
+                               scratch, 0, npart);
+  accumulate_moments<props>(scratch, 0, npart, moments);
+
+  double com[3] = {0, 0, 0};
+  double r2_outer = 0;
+  if constexpr (PropertyNeeds<props>::shells) {
+    for (int k = 0; k < 3; k++) {
+      com[k] = moments.mx[k] / moments.mass;
+    }
+    r2_outer = accumulate_shells(scratch, com, 0, npart);
+  } else if constexpr (PropertyNeeds<props>::pos) {
+    for (int k = 0; k < 3; k++) {
+      com[k] = moments.mx[k] / moments.mass;
+    }
+  }
+
+  finish_halo_properties<props>(domain, catalog, ihalo, moments, scratch, com,
+                                r2_outer);
+}
+
+/**
+ * @brief The data shared by the threads working on the small halos.
+ */
+struct SmallHaloData {
+  Domain *domain;
+  HaloCatalog *catalog;
+  ThreadPool *threadpool;
+  std::vector<PropertyScratch> *scratches;
+};
+
+/** @brief Calculate the properties of a batch of small halos.
+ *
+ * @param map_data The halos' indices in the catalogue (size_t).
+ * @param num_elements The number of halos in the batch.
+ * @param extra_data The SmallHaloData.
+ */
+template <unsigned props>
+static void small_halo_mapper(void *map_data, int num_elements,
+                              void *extra_data) {
+
+  size_t *halos = static_cast<size_t *>(map_data);
+  SmallHaloData *data = static_cast<SmallHaloData *>(extra_data);
+
+  /* Each thread keeps its scratch for every batch it does. */
+  PropertyScratch &scratch =
+      (*data->scratches)[data->threadpool->getThreadId()];
+
+  for (int i = 0; i < num_elements; i++) {
+    calculate_single_halo<props>(data->domain, data->catalog, halos[i],
+                                 scratch);
+  }
+}
+
+/**
+ * @brief The data shared by the threads working on a single large halo.
+ */
+struct LargeHaloData {
+  Domain *domain;
+  const size_t *part_inds;
+  PropertyScratch *scratch;
+  HaloMoments moments;
+  double com[3];
+  double r2_outer;
+  std::mutex lock;
+};
+
+/** @brief Gather and accumulate the moments for a chunk of a large halo.
+ *
+ * @param map_data The chunk's particle indices (in the halo's part_inds).
+ * @param num_elements The number of particles in the chunk.
+ * @param extra_data The LargeHaloData.
+ */
+template <unsigned props>
+static void large_halo_moments_mapper(void *map_data, int num_elements,
+                                      void *extra_data) {
+
+  LargeHaloData *data = static_cast<LargeHaloData *>(extra_data);
+  size_t start = static_cast<size_t *>(map_data) - data->part_inds;
+  size_t end = start + num_elements;
+
+  HaloMoments moments;
+  gather_halo_particles<props>(data->domain, data->part_inds, *data->scratch,
+                               start, end);
+  accumulate_moments<props>(*data->scratch, start, end, moments);
+
+  std::lock_guard<std::mutex> lock(data->lock);
+  data->moments.add(moments);
+}
+
+/** @brief Compute the shells for a chunk of a large halo.
+ *
+ * @param map_data The chunk's particle indices (in the halo's part_inds).
+ * @param num_elements The number of particles in the chunk.
+ * @param extra_data The LargeHaloData.
+ */
+static void large_halo_shells_mapper(void *map_data, int num_elements,
+                                     void *extra_data) {
+
+  LargeHaloData *data = static_cast<LargeHaloData *>(extra_data);
+  size_t start = static_cast<size_t *>(map_data) - data->part_inds;
+
+  double r2_outer =
+      accumulate_shells(*data->scratch, data->com, start, start + num_elements);
+
+  std::lock_guard<std::mutex> lock(data->lock);
+  data->r2_outer = std::max(data->r2_outer, r2_outer);
+}
+
+/** @brief Calculate a set of properties for the small and large halos.
+ *
+ * Small halos are handed to the threads in batches, each thread working
+ * through its batches with one reusable scratch. Large halos would leave a
+ * single thread working long after the others have finished, so each of
+ * these is instead split over all the threads. The scratches only live as
+ * long as the calculation.
+ *
+ * @param engine The engine.
+ * @param catalog The catalogue.
+ * @param small_halos The halos to do in batches.
+ * @param large_halos The halos to split over the threads.
+ */
+template <unsigned props>
+static void calculate_property_set(Engine *engine, HaloCatalog &catalog,
+                                   std::vector<size_t> &small_halos,
+                                   std::vector<size_t> &large_halos) {
+
+  Domain *domain = engine->domain;
+  ThreadPool *threadpool = engine->threadpool;
+
+  /* Do the small halos in batches. */
+  std::vector<PropertyScratch> scratches(threadpool->getNumThreads());
+  SmallHaloData small_data = {domain, &catalog, threadpool, &scratches};
+  threadpool->map(small_halo_mapper<props>, small_halos.data(),
+                  small_halos.size(), sizeof(size_t), prop_batch_size,
+                  &small_data);
+  scratches = std::vector<PropertyScratch>();
+
+  /* Do the large halos one at a time over all threads. */
+  PropertyScratch scratch;
+  for (size_t ihalo : large_halos) {
+    size_t npart = catalog.npart[ihalo];
+    size_t *part_inds = catalog.parts(ihalo);
+    resize_scratch<props>(scratch, npart);
+
+    LargeHaloData data;
+    data.domain = domain;
+    data.part_inds = part_inds;
+    data.scratch = &scratch;
+    data.com[0] = data.com[1] = data.com[2] = 0;
+    data.r2_outer = 0;
+
+    threadpool->map(large_halo_moments_mapper<props>, part_inds, npart,
+                    sizeof(size_t), ThreadPool::threadpool_auto_chunk_size,
+                    &data);
+
+    if constexpr (PropertyNeeds<props>::pos) {
+      for (int k = 0; k < 3; k++) {
+        data.com[k] = data.moments.mx[k] / data.moments.mass;
+      }
+    }
+
+    if constexpr (PropertyNeeds<props>::shells) {
+      threadpool->map(large_halo_shells_mapper, part_inds, npart,
+                      sizeof(size_t), ThreadPool::threadpool_auto_chunk_size,
+                      &data);
+    }
+
+    finish_halo_properties<props>(domain, &catalog, ihalo, data.moments,
+                                  scratch, data.com, data.r2_outer);
+  }
+}
+
+/* The signature of a specialised property calculation. */
+using PropertySetFunc = void (*)(Engine *, HaloCatalog &,
+                                 std::vector<size_t> &, std::vector<size_t> &);
+
+/**
+ * @brief Get the specialisation for a mask, only instantiated for masks
+ * already closed under their dependencies (the only ones ever requested).
+ */
+template <unsigned props, bool closed = PropertyRegistry::resolve(props) ==
+                                        props>
+struct PropertySet {
+  static constexpr PropertySetFunc func = calculate_property_set<props>;
+};
+template <unsigned props> struct PropertySet<props, false> {
+  static constexpr PropertySetFunc func = nullptr;
+};
+
+/** @brief Build the table of specialisations indexed by mask.
+ */
+template <size_t... masks>
+static constexpr std::array<PropertySetFunc, sizeof...(masks)>
+make_property_table(std::index_sequence<masks...>) {
+  return {PropertySet<static_cast<unsigned>(masks)>::func...};
+}
+
+/* Every specialisation, indexed by property mask. */
+static constexpr auto property_table =
+    make_property_table(std::make_index_sequence<prop_all + 1>{});
+
+/**
+ * @brief An output column of halo properties.
+ */
+struct PropertyColumn {
+
+  /* The property it belongs to. */
+  unsigned flag;
+
+  /* The dataset name. */
+  const char *name;
+
+  /* The number of components. */
+  int ncomp;
+
+  /* The catalogue array holding it. */
+  halo_vector<double> HaloCatalog::*data;
+};
+
+/* The output columns. */
+static const PropertyColumn property_columns[] = {
+    {prop_mass, "Mass", 1, &HaloCatalog::mass},
+    {prop_com, "CentreOfMass", 3, &HaloCatalog::x},
+    {prop_vel, "BulkVelocity", 3, &HaloCatalog::v},
+    {prop_vel_disp, "VelocityDispersion", 1, &HaloCatalog::vel_disp},
+    {prop_spin, "Spin", 1, &HaloCatalog::spin},
+    {prop_r_half, "HalfMassRadius", 1, &HaloCatalog::r_half},
+    {prop_vmax, "Vmax", 1, &HaloCatalog::vmax},
+    {prop_vmax, "Rmax", 1, &HaloCatalog::rmax},
+};
+
+/** @brief Calculate the requested properties of every halo.
+ *
+ * @param engine The engine.
+ * @param catalog The catalogue of halos.
+ */
+void calculate_halo_properties(Engine *engine, HaloCatalog &catalog) {
+
+  unsigned props = engine->prop_registry.props;
+  if (props == 0) {
+    return;
+  }
+
+  tic();
+  ProfileScope profile("Properties");
+
+  /* Split the small halos from the large. */
+  std::vector<size_t> small_halos, large_halos;
+  for (size_t ihalo = 0; ihalo < catalog.nhalos; ihalo++) {
+    if (catalog.npart[ihalo] == 0) {
+      continue;
+    }
+    if (catalog.npart[ihalo] >= prop_large_halo_npart) {
+      large_halos.push_back(ihalo);
+    } else {
+      small_halos.push_back(ihalo);
+    }
+  }
+
+  /* Run the specialisation for this set of properties, into columns sized
+   * for just those properties. */
+  PropertySetFunc func = property_table[props];
+  if (func == nullptr) {
+    error("Property set %u is missing its dependencies!", props);
+  }
+  for (const PropertyColumn &col : property_columns) {
+    if (props & col.flag) {
+      (catalog.*col.data).assign(col.ncomp * catalog.nhalos, 0);
+    }
+  }
+  func(engine, catalog, small_halos, large_halos);
+
+  message("Calculated %s for %zu halos (%zu large)",
+          PropertyRegistry::describe(props).c_str(),
+          small_halos.size() + large_halos.size(), large_halos.size());
+
+  toc("Calculating halo properties");
+}
+
+/** @brief Copy a halo's calculated properties to another catalogue, growing
+ * its columns to fit.
+ *
+ * @param props The properties calculated.
+ * @param from The catalogue to copy from.
+ * @param from_halo The halo to copy.
+ * @param to The catalogue to copy to.
+ * @param to_halo The halo to copy it to.
+ */
+void copy_halo_properties(unsigned props, const HaloCatalog &from,
+                          size_t from_halo, HaloCatalog &to, size_t to_halo) {
+  for (const PropertyColumn &col : property_columns) {
+    if (!(props & col.flag)) {
+      continue;
+    }
+    const halo_vector<double> &src = from.*col.data;
+    halo_vector<double> &dst = to.*col.data;
+    size_t ncomp = col.ncomp;
+    if (dst.size() < ncomp * (to_halo + 1)) {
+      dst.resize(ncomp * (to_halo + 1), 0);
+    }
+    std::copy_n(src.begin() + ncomp * from_halo, ncomp,
+                dst.begin() + ncomp * to_halo);
+  }
+}
+
+/** @brief Write the requested halo properties to a file.
+ *
+ * Only requested properties get a dataset, dependencies calculated along the
+ * way are not written.
+ *
+ * @param file The file to write to.
+ * @param group The (existing) group to write the datasets in.
+ * @param catalog The catalogue of halos.
+ * @param registry The registry of properties.
+ *
+ * @return Whether every dataset was written.
+ */
+bool write_halo_properties(HDF5Helper &file, const std::string &group,
+                           const HaloCatalog &catalog,
+                           const PropertyRegistry &registry) {
+
+  bool success = true;
+
+  /* The catalogue columns are already contiguous, write them directly. */
+  for (const PropertyColumn &col : property_columns) {
+    if (!registry.outputs(col.flag)) {
+      continue;
+    }
+    success &=
+        file.writeDataset(group + "/" + col.name, catalog.*col.data, col.ncomp);
+  }
+
+  return success;
+}
+
+/** @brief Add the requested halo properties to a binary catalogue.
+ *
+ * The same columns as write_halo_properties, named as the datasets are.
+ *
+ * @param writer The binary catalogue.
+ * @param catalog The catalogue of halos.
+ * @param registry The registry of properties.
+ */
+void add_halo_properties(MegaCatalogWriter &writer, const HaloCatalog &catalog,
+                         const PropertyRegistry &registry) {
+  for (const PropertyColumn &col : property_columns) {
+    if (registry.outputs(col.flag)) {
+      writer.addColumn(col.name, catalog.*col.data, col.ncomp);
+    }
+  }
+}
@@ -0,0 +1,117 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the prototypes for calculating halo properties.
+ ******************************************************************************/
+#ifndef PROPERTIES_H_
+#define PROPERTIES_H_
+
+/* Includes */
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Local includes. */
+#include "domain.h"
+#include "engine.h"
+#include "halo.h"
+#include "mega_catalog.h"
+#include "memory.h"
+#include "property_registry.h"
+#include "serial_io.h"
+
+/* Halos with at least this many particles have their properties calculated
+ * in parallel over their particles, smaller halos are done in batches. */
+#define prop_large_halo_npart 100000
+
+/* The number of small halos handled by a single thread at once. */
+#define prop_batch_size 64
+
+/* The number of independent accumulators used in the reductions. This lets
+ * the compiler vectorise the sums without reassociating them. */
+#define prop_simd_width 8
+
+/* The number of segments the radial mass profile is split into. */
+#define prop_profile_nseg 64
+
+/**
+ * @class HaloMoments
+ * @brief The mass weighted sums over a halo's particles.
+ *
+ * Everything except the radial profile can be derived from these, so they
+ * are accumulated in a single pass over the particles. Positions are relative
+ * to a reference particle so the sums are safe across a periodic boundary.
+ * Only the sums needed by the requested properties are accumulated, the rest
+ * stay zero.
+ *
+ * @param mass The total mass.
+ * @param mx The mass weighted positions.
+ * @param mv The mass weighted velocities.
+ * @param mv2 The mass weighted squared speeds.
+ * @param mrxv The mass weighted angular momenta (r x v).
+ */
+class HaloMoments {
+public:
+  double mass = 0;
+  double mx[3] = {0, 0, 0};
+  double mv[3] = {0, 0, 0};
+  double mv2 = 0;
+  double mrxv[3] = {0, 0, 0};
+
+  /* Add another set of moments to these. */
+  void add(const HaloMoments &other);
+};
+
+/**
+ * @class PropertyScratch
+ * @brief The working arrays used when calculating a halo's properties.
+ *
+ * A halo's particles are gathered into contiguous structure of arrays form so
+ * every loop over them streams through memory and can be vectorised. A
+ * scratch is reused for every halo a thread works on to avoid reallocating,
+ * and freed once every halo's properties are done.
+ */
+class PropertyScratch {
+public:
+  /* The positions relative to the reference particle. */
+  tracked_vector<double, mem_properties> x, y, z;
+
+  /* The velocities. */
+  tracked_vector<double, mem_properties> vx, vy, vz;
+
+  /* The masses. */
+  tracked_vector<double, mem_properties> m;
+
+  /* The (squared radius, mass) of each particle about the centre of mass. */
+  tracked_vector<std::pair<double, double>, mem_properties> shells;
+
+  /* Make sure there is room for n particles (and only the arrays needed). */
+  void resize(size_t n, bool with_pos, bool with_vel, bool with_shells);
+};
+
+/* Prototypes */
+void calculate_halo_properties(Engine *engine, HaloCatalog &catalog);
+void copy_halo_properties(unsigned props, const HaloCatalog &from,
+                          size_t from_halo, HaloCatalog &to, size_t to_halo);
+bool write_halo_properties(HDF5Helper &file, const std::string &group,
+                           const HaloCatalog &catalog,
+                           const PropertyRegistry &registry);
+void add_halo_properties(MegaCatalogWriter &writer, const HaloCatalog &catalog,
+                         const PropertyRegistry &registry);
+
+#endif // PROPERTIES_H_
@@ -0,0 +1,194 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the registry of halo properties which can be
+ * requested in the parameter file.
+ ******************************************************************************/
+#ifndef PROPERTY_REGISTRY_H_
+#define PROPERTY_REGISTRY_H_
+
+/* Includes */
+#include <cctype>
+#include <string>
+
+/* Local includes. */
+#include "logging.h"
+#include "params.h"
+
+/*! @brief The halo properties which can be calculated.
+ *
+ * Each property is a bit so a set of properties is a mask. The mask is a
+ * template parameter of the property kernels, so anything not in it is
+ * compiled out entirely. */
+enum halo_props : unsigned {
+  prop_mass = 1u << 0,
+  prop_com = 1u << 1,
+  prop_vel = 1u << 2,
+  prop_vel_disp = 1u << 3,
+  prop_spin = 1u << 4,
+  prop_r_half = 1u << 5,
+  prop_vmax = 1u << 6,
+  prop_all = (1u << 7) - 1,
+};
+
+/*! @brief The definition of a property in the registry. */
+struct PropertyDef {
+
+  /*! The name used in the parameter file. */
+  const char *name;
+
+  /*! The property's bit. */
+  unsigned flag;
+
+  /*! The properties it can't be calculated without. */
+  unsigned deps;
+};
+
+/*! The registry of properties (dependencies are listed directly, the full set
+ * is found by PropertyRegistry::resolve). */
+inline constexpr PropertyDef halo_prop_defs[] = {
+    {"mass", prop_mass, 0},
+    {"com", prop_com, prop_mass},
+    {"vel", prop_vel, prop_mass},
+    {"vel_disp", prop_vel_disp, prop_vel},
+    {"spin", prop_spin, prop_com | prop_vel},
+    {"r_half", prop_r_half, prop_com},
+    {"vmax", prop_vmax, prop_com},
+};
+
+/**
+ * @class PropertyRegistry
+ * @brief The set of halo properties this run will calculate and output.
+ *
+ * The properties are read from the parameter file as a list, e.g.
+ *   Output/properties: [mass, com, vmax, spin]
+ * or "all" (the default). Anything a requested property depends on is
+ * calculated too (e.g. spin needs the centre of mass and bulk velocity), but
+ * only the requested properties are output. If Output/calculate_props is 0
+ * nothing is calculated and only the particle membership is output.
+ *
+ * @param requested The properties asked for in the parameter file.
+ * @param props The properties to calculate (requested plus dependencies).
+ */
+class PropertyRegistry {
+public:
+  /* The properties asked for. */
+  unsigned requested;
+
+  /* The properties to calculate. */
+  unsigned props;
+
+  PropertyRegistry() : requested(0), props(0) {}
+
+  /** @brief Construct the registry from the parameter file.
+   *
+   * @param params The parameters.
+   * @param calculate_props Are we calculating properties at all?
+   */
+  PropertyRegistry(Parameters &params, int calculate_props) {
+    std::string list = params.getParameterString("Output/properties", "all");
+    requested = calculate_props ? parse(list) : 0;
+    props = resolve(requested);
+  }
+
+  /** @brief Add every dependency to a set of properties.
+   *
+   * @param props The set of properties.
+   */
+  static constexpr unsigned resolve(unsigned props) {
+    unsigned resolved = props;
+    unsigned last = 0;
+    while (resolved != last) {
+      last = resolved;
+      for (const PropertyDef &def : halo_prop_defs) {
+        if (resolved & def.flag) {
+          resolved |= def.deps;
+        }
+      }
+    }
+    return resolved;
+  }
+
+  /** @brief Are we calculating a property?
+   *
+   * @param flag The property's bit.
+   */
+  bool has(unsigned flag) const { return (props & flag) == flag; }
+
+  /** @brief Was a property requested for output?
+   *
+   * @param flag The property's bit.
+   */
+  bool outputs(unsigned flag) const { return (requested & flag) == flag; }
+
+  /** @brief Get a comma separated list of the properties in a set.
+   *
+   * @param set The set of properties.
+   */
+  static std::string describe(unsigned set) {
+    std::string names;
+    for (const PropertyDef &def : halo_prop_defs) {
+      if (set & def.flag) {
+        names += names.empty() ? def.name : std::string(", ") + def.name;
+      }
+    }
+    return names.empty() ? "none" : names;
+  }
+
+private:
+  /** @brief Parse a list of property names.
+   *
+   * @param list The list, e.g. "[mass, com, vmax]" or "all".
+   */
+  static unsigned parse(const std::string &list) {
+    unsigned set = 0;
+    std::string name;
+
+    /* Walk the string, every non-name character ends a name. */
+    for (size_t i = 0; i <= list.length(); i++) {
+      char c = i < list.length() ? list[i] : ',';
+      if (std::isalnum(static_cast<unsigned char>(c)) || c == '_') {
+        name += c;
+        continue;
+      }
+      if (name.empty()) {
+        continue;
+      }
+
+      if (name == "all") {
+        set |= prop_all;
+      } else {
+        unsigned flag = 0;
+        for (const PropertyDef &def : halo_prop_defs) {
+          if (name == def.name) {
+            flag = def.flag;
+          }
+        }
+        if (flag == 0) {
+          error("Unknown halo property '%s' in Output/properties",
+                name.c_str());
+        }
+        set |= flag;
+      }
+      name.clear();
+    }
+
+    return set;
+  }
+};
+
+#endif // PROPERTY_REGISTRY_H_
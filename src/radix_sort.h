@@ -0,0 +1,268 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains a parallel LSD radix sort of unsigned keys with
+ * a payload, run on the ThreadPool.
+ ******************************************************************************/
+#ifndef RADIX_SORT_H_
+#define RADIX_SORT_H_
+
+/* Includes */
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+/* Local includes. */
+#include "memory.h"
+#include "threadpool.h"
+
+/* The number of bits sorted per pass. */
+#define radix_bits 8
+#define radix_size (1 << radix_bits)
+
+/* The number of elements held per digit before they are written out. */
+#define radix_wc_size 16
+
+/* Don't split the sort into chunks smaller than this. */
+#define radix_min_chunk 65536
+
+/**
+ * @brief The state shared by the threads running a radix sort.
+ *
+ * The elements are split into nchunks contiguous chunks and the passes map
+ * over the chunk numbers, so the sort is stable and the result is the same
+ * for any number of threads.
+ */
+template <typename K, typename V> struct RadixSortData {
+
+  /* The number of elements and chunks. */
+  size_t n;
+  int nchunks;
+
+  /* The input and output of the current pass. */
+  K *in_keys, *out_keys;
+  V *in_vals, *out_vals;
+
+  /* The bits being sorted on. */
+  int shift;
+
+  /* Each chunk's digit counts, then where it writes each digit. */
+  std::vector<size_t> offsets;
+
+  /* The first element in a chunk. */
+  size_t chunkStart(int chunk) const { return n * chunk / nchunks; }
+
+  /* The digit of a key in this pass. */
+  size_t digit(K key) const { return (key >> shift) & (radix_size - 1); }
+};
+
+/** @brief Count the digits in a chunk.
+ *
+ * @param map_data The chunk number (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The RadixSortData.
+ */
+template <typename K, typename V>
+void radix_count_mapper(void *map_data, int num_elements, void *extra_data) {
+  (void)num_elements;
+
+  int chunk = *static_cast<int *>(map_data);
+  auto *data = static_cast<RadixSortData<K, V> *>(extra_data);
+  size_t *hist = &data->offsets[chunk * radix_size];
+
+  std::fill(hist, hist + radix_size, 0);
+  for (size_t i = data->chunkStart(chunk); i < data->chunkStart(chunk + 1);
+       i++) {
+    hist[data->digit(data->in_keys[i])]++;
+  }
+}
+
+/** @brief Scatter a chunk to its place in the output.
+ *
+ * Elements are staged in a small buffer per digit and written out a buffer
+ * at a time, so each write touches a few whole cache lines rather than
+ * scattering single elements over radix_size destinations.
+ *
+ * @param map_data The chunk number (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The RadixSortData.
+ */
+template <typename K, typename V>
+void radix_scatter_mapper(void *map_data, int num_elements, void *extra_data) {
+  (void)num_elements;
+
+  int chunk = *static_cast<int *>(map_data);
+  auto *data = static_cast<RadixSortData<K, V> *>(extra_data);
+  size_t *dest = &data->offsets[chunk * radix_size];
+
+  /* The write-combining buffers. */
+  std::vector<K> key_buf(radix_size * radix_wc_size);
+  std::vector<V> val_buf(radix_size * radix_wc_size);
+  int count[radix_size] = {0};
+
+  auto flush = [&](size_t d) {
+    std::memcpy(&data->out_keys[dest[d]], &key_buf[d * radix_wc_size],
+                count[d] * sizeof(K));
+    std::memcpy(&data->out_vals[dest[d]], &val_buf[d * radix_wc_size],
+                count[d] * sizeof(V));
+    dest[d] += count[d];
+    count[d] = 0;
+  };
+
+  for (size_t i = data->chunkStart(chunk); i < data->chunkStart(chunk + 1);
+       i++) {
+    size_t d = data->digit(data->in_keys[i]);
+    key_buf[d * radix_wc_size + count[d]] = data->in_keys[i];
+    val_buf[d * radix_wc_size + count[d]] = data->in_vals[i];
+    if (++count[d] == radix_wc_size) {
+      flush(d);
+    }
+  }
+  for (size_t d = 0; d < radix_size; d++) {
+    flush(d);
+  }
+}
+
+/** @brief Copy a chunk of the sorted elements back to the caller's arrays.
+ *
+ * @param map_data The chunk number (int).
+ * @param num_elements Unused (always 1).
+ * @param extra_data The RadixSortData.
+ */
+template <typename K, typename V>
+void radix_copy_mapper(void *map_data, int num_elements, void *extra_data) {
+  (void)num_elements;
+
+  int chunk = *static_cast<int *>(map_data);
+  auto *data = static_cast<RadixSortData<K, V> *>(extra_data);
+  size_t start = data->chunkStart(chunk);
+  size_t count = data->chunkStart(chunk + 1) - start;
+
+  std::memcpy(&data->out_keys[start], &data->in_keys[start],
+              count * sizeof(K));
+  std::memcpy(&data->out_vals[start], &data->in_vals[start],
+              count * sizeof(V));
+}
+
+/** @brief Sort unsigned keys, and a payload with them, in parallel.
+ *
+ * A stable least significant digit radix sort. Each pass counts the digits
+ * of every chunk, turns the counts into where each chunk writes each digit,
+ * and scatters. A pass where every key has the same digit is skipped.
+ *
+ * If the caller knows the keys lie in [min_key, max_key] only the bits that
+ * can differ within that range are sorted on, e.g. keys below 2^24 only take
+ * 3 passes rather than 8.
+ *
+ * The sorted elements always end up back in keys and vals. The sort needs
+ * as much scratch again, which the caller can provide (e.g. to reuse it
+ * between sorts), otherwise it is allocated here.
+ *
+ * @param threadpool The threadpool.
+ * @param keys The keys.
+ * @param vals The payload.
+ * @param n The number of elements.
+ * @param key_scratch Scratch for n keys (or nullptr).
+ * @param val_scratch Scratch for n payloads (or nullptr).
+ * @param min_key The smallest possible key.
+ * @param max_key The largest possible key.
+ */
+template <typename K, typename V>
+void radix_sort(ThreadPool *threadpool, K *keys, V *vals, size_t n,
+                K *key_scratch = nullptr, V *val_scratch = nullptr,
+                K min_key = 0, K max_key = std::numeric_limits<K>::max()) {
+
+  static_assert(std::is_unsigned<K>::value, "Radix sort keys must be unsigned");
+
+  if (n < 2) {
+    return;
+  }
+
+  /* Get the scratch. */
+  tracked_vector<K, mem_sort> own_keys;
+  tracked_vector<V, mem_sort> own_vals;
+  if (key_scratch == nullptr) {
+    own_keys.resize(n);
+    key_scratch = own_keys.data();
+  }
+  if (val_scratch == nullptr) {
+    own_vals.resize(n);
+    val_scratch = own_vals.data();
+  }
+
+  RadixSortData<K, V> data;
+  data.n = n;
+  data.nchunks = static_cast<int>(std::min<size_t>(
+      threadpool->getNumThreads(), std::max<size_t>(n / radix_min_chunk, 1)));
+  data.in_keys = keys;
+  data.in_vals = vals;
+  data.out_keys = key_scratch;
+  data.out_vals = val_scratch;
+  data.offsets.resize(data.nchunks * radix_size);
+  std::vector<int> chunks(data.nchunks);
+  std::iota(chunks.begin(), chunks.end(), 0);
+
+  /* Only sort on the bits which differ within the key range. */
+  K diff = min_key ^ max_key;
+  int nbits = 0;
+  while (nbits < std::numeric_limits<K>::digits && (diff >> nbits) != 0) {
+    nbits++;
+  }
+
+  for (data.shift = 0; data.shift < nbits; data.shift += radix_bits) {
+
+    /* Count each chunk's digits. */
+    threadpool->map(radix_count_mapper<K, V>, chunks.data(), data.nchunks,
+                    sizeof(int), 1, &data);
+
+    /* Turn the counts into where each chunk writes each digit, skipping the
+     * pass if every key has the same digit. */
+    size_t total = 0;
+    bool trivial = false;
+    for (int b = 0; b < radix_size; b++) {
+      size_t start = total;
+      for (int c = 0; c < data.nchunks; c++) {
+        size_t count = data.offsets[c * radix_size + b];
+        data.offsets[c * radix_size + b] = total;
+        total += count;
+      }
+      trivial |= total - start == n;
+    }
+    if (trivial) {
+      continue;
+    }
+
+    threadpool->map(radix_scatter_mapper<K, V>, chunks.data(), data.nchunks,
+                    sizeof(int), 1, &data);
+    std::swap(data.in_keys, data.out_keys);
+    std::swap(data.in_vals, data.out_vals);
+  }
+
+  /* Make sure the result is in the caller's arrays. */
+  if (data.in_keys != keys) {
+    data.out_keys = keys;
+    data.out_vals = vals;
+    threadpool->map(radix_copy_mapper<K, V>, chunks.data(), data.nchunks,
+                    sizeof(int), 1, &data);
+  }
+}
+
+#endif // RADIX_SORT_H_
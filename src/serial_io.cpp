@@ -19,9 +19,48 @@
  * a HDF5 file in serial.
  ******************************************************************************/
 
+/* Includes. */
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <optional>
+#include <zlib.h>
+
 /* Local includes. */
+#include "memory.h"
 #include "serial_io.h"
 
+/** @brief Is HDF5 only safe to call from one thread at a time?
+ *
+ * Asked of the library once, on the first call.
+ */
+bool HDF5Lock::serialised() {
+  static const bool serialise = []() {
+    hbool_t threadsafe = false;
+    return H5is_library_threadsafe(&threadsafe) < 0 || !threadsafe;
+  }();
+  return serialise;
+}
+
+/** @brief Take the HDF5 lock (if the library needs it) until destroyed. */
+HDF5Lock::HDF5Lock() {
+  static std::recursive_mutex mutex;
+  if (serialised()) {
+    guard = std::unique_lock<std::recursive_mutex>(mutex);
+  }
+}
+
+/** @brief Open (or create) a file, holding the HDF5 lock.
+ *
+ * @param filename The filepath to the HDF5 file.
+ * @param accessMode The mode with which to open the HDF5 file.
+ */
+static H5::H5File open_file(const std::string &filename,
+                            unsigned int accessMode) {
+  HDF5Lock lock;
+  return H5::H5File(filename, accessMode);
+}
+
 /** @brief The constructor for the #HDF5Helper class.
  *
  * This will create an instance of the HDF5Helper class with the HDF5 file
@@ -35,11 +74,212 @@
  *                   or H5F_ACC_CREAT. Defaults to H5F_ACC_RDONLY.
  */
 HDF5Helper::HDF5Helper(const std::string &filename, unsigned int accessMode)
-    : file(filename, accessMode) {}
+    : file(open_file(filename, accessMode)), compression(0), chunk_rows(0),
+      compression_pool(nullptr) {}
+
+HDF5Helper::~HDF5Helper() {
+  /* Closed here, holding the lock (the closed file's destructor doesn't call
+   * HDF5). */
+  HDF5Lock lock;
+  this->file.close();
+}
+
+/** @brief Set how new datasets are stored.
+ *
+ * @param level The deflate level (1-9, 0 for contiguous and uncompressed).
+ * @param rows The number of rows in a chunk.
+ * @param pool The threads compressing chunks (nullptr to compress them on
+ *             the thread writing).
+ */
+void HDF5Helper::setCompression(int level, hsize_t rows, ThreadPool *pool) {
+  compression = level;
+  chunk_rows = std::max<hsize_t>(rows, 1);
+  compression_pool = pool;
+}
+
+/** @brief The creation properties of a new dataset.
+ *
+ * Chunked with the shuffle (for multi-byte values) and deflate filters if
+ * compressing, otherwise the default (contiguous).
+ *
+ * @param nrows The number of rows.
+ * @param ncols The number of columns (1 for 1D).
+ * @param elem_size The size of a value.
+ */
+H5::DSetCreatPropList HDF5Helper::creationPlist(hsize_t nrows, hsize_t ncols,
+                                                size_t elem_size) const {
+  H5::DSetCreatPropList plist;
+  if (compression <= 0 || nrows == 0) {
+    return plist;
+  }
+  hsize_t chunk[2] = {std::min(chunk_rows, nrows), ncols};
+  plist.setChunk(ncols > 1 ? 2 : 1, chunk);
+  if (elem_size > 1) {
+    plist.setShuffle();
+  }
+  plist.setDeflate(compression);
+  return plist;
+}
+
+/** @brief Shuffle a chunk's bytes (as the HDF5 shuffle filter does), the
+ * first byte of every value, then the second, and so on.
+ *
+ * @param in The chunk.
+ * @param out The shuffled chunk.
+ * @param nvalues The number of values.
+ * @param elem_size The size of a value.
+ */
+static void shuffle_bytes(const char *in, char *out, size_t nvalues,
+                          size_t elem_size) {
+  for (size_t b = 0; b < elem_size; b++) {
+    char *out_b = out + b * nvalues;
+    for (size_t i = 0; i < nvalues; i++) {
+      out_b[i] = in[i * elem_size + b];
+    }
+  }
+}
+
+/**
+ * @brief The data shared by the threads compressing and writing a dataset's
+ * chunks.
+ */
+struct ChunkData {
+  hid_t dataset;
+  const char *data;
+  hsize_t nrows;
+  hsize_t rows;
+  size_t row_bytes;
+  size_t elem_size;
+  int level;
+
+  /* Guards everything below. */
+  std::mutex lock;
+
+  /* The chunks compressed but not yet written (in order). */
+  std::vector<tracked_vector<unsigned char, mem_io>> compressed;
+  std::vector<bool> ready;
+
+  /* The next chunk to write. */
+  size_t next_write;
+
+  /* Did compressing or writing a chunk fail? */
+  bool failed;
+};
+
+/** @brief Compress a chunk of a new dataset, then write every chunk ready
+ * to be written.
+ *
+ * The chunk is shuffled and deflated exactly as the HDF5 filters would, the
+ * last chunk padded to a whole chunk as HDF5 stores them. Chunks are written
+ * in order as soon as they and every chunk before them are compressed, so
+ * the file is the same however many threads there are and only the chunks
+ * finished early are held. Only the writes take the HDF5 lock.
+ *
+ * @param map_data The chunk numbers (size_t).
+ * @param num_elements The number of chunks.
+ * @param extra_data The ChunkData.
+ */
+static void compress_chunks_mapper(void *map_data, int num_elements,
+                                   void *extra_data) {
+
+  const size_t *chunks = static_cast<size_t *>(map_data);
+  ChunkData *data = static_cast<ChunkData *>(extra_data);
+  size_t chunk_bytes = data->rows * data->row_bytes;
+  tracked_vector<char, mem_io> padded, shuffled;
+
+  for (int i = 0; i < num_elements; i++) {
+    size_t c = chunks[i];
+    size_t first = c * data->rows;
+    size_t n = std::min<size_t>(data->rows, data->nrows - first);
+    const char *chunk = data->data + first * data->row_bytes;
+    if (n < data->rows) {
+      padded.resize(chunk_bytes);
+      std::memcpy(padded.data(), chunk, n * data->row_bytes);
+      std::memset(padded.data() + n * data->row_bytes, 0,
+                  (data->rows - n) * data->row_bytes);
+      chunk = padded.data();
+    }
+    if (data->elem_size > 1) {
+      shuffled.resize(chunk_bytes);
+      shuffle_bytes(chunk, shuffled.data(), chunk_bytes / data->elem_size,
+                    data->elem_size);
+      chunk = shuffled.data();
+    }
+    uLongf size = compressBound(chunk_bytes);
+    tracked_vector<unsigned char, mem_io> compressed(size);
+    bool ok = compress2(compressed.data(), &size,
+                        reinterpret_cast<const Bytef *>(chunk), chunk_bytes,
+                        data->level) == Z_OK;
+    compressed.resize(size);
+
+    /* Hand it over, and write it (and any after it) if it's next. */
+    std::lock_guard<std::mutex> guard(data->lock);
+    data->failed |= !ok;
+    data->compressed[c] = std::move(compressed);
+    data->ready[c] = true;
+    while (data->next_write < data->ready.size() &&
+           data->ready[data->next_write]) {
+      size_t w = data->next_write++;
+      tracked_vector<unsigned char, mem_io> done =
+          std::move(data->compressed[w]);
+      if (data->failed) {
+        continue;
+      }
+      hsize_t offset[2] = {w * data->rows, 0};
+      HDF5Lock hdf5_lock;
+      data->failed |= H5Dwrite_chunk(data->dataset, H5P_DEFAULT, 0, offset,
+                                     done.size(), done.data()) < 0;
+    }
+  }
+}
+
+/** @brief Compress and write every chunk of a new dataset.
+ *
+ * HDF5 only runs one call at a time, so rather than having HDF5 filter the
+ * chunks (one after another) they're compressed on the compression pool and
+ * written with H5Dwrite_chunk as they finish. The HDF5 lock mustn't be held,
+ * so other threads can use HDF5 meanwhile.
+ *
+ * @param dataset The dataset (created with creationPlist).
+ * @param data The data (row major).
+ * @param nrows The number of rows.
+ * @param ncols The number of columns.
+ * @param elem_size The size of a value.
+ */
+void HDF5Helper::writeChunks(H5::DataSet &dataset, const char *data,
+                             hsize_t nrows, hsize_t ncols,
+                             size_t elem_size) const {
 
-HDF5Helper::~HDF5Helper() { this->file.close(); }
+  ChunkData chunk_data;
+  chunk_data.dataset = dataset.getId();
+  chunk_data.data = data;
+  chunk_data.nrows = nrows;
+  chunk_data.rows = std::min(chunk_rows, nrows);
+  chunk_data.row_bytes = ncols * elem_size;
+  chunk_data.elem_size = elem_size;
+  chunk_data.level = compression;
+  size_t nchunks = (nrows + chunk_data.rows - 1) / chunk_data.rows;
+  chunk_data.compressed.resize(nchunks);
+  chunk_data.ready.assign(nchunks, false);
+  chunk_data.next_write = 0;
+  chunk_data.failed = false;
+
+  std::vector<size_t> chunks(nchunks);
+  std::iota(chunks.begin(), chunks.end(), 0);
+  if (compression_pool != nullptr) {
+    compression_pool->map(compress_chunks_mapper, chunks.data(), nchunks,
+                          sizeof(size_t), 1, &chunk_data);
+  } else {
+    compress_chunks_mapper(chunks.data(), nchunks, &chunk_data);
+  }
+  if (chunk_data.failed) {
+    throw H5::DataSetIException("HDF5Helper::writeChunks",
+                                "Failed to compress or write a chunk");
+  }
+}
 
 bool HDF5Helper::createGroup(const std::string &groupName) {
+  HDF5Lock lock;
   try {
     H5::Group group = file.createGroup(groupName);
     return true;
@@ -51,6 +291,7 @@ bool HDF5Helper::createGroup(const std::string &groupName) {
 bool HDF5Helper::writeAttribute(const std::string &objName,
                                 const std::string &attributeName,
                                 const std::string &attributeValue) {
+  HDF5Lock lock;
   try {
     H5::Group group(file.openGroup(objName));
     H5::DataSpace dataspace(H5S_SCALAR);
@@ -64,29 +305,170 @@ bool HDF5Helper::writeAttribute(const std::string &objName,
   }
 }
 
-template <typename T>
-bool HDF5Helper::writeDataset(const std::string &datasetName,
-                              const std::vector<T> &data) {
+/** @brief Get the shape of a dataset.
+ *
+ * @param datasetName The path of the dataset.
+ * @param dims The size of each dimension (resized to the rank).
+ */
+bool HDF5Helper::getDatasetDims(const std::string &datasetName,
+                                std::vector<hsize_t> &dims) {
+  HDF5Lock lock;
+  try {
+    H5::DataSet dataset = file.openDataSet(datasetName);
+    H5::DataSpace dataspace = dataset.getSpace();
+    dims.resize(dataspace.getSimpleExtentNdims());
+    dataspace.getSimpleExtentDims(dims.data());
+    return true;
+  } catch (H5::Exception &e) {
+    return false;
+  }
+}
+
+/** @brief Write an array to a new dataset, stored as the type it's held in
+ * (and compressed if compression is set).
+ *
+ * @param datasetName The path of the dataset to create.
+ * @param data The data to write (row major if ncols > 1).
+ * @param type The type of the data.
+ * @param nrows The number of rows.
+ * @param ncols The number of columns, the dataset is 2D if this is > 1.
+ */
+bool HDF5Helper::writeData(const std::string &datasetName, const void *data,
+                           const H5::DataType &type, hsize_t nrows,
+                           hsize_t ncols) {
+
+  /* Taken before the dataset is destroyed (closing it). */
+  std::optional<HDF5Lock> closing;
+  H5::DataSet dataset;
+  try {
+    size_t elem_size;
+    bool compress = nrows > 0 && compression > 0;
+    {
+      HDF5Lock lock;
+      elem_size = type.getSize();
+      hsize_t dims[2] = {nrows, ncols};
+      H5::DataSpace dataspace(ncols > 1 ? 2 : 1, dims);
+      dataset = file.createDataSet(datasetName, type, dataspace,
+                                   creationPlist(nrows, ncols, elem_size));
+      if (nrows > 0 && !compress) {
+        dataset.write(data, type);
+      }
+    }
+
+    /* Compress without holding the HDF5 lock. */
+    if (compress) {
+      writeChunks(dataset, static_cast<const char *>(data), nrows, ncols,
+                  elem_size);
+    }
+    closing.emplace();
+    return true;
+  } catch (H5::Exception &e) {
+    closing.emplace();
+    return false;
+  }
+}
+
+/** @brief Create an empty 1D dataset to be written in slices.
+ *
+ * If compression is set HDF5 compresses the chunks as the slices are written.
+ *
+ * @param datasetName The path of the dataset to create.
+ * @param type The type of the data.
+ * @param size The number of elements.
+ */
+bool HDF5Helper::createData(const std::string &datasetName,
+                            const H5::DataType &type, hsize_t size) {
+  HDF5Lock lock;
   try {
-    H5::DataSpace dataspace(1, data.size());
-    H5::DataSet dataset =
-        file.createDataSet(datasetName, H5::PredType::NATIVE_DOUBLE, dataspace);
-    dataset.write(data.data(), H5::PredType::NATIVE_DOUBLE);
+    H5::DataSpace dataspace(1, &size);
+    file.createDataSet(datasetName, type, dataspace,
+                       creationPlist(size, 1, type.getSize()));
     return true;
   } catch (H5::Exception &e) {
     return false;
   }
 }
 
-template <typename T>
-bool HDF5Helper::readDataset(const std::string &datasetName,
-                             std::vector<T> &data) {
+/** @brief Write an array to a slice of an existing 1D dataset.
+ *
+ * @param datasetName The path of the dataset.
+ * @param data The data to write.
+ * @param type The type of the data.
+ * @param count The number of elements.
+ * @param offset Where in the dataset the data starts.
+ */
+bool HDF5Helper::writeDataSlice(const std::string &datasetName,
+                                const void *data, const H5::DataType &type,
+                                hsize_t count, hsize_t offset) {
+  if (count == 0) {
+    return true;
+  }
+  HDF5Lock lock;
   try {
     H5::DataSet dataset = file.openDataSet(datasetName);
-    H5::DataSpace dataspace = dataset.getSpace();
-    std::vector<T> buffer(dataspace.getSelectNpoints());
-    dataset.read(buffer.data(), H5::PredType::NATIVE_DOUBLE);
-    data = buffer;
+    H5::DataSpace filespace = dataset.getSpace();
+    filespace.selectHyperslab(H5S_SELECT_SET, &count, &offset);
+    H5::DataSpace memspace(1, &count);
+    dataset.write(data, type, memspace, filespace);
+    return true;
+  } catch (H5::Exception &e) {
+    return false;
+  }
+}
+
+/** @brief Read rows of a 1D or 2D dataset into memory, a row every stride
+ * bytes.
+ *
+ * A stride longer than a row is described to HDF5 as a strided selection of
+ * memory (a block of ncols values every stride bytes), so the values are
+ * converted (if the file holds another type) and scattered straight into
+ * place by HDF5 without an intermediate buffer.
+ *
+ * @param datasetName The path of the dataset.
+ * @param data Where the first row read goes.
+ * @param type The type of the data in memory.
+ * @param start The first row to read.
+ * @param count The number of rows to read.
+ * @param ncols The number of columns (must match the dataset).
+ * @param stride The bytes between rows in memory (a multiple of the type's
+ *               size, at least a row).
+ */
+bool HDF5Helper::readRows(const std::string &datasetName, void *data,
+                          const H5::DataType &type, hsize_t start,
+                          hsize_t count, hsize_t ncols, size_t stride) {
+  HDF5Lock lock;
+  try {
+    H5::DataSet dataset = file.openDataSet(datasetName);
+    H5::DataSpace filespace = dataset.getSpace();
+    int ndims = filespace.getSimpleExtentNdims();
+    hsize_t dims[2] = {0, 1};
+    if (ndims < 1 || ndims > 2) {
+      return false;
+    }
+    filespace.getSimpleExtentDims(dims);
+    size_t elem_size = type.getSize();
+    if (dims[1] != ncols || start + count > dims[0] ||
+        stride % elem_size != 0 || stride < ncols * elem_size) {
+      return false;
+    }
+    if (count == 0) {
+      return true;
+    }
+
+    hsize_t file_start[2] = {start, 0};
+    hsize_t file_count[2] = {count, ncols};
+    filespace.selectHyperslab(H5S_SELECT_SET, file_count, file_start);
+
+    hsize_t mem_stride = stride / elem_size;
+    hsize_t mem_dims = (count - 1) * mem_stride + ncols;
+    H5::DataSpace memspace(1, &mem_dims);
+    if (mem_stride != ncols) {
+      hsize_t mem_start = 0;
+      memspace.selectHyperslab(H5S_SELECT_SET, &count, &mem_start,
+                               &mem_stride, &ncols);
+    }
+
+    dataset.read(data, type, memspace, filespace);
     return true;
   } catch (H5::Exception &e) {
     return false;
@@ -22,38 +22,285 @@
 #define SERIAL_IO_H_
 
 #include <H5Cpp.h>
+#include <cstddef>
+#include <mutex>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+/* Local includes. */
+#include "memory.h"
+#include "threadpool.h"
+
+/**
+ * @class HDF5Lock
+ * @brief Serialises HDF5 calls across threads.
+ *
+ * The reader and writer threads (and the threads reading each snapshot) all
+ * use HDF5 at once, which only a library built thread-safe allows. Unless it
+ * was, every HDF5 call (including destroying the H5 objects, which closes
+ * them) is made holding one of these, which holds a process-wide lock for
+ * its lifetime. The lock is recursive, so methods holding it can call each
+ * other.
+ */
+class HDF5Lock {
+public:
+  HDF5Lock();
+
+  static bool serialised();
+
+private:
+  std::unique_lock<std::recursive_mutex> guard;
+};
+
+/** @brief The HDF5 native type matching a C++ type.
+ *
+ * Resolved at compile time. Integers are matched by size and signedness (so
+ * size_t and uint64_t are both NATIVE_UINT64) and enums by their underlying
+ * type.
+ */
+template <typename T> const H5::PredType &h5_type() {
+  if constexpr (std::is_enum_v<T>) {
+    return h5_type<std::underlying_type_t<T>>();
+  } else if constexpr (std::is_same_v<T, double>) {
+    return H5::PredType::NATIVE_DOUBLE;
+  } else if constexpr (std::is_same_v<T, float>) {
+    return H5::PredType::NATIVE_FLOAT;
+  } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+    static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 ||
+                      sizeof(T) == 8,
+                  "No HDF5 type for this integer");
+    if constexpr (sizeof(T) == 1) {
+      return H5::PredType::NATIVE_INT8;
+    } else if constexpr (sizeof(T) == 2) {
+      return H5::PredType::NATIVE_INT16;
+    } else if constexpr (sizeof(T) == 4) {
+      return H5::PredType::NATIVE_INT32;
+    } else {
+      return H5::PredType::NATIVE_INT64;
+    }
+  } else if constexpr (std::is_integral_v<T>) {
+    static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 ||
+                      sizeof(T) == 8,
+                  "No HDF5 type for this integer");
+    if constexpr (sizeof(T) == 1) {
+      return H5::PredType::NATIVE_UINT8;
+    } else if constexpr (sizeof(T) == 2) {
+      return H5::PredType::NATIVE_UINT16;
+    } else if constexpr (sizeof(T) == 4) {
+      return H5::PredType::NATIVE_UINT32;
+    } else {
+      return H5::PredType::NATIVE_UINT64;
+    }
+  } else {
+    static_assert(std::is_arithmetic_v<T>, "No HDF5 type for this type");
+  }
+}
+
+/**
+ * @class HDF5Helper
+ * @brief Reading from and writing to a HDF5 file.
+ *
+ * Datasets are written in (and read into) the native HDF5 type of the C++
+ * type given (see h5_type), so HDF5 only converts values when the type in
+ * the file differs from the type in memory. The templated methods are thin
+ * wrappers around the type-erased ones, which take the memory type
+ * explicitly.
+ *
+ * New datasets are contiguous and uncompressed unless compression is set
+ * (see setCompression), when they're chunked and stored with the shuffle and
+ * deflate filters.
+ */
 class HDF5Helper {
 public:
   H5::H5File file;
 
+  /* The deflate level of new datasets (0 for none), the rows in a chunk, and
+   * the threads compressing chunks (nullptr to compress them on the thread
+   * writing). */
+  int compression;
+  hsize_t chunk_rows;
+  ThreadPool *compression_pool;
+
   HDF5Helper(const std::string &filename,
              unsigned int accessMode = H5F_ACC_RDONLY);
   ~HDF5Helper();
 
+  void setCompression(int level, hsize_t rows, ThreadPool *pool = nullptr);
+
   bool createGroup(const std::string &groupName);
   bool writeAttribute(const std::string &objName,
                       const std::string &attributeName,
                       const std::string &attributeValue);
+  bool getDatasetDims(const std::string &datasetName,
+                      std::vector<hsize_t> &dims);
+
+  /* The type-erased reading and writing. */
+  bool writeData(const std::string &datasetName, const void *data,
+                 const H5::DataType &type, hsize_t nrows, hsize_t ncols);
+  bool createData(const std::string &datasetName, const H5::DataType &type,
+                  hsize_t size);
+  bool writeDataSlice(const std::string &datasetName, const void *data,
+                      const H5::DataType &type, hsize_t count,
+                      hsize_t offset);
+  bool readRows(const std::string &datasetName, void *data,
+                const H5::DataType &type, hsize_t start, hsize_t count,
+                hsize_t ncols, size_t stride);
 
+  /** @brief Write an array to a new dataset.
+   *
+   * @param datasetName The path of the dataset to create.
+   * @param data The data to write (row major if ncols > 1).
+   * @param nrows The number of rows.
+   * @param ncols The number of columns, the dataset is 2D if this is > 1.
+   */
   template <typename T>
-  bool writeDataset(const std::string &datasetName, const std::vector<T> &data);
+  bool writeDataset(const std::string &datasetName, const T *data,
+                    hsize_t nrows, hsize_t ncols = 1) {
+    return writeData(datasetName, data, h5_type<T>(), nrows, ncols);
+  }
+
+  /** @brief Write a vector to a new dataset.
+   *
+   * @param datasetName The path of the dataset to create.
+   * @param data The data to write (row major if ncols > 1).
+   * @param ncols The number of columns, the dataset is 2D if this is > 1.
+   */
+  template <typename T, typename A>
+  bool writeDataset(const std::string &datasetName,
+                    const std::vector<T, A> &data, hsize_t ncols = 1) {
+    return writeData(datasetName, data.data(), h5_type<T>(),
+                     data.size() / ncols, ncols);
+  }
 
+  /** @brief Create an empty 1D dataset to be written in slices.
+   *
+   * @param datasetName The path of the dataset to create.
+   * @param size The number of elements.
+   */
   template <typename T>
-  bool readDataset(const std::string &datasetName, std::vector<T> &data);
-  // template <typename T>
-  // bool readAttribute(const std::string &objName,
-  //                    const std::string &attributeName, T &attributeValue);
+  bool createDataset(const std::string &datasetName, hsize_t size) {
+    return createData(datasetName, h5_type<T>(), size);
+  }
+
+  /** @brief Write a vector to a slice of an existing 1D dataset.
+   *
+   * @param datasetName The path of the dataset.
+   * @param data The data to write.
+   * @param offset Where in the dataset the data starts.
+   */
+  template <typename T, typename A>
+  bool writeDatasetSlice(const std::string &datasetName,
+                         const std::vector<T, A> &data, hsize_t offset) {
+    return writeDataSlice(datasetName, data.data(), h5_type<T>(), data.size(),
+                          offset);
+  }
+
+  /** @brief Read a whole dataset into a vector (resized to fit).
+   *
+   * @param datasetName The path of the dataset.
+   * @param data The vector to read into (row major if 2D).
+   */
+  template <typename T, typename A>
+  bool readDataset(const std::string &datasetName, std::vector<T, A> &data) {
+    std::vector<hsize_t> dims;
+    if (!getDatasetDims(datasetName, dims) || dims.empty() || dims.size() > 2) {
+      return false;
+    }
+    hsize_t ncols = dims.size() > 1 ? dims[1] : 1;
+    data.resize(dims[0] * ncols);
+    return readRows(datasetName, data.data(), h5_type<T>(), 0, dims[0], ncols,
+                    ncols * sizeof(T));
+  }
+
+  /** @brief Read a whole dataset into the caller's array.
+   *
+   * @param datasetName The path of the dataset.
+   * @param data The array to read into (room for nrows * ncols).
+   * @param nrows The number of rows (must match the dataset).
+   * @param ncols The number of columns (must match the dataset).
+   */
+  template <typename T>
+  bool readDataset(const std::string &datasetName, T *data, hsize_t nrows,
+                   hsize_t ncols = 1) {
+    std::vector<hsize_t> dims;
+    if (!getDatasetDims(datasetName, dims) || dims.empty() ||
+        dims[0] != nrows) {
+      return false;
+    }
+    return readDatasetStrided(datasetName, data, 0, nrows, ncols,
+                              ncols * sizeof(T));
+  }
+
+  /** @brief Read rows of a dataset into the caller's memory, a row every
+   * stride bytes (e.g. into a field of an array of structs).
+   *
+   * @param datasetName The path of the dataset.
+   * @param data Where the first row read goes.
+   * @param start The first row to read.
+   * @param count The number of rows to read.
+   * @param ncols The number of columns (must match the dataset).
+   * @param stride The bytes between rows in memory.
+   */
+  template <typename T>
+  bool readDatasetStrided(const std::string &datasetName, T *data,
+                          hsize_t start, hsize_t count, hsize_t ncols,
+                          size_t stride) {
+    return readRows(datasetName, data, h5_type<T>(), start, count, ncols,
+                    stride);
+  }
+
+  /** @brief Read an attribute into a value or fixed size array.
+   *
+   * The attribute is converted to the type of the value (e.g. SWIFT's 64 bit
+   * NumPart_Total into an array of int64_t), and must fit in it.
+   *
+   * @param objName The path of the group holding the attribute.
+   * @param attributeName The name of the attribute.
+   * @param attributeValue The value (or array) to read into.
+   */
   template <typename T>
   bool readAttribute(const std::string &objName,
                      const std::string &attributeName, T &attributeValue) {
+    using Elem = std::remove_all_extents_t<T>;
+    HDF5Lock lock;
+    try {
+      H5::Group group(file.openGroup(objName));
+      H5::Attribute attr = group.openAttribute(attributeName);
+      if (attr.getSpace().getSimpleExtentNpoints() * sizeof(Elem) >
+          sizeof(T)) {
+        return false;
+      }
+      attr.read(h5_type<Elem>(), &attributeValue);
+      return true;
+    } catch (H5::Exception &e) {
+      return false;
+    }
+  }
+
+  /** @brief Read an array attribute (of any length) into a vector.
+   *
+   * @param objName The path of the group holding the attribute.
+   * @param attributeName The name of the attribute.
+   * @param values The values (resized to fit).
+   */
+  template <typename T>
+  bool readAttributeArray(const std::string &objName,
+                          const std::string &attributeName,
+                          std::vector<T> &values) {
+    HDF5Lock lock;
     try {
+      /* Check first, so a missing attribute isn't reported by HDF5. */
+      if (!file.nameExists(objName)) {
+        return false;
+      }
       H5::Group group(file.openGroup(objName));
+      if (!group.attrExists(attributeName)) {
+        return false;
+      }
       H5::Attribute attr = group.openAttribute(attributeName);
-      H5::DataType attrType = attr.getDataType();
-      attr.read(attrType, &attributeValue);
+      values.resize(attr.getSpace().getSimpleExtentNpoints());
+      attr.read(h5_type<T>(), values.data());
       return true;
     } catch (H5::Exception &e) {
       return false;
@@ -61,6 +308,10 @@ public:
   }
 
 private:
+  H5::DSetCreatPropList creationPlist(hsize_t nrows, hsize_t ncols,
+                                      size_t elem_size) const;
+  void writeChunks(H5::DataSet &dataset, const char *data, hsize_t nrows,
+                   hsize_t ncols, size_t elem_size) const;
 };
 
 #endif // SERIAL_IO_H_
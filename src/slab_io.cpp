@@ -0,0 +1,379 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for reading datasets in slabs of rows
+ * on several threads, straight into the arrays they end up in.
+ *
+ * HDF5 (even built thread safe) only runs one call at a time, so threads
+ * reading through it take turns. A dataset stored uncompressed, whether
+ * contiguously or in chunks (as SWIFT writes them), is read by the threads
+ * at once with pread from where HDF5 says the data (or each chunk) starts,
+ * bypassing the library. Anything else (compressed, or needing its type
+ * converted) is read through HDF5, a slab at a time, using a strided
+ * selection of the destination so HDF5 converts and scatters the values into
+ * place itself. Those slabs are read one at a time, however many threads are
+ * reading.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+/* Local includes. */
+#include "logging.h"
+#include "memory.h"
+#include "slab_io.h"
+
+/**
+ * @brief A dataset being read, with how to read it.
+ *
+ * A contiguous dataset is read directly as a single chunk of every row.
+ *
+ * @param target Where the dataset goes.
+ * @param elem_size The size of a value in memory.
+ * @param chunk_rows The number of rows in a chunk (if read directly).
+ * @param chunk_offsets Where each chunk starts in the file (if read
+ *                      directly).
+ * @param direct Is the data read directly (bypassing HDF5)?
+ */
+struct SlabSource {
+  const SlabTarget *target;
+  size_t elem_size;
+  size_t chunk_rows;
+  std::vector<haddr_t> chunk_offsets;
+  bool direct;
+};
+
+/**
+ * @brief A slab of rows of a dataset, the unit of work.
+ *
+ * @param source The dataset.
+ * @param start The first row in the file.
+ * @param count The number of rows.
+ * @param dest_row Where the first row goes in memory (in rows).
+ */
+struct Slab {
+  size_t source;
+  size_t start;
+  size_t count;
+  size_t dest_row;
+};
+
+/** @brief Can a dataset be read straight from the file with pread?
+ *
+ * It can if it's uncompressed, has been written, and is already in the type
+ * (and byte order) wanted in memory. It must also either be stored
+ * contiguously or in chunks of whole rows, every chunk holding rows that are
+ * read having been written.
+ *
+ * @param file The file.
+ * @param dataset The dataset.
+ * @param dims The shape of the dataset.
+ * @param nrows The number of rows read (from the first).
+ * @param source The dataset being read (its chunks are set if it can).
+ */
+static bool can_read_direct(HDF5Helper &file, H5::DataSet &dataset,
+                            const hsize_t *dims, size_t nrows,
+                            SlabSource &source) {
+
+  /* Only the default driver keeps the file as a single plain file. */
+  if (file.file.getAccessPlist().getDriver() != H5FD_SEC2) {
+    return false;
+  }
+
+  H5::DSetCreatPropList plist = dataset.getCreatePlist();
+  if (plist.getNfilters() != 0 ||
+      !(dataset.getDataType() == *source.target->mem_type)) {
+    return false;
+  }
+  source.chunk_offsets.clear();
+
+  /* Contiguous, one chunk of every row. */
+  if (plist.getLayout() == H5D_CONTIGUOUS) {
+    haddr_t offset = dataset.getOffset();
+    source.chunk_rows = std::max<hsize_t>(dims[0], 1);
+    source.chunk_offsets.push_back(offset);
+    return offset != HADDR_UNDEF;
+  }
+
+  /* Chunked, where each chunk holding rows read starts. */
+  if (plist.getLayout() != H5D_CHUNKED) {
+    return false;
+  }
+  hsize_t chunk_dims[2] = {0, 1};
+  int ndims = plist.getChunk(2, chunk_dims);
+  if (ndims < 1 || chunk_dims[0] == 0 ||
+      (ndims == 2 && chunk_dims[1] != dims[1])) {
+    return false;
+  }
+  size_t row_size = dims[1] * source.elem_size;
+  source.chunk_rows = chunk_dims[0];
+  for (size_t start = 0; start < nrows; start += source.chunk_rows) {
+    hsize_t coords[2] = {start, 0};
+    unsigned filter_mask = 0;
+    haddr_t addr = HADDR_UNDEF;
+    hsize_t size = 0;
+    if (H5Dget_chunk_info_by_coord(dataset.getId(), coords, &filter_mask,
+                                   &addr, &size) < 0 ||
+        addr == HADDR_UNDEF || size != source.chunk_rows * row_size) {
+      return false;
+    }
+    source.chunk_offsets.push_back(addr);
+  }
+  return true;
+}
+
+/** @brief Read bytes from a file with pread.
+ *
+ * @param fd The file.
+ * @param buffer Where the bytes go.
+ * @param nbytes The number of bytes.
+ * @param offset Where the bytes start in the file.
+ *
+ * @return Were all the bytes read?
+ */
+static bool pread_all(int fd, char *buffer, size_t nbytes, off_t offset) {
+
+  /* pread can return short, keep going until everything is in. */
+  size_t done = 0;
+  while (done < nbytes) {
+    ssize_t got = pread(fd, buffer + done, nbytes - done,
+                        offset + static_cast<off_t>(done));
+    if (got <= 0) {
+      return false;
+    }
+    done += got;
+  }
+  return true;
+}
+
+/** @brief Read a slab with pread, a chunk of the dataset at a time.
+ *
+ * Rows packed together in memory (an array of IDs alone, say) are read
+ * straight into place. Rows going into a field of an array of structs are
+ * read into the staging buffer and copied into their structs, since a row
+ * in the file is only a few bytes of each struct.
+ *
+ * @param fd The file.
+ * @param source The dataset.
+ * @param slab The slab.
+ * @param staging The thread's buffer for a slab going into an array of
+ *                structs.
+ */
+static void read_direct(int fd, const SlabSource &source, const Slab &slab,
+                        tracked_vector<char, mem_io> &staging) {
+
+  const SlabTarget &target = *source.target;
+  size_t row_size = target.ncols * source.elem_size;
+  char *dest = target.dest + slab.dest_row * target.stride;
+  bool packed = target.stride == row_size;
+  if (!packed) {
+    staging.resize(slab.count * row_size);
+  }
+  char *buffer = packed ? dest : staging.data();
+
+  /* The slab's rows in each chunk they span. */
+  size_t done = 0;
+  while (done < slab.count) {
+    size_t row = slab.start + done;
+    size_t chunk = row / source.chunk_rows;
+    size_t within = row - chunk * source.chunk_rows;
+    size_t count = std::min(slab.count - done, source.chunk_rows - within);
+    if (!pread_all(fd, buffer + done * row_size, count * row_size,
+                   source.chunk_offsets[chunk] + within * row_size)) {
+      error("Failed to read %s (rows %zu-%zu)!", target.dataset.c_str(),
+            slab.start, slab.start + slab.count);
+    }
+    done += count;
+  }
+
+  /* A row's columns are contiguous in memory too, so copy whole rows. */
+  if (!packed) {
+    for (size_t i = 0; i < slab.count; i++) {
+      std::memcpy(dest + i * target.stride, staging.data() + i * row_size,
+                  row_size);
+    }
+  }
+}
+
+/** @brief Read a slab through HDF5, straight into place (HDF5 scatters the
+ * rows into memory and converts them if needed, see HDF5Helper::readRows).
+ *
+ * @param file The file.
+ * @param source The dataset.
+ * @param slab The slab.
+ */
+static void read_hdf5(HDF5Helper &file, const SlabSource &source,
+                      const Slab &slab) {
+
+  const SlabTarget &target = *source.target;
+  if (!file.readRows(target.dataset,
+                     target.dest + slab.dest_row * target.stride,
+                     *target.mem_type, slab.start, slab.count, target.ncols,
+                     target.stride)) {
+    error("Failed to read %s (rows %zu-%zu)!", target.dataset.c_str(),
+          slab.start, slab.start + slab.count);
+  }
+}
+
+/** @brief Read rows of datasets into memory in slabs on several threads.
+ *
+ * The same rows are read from every dataset, and the rows read are put one
+ * after another in memory. The ranges are split into slabs of at most
+ * slab_rows rows and the threads take slabs from all the datasets until
+ * they're all read, so the reading stays balanced however the datasets
+ * differ in size.
+ *
+ * These threads are separate from the threadpool (this runs alongside the
+ * halo finding).
+ *
+ * @param file The file.
+ * @param targets The datasets and where to put them.
+ * @param ranges The rows to read (in the order they go in memory).
+ * @param nthreads The number of threads to read with.
+ *
+ * @return The number of datasets read directly (bypassing HDF5).
+ */
+size_t read_slabs(HDF5Helper &file, const std::vector<SlabTarget> &targets,
+                const std::vector<RowRange> &ranges, int nthreads) {
+
+  size_t nrows = 0;
+  for (const RowRange &range : ranges) {
+    nrows = std::max(nrows, range.start + range.count);
+  }
+
+  /* Work out how each dataset will be read, and check its shape. */
+  std::vector<SlabSource> sources(targets.size());
+  size_t ndirect = 0;
+  for (size_t i = 0; i < targets.size(); i++) {
+    const SlabTarget &target = targets[i];
+    SlabSource &source = sources[i];
+    source.target = &target;
+
+    /* Checked holding the HDF5 lock, released before the reading starts. */
+    HDF5Lock lock;
+    source.elem_size = target.mem_type->getSize();
+    source.direct = false;
+    if (target.stride % source.elem_size != 0 ||
+        target.stride < target.ncols * source.elem_size) {
+      error("Can't read %s into memory with a stride of %zu bytes!",
+            target.dataset.c_str(), target.stride);
+    }
+
+    try {
+      H5::DataSet dataset = file.file.openDataSet(target.dataset);
+      H5::DataSpace space = dataset.getSpace();
+      int ndims = space.getSimpleExtentNdims();
+      hsize_t dims[2] = {0, 1};
+      if (ndims < 1 || ndims > 2) {
+        error("%s has %d dimensions!", target.dataset.c_str(), ndims);
+      }
+      space.getSimpleExtentDims(dims);
+      if (dims[0] < nrows || dims[1] != target.ncols) {
+        error("%s has shape (%llu, %llu), expected at least (%zu, %llu)!",
+              target.dataset.c_str(), static_cast<unsigned long long>(dims[0]),
+              static_cast<unsigned long long>(dims[1]), nrows,
+              static_cast<unsigned long long>(target.ncols));
+      }
+      source.direct = can_read_direct(file, dataset, dims, nrows, source);
+    } catch (H5::Exception &e) {
+      error("Failed to open %s!", target.dataset.c_str());
+    }
+    ndirect += source.direct;
+  }
+
+  /* The slabs, in dataset order. */
+  std::vector<Slab> slabs;
+  for (size_t i = 0; i < sources.size(); i++) {
+    size_t dest_row = 0;
+    for (const RowRange &range : ranges) {
+      for (size_t done = 0; done < range.count; done += slab_rows) {
+        size_t count = std::min<size_t>(slab_rows, range.count - done);
+        slabs.push_back({i, range.start + done, count, dest_row});
+        dest_row += count;
+      }
+    }
+  }
+
+  /* The file for reading directly. */
+  int fd = -1;
+  if (ndirect > 0) {
+    std::string path;
+    {
+      HDF5Lock lock;
+      path = file.file.getFileName();
+    }
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      error("Failed to open %s!", path.c_str());
+    }
+  }
+
+  /* Each thread takes the next slab until there are none left (or one has
+   * failed). */
+  std::atomic<size_t> next_slab(0);
+  std::mutex lock;
+  std::exception_ptr failure;
+  auto work = [&]() {
+    tracked_vector<char, mem_io> staging;
+    try {
+      size_t i;
+      while ((i = next_slab++) < slabs.size()) {
+        const SlabSource &source = sources[slabs[i].source];
+        if (source.direct) {
+          read_direct(fd, source, slabs[i], staging);
+        } else {
+          read_hdf5(file, source, slabs[i]);
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!failure) {
+        failure = std::current_exception();
+      }
+      next_slab = slabs.size();
+    }
+  };
+
+  int nworkers = std::max(1, std::min<int>(nthreads, slabs.size()));
+  std::vector<std::thread> workers;
+  for (int i = 1; i < nworkers; i++) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (failure) {
+    std::rethrow_exception(failure);
+  }
+
+  v_message("Read %zu datasets (%zu directly) in %zu slabs on %d threads",
+            targets.size(), ndirect, slabs.size(), nworkers);
+
+  return ndirect;
+}
@@ -0,0 +1,73 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definitions for reading datasets in slabs
+ * of rows on several threads, straight into the arrays they end up in.
+ ******************************************************************************/
+#ifndef SLAB_IO_H_
+#define SLAB_IO_H_
+
+/* Includes */
+#include <H5Cpp.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "serial_io.h"
+
+/* The number of rows of a dataset read at once by a thread. */
+#define slab_rows (1 << 18)
+
+/**
+ * @brief A dataset to read and where its rows go in memory.
+ *
+ * The i-th row read (ncols values of mem_type) goes to dest + i * stride, so
+ * a dataset can be read straight into a field of an array of structs.
+ *
+ * @param dataset The path of the dataset.
+ * @param dest Where the first row goes.
+ * @param stride The bytes between rows in memory.
+ * @param ncols The number of columns (1 for a 1D dataset).
+ * @param mem_type The type of the values in memory (one of the predefined
+ *                 types, see h5_type, pointed to since copying an HDF5 type
+ *                 calls HDF5).
+ */
+struct SlabTarget {
+  std::string dataset;
+  char *dest;
+  size_t stride;
+  hsize_t ncols;
+  const H5::PredType *mem_type;
+};
+
+/**
+ * @brief A run of consecutive rows to read.
+ *
+ * @param start The first row.
+ * @param count The number of rows.
+ */
+struct RowRange {
+  size_t start;
+  size_t count;
+};
+
+/* Prototypes */
+size_t read_slabs(HDF5Helper &file, const std::vector<SlabTarget> &targets,
+                  const std::vector<RowRange> &ranges, int nthreads);
+
+#endif // SLAB_IO_H_
@@ -0,0 +1,475 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality for finding the files a snapshot is
+ * written in and reading them.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+/* Local includes. */
+#include "logging.h"
+#include "serial_io.h"
+#include "snapshot.h"
+
+/** @brief Open a snapshot file (HDF5's exceptions aren't std::exceptions).
+ *
+ * @param path The file.
+ */
+static std::unique_ptr<HDF5Helper> open_snapshot(const std::string &path) {
+  try {
+    return std::make_unique<HDF5Helper>(path);
+  } catch (H5::Exception &e) {
+    error("Failed to open the snapshot %s!", path.c_str());
+  }
+  return nullptr;
+}
+
+/** @brief Get the number of dark matter particles in a snapshot file.
+ *
+ * Taken from the header (NumPart_ThisFile) if there is one, otherwise from
+ * the length of the particle IDs.
+ *
+ * @param path The file.
+ */
+static size_t count_particles(const std::string &path) {
+
+  std::unique_ptr<HDF5Helper> file = open_snapshot(path);
+
+  std::vector<uint64_t> npart_file;
+  if (file->readAttributeArray("/Header", "NumPart_ThisFile", npart_file) &&
+      npart_file.size() > 1) {
+    return npart_file[1];
+  }
+
+  std::vector<hsize_t> dims;
+  if (!file->getDatasetDims("/PartType1/ParticleIDs", dims) ||
+      dims.size() != 1) {
+    error("Failed to get the number of particles in %s!", path.c_str());
+  }
+  return dims[0];
+}
+
+/** @brief The constructor for SnapshotFiles, finding the files a snapshot is
+ * written in and which of their particles to read.
+ *
+ * @param path The snapshot (base_0042.hdf5), distributed snapshots are found
+ *             by looking for base_0042.0.hdf5.
+ * @param lower The lower corner of the region to load (nullptr for all).
+ * @param upper The upper corner of the region to load (nullptr for all).
+ */
+SnapshotFiles::SnapshotFiles(const std::string &path, const double *lower,
+                             const double *upper)
+    : nrows_total(0) {
+
+  /* Is the snapshot distributed? */
+  std::string stem = path;
+  const std::string ext = ".hdf5";
+  if (stem.size() > ext.size() &&
+      stem.compare(stem.size() - ext.size(), ext.size(), ext) == 0) {
+    stem.erase(stem.size() - ext.size());
+  }
+  std::string first_part = stem + ".0" + ext;
+
+  if (std::filesystem::exists(first_part)) {
+
+    /* The header says how many files there are, otherwise count them. */
+    std::vector<int64_t> nfiles;
+    {
+      std::unique_ptr<HDF5Helper> file = open_snapshot(first_part);
+      file->readAttributeArray("/Header", "NumFilesPerSnapshot", nfiles);
+    }
+    if (!nfiles.empty()) {
+      for (int64_t i = 0; i < nfiles[0]; i++) {
+        paths.push_back(stem + "." + std::to_string(i) + ext);
+      }
+    } else {
+      std::string part = first_part;
+      while (std::filesystem::exists(part)) {
+        paths.push_back(part);
+        part = stem + "." + std::to_string(paths.size()) + ext;
+      }
+    }
+  } else {
+    paths.push_back(path);
+  }
+
+  /* Which rows are read from each file? */
+  std::vector<size_t> nrows(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    nrows[i] = count_particles(paths[i]);
+    nrows_total += nrows[i];
+  }
+  if (lower != nullptr) {
+    selectRegion(nrows, lower, upper);
+  } else {
+    ranges.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+      ranges[i].push_back({0, nrows[i]});
+    }
+  }
+
+  countRows();
+
+  if (paths.size() > 1) {
+    v_message("%s is distributed over %zu files", path.c_str(),
+              paths.size());
+  }
+}
+
+/** @brief Work out how many particles are read from each file and where
+ * they go.
+ */
+void SnapshotFiles::countRows() {
+  counts.assign(paths.size(), 0);
+  offsets.assign(1, 0);
+  for (size_t i = 0; i < paths.size(); i++) {
+    for (const RowRange &range : ranges[i]) {
+      counts[i] += range.count;
+    }
+    offsets.push_back(offsets.back() + counts[i]);
+  }
+}
+
+/** @brief Read the snapshot's cell metadata.
+ *
+ * The cells are read from the first file's /Cells, which describes every
+ * cell in the snapshot.
+ */
+SnapshotCells SnapshotFiles::readCells() const {
+
+  std::unique_ptr<HDF5Helper> file = open_snapshot(paths[0]);
+
+  SnapshotCells cells;
+  if (!file->readAttributeArray("/Cells/Meta-data", "size", cells.width) ||
+      cells.width.size() != 3 ||
+      !file->readDataset("/Cells/Centres", cells.centres) ||
+      !file->readDataset("/Cells/Counts/PartType1", cells.counts) ||
+      cells.centres.size() != 3 * cells.counts.size()) {
+    error("%s has no cell metadata (/Cells)!", paths[0].c_str());
+  }
+
+  /* The header says how big the box is (one value for a cube). */
+  file->readAttributeArray("/Header", "BoxSize", cells.boxsize);
+  if (cells.boxsize.size() == 1) {
+    cells.boxsize.assign(3, cells.boxsize[0]);
+  }
+
+  return cells;
+}
+
+/** @brief Select the rows of the cells overlapping a region.
+ *
+ * Each cell's particles are found either by the file they're in and their
+ * offset in it (Files and OffsetsInFile), or by their offset in the whole
+ * snapshot (Offsets, older snapshots).
+ *
+ * @param nrows The number of particles in each file.
+ * @param lower The lower corner of the region.
+ * @param upper The upper corner of the region.
+ */
+void SnapshotFiles::selectRegion(const std::vector<size_t> &nrows,
+                                 const double *lower, const double *upper) {
+
+  /* The cells' centres, width and particle counts. */
+  SnapshotCells cells = readCells();
+  const std::vector<double> &centres = cells.centres;
+  const std::vector<double> &width = cells.width;
+  const std::vector<uint64_t> &cell_counts = cells.counts;
+  const std::vector<double> &boxsize = cells.boxsize;
+  size_t ncells = cells.size();
+
+  /* Where each cell's particles are. */
+  std::unique_ptr<HDF5Helper> file = open_snapshot(paths[0]);
+  std::vector<int64_t> cell_files(ncells, 0);
+  std::vector<uint64_t> cell_offsets;
+  bool have_offsets;
+  {
+    HDF5Lock lock;
+    have_offsets = file->file.nameExists("/Cells/OffsetsInFile");
+  }
+  if (have_offsets) {
+    if (!file->readDataset("/Cells/Files/PartType1", cell_files) ||
+        !file->readDataset("/Cells/OffsetsInFile/PartType1", cell_offsets)) {
+      error("Failed to read the cell offsets from %s!", paths[0].c_str());
+    }
+  } else {
+    if (!file->readDataset("/Cells/Offsets/PartType1", cell_offsets)) {
+      error("Failed to read the cell offsets from %s!", paths[0].c_str());
+    }
+
+    /* Convert the offsets in the snapshot to offsets in each file. */
+    size_t file_start = 0, f = 0;
+    std::vector<std::pair<uint64_t, size_t>> order(ncells);
+    for (size_t c = 0; c < ncells; c++) {
+      order[c] = {cell_offsets[c], c};
+    }
+    std::sort(order.begin(), order.end());
+    for (const auto &pair : order) {
+      while (f + 1 < nrows.size() && pair.first >= file_start + nrows[f]) {
+        file_start += nrows[f++];
+      }
+      cell_files[pair.second] = f;
+      cell_offsets[pair.second] -= file_start;
+    }
+  }
+
+  /* Take the cells overlapping the region (a region reaching outside the box
+   * wraps around it, if the header says how big the box is). */
+  ranges.assign(paths.size(), {});
+  size_t nselected = 0;
+  for (size_t c = 0; c < ncells; c++) {
+    bool overlaps = cell_counts[c] > 0;
+    for (int k = 0; k < 3 && overlaps; k++) {
+      double box = boxsize.size() == 3 ? boxsize[k] : 0;
+      overlaps = false;
+      for (int shift = box > 0 ? -1 : 0; shift <= (box > 0 ? 1 : 0);
+           shift++) {
+        double centre = centres[3 * c + k] + shift * box;
+        overlaps |= centre + 0.5 * width[k] > lower[k] &&
+                    centre - 0.5 * width[k] < upper[k];
+      }
+    }
+    if (!overlaps) {
+      continue;
+    }
+    size_t f = cell_files[c];
+    if (f >= paths.size() || cell_offsets[c] + cell_counts[c] > nrows[f]) {
+      error("Cell %zu's particles aren't in %s!", c, paths[0].c_str());
+    }
+    ranges[f].push_back({cell_offsets[c], cell_counts[c]});
+    nselected++;
+  }
+
+  /* Read neighbouring cells as one run. */
+  for (std::vector<RowRange> &file_ranges : ranges) {
+    std::sort(file_ranges.begin(), file_ranges.end(),
+              [](const RowRange &a, const RowRange &b) {
+                return a.start < b.start;
+              });
+    std::vector<RowRange> merged;
+    for (const RowRange &range : file_ranges) {
+      if (!merged.empty() &&
+          merged.back().start + merged.back().count == range.start) {
+        merged.back().count += range.count;
+      } else {
+        merged.push_back(range);
+      }
+    }
+    file_ranges = std::move(merged);
+  }
+
+  v_message("Loading %zu of %zu cells in the region [%g, %g, %g] - "
+            "[%g, %g, %g]",
+            nselected, ncells, lower[0], lower[1], lower[2], upper[0],
+            upper[1], upper[2]);
+}
+
+/** @brief Read the group IDs of the rows selected, a batch at a time.
+ *
+ * Each file's runs of rows are read in batches of at most fof_scan_rows
+ * rows (split up if need be), so only a batch of group IDs is ever held
+ * however big the snapshot.
+ *
+ * @param files The snapshot's files.
+ * @param nthreads The number of threads to read each batch with.
+ * @param visit Called for each run (in order) with its file, its rows and
+ *              their group IDs.
+ */
+static void scan_groups(
+    const SnapshotFiles &files, int nthreads,
+    const std::function<void(size_t, const RowRange &, const int64_t *)>
+        &visit) {
+
+  tracked_vector<int64_t, mem_io> batch_groups(fof_scan_rows);
+  std::vector<RowRange> batch;
+  size_t batch_rows = 0;
+
+  for (size_t f = 0; f < files.paths.size(); f++) {
+    if (files.counts[f] == 0) {
+      continue;
+    }
+    std::unique_ptr<HDF5Helper> file = open_snapshot(files.paths[f]);
+
+    /* Read the runs batched so far, handing each to visit. */
+    auto flush = [&]() {
+      read_slabs(*file,
+                 {{"/PartType1/FOFGroupIDs",
+                   reinterpret_cast<char *>(batch_groups.data()),
+                   sizeof(int64_t), 1, &h5_type<int64_t>()}},
+                 batch, nthreads);
+      size_t done = 0;
+      for (const RowRange &run : batch) {
+        visit(f, run, batch_groups.data() + done);
+        done += run.count;
+      }
+      batch.clear();
+      batch_rows = 0;
+    };
+
+    for (const RowRange &range : files.ranges[f]) {
+      for (size_t start = range.start; start < range.start + range.count;) {
+        size_t count = std::min(range.start + range.count - start,
+                                fof_scan_rows - batch_rows);
+        batch.push_back({start, count});
+        batch_rows += count;
+        start += count;
+        if (batch_rows == fof_scan_rows) {
+          flush();
+        }
+      }
+    }
+    if (batch_rows > 0) {
+      flush();
+    }
+  }
+}
+
+/** @brief Only keep the particles in FOF groups with at least threshold
+ * particles.
+ *
+ * The group each particle is in (/PartType1/FOFGroupIDs, as SWIFT writes when
+ * running FOF on the fly) is scanned a batch at a time over the rows already
+ * selected, first to count each group's particles and then to drop every
+ * other row, so the field particles are never read. Group sizes are counted
+ * over the rows selected (so a group cut by a region only counts the
+ * particles inside it). Only a count per group and the group IDs of the
+ * particles kept (groups, for the particles' fof_group) are held.
+ *
+ * @param threshold The fewest particles a group can have.
+ * @param field_id The group ID of particles in no group.
+ * @param nthreads The number of threads to read with.
+ */
+void SnapshotFiles::selectGroups(size_t threshold, int64_t field_id,
+                                 int nthreads) {
+
+  /* Count each group's particles. */
+  std::unordered_map<int64_t, size_t> group_size;
+  scan_groups(*this, nthreads,
+              [&](size_t, const RowRange &run, const int64_t *ids) {
+                for (size_t i = 0; i < run.count; i++) {
+                  if (ids[i] != field_id) {
+                    group_size[ids[i]]++;
+                  }
+                }
+              });
+  size_t ngroups = 0, nkept = 0, total = npart();
+  for (const auto &pair : group_size) {
+    if (pair.second >= threshold) {
+      ngroups++;
+      nkept += pair.second;
+    }
+  }
+
+  /* Keep the runs of rows in big enough groups, and their groups. */
+  std::vector<std::vector<RowRange>> kept(paths.size());
+  groups.clear();
+  groups.reserve(nkept);
+  scan_groups(*this, nthreads,
+              [&](size_t f, const RowRange &run, const int64_t *ids) {
+                std::vector<RowRange> &file_kept = kept[f];
+                for (size_t i = 0; i < run.count; i++) {
+                  if (ids[i] == field_id || group_size[ids[i]] < threshold) {
+                    continue;
+                  }
+                  size_t row = run.start + i;
+                  if (!file_kept.empty() &&
+                      file_kept.back().start + file_kept.back().count ==
+                          row) {
+                    file_kept.back().count++;
+                  } else {
+                    file_kept.push_back({row, 1});
+                  }
+                  groups.push_back(ids[i]);
+                }
+              });
+  ranges = std::move(kept);
+  countRows();
+
+  v_message("Loading the %zu particles (of %zu) in %zu FOF groups with at "
+            "least %zu particles",
+            npart(), total, ngroups, threshold);
+}
+
+/** @brief Read the snapshot's datasets into memory.
+ *
+ * The targets say where the first particle's values go (see read_slabs),
+ * each file's are put after the files before it. Several files are read at
+ * once (a parallel filesystem serves concurrent files far faster than one),
+ * each on its share of the threads.
+ *
+ * @param targets The datasets and where the first particle's values go.
+ * @param nthreads The number of threads to read with.
+ */
+void SnapshotFiles::read(const std::vector<SlabTarget> &targets,
+                         int nthreads) const {
+
+  size_t nfiles = paths.size();
+  int nworkers = std::max(1, std::min<int>(nthreads, nfiles));
+  int file_threads = std::max(1, nthreads / nworkers);
+
+  /* Each worker takes the next file until there are none left (or one has
+   * failed). */
+  std::atomic<size_t> next_file(0);
+  std::mutex lock;
+  std::exception_ptr failure;
+  auto work = [&]() {
+    try {
+      size_t i;
+      while ((i = next_file++) < nfiles) {
+        if (counts[i] == 0) {
+          continue;
+        }
+        std::vector<SlabTarget> file_targets = targets;
+        for (SlabTarget &target : file_targets) {
+          target.dest += offsets[i] * target.stride;
+        }
+        std::unique_ptr<HDF5Helper> file = open_snapshot(paths[i]);
+        read_slabs(*file, file_targets, ranges[i], file_threads);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!failure) {
+        failure = std::current_exception();
+      }
+      next_file = nfiles;
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < nworkers; i++) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  if (failure) {
+    std::rethrow_exception(failure);
+  }
+}
@@ -0,0 +1,126 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definitions for finding the files a
+ * snapshot is written in and reading them.
+ ******************************************************************************/
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "memory.h"
+#include "slab_io.h"
+
+/* The most group IDs held at once while selecting FOF groups. */
+#define fof_scan_rows (size_t(1) << 22)
+
+/**
+ * @brief The cell metadata of a snapshot (/Cells), describing the top level
+ * cells SWIFT sorts the particles by.
+ *
+ * @param centres The centre of each cell (3 values a cell).
+ * @param width The width of the cells.
+ * @param counts The number of dark matter particles in each cell.
+ * @param boxsize The size of the box (empty if the header doesn't say).
+ */
+struct SnapshotCells {
+  std::vector<double> centres;
+  std::vector<double> width;
+  std::vector<uint64_t> counts;
+  std::vector<double> boxsize;
+
+  /** @brief The number of cells. */
+  size_t size() const { return counts.size(); }
+};
+
+/**
+ * @class SnapshotFiles
+ * @brief The files a snapshot is written in, and where each file's
+ * particles go.
+ *
+ * A snapshot is either a single file (base_0042.hdf5) or distributed over
+ * several (base_0042.0.hdf5, base_0042.1.hdf5, ...), as SWIFT writes large
+ * runs. A distributed snapshot may also have a master file (base_0042.hdf5)
+ * of virtual datasets, but HDF5 reads those a file at a time, so if the
+ * distributed files are there they're read instead.
+ *
+ * The particles of each file go after those of the files before it, in one
+ * contiguous array.
+ *
+ * Only the particles in a region can be loaded instead, using the cell
+ * metadata SWIFT writes (/Cells). The particles are stored sorted by cell, so
+ * only the runs of rows belonging to cells overlapping the region are read,
+ * and nothing of the rest of the file is touched. Every particle in those
+ * cells is loaded, so the region is rounded out to whole cells. A region
+ * reaching outside the box wraps around it.
+ *
+ * If the snapshot has FOF groups (as SWIFT finds on the fly) only the
+ * particles of groups big enough to be halos can be loaded instead (see
+ * selectGroups), skipping every field particle.
+ *
+ * @param paths The files.
+ * @param nrows_total The number of particles in the whole snapshot.
+ * @param ranges The rows read from each file.
+ * @param counts The number of particles read from each file.
+ * @param offsets Where each file's particles start (plus the total).
+ * @param groups The FOF group of each particle read (if groups were
+ *               selected).
+ */
+class SnapshotFiles {
+public:
+  /* The files. */
+  std::vector<std::string> paths;
+
+  /* The number of particles in the whole snapshot (read or not). */
+  size_t nrows_total;
+
+  /* The rows read from each file. */
+  std::vector<std::vector<RowRange>> ranges;
+
+  /* The number of particles read from each file. */
+  std::vector<size_t> counts;
+
+  /* Where each file's particles start (plus the total). */
+  std::vector<size_t> offsets;
+
+  /* The FOF group of each particle read, found while selecting the groups
+   * (empty unless they were selected). */
+  tracked_vector<int64_t, mem_particles> groups;
+
+  SnapshotFiles(const std::string &path, const double *lower = nullptr,
+                const double *upper = nullptr);
+
+  /** @brief The number of particles in the snapshot. */
+  size_t npart() const { return offsets.back(); }
+
+  SnapshotCells readCells() const;
+  void selectGroups(size_t threshold, int64_t field_id, int nthreads);
+  void read(const std::vector<SlabTarget> &targets, int nthreads) const;
+
+private:
+  void countRows();
+  void selectRegion(const std::vector<size_t> &nrows, const double *lower,
+                    const double *upper);
+};
+
+#endif // SNAPSHOT_H_
@@ -23,6 +23,7 @@
 using namespace std;
 
 /* Local includes. */
+#include "comms.h"
 #include "talking.h"
 #include "version.h"
 
@@ -127,14 +128,9 @@ void say_hello() {
   // #ifdef HAVE_LIBGSL
   //     printf(" GSL library version      : %s\n", libgsl_version());
   // #endif
-  // #ifdef WITH_MPI
-  //     printf(" MPI library version      : %s\n", mpi_version());
-  // #ifdef HAVE_METIS
-  //     printf(" METIS library version    : %s\n", metis_version());
-  // #endif
-  // #ifdef HAVE_PARMETIS
-  //     printf(" ParMETIS library version : %s\n", parmetis_version());
-  // #endif
-  // #endif
+#ifdef WITH_MPI
+  cout << padString(string(" MPI library version: "), nPad)
+       << comms_version() << endl;
+#endif
   printf("\n");
 }
@@ -0,0 +1,116 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the functionality of the task queue used to run
+ * dynamically generated work on the threadpool.
+ ******************************************************************************/
+
+/* Includes. */
+#include <utility>
+
+/* Local includes. */
+#include "tasks.h"
+
+/** @brief The constructor for the TaskQueue.
+ *
+ * @param threadpool The threadpool to run the tasks with.
+ */
+TaskQueue::TaskQueue(ThreadPool *threadpool)
+    : threadpool(threadpool), n_in_flight(0), n_run(0) {}
+
+/** @brief Add a task to the queue.
+ *
+ * This can be called from within a running task to spawn more work.
+ *
+ * @param task The task to add.
+ */
+void TaskQueue::push(Task task) {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    tasks.push_back(std::move(task));
+  }
+  queue_condition.notify_one();
+}
+
+/** @brief Run every task in the queue, including any spawned along the way.
+ *
+ * Returns once the queue is empty and no task is running.
+ */
+void TaskQueue::run() {
+
+  /* Nothing to do? */
+  if (tasks.empty()) {
+    return;
+  }
+
+  /* Map a runner over every thread. The data is a dummy, the runners only
+   * need the queue (passed as the extra data). */
+  int nthreads = threadpool->getNumThreads();
+  std::vector<int> runners(nthreads);
+  threadpool->map(TaskQueue::runner, runners.data(), nthreads, sizeof(int), 1,
+                  this);
+}
+
+/** @brief Execute tasks from the queue until there is no work left.
+ *
+ * @param map_data Unused (a dummy runner per thread).
+ * @param count Unused.
+ * @param extra_data The TaskQueue.
+ */
+void TaskQueue::runner(void *map_data, int count, void *extra_data) {
+  (void)map_data;
+  (void)count;
+
+  TaskQueue *queue = static_cast<TaskQueue *>(extra_data);
+
+  while (true) {
+
+    Task task;
+
+    /* Wait until there is a task or we're all done. */
+    {
+      std::unique_lock<std::mutex> lock(queue->queue_mutex);
+      queue->queue_condition.wait(lock, [&]() {
+        return !queue->tasks.empty() || queue->n_in_flight == 0;
+      });
+
+      /* No tasks and nothing running that could make more, we're done. */
+      if (queue->tasks.empty()) {
+        queue->queue_condition.notify_all();
+        return;
+      }
+
+      /* Take the most recently spawned task. */
+      task = std::move(queue->tasks.back());
+      queue->tasks.pop_back();
+      queue->n_in_flight++;
+    }
+
+    /* Do the work. */
+    task();
+
+    /* Let everyone know we're done with this one. */
+    {
+      std::lock_guard<std::mutex> lock(queue->queue_mutex);
+      queue->n_in_flight--;
+      queue->n_run++;
+      if (queue->tasks.empty() && queue->n_in_flight == 0) {
+        queue->queue_condition.notify_all();
+      }
+    }
+  }
+}
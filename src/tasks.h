@@ -0,0 +1,90 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the definition of the task queue used to run
+ * dynamically generated work (e.g. the substructure search) on the threadpool.
+ ******************************************************************************/
+#ifndef TASKS_H_
+#define TASKS_H_
+
+/* Includes */
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/* Local includes. */
+#include "threadpool.h"
+
+/**
+ * @class TaskQueue
+ * @brief A queue of tasks which can spawn further tasks while running.
+ *
+ * The threadpool can only map a function over an array of known size. Work
+ * such as the substructure search is only known once the work before it has
+ * finished (a subhalo search can only start once its host exists). The
+ * TaskQueue handles this by mapping a "runner" over every thread in the
+ * threadpool. Each runner pulls tasks from the queue until the queue is empty
+ * and no task is still running (since a running task may push more work).
+ *
+ * Tasks are popped in LIFO order so newly spawned children run next, on the
+ * same thread where possible, while their parent's data is still in cache.
+ *
+ * Usage:
+ * - Push the initial tasks with `push`.
+ * - Call `run` to execute them (and anything they spawn) on the threadpool.
+ * - Tasks can safely call `push` on the queue they are running from.
+ */
+class TaskQueue {
+public:
+  /* The type of a task. */
+  using Task = std::function<void()>;
+
+  TaskQueue(ThreadPool *threadpool);
+
+  /* Add a task to the queue (thread safe). */
+  void push(Task task);
+
+  /* Run all tasks (including any spawned while running) to completion. */
+  void run();
+
+  /* How many tasks have been run since construction? */
+  size_t nrun() const { return n_run; }
+
+private:
+  /* The threadpool the runners are mapped over. */
+  ThreadPool *threadpool;
+
+  /* The pending tasks. */
+  std::vector<Task> tasks;
+
+  /* The number of tasks currently being executed. */
+  size_t n_in_flight;
+
+  /* The number of tasks that have been run. */
+  size_t n_run;
+
+  /* Guards for the queue. */
+  std::mutex queue_mutex;
+  std::condition_variable queue_condition;
+
+  /* The function mapped over the threads to execute tasks. */
+  static void runner(void *map_data, int count, void *extra_data);
+};
+
+#endif // TASKS_H_
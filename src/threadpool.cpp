@@ -19,12 +19,17 @@
  * distribute local work over local threads. This implementation uses
  pthreads.
  ******************************************************************************/
+#include "profiler.h"
 #include "threadpool.h"
 #include <atomic>
+#include <climits>
 
 // Declare and define the threadpool_tid globally.
 pthread_key_t threadpool_tid;
 
+// Make sure the threadpool_tid key is only created once.
+static std::once_flag threadpool_tid_once;
+
 /**
  * @brief Constructor for the ThreadPool class.
  *
@@ -32,6 +37,11 @@ pthread_key_t threadpool_tid;
  */
 ThreadPool::ThreadPool(int numThreads)
     : taskInd(0), numThreads(numThreads - 1), numThreadsRunning(0) {
+  std::call_once(threadpool_tid_once,
+                 []() { pthread_key_create(&threadpool_tid, nullptr); });
+
+  // Nothing to map until map is called (a pool can be destroyed unused)
+  this->mapDataSize = 0;
   initializeThreads();
 }
 
@@ -46,8 +56,12 @@ ThreadPool::~ThreadPool() {
   // Clean up the threadpool
   this->mapFunction = nullptr;
 
-  // We're done
-  this->done = true;
+  // We're done (set holding the lock the workers nap with, so none can miss
+  // the wake up below)
+  {
+    std::unique_lock<std::mutex> lock(waitMutex);
+    this->done = true;
+  }
 
   // Wake up the threads to let them know we're done
   runCondition.notify_all();
@@ -84,18 +98,36 @@ void ThreadPool::initializeThreads() {
  * This function sets up the member variables and then signals the worker
  * threads to start processing. The actual work is done in the workerThread.
  *
- * TODO: The main thread should be able to do some work too.
+ * TODO: The main thread should be able to do some work too. For now it only
+ * does the work when there are no worker threads (i.e. running on 1 thread).
  *
  * @param mapFunction The function to apply to each element of the array.
  * @param mapData Pointer to the array of data.
  * @param dataSize The size of the array.
+ * @param stride The size in bytes of each element of the array.
  * @param chunk The defintion to use to define the size of each processing
  *              chunk.
  * @param extraData Additional data to be passed to the map function.
  */
 void ThreadPool::map(std::function<void(void *, int, void *)> mapFunction,
-                     void *mapData, size_t dataSize, int chunk,
-                     void *extraData) {
+                     void *mapData, size_t dataSize, size_t stride,
+                     int chunk, void *extraData) {
+
+  // Nothing to do?
+  if (dataSize == 0) {
+    return;
+  }
+
+  // Without any workers the main thread has to do everything itself
+  if (this->numThreads == 0) {
+    for (size_t ind = 0; ind < dataSize; ind += INT_MAX) {
+      mapFunction(static_cast<char *>(mapData) + ind * stride,
+                  static_cast<int>(std::min<size_t>(dataSize - ind, INT_MAX)),
+                  extraData);
+    }
+    return;
+  }
+
   std::unique_lock<std::mutex> lock(waitMutex);
 
   // Set the map function
@@ -104,6 +136,7 @@ void ThreadPool::map(std::function<void(void *, int, void *)> mapFunction,
   // Set the map data and size
   this->mapData = mapData;
   this->mapDataSize = dataSize;
+  this->mapDataStride = stride;
 
   // Set the extra data
   this->mapExtraData = extraData;
@@ -166,6 +199,7 @@ void ThreadPool::workerThread(int tid) {
   // Set the thread ID for this thread
   int localtid = tid;
   pthread_setspecific(threadpool_tid, &localtid);
+  profiler_name_thread("worker " + std::to_string(tid));
 
   // Define the current threadpool task index.
   size_t currentTaskInd;
@@ -187,6 +221,11 @@ void ThreadPool::workerThread(int tid) {
       numThreadsRunning.fetch_sub(1, std::memory_order_relaxed);
       numThreadsFinished.fetch_add(1, std::memory_order_relaxed);
 
+      // Are we done? (the destructor may have been called before we napped)
+      if (this->done) {
+        break;
+      }
+
       // Signal that, we're waiting and then have a nap
       waitCondition.notify_one();
       runCondition.wait(waitLock);
@@ -204,9 +243,14 @@ void ThreadPool::workerThread(int tid) {
       break;
     }
 
+    // Woken up for a map with fewer chunks than threads, try again
+    if (currentTaskInd >= this->mapDataSize) {
+      continue;
+    }
+
     // Get the pointer to the current map data and current chunk size
-    double *currentMapData =
-        &static_cast<double *>(this->mapData)[currentTaskInd];
+    char *currentMapData = static_cast<char *>(this->mapData) +
+                           currentTaskInd * this->mapDataStride;
 
     // Handle chunks that would extend beyond the end of the map data
     ptrdiff_t currentChunkSize = std::min(
@@ -45,6 +45,8 @@ extern pthread_key_t threadpool_tid;
  *
  * Functions mapped over must have the following signature:
  *   void mapFunction(void *mapData, int size, void *extraData)
+ * where mapData points to the first element of the chunk and size is the
+ * number of elements (each of stride bytes) in the chunk.
  *
  * Key Features:
  * - Automatic and uniform chunking options for workload distribution.
@@ -106,7 +108,18 @@ public:
 
   // Map function to apply a given function to an array of data in parallel
   void map(std::function<void(void *, int, void *)> mapFunction, void *mapData,
-           size_t dataSize, int chunk, void *extraData = nullptr);
+           size_t dataSize, size_t stride, int chunk,
+           void *extraData = nullptr);
+
+  // The number of threads that can run work (including the main thread)
+  int getNumThreads() const { return numThreads + 1; }
+
+  // The ID of the calling thread (workers are 0 to numThreads - 1, the main
+  // thread is numThreads)
+  int getThreadId() const {
+    void *tid = pthread_getspecific(threadpool_tid);
+    return tid != nullptr ? *static_cast<int *>(tid) : numThreads;
+  }
 
 private:
   // Struct to store log entry information
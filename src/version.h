@@ -0,0 +1,9 @@
+#define PROJECT_VERSION_MAJOR 0
+#define PROJECT_VERSION_MINOR 1
+#define PROJECT_VERSION_PATCH 0
+#define GIT_REVISION "6f1a6ce"
+#define GIT_BRANCH "master"
+#define GIT_DATE "2026-10-18"
+#define COMPILER_INFO "GNU@12.2.0"
+#define CFLAGS_INFO "-Wall -Wextra"
+#define HDF5_VERSION "1.10.8"
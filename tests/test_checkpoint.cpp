@@ -0,0 +1,246 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of writing a checkpoint and restarting from
+ * it.
+ ******************************************************************************/
+
+/* Includes. */
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "checkpoint.h"
+#include "generation.h"
+#include "graph.h"
+#include "testing.h"
+
+/** @brief Does restoring from the checkpoint fail?
+ *
+ * @param engine The engine.
+ * @param graph The merger graph (nullptr if not outputting graphs).
+ */
+static bool restore_fails(const Engine *engine, GraphBuilder *graph) {
+  Generation gen;
+  try {
+    read_checkpoint(engine, gen, graph);
+  } catch (std::runtime_error &e) {
+    return true;
+  }
+  return false;
+}
+
+/** @brief Make a generation that has been written out, with some of its
+ * particles in halos at two depths.
+ *
+ * The particles are held as IDs alone, in no particular order.
+ *
+ * @param gen The generation (filled).
+ * @param ids The IDs of the particles.
+ * @param member Is each particle in a halo?
+ */
+static void make_generation(Generation &gen, std::vector<size_t> &ids,
+                            std::vector<bool> &member) {
+  std::mt19937_64 rng(4);
+  size_t npart = 5000;
+  gen.snap = 6;
+  gen.written = true;
+  gen.npart = npart;
+  gen.halo_offset = 17;
+  gen.catalog.nhalos = 40;
+  gen.catalog.halo_id.resize(2);
+  for (size_t p = 0; p < npart; p++) {
+    ids.push_back(1000000 + rng() % 100000000);
+    gen.part_ids.push_back(ids.back());
+
+    /* Most members are only in hosts, some in subhalos too, and a few are
+     * only in a subhalo. */
+    int64_t host = rng() % 3 == 0 ? halo_null : rng() % 30;
+    int64_t sub = rng() % 4 == 0 ? 30 + rng() % 10 : halo_null;
+    gen.catalog.halo_id[0].push_back(host);
+    gen.catalog.halo_id[1].push_back(sub);
+    member.push_back(host != halo_null || sub != halo_null);
+  }
+
+  gen.owned.shared = true;
+  gen.owned.min_id = 12;
+  gen.owned.max_id = 34567;
+  gen.owned.ndepths = 2;
+  gen.owned.ids = {12, 40, 41, 9999};
+  gen.owned.halos = {3, halo_null, 5, 6, 7, halo_null, 0, 1};
+}
+
+/** @brief Restarting reproduces the generation's memberships, rebuilt over
+ * the halo members alone in ID order.
+ *
+ * @param engine The engine.
+ */
+static void check_generation(Engine *engine) {
+  Generation gen;
+  std::vector<size_t> ids;
+  std::vector<bool> member;
+  make_generation(gen, ids, member);
+  write_checkpoint(engine, gen, nullptr);
+  check(std::filesystem::exists(engine->checkpointPath()));
+  check(!std::filesystem::exists(engine->checkpointPath() + ".tmp"));
+
+  Generation restored;
+  restored.snap = 99;
+  read_checkpoint(engine, restored, nullptr);
+  check(restored.snap == gen.snap);
+  check(restored.written);
+  check(restored.catalog.nhalos == gen.catalog.nhalos);
+  check(restored.halo_offset == gen.halo_offset);
+  check(restored.catalog.halo_id.size() == 2);
+
+  /* Every member is found at a row holding its halos, in ID order. */
+  size_t nmembers = 0, nwrong = 0;
+  for (size_t p = 0; p < ids.size(); p++) {
+    size_t row = restored.index.find(ids[p]);
+    if (!member[p]) {
+      nwrong += row != id_index_none;
+      continue;
+    }
+    nmembers++;
+    if (row == id_index_none || row >= restored.catalog.halo_id[0].size()) {
+      nwrong++;
+      continue;
+    }
+    for (size_t d = 0; d < 2; d++) {
+      nwrong += restored.catalog.halo_id[d][row] != gen.catalog.halo_id[d][p];
+    }
+  }
+  check(nwrong == 0);
+  check(restored.index.nids == nmembers);
+  check(restored.catalog.halo_id[0].size() == nmembers);
+  check(restored.catalog.halo_id[1].size() == nmembers);
+
+  /* The memberships owned on several ranks. */
+  check(restored.owned.shared);
+  check(restored.owned.min_id == gen.owned.min_id);
+  check(restored.owned.max_id == gen.owned.max_id);
+  check(restored.owned.ndepths == gen.owned.ndepths);
+  check(restored.owned.ids == gen.owned.ids);
+  check(restored.owned.halos == gen.owned.halos);
+
+  /* Restarting with graph output needs a checkpoint written with it. */
+  GraphBuilder graph(engine);
+  check(restore_fails(engine, &graph));
+}
+
+/** @brief Restarting restores the merger graph, dropping anything streamed
+ * after the checkpoint was written.
+ *
+ * @param engine The engine.
+ */
+static void check_graph(Engine *engine) {
+  Generation gen;
+  gen.snap = 1;
+  gen.catalog.halo_id.resize(1);
+
+  /* Two snapshots added by the checkpoint and a third after it. */
+  std::vector<int64_t> parent = {halo_null, halo_null, 0};
+  std::vector<size_t> npart = {30, 20, 10};
+  std::vector<size_t> offsets = {0, 1, 2, 2};
+  std::vector<int64_t> progs = {1, 0};
+  GraphBuilder graph(engine);
+  graph.addHalos(0, 3, parent.data(), npart.data(), nullptr, progs.data());
+  graph.addHalos(1, 3, parent.data(), npart.data(), offsets.data(),
+                 progs.data());
+  write_checkpoint(engine, gen, &graph);
+  graph.addHalos(2, 3, parent.data(), npart.data(), nullptr, progs.data());
+  graph.scratch.close();
+
+  engine->restart = 1;
+  GraphBuilder restored(engine);
+  Generation restored_gen;
+  read_checkpoint(engine, restored_gen, &restored);
+  check(restored.last_snap == 1);
+  check(restored.nrecords == 6);
+  check(restored.labels == std::vector<uint64_t>(graph.labels.begin(),
+                                                 graph.labels.end() - 2));
+  check((restored.frontier == std::vector<uint64_t>{1, 0, 1}));
+  check(std::filesystem::file_size(restored.scratch_path) ==
+        6 * sizeof(GraphRecord));
+  check(restored_gen.catalog.halo_id.size() == 1);
+  check(restored_gen.index.nids == 0);
+
+  /* Carrying on from the restart gives the same graph. */
+  restored.addHalos(2, 3, parent.data(), npart.data(), nullptr, progs.data());
+  check(restored.nrecords == graph.nrecords);
+  check(restored.labels == graph.labels);
+  check(std::filesystem::file_size(restored.scratch_path) ==
+        9 * sizeof(GraphRecord));
+  restored.scratch.close();
+  engine->restart = 0;
+
+  /* And restarting without graph output needs a checkpoint written without
+   * it. */
+  check(restore_fails(engine, nullptr));
+}
+
+/** @brief A missing, foreign or cut short checkpoint can't be restarted
+ * from.
+ *
+ * @param engine The engine.
+ */
+static void check_bad_checkpoints(const Engine *engine) {
+  std::string path = engine->checkpointPath();
+  Generation gen;
+  std::vector<size_t> ids;
+  std::vector<bool> member;
+  make_generation(gen, ids, member);
+  write_checkpoint(engine, gen, nullptr);
+  check(!restore_fails(engine, nullptr));
+
+  /* Cut short, missing its closing magic (or more). */
+  size_t size = std::filesystem::file_size(path);
+  std::filesystem::resize_file(path, size - 1);
+  check(restore_fails(engine, nullptr));
+  std::filesystem::resize_file(path, size / 2);
+  check(restore_fails(engine, nullptr));
+
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << "not mega";
+  check(restore_fails(engine, nullptr));
+
+  std::filesystem::remove(path);
+  check(restore_fails(engine, nullptr));
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+
+  std::filesystem::path dir =
+      std::filesystem::temp_directory_path() / "mega_test_checkpoint";
+  std::filesystem::create_directories(dir);
+  Parameters params;
+  params.setParameter("Output/output_dir", dir.string());
+  params.setParameter("Output/output_basename", std::string("test_"));
+  Engine *engine = test_engine(params);
+
+  check_generation(engine);
+  check_graph(engine);
+  check_bad_checkpoints(engine);
+
+  std::filesystem::remove_all(dir);
+  return test_finish("test_checkpoint");
+}
@@ -0,0 +1,190 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of splitting the box between ranks
+ * (Decomposition).
+ ******************************************************************************/
+
+/* Includes. */
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+/* Local includes. */
+#include "decomposition.h"
+#include "testing.h"
+
+/* The size of the box. */
+#define boxsize_test 100.0
+
+/** @brief Make the cells of a box with a cube of cells along each side.
+ *
+ * @param ncells The number of cells along a side.
+ * @param plane_counts The particles in each plane of cells along x (spread
+ *                     over the plane's cells, the rest in the first).
+ */
+static SnapshotCells make_cells(int ncells,
+                                const std::vector<uint64_t> &plane_counts) {
+  SnapshotCells cells;
+  double width = boxsize_test / ncells;
+  cells.width.assign(3, width);
+  cells.boxsize.assign(3, boxsize_test);
+  uint64_t per_plane = ncells * ncells;
+  for (int i = 0; i < ncells; i++) {
+    for (int j = 0; j < ncells; j++) {
+      for (int k = 0; k < ncells; k++) {
+        cells.centres.push_back((i + 0.5) * width);
+        cells.centres.push_back((j + 0.5) * width);
+        cells.centres.push_back((k + 0.5) * width);
+        uint64_t count = plane_counts[i] / per_plane;
+        if (j == 0 && k == 0) {
+          count += plane_counts[i] % per_plane;
+        }
+        cells.counts.push_back(count);
+      }
+    }
+  }
+  return cells;
+}
+
+/** @brief Check a decomposition is made of whole planes covering the box,
+ * at least one for each rank, with the particles counted in the right
+ * block.
+ *
+ * @param decomp The decomposition.
+ * @param plane_counts The particles in each plane.
+ */
+static void check_blocks(const Decomposition &decomp,
+                         const std::vector<uint64_t> &plane_counts) {
+  int nplanes = plane_counts.size();
+  double width = boxsize_test / nplanes;
+  check(decomp.bounds.size() == static_cast<size_t>(decomp.nranks) + 1);
+  check(decomp.counts.size() == static_cast<size_t>(decomp.nranks));
+  check(decomp.bounds.front() == 0.0);
+  check(decomp.bounds.back() == boxsize_test);
+
+  size_t nwrong = 0;
+  for (int rank = 0; rank < decomp.nranks; rank++) {
+    int first = std::lround(decomp.bounds[rank] / width);
+    int last = std::lround(decomp.bounds[rank + 1] / width);
+    nwrong += last <= first;
+    nwrong += std::abs(decomp.bounds[rank] - first * width) > 1e-9;
+    nwrong += decomp.counts[rank] !=
+              std::accumulate(plane_counts.begin() + first,
+                              plane_counts.begin() + last, uint64_t(0));
+  }
+  check(nwrong == 0);
+}
+
+/** @brief Split the box, checking the blocks are sound.
+ *
+ * @param ncells The number of cells along a side.
+ * @param plane_counts The particles in each plane.
+ * @param nranks The number of ranks.
+ */
+static Decomposition split(int ncells,
+                           const std::vector<uint64_t> &plane_counts,
+                           int nranks) {
+  Decomposition decomp(make_cells(ncells, plane_counts), boxsize_test,
+                       nranks);
+  check_blocks(decomp, plane_counts);
+  return decomp;
+}
+
+/** @brief The blocks are weighted by the particles in them, not volume.
+ */
+static void check_weighting() {
+
+  /* Evenly spread: the same number of planes each. */
+  Decomposition even = split(8, std::vector<uint64_t>(8, 640), 4);
+  check((even.bounds == std::vector<double>{0, 25, 50, 75, 100}));
+  check((even.counts == std::vector<size_t>{1280, 1280, 1280, 1280}));
+
+  /* A single rank takes the whole box. */
+  Decomposition single = split(4, {5, 6, 7, 8}, 1);
+  check((single.bounds == std::vector<double>{0, 100}));
+  check((single.counts == std::vector<size_t>{26}));
+
+  /* Most particles at one end: the ranks there take fewer planes. */
+  Decomposition skewed = split(4, {10, 10, 10, 70}, 2);
+  check((skewed.bounds == std::vector<double>{0, 75, 100}));
+  check((skewed.counts == std::vector<size_t>{30, 70}));
+  skewed = split(4, {70, 10, 10, 10}, 2);
+  check((skewed.bounds == std::vector<double>{0, 25, 100}));
+  check((skewed.counts == std::vector<size_t>{70, 30}));
+
+  /* Every rank gets a plane, even with every particle in the last. */
+  Decomposition empty = split(4, {0, 0, 0, 100}, 4);
+  check((empty.bounds == std::vector<double>{0, 25, 50, 75, 100}));
+  check((empty.counts == std::vector<size_t>{0, 0, 0, 100}));
+  empty = split(4, {100, 0, 0, 0}, 4);
+  check((empty.counts == std::vector<size_t>{100, 0, 0, 0}));
+
+  /* Randomly clustered: no rank is short of its share by more than the
+   * plane after it. */
+  std::mt19937 rng(5);
+  int nplanes = 32;
+  std::vector<uint64_t> plane_counts(nplanes);
+  for (uint64_t &count : plane_counts) {
+    count = rng() % 4 == 0 ? rng() % 100000 : rng() % 1000;
+  }
+  uint64_t total = std::accumulate(plane_counts.begin(), plane_counts.end(),
+                                   uint64_t(0));
+  for (int nranks = 2; nranks <= 7; nranks++) {
+    Decomposition decomp = split(nplanes, plane_counts, nranks);
+    size_t nwrong = 0;
+    uint64_t taken = 0;
+    for (int rank = 0; rank + 1 < nranks; rank++) {
+      taken += decomp.counts[rank];
+      size_t next =
+          std::lround(decomp.bounds[rank + 1] / boxsize_test * nplanes);
+      nwrong += taken + plane_counts[next] <= total * (rank + 1) / nranks;
+    }
+    check(nwrong == 0);
+  }
+}
+
+/** @brief Cells are put in the plane their centre is in.
+ */
+static void check_cell_planes() {
+
+  /* There have to be at least as many planes of cells as ranks. */
+  bool too_few = false;
+  try {
+    Decomposition decomp(make_cells(2, {10, 10}), boxsize_test, 3);
+  } catch (std::runtime_error &e) {
+    too_few = true;
+  }
+  check(too_few);
+
+  /* A cell centred on the edge of the box counts towards the last plane. */
+  SnapshotCells cells = make_cells(2, {40, 40});
+  cells.centres.insert(cells.centres.end(), {boxsize_test, 10.0, 10.0});
+  cells.counts.push_back(20);
+  Decomposition decomp(cells, boxsize_test, 2);
+  check((decomp.counts == std::vector<size_t>{40, 60}));
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+  check_weighting();
+  check_cell_planes();
+  return test_finish("test_decomposition");
+}
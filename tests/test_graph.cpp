@@ -0,0 +1,236 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of building the merger graph (GraphBuilder).
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "graph.h"
+#include "serial_io.h"
+#include "testing.h"
+
+/**
+ * @brief A generation to add to the graph, as GraphBuilder::addHalos takes
+ * it.
+ */
+struct TestGeneration {
+  std::vector<int64_t> parent;
+  std::vector<size_t> npart;
+  std::vector<size_t> prog_offsets;
+  std::vector<int64_t> progs;
+};
+
+/**
+ * @brief The graph file, read back.
+ */
+struct TestGraph {
+  std::vector<uint64_t> graph_ids, npart, offsets, nhalos;
+  std::vector<int64_t> snaps, halos;
+};
+
+/** @brief Add the generations to a graph and read back the graph file.
+ *
+ * @param engine The engine.
+ * @param gens The generations.
+ * @param run_size The records sorted in memory at once.
+ */
+static TestGraph build_graph(Engine *engine,
+                             const std::vector<TestGeneration> &gens,
+                             size_t run_size) {
+  GraphBuilder builder(engine);
+  builder.run_size = run_size;
+  for (size_t snap = 0; snap < gens.size(); snap++) {
+    const TestGeneration &gen = gens[snap];
+    builder.addHalos(snap, gen.parent.size(), gen.parent.data(),
+                     gen.npart.data(),
+                     gen.prog_offsets.empty() ? nullptr
+                                              : gen.prog_offsets.data(),
+                     gen.progs.data());
+  }
+  builder.finish();
+
+  /* The scratch files are cleaned up. */
+  check(!std::filesystem::exists(builder.scratch_path));
+  check(!std::filesystem::exists(builder.runs_path));
+
+  TestGraph graph;
+  HDF5Helper file(builder.output_path);
+  check(file.readDataset("/Halos/GraphID", graph.graph_ids));
+  check(file.readDataset("/Halos/Snapshot", graph.snaps));
+  check(file.readDataset("/Halos/HaloIndex", graph.halos));
+  check(file.readDataset("/Halos/NumberOfParticles", graph.npart));
+  check(file.readDataset("/Graphs/Offsets", graph.offsets));
+  check(file.readDataset("/Graphs/NumberOfHalos", graph.nhalos));
+  return graph;
+}
+
+/** @brief A few generations small enough to follow by hand.
+ *
+ * Two graphs are each made of two starts united later, once by a merger and
+ * once through the hierarchy, after the first halos were streamed out.
+ *
+ * @param engine The engine.
+ */
+static void check_small_graph(Engine *engine) {
+
+  /* Snapshot 0: 0, 1 and 3 start graphs, 2 is in 0's. */
+  TestGeneration snap0 = {{halo_null, halo_null, 0, halo_null},
+                          {100, 50, 20, 30},
+                          {},
+                          {}};
+
+  /* Snapshot 1: 0 descends from 1, 1 starts a graph, 2 descends from 3 and
+   * 3 descends from 0 while being in 0's (uniting 0 and 1's graphs). */
+  TestGeneration snap1 = {{halo_null, halo_null, halo_null, 0},
+                          {60, 10, 35, 90},
+                          {0, 1, 1, 2, 3},
+                          {1, 3, 0}};
+
+  /* Snapshot 2: 0 descends from 1, 1 from 2 while in 0's (uniting 1 and
+   * 2's graphs from snapshot 1). */
+  TestGeneration snap2 = {{halo_null, 0}, {15, 40}, {0, 1, 2}, {1, 2}};
+
+  TestGraph graph = build_graph(engine, {snap0, snap1, snap2}, 4);
+
+  /* Graphs in the order they first appeared, halos in (snapshot, halo)
+   * order within them. */
+  check((graph.graph_ids ==
+         std::vector<uint64_t>{0, 0, 0, 0, 0, 1, 1, 1, 1, 1}));
+  check((graph.snaps == std::vector<int64_t>{0, 0, 0, 1, 1, 0, 1, 1, 2, 2}));
+  check((graph.halos == std::vector<int64_t>{0, 1, 2, 0, 3, 3, 1, 2, 0, 1}));
+  check((graph.npart ==
+         std::vector<uint64_t>{100, 50, 20, 60, 90, 30, 10, 35, 15, 40}));
+  check((graph.offsets == std::vector<uint64_t>{0, 5}));
+  check((graph.nhalos == std::vector<uint64_t>{5, 5}));
+}
+
+/** @brief Many generations, sorted in many runs and merged.
+ *
+ * The graph is checked against a plain union-find over every halo.
+ *
+ * @param engine The engine.
+ */
+static void check_merged_runs(Engine *engine) {
+  std::mt19937 rng(3);
+  int nsnaps = 40;
+  size_t nhalos = 2000;
+
+  /* Random hierarchies and links, every halo numbered in (snapshot, halo)
+   * order for the reference. */
+  std::vector<TestGeneration> gens(nsnaps);
+  std::vector<size_t> nodes(nsnaps * nhalos);
+  std::iota(nodes.begin(), nodes.end(), 0);
+  auto find = [&nodes](size_t n) {
+    while (nodes[n] != n) {
+      n = nodes[n] = nodes[nodes[n]];
+    }
+    return n;
+  };
+  auto unite = [&nodes, &find](size_t a, size_t b) {
+    nodes[find(a)] = find(b);
+  };
+  for (int snap = 0; snap < nsnaps; snap++) {
+    TestGeneration &gen = gens[snap];
+    gen.prog_offsets.push_back(0);
+    for (size_t i = 0; i < nhalos; i++) {
+      size_t node = snap * nhalos + i;
+      gen.npart.push_back(20 + rng() % 1000);
+      gen.parent.push_back(halo_null);
+      if (i > 0 && rng() % 5 == 0) {
+        gen.parent.back() = rng() % i;
+        unite(node, snap * nhalos + gen.parent.back());
+      }
+      int nprogs = snap > 0 ? rng() % 3 : 0;
+      for (int l = 0; l < nprogs; l++) {
+        gen.progs.push_back(rng() % nhalos);
+        unite(node, (snap - 1) * nhalos + gen.progs.back());
+      }
+      gen.prog_offsets.push_back(gen.progs.size());
+    }
+  }
+
+  /* Graphs are numbered by their first halo, then sorted stably. */
+  std::vector<uint64_t> root_graph(nodes.size(), UINT64_MAX);
+  std::vector<uint64_t> node_graph(nodes.size());
+  uint64_t ngraphs = 0;
+  for (size_t n = 0; n < nodes.size(); n++) {
+    uint64_t &graph = root_graph[find(n)];
+    if (graph == UINT64_MAX) {
+      graph = ngraphs++;
+    }
+    node_graph[n] = graph;
+  }
+  std::vector<size_t> order(nodes.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return node_graph[a] < node_graph[b];
+  });
+
+  /* Far more runs than records buffered from each. */
+  TestGraph graph = build_graph(engine, gens, 997);
+
+  check(graph.graph_ids.size() == nodes.size());
+  check(graph.offsets.size() == ngraphs && graph.nhalos.size() == ngraphs);
+  if (graph.graph_ids.size() != nodes.size() ||
+      graph.offsets.size() != ngraphs) {
+    return;
+  }
+  size_t nwrong = 0;
+  for (size_t r = 0; r < order.size(); r++) {
+    size_t snap = order[r] / nhalos, halo = order[r] % nhalos;
+    nwrong += graph.graph_ids[r] != node_graph[order[r]] ||
+              graph.snaps[r] != static_cast<int64_t>(snap) ||
+              graph.halos[r] != static_cast<int64_t>(halo) ||
+              graph.npart[r] != gens[snap].npart[halo];
+  }
+  check(nwrong == 0);
+  for (uint64_t g = 0; g < ngraphs; g++) {
+    size_t end = graph.offsets[g] + graph.nhalos[g];
+    nwrong += graph.nhalos[g] == 0 || end > order.size() ||
+              graph.graph_ids[graph.offsets[g]] != g ||
+              graph.graph_ids[end - 1] != g ||
+              (g + 1 < ngraphs && graph.offsets[g + 1] != end);
+  }
+  check(nwrong == 0);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+
+  std::filesystem::path dir =
+      std::filesystem::temp_directory_path() / "mega_test_graph";
+  std::filesystem::create_directories(dir);
+  Parameters params;
+  params.setParameter("Output/output_dir", dir.string());
+  params.setParameter("Output/output_basename", std::string("test_"));
+  Engine *engine = test_engine(params);
+
+  check_small_graph(engine);
+  check_merged_runs(engine);
+
+  std::filesystem::remove_all(dir);
+  return test_finish("test_graph");
+}
@@ -0,0 +1,219 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of compacting the halos found by each thread
+ * into a catalogue (HaloCatalog::compact), and of removing particles from
+ * the catalogue's halos.
+ ******************************************************************************/
+
+/* Includes. */
+#include <utility>
+#include <vector>
+
+/* Local includes. */
+#include "generation.h"
+#include "halo.h"
+#include "linker.h"
+#include "testing.h"
+
+/* Ten particles in two hosts, each with substructure:
+ *   host B: 0, 1, 2, 3, 8, 9 with subhalos b1 (2, 3) and b2 (0, 1, 8),
+ *   host A: 4, 5, 6, 7 with subhalo a1 (5, 6). */
+#define npart_test 10
+
+/** @brief Compact the halos, found by two threads in either order, and check
+ * the catalogue only depends on the halos themselves.
+ *
+ * @param threadpool The threadpool.
+ * @param b_first Did the first thread find host B (or host A)?
+ */
+static void check_compact(ThreadPool *threadpool, bool b_first) {
+
+  std::vector<HaloBlock> blocks;
+  blocks.emplace_back(0);
+  blocks.emplace_back(1);
+  HaloBlock &block_b = blocks[b_first ? 0 : 1];
+  HaloBlock &block_a = blocks[b_first ? 1 : 0];
+
+  /* Each thread adds its host then its subhalos (smallest first, so the
+   * catalogue has to reorder them). */
+  int64_t b = block_b.append(host, 0, halo_null, 6, 0);
+  int64_t b1 = block_b.append(substructure, 1, b, 2, 2);
+  int64_t b2 = block_b.append(substructure, 1, b, 3, 0);
+  int64_t a = block_a.append(host, 0, halo_null, 4, 4);
+  int64_t a1 = block_a.append(substructure, 1, a, 2, 5);
+
+  /* Which of them each particle is in, by provisional handle. */
+  std::vector<member_vector<int64_t>> part_halos(2);
+  part_halos[0] = {b, b, b, b, a, a, a, a, b, b};
+  part_halos[1] = {b2, b2, b1, b1, halo_null,
+                   a1, a1, halo_null, b2, halo_null};
+
+  HaloCatalog catalog;
+  catalog.compact(threadpool, blocks, std::move(part_halos));
+
+  /* Hosts first by decreasing size, then each host's subhalos by decreasing
+   * size: B, A, b2, b1, a1. */
+  check(catalog.nhalos == 5);
+  check(catalog.nhosts() == 2);
+  check((catalog.depth_offsets == halo_vector<size_t>{0, 2, 5}));
+  check((catalog.type == halo_vector<enum halo_types>{
+                             host, host, substructure, substructure,
+                             substructure}));
+  check((catalog.depth == halo_vector<int>{0, 0, 1, 1, 1}));
+  check((catalog.npart == halo_vector<size_t>{6, 4, 3, 2, 2}));
+
+  /* The hierarchy points at the final indices. */
+  check((catalog.parent ==
+         halo_vector<int64_t>{halo_null, halo_null, 0, 0, 1}));
+  check((catalog.first_child ==
+         halo_vector<int64_t>{2, 4, halo_null, halo_null, halo_null}));
+  check((catalog.n_child == halo_vector<int>{2, 1, 0, 0, 0}));
+  check((catalog.next_sibling == halo_vector<int64_t>{halo_null, halo_null, 3,
+                                                       halo_null, halo_null}));
+
+  /* So do the particles. */
+  check(catalog.halo_id.size() == 2);
+  check((catalog.halo_id[0] ==
+         member_vector<int64_t>{0, 0, 0, 0, 1, 1, 1, 1, 0, 0}));
+  check((catalog.halo_id[1] ==
+         member_vector<int64_t>{2, 2, 3, 3, halo_null, 4, 4, halo_null, 2,
+                                halo_null}));
+
+  /* Each halo's particles, in ascending order. */
+  const std::vector<std::vector<size_t>> members = {
+      {0, 1, 2, 3, 8, 9}, {4, 5, 6, 7}, {0, 1, 8}, {2, 3}, {5, 6}};
+  for (size_t i = 0; i < catalog.nhalos && i < members.size(); i++) {
+    check((std::vector<size_t>(catalog.parts(i),
+                               catalog.parts(i) + catalog.npart[i]) ==
+           members[i]));
+  }
+
+  /* The blocks are emptied for the next time. */
+  check(blocks[0].size() == 0 && blocks[1].size() == 0);
+  check(blocks[0].block_id == 0 && blocks[1].block_id == 1);
+}
+
+/** @brief Compacting a thread's halos when another thread found none.
+ *
+ * @param threadpool The threadpool.
+ */
+static void check_compact_empty_block(ThreadPool *threadpool) {
+  std::vector<HaloBlock> blocks;
+  blocks.emplace_back(0);
+  blocks.emplace_back(1);
+  int64_t h = blocks[1].append(host, 0, halo_null, 2, 1);
+  std::vector<member_vector<int64_t>> part_halos(1);
+  part_halos[0] = {halo_null, h, h};
+
+  HaloCatalog catalog;
+  catalog.compact(threadpool, blocks, std::move(part_halos));
+  check(catalog.nhalos == 1);
+  check((catalog.halo_id[0] == member_vector<int64_t>{halo_null, 0, 0}));
+  check(catalog.npart[0] == 2 && catalog.parts(0)[0] == 1);
+}
+
+/** @brief Make a generation holding the ten particles (with IDs 100
+ * onwards) and their halos: B, A, b2, b1, a1.
+ *
+ * @param engine The engine.
+ * @param gen The generation (filled).
+ */
+static void make_generation(Engine *engine, Generation &gen) {
+  std::vector<HaloBlock> blocks;
+  blocks.emplace_back(0);
+  int64_t b = blocks[0].append(host, 0, halo_null, 6, 0);
+  int64_t b1 = blocks[0].append(substructure, 1, b, 2, 2);
+  int64_t b2 = blocks[0].append(substructure, 1, b, 3, 0);
+  int64_t a = blocks[0].append(host, 0, halo_null, 4, 4);
+  int64_t a1 = blocks[0].append(substructure, 1, a, 2, 5);
+  std::vector<member_vector<int64_t>> part_halos(2);
+  part_halos[0] = {b, b, b, b, a, a, a, a, b, b};
+  part_halos[1] = {b2, b2, b1, b1, halo_null,
+                   a1, a1, halo_null, b2, halo_null};
+  gen.catalog.compact(engine->threadpool, blocks, std::move(part_halos));
+
+  gen.npart = npart_test;
+  for (size_t p = 0; p < npart_test; p++) {
+    gen.part_ids.push_back(100 + p);
+  }
+  gen.index.build(engine, gen);
+}
+
+/** @brief Removing particles closes up the rows, so parts() and linking only
+ * see the particles left.
+ *
+ * @param engine The engine (linking halos sharing at least 3 particles).
+ */
+static void check_remove_particles(Engine *engine) {
+  Generation prev, curr;
+  make_generation(engine, prev);
+  make_generation(engine, curr);
+
+  /* Take 3 and 9 out of B, 7 out of A and 8 out of b2 (but not out of B). */
+  size_t nremoved = curr.catalog.removeParticles([](size_t ihalo, size_t p) {
+    return (ihalo == 0 && (p == 3 || p == 9)) || (ihalo == 1 && p == 7) ||
+           (ihalo == 2 && p == 8);
+  });
+  HaloCatalog &catalog = curr.catalog;
+  check(nremoved == 4);
+  check((catalog.npart == halo_vector<size_t>{4, 3, 2, 2, 2}));
+  check((catalog.part_offsets == member_vector<size_t>{0, 4, 7, 9, 11, 13}));
+  check(catalog.part_members.size() == 13);
+  const std::vector<std::vector<size_t>> members = {
+      {0, 1, 2, 8}, {4, 5, 6}, {0, 1}, {2, 3}, {5, 6}};
+  for (size_t i = 0; i < catalog.nhalos; i++) {
+    check((std::vector<size_t>(catalog.parts(i),
+                               catalog.parts(i) + catalog.npart[i]) ==
+           members[i]));
+  }
+  check((catalog.halo_id[0] == member_vector<int64_t>{
+                                   0, 0, 0, halo_null, 1, 1, 1, halo_null, 0,
+                                   halo_null}));
+  check((catalog.halo_id[1] ==
+         member_vector<int64_t>{2, 2, 3, 3, halo_null, 4, 4, halo_null,
+                                halo_null, halo_null}));
+
+  /* B and A keep 4 and 3 of their particles, enough to link them. The
+   * subhalos keep 2 each, b2 having lost one of the 3 it would have
+   * shared. */
+  link_halos(engine, prev, curr);
+  check((catalog.prog_offsets == halo_vector<size_t>{0, 1, 2, 2, 2, 2}));
+  check((catalog.progs == halo_vector<int64_t>{0, 1}));
+  check((catalog.prog_shared == halo_vector<size_t>{4, 3}));
+  check((prev.catalog.desc_offsets ==
+         halo_vector<size_t>{0, 1, 2, 2, 2, 2}));
+  check((prev.catalog.descs == halo_vector<int64_t>{0, 1}));
+  check((prev.catalog.desc_shared == halo_vector<size_t>{4, 3}));
+
+  /* Nothing left to remove leaves the rows alone. */
+  check(catalog.removeParticles([](size_t, size_t) { return false; }) == 0);
+  check(catalog.part_offsets.back() == 13);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+  ThreadPool threadpool(2);
+  check_compact(&threadpool, true);
+  check_compact(&threadpool, false);
+  check_compact_empty_block(&threadpool);
+
+  Parameters params;
+  params.setParameter("Halos/link_threshold", 3);
+  check_remove_particles(test_engine(params));
+  return test_finish("test_halo_compact");
+}
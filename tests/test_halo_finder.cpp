@@ -0,0 +1,299 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of finding halos (find_halos): the task queue
+ * the search runs on, the friends-of-friends over the whole box, and the
+ * substructure search on a small set of clumps.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <vector>
+
+/* Local includes. */
+#include "domain.h"
+#include "generation.h"
+#include "halo_finder.h"
+#include "tasks.h"
+#include "testing.h"
+
+/* The size of the (periodic) box. */
+#define boxsize_test 100.0
+
+/* The particles in the whole simulation (a mean separation of 1, so the host
+ * linking length is 0.2 and the first substructure one 0.1). */
+#define npart_sim_test 1000000
+
+/** @brief Run a tree of tasks, each spawning two more until the tree is
+ * deep enough, and check every task ran exactly once.
+ *
+ * @param threadpool The threadpool.
+ */
+static void check_task_queue(ThreadPool *threadpool) {
+  TaskQueue queue(threadpool);
+
+  /* Nothing to run. */
+  queue.run();
+  check(queue.nrun() == 0);
+
+  /* 8 trees of 6 levels. */
+  const int nroots = 8, nlevels = 6;
+  std::vector<std::atomic<int>> ran(nlevels);
+  for (std::atomic<int> &n : ran) {
+    n = 0;
+  }
+  std::function<void(int)> spawn = [&](int level) {
+    ran[level]++;
+    if (level + 1 < nlevels) {
+      for (int child = 0; child < 2; child++) {
+        queue.push([&spawn, level]() { spawn(level + 1); });
+      }
+    }
+  };
+  for (int root = 0; root < nroots; root++) {
+    queue.push([&spawn]() { spawn(0); });
+  }
+  queue.run();
+
+  size_t ntasks = 0;
+  for (int level = 0; level < nlevels; level++) {
+    check(ran[level] == nroots << level);
+    ntasks += ran[level];
+  }
+  check(queue.nrun() == ntasks);
+
+  /* The queue can be run again. */
+  queue.push([&spawn]() { spawn(nlevels - 1); });
+  queue.run();
+  check(ran[nlevels - 1] == (nroots << (nlevels - 1)) + 1);
+  check(queue.nrun() == ntasks + 1);
+}
+
+/** @brief Link random clustered particles with fof_link_all, on one thread
+ * and on many, and check the groups against linking every pair directly.
+ *
+ * @param threadpool The threadpool.
+ * @param periodic Is the box periodic?
+ */
+static void check_fof_link_all(ThreadPool *threadpool, bool periodic) {
+  std::mt19937_64 rng(26);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::normal_distribution<double> normal;
+
+  /* A uniform background with dense clumps spread over many cells. */
+  const double box = 10, ll = 0.25;
+  const size_t nbackground = 15000, nclumps = 20, nclump = 250;
+  std::vector<double> pos;
+  for (size_t i = 0; i < nbackground; i++) {
+    for (int k = 0; k < 3; k++) {
+      pos.push_back(box * uniform(rng));
+    }
+  }
+  for (size_t c = 0; c < nclumps; c++) {
+    double centre[3];
+    for (int k = 0; k < 3; k++) {
+      centre[k] = box * uniform(rng);
+    }
+    for (size_t i = 0; i < nclump; i++) {
+      for (int k = 0; k < 3; k++) {
+        double x = centre[k] + 0.3 * normal(rng);
+        pos.push_back(periodic ? x - box * std::floor(x / box)
+                               : std::min(std::max(x, 0.0), box));
+      }
+    }
+  }
+  size_t npart = pos.size() / 3;
+
+  /* Every pair, directly. */
+  std::vector<size_t> expected(npart);
+  std::iota(expected.begin(), expected.end(), 0);
+  for (size_t i = 0; i < npart; i++) {
+    for (size_t j = i + 1; j < npart; j++) {
+      double r2 = 0;
+      for (int k = 0; k < 3; k++) {
+        double dx = pos[3 * j + k] - pos[3 * i + k];
+        if (periodic) {
+          dx -= box * std::nearbyint(dx / box);
+        }
+        r2 += dx * dx;
+      }
+      if (r2 < ll * ll) {
+        fof_union(expected.data(), i, j);
+      }
+    }
+  }
+  for (size_t i = 0; i < npart; i++) {
+    expected[i] = fof_find(expected.data(), i);
+  }
+
+  /* The lowest root wins, so the roots match exactly. */
+  double boxsize[3] = {box, box, box};
+  HaloGrid grid(pos.data(), 3, npart, ll, periodic ? boxsize : nullptr);
+  check(grid.cdim[0] > 3 && grid.cdim[1] > 3 && grid.cdim[2] > 3);
+  ThreadPool serial(1);
+  for (ThreadPool *pool : {&serial, threadpool}) {
+    std::vector<size_t> uf(npart);
+    std::iota(uf.begin(), uf.end(), 0);
+    fof_link_all(pool, pos.data(), 3, grid, ll, uf.data());
+    size_t nwrong = 0;
+    for (size_t i = 0; i < npart; i++) {
+      nwrong += fof_find(uf.data(), i) != expected[i];
+    }
+    check(nwrong == 0);
+  }
+
+  /* And there were groups big enough to span cells. */
+  std::vector<size_t> group_size(npart, 0);
+  for (size_t i = 0; i < npart; i++) {
+    group_size[expected[i]]++;
+  }
+  check(*std::max_element(group_size.begin(), group_size.end()) >= nclump);
+}
+
+/** @brief Add a cubic lattice of particles to a generation.
+ *
+ * @param gen The generation (with room for the particles).
+ * @param centre The centre of the lattice.
+ * @param n The number of particles along each side.
+ * @param spacing The distance between neighbouring particles.
+ *
+ * @return The indices of the particles added.
+ */
+static std::vector<size_t> add_lattice(Generation &gen, const double *centre,
+                                       int n, double spacing) {
+  std::vector<size_t> added;
+  for (int i = 0; i < n * n * n; i++) {
+    int ijk[3] = {i / (n * n), (i / n) % n, i % n};
+    size_t p = gen.npart++;
+    DMParticle &part = gen.dark_matter[p];
+    part.id = p;
+    part.mass = 1;
+    for (int k = 0; k < 3; k++) {
+      double x = centre[k] + (ijk[k] - (n - 1) / 2.0) * spacing;
+      part.pos[k] = x - boxsize_test * std::floor(x / boxsize_test);
+      part.vel[k] = 0;
+    }
+    added.push_back(p);
+  }
+  return added;
+}
+
+/** @brief Find the halos in two clumps joined by a bridge, a looser clump
+ * straddling the box edge and a sparse background, and check the hosts and
+ * substructure found.
+ *
+ * At the host linking length (0.2) the bridge (particles 0.15 apart) joins
+ * the two dense clumps (0.05 apart) into one host, and the loose clump (0.15
+ * apart) is a host of its own. At the substructure linking length (0.1) the
+ * bridge breaks, leaving the dense clumps as the host's subhalos, while the
+ * loose clump falls apart into particles below the threshold.
+ *
+ * @param engine The engine.
+ */
+static void check_two_clumps(Engine *engine) {
+  Generation gen;
+  gen.reserve(6000);
+  gen.npart_snapshot = npart_sim_test;
+
+  double centre_a[3] = {20, 20, 20}, centre_b[3] = {20.8, 20, 20};
+  std::vector<size_t> clump_a = add_lattice(gen, centre_a, 6, 0.05);
+  std::vector<size_t> clump_b = add_lattice(gen, centre_b, 5, 0.05);
+  std::vector<size_t> bridge;
+  for (int i = 1; i <= 3; i++) {
+    double x[3] = {20.125 + 0.15 * i, 20, 20};
+    std::vector<size_t> p = add_lattice(gen, x, 1, 0);
+    bridge.push_back(p[0]);
+  }
+  double centre_c[3] = {0, 50, 50};
+  std::vector<size_t> clump_c = add_lattice(gen, centre_c, 4, 0.15);
+
+  /* A dense group below the threshold. */
+  double centre_d[3] = {50, 50, 50};
+  add_lattice(gen, centre_d, 2, 0.05);
+
+  /* And a background well away from them all. */
+  std::mt19937_64 rng(26);
+  std::uniform_real_distribution<double> uniform(0, boxsize_test);
+  while (gen.npart < 5000) {
+    double x[3] = {uniform(rng), uniform(rng), uniform(rng)};
+    bool near = false;
+    for (const double *c : {centre_a, centre_c, centre_d}) {
+      double r2 = 0;
+      for (int k = 0; k < 3; k++) {
+        double dx = x[k] - c[k];
+        dx -= boxsize_test * std::nearbyint(dx / boxsize_test);
+        r2 += dx * dx;
+      }
+      near |= r2 < 25;
+    }
+    if (!near) {
+      add_lattice(gen, x, 1, 0);
+    }
+  }
+  gen.attach(engine->domain);
+
+  HaloCatalog &catalog = gen.catalog;
+  find_halos(engine, catalog);
+
+  /* Hosts by decreasing size then the subhalos. */
+  std::vector<size_t> host_ab = clump_a;
+  host_ab.insert(host_ab.end(), clump_b.begin(), clump_b.end());
+  host_ab.insert(host_ab.end(), bridge.begin(), bridge.end());
+  std::sort(host_ab.begin(), host_ab.end());
+  check(catalog.nhalos == 4);
+  check(catalog.nhosts() == 2);
+  if (catalog.nhalos != 4) {
+    return;
+  }
+  check((catalog.depth == halo_vector<int>{0, 0, 1, 1}));
+  check((catalog.npart == halo_vector<size_t>{344, 64, 216, 125}));
+  check(catalog.parent[2] == 0 && catalog.parent[3] == 0);
+  check(catalog.n_child[0] == 2 && catalog.n_child[1] == 0);
+
+  const std::vector<std::vector<size_t>> members = {host_ab, clump_c, clump_a,
+                                                    clump_b};
+  for (size_t i = 0; i < catalog.nhalos; i++) {
+    check((std::vector<size_t>(catalog.parts(i),
+                               catalog.parts(i) + catalog.npart[i]) ==
+           members[i]));
+  }
+
+  /* Each particle knows its halo at each depth. */
+  check(catalog.halo_id[0][clump_b[0]] == 0);
+  check(catalog.halo_id[1][clump_b[0]] == 3);
+  check(catalog.halo_id[0][bridge[0]] == 0);
+  check(catalog.halo_id[1][bridge[0]] == halo_null);
+  check(catalog.halo_id[0][clump_c[0]] == 1);
+  check(catalog.halo_id[1][clump_c[0]] == halo_null);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+  Engine *engine = test_engine(Parameters(), 4);
+  double box[3] = {boxsize_test, boxsize_test, boxsize_test};
+  engine->domain = new Domain(box, 1);
+  check_task_queue(engine->threadpool);
+  check_fof_link_all(engine->threadpool, true);
+  check_fof_link_all(engine->threadpool, false);
+  check_two_clumps(engine);
+  return test_finish("test_halo_finder");
+}
@@ -0,0 +1,177 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of the particle ID index (IdIndex), both as a
+ * direct-mapped table and as sorted IDs.
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+/* Local includes. */
+#include "generation.h"
+#include "id_index.h"
+#include "testing.h"
+
+/** @brief Check every ID is found at its index, and IDs that aren't there
+ * aren't.
+ *
+ * @param index The index.
+ * @param ids The IDs indexed (the i-th at index i).
+ */
+static void check_finds(const IdIndex &index, const std::vector<size_t> &ids) {
+  check(index.nids == ids.size());
+  size_t nwrong = 0;
+  for (size_t i = 0; i < ids.size(); i++) {
+    nwrong += index.find(ids[i]) != i;
+  }
+  check(nwrong == 0);
+
+  /* Either side of the range, and in the gaps. */
+  std::vector<size_t> sorted = ids;
+  std::sort(sorted.begin(), sorted.end());
+  check(index.find(sorted.front() - 1) == id_index_none);
+  check(index.find(sorted.back() + 1) == id_index_none);
+  check(index.find(SIZE_MAX) == id_index_none);
+  size_t ngaps = 0;
+  for (size_t i = 0; i + 1 < sorted.size(); i++) {
+    if (sorted[i + 1] > sorted[i] + 1) {
+      nwrong += index.find(sorted[i] + 1) != id_index_none;
+      ngaps++;
+    }
+  }
+  check(ngaps > 0);
+  check(nwrong == 0);
+}
+
+/** @brief Build an index over some IDs held in a generation, either as whole
+ * particles or as IDs alone (out of core).
+ *
+ * @param engine The engine.
+ * @param ids The IDs.
+ * @param particles Are they held as particles?
+ * @param gen The generation (filled).
+ */
+static void build_index(Engine *engine, const std::vector<size_t> &ids,
+                        bool particles, Generation &gen) {
+  gen.npart = ids.size();
+  if (particles) {
+    gen.reserve(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+      gen.dark_matter[i].id = ids[i];
+    }
+  } else {
+    gen.part_ids.assign(ids.begin(), ids.end());
+  }
+  gen.index.build(engine, gen);
+}
+
+/** @brief IDs spanning less than twice their number get a table.
+ *
+ * @param engine The engine.
+ */
+static void check_dense(Engine *engine) {
+
+  /* 1000 to 2999, shuffled, with every tenth missing. */
+  std::vector<size_t> ids;
+  for (size_t id = 1000; id < 3000; id++) {
+    if (id % 10 != 3) {
+      ids.push_back(id);
+    }
+  }
+  std::mt19937_64 rng(42);
+  std::shuffle(ids.begin(), ids.end(), rng);
+
+  for (bool particles : {true, false}) {
+    Generation gen;
+    build_index(engine, ids, particles, gen);
+    check(gen.index.dense);
+    check(gen.index.min_id == 1000 && gen.index.max_id == 2999);
+    check_finds(gen.index, ids);
+  }
+}
+
+/** @brief Sparse IDs are sorted and searched.
+ *
+ * @param engine The engine.
+ */
+static void check_sorted(Engine *engine) {
+
+  /* Random IDs over most of 64 bits (without repeats). */
+  std::mt19937_64 rng(7);
+  std::vector<size_t> ids(5000);
+  for (size_t &id : ids) {
+    id = (rng() >> 2) + 1;
+  }
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  std::shuffle(ids.begin(), ids.end(), rng);
+
+  for (bool particles : {true, false}) {
+    Generation gen;
+    build_index(engine, ids, particles, gen);
+    check(!gen.index.dense);
+    check_finds(gen.index, ids);
+  }
+
+  /* A single particle, and none at all. */
+  Generation one;
+  build_index(engine, {12345}, false, one);
+  check(one.index.find(12345) == 0);
+  check(one.index.find(12344) == id_index_none);
+  Generation none;
+  build_index(engine, {}, false, none);
+  check(none.index.nids == 0);
+  check(none.index.find(0) == id_index_none);
+}
+
+/** @brief Indexing IDs already sorted (as restored from a checkpoint).
+ */
+static void check_build_sorted() {
+  std::vector<size_t> dense, sparse;
+  for (size_t id = 50; id < 150; id += 3) {
+    dense.push_back(id);
+  }
+  for (size_t id = 1; id < (size_t(1) << 60); id *= 7) {
+    sparse.push_back(id + 5);
+  }
+
+  IdIndex index;
+  index.buildSorted(dense.data(), dense.size());
+  check(!index.dense);
+  check_finds(index, dense);
+  index.buildSorted(sparse.data(), sparse.size());
+  check(!index.dense);
+  check_finds(index, sparse);
+
+  std::vector<size_t> gappy = {10, 11, 13, 14, 15};
+  index.buildSorted(gappy.data(), gappy.size());
+  check(index.dense);
+  check_finds(index, gappy);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+  Engine *engine = test_engine(Parameters());
+  check_dense(engine);
+  check_sorted(engine);
+  check_build_sorted();
+  return test_finish("test_id_index");
+}
@@ -0,0 +1,242 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of linking halos between snapshots
+ * (link_halos).
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/* Local includes. */
+#include "generation.h"
+#include "halo.h"
+#include "linker.h"
+#include "testing.h"
+
+/** @brief Make a generation from the halos each particle is in.
+ *
+ * The halos are given by label, a subhalo's host being the host of its
+ * particles. The particles are held as IDs alone and the ID index built.
+ *
+ * @param engine The engine.
+ * @param gen The generation (filled).
+ * @param ids The IDs of the particles.
+ * @param hosts The host each particle is in (-1 if none).
+ * @param subs The subhalo each particle is in (-1 if none).
+ */
+static void make_generation(Engine *engine, Generation &gen,
+                            const std::vector<size_t> &ids,
+                            const std::vector<int> &hosts,
+                            const std::vector<int> &subs) {
+
+  /* The size, first particle and host of each label's halo. */
+  size_t npart = ids.size();
+  std::map<int, std::tuple<size_t, size_t, int>> host_halos, sub_halos;
+  for (size_t p = 0; p < npart; p++) {
+    if (hosts[p] >= 0) {
+      auto it = host_halos.emplace(hosts[p], std::make_tuple(0, p, -1)).first;
+      std::get<0>(it->second)++;
+    }
+    if (subs[p] >= 0) {
+      auto it =
+          sub_halos.emplace(subs[p], std::make_tuple(0, p, hosts[p])).first;
+      std::get<0>(it->second)++;
+    }
+  }
+
+  std::vector<HaloBlock> blocks;
+  blocks.emplace_back(0);
+  std::map<int, int64_t> host_handles, sub_handles;
+  for (const auto &halo : host_halos) {
+    host_handles[halo.first] =
+        blocks[0].append(host, 0, halo_null, std::get<0>(halo.second),
+                         std::get<1>(halo.second));
+  }
+  for (const auto &halo : sub_halos) {
+    sub_handles[halo.first] = blocks[0].append(
+        substructure, 1, host_handles.at(std::get<2>(halo.second)),
+        std::get<0>(halo.second), std::get<1>(halo.second));
+  }
+
+  std::vector<member_vector<int64_t>> part_halos(2);
+  for (size_t p = 0; p < npart; p++) {
+    part_halos[0].push_back(hosts[p] >= 0 ? host_handles[hosts[p]]
+                                          : halo_null);
+    part_halos[1].push_back(subs[p] >= 0 ? sub_handles[subs[p]] : halo_null);
+  }
+  gen.catalog.compact(engine->threadpool, blocks, std::move(part_halos));
+
+  gen.npart = npart;
+  gen.part_ids.assign(ids.begin(), ids.end());
+  gen.index.build(engine, gen);
+}
+
+/** @brief Link two hand-built snapshots and check the shared counts, with
+ * and without the pairs sharing few particles cut.
+ *
+ * The earlier snapshot has IDs 1000 to 1023:
+ *   host P0: 1000-1011, with subhalo p2: 1000-1005,
+ *   host P1: 1012-1019.
+ * The later snapshot has IDs 1000 to 1027, in reverse:
+ *   host D0: 1000-1007 and 1012-1015, with subhalo d2: 1000-1004,
+ *   host D1: 1008-1011, 1016-1019 and 1024-1025.
+ * So D0 shares 8 with P0 and 4 with P1, D1 shares 4 with each and d2 shares
+ * 5 with p2 (and none with the hosts, being at another depth).
+ *
+ * @param engine The engine.
+ */
+static void check_hand_built(Engine *engine) {
+  std::vector<size_t> ids;
+  std::vector<int> hosts, subs;
+  for (size_t id = 1000; id < 1024; id++) {
+    ids.push_back(id);
+    hosts.push_back(id < 1012 ? 0 : id < 1020 ? 1 : -1);
+    subs.push_back(id < 1006 ? 0 : -1);
+  }
+  Generation prev;
+  make_generation(engine, prev, ids, hosts, subs);
+  check((prev.catalog.npart == halo_vector<size_t>{12, 8, 6}));
+
+  ids.clear();
+  hosts.clear();
+  subs.clear();
+  for (size_t id = 1027; id >= 1000; id--) {
+    ids.push_back(id);
+    bool d0 = id < 1008 || (id >= 1012 && id < 1016);
+    bool d1 = (id >= 1008 && id < 1012) || (id >= 1016 && id < 1020) ||
+              id == 1024 || id == 1025;
+    hosts.push_back(d0 ? 0 : d1 ? 1 : -1);
+    subs.push_back(id < 1005 ? 0 : -1);
+  }
+  Generation curr;
+  make_generation(engine, curr, ids, hosts, subs);
+  check((curr.catalog.npart == halo_vector<size_t>{12, 10, 5}));
+
+  /* Sharing at least 5: P0 -> D0 and p2 -> d2, the rest are cut. */
+  engine->link_threshold = 5;
+  link_halos(engine, prev, curr);
+  check((curr.catalog.prog_offsets == halo_vector<size_t>{0, 1, 1, 2}));
+  check((curr.catalog.progs == halo_vector<int64_t>{0, 2}));
+  check((curr.catalog.prog_shared == halo_vector<size_t>{8, 5}));
+  check((prev.catalog.desc_offsets == halo_vector<size_t>{0, 1, 1, 2}));
+  check((prev.catalog.descs == halo_vector<int64_t>{0, 2}));
+  check((prev.catalog.desc_shared == halo_vector<size_t>{8, 5}));
+
+  /* Sharing at least 4 keeps them all, most shared first. */
+  engine->link_threshold = 4;
+  link_halos(engine, prev, curr);
+  check((curr.catalog.prog_offsets == halo_vector<size_t>{0, 2, 4, 5}));
+  check((curr.catalog.progs == halo_vector<int64_t>{0, 1, 0, 1, 2}));
+  check((curr.catalog.prog_shared == halo_vector<size_t>{8, 4, 4, 4, 5}));
+  check((prev.catalog.desc_offsets == halo_vector<size_t>{0, 2, 4, 5}));
+  check((prev.catalog.descs == halo_vector<int64_t>{0, 1, 0, 1, 2}));
+  check((prev.catalog.desc_shared == halo_vector<size_t>{8, 4, 4, 4, 5}));
+}
+
+/** @brief Link two random snapshots, the counts merged across threads, and
+ * compare with counting every particle in turn.
+ *
+ * @param engine The engine.
+ */
+static void check_random(Engine *engine) {
+  std::mt19937_64 rng(31);
+  size_t npart = 50000;
+  std::vector<size_t> ids(npart);
+  std::vector<int> hosts(npart), subs(npart);
+
+  /* Each host has two subhalos. Most particles stay in their halos, the
+   * rest move at random (the IDs shuffled between the snapshots). */
+  for (size_t p = 0; p < npart; p++) {
+    ids[p] = 7 + 3 * p;
+    hosts[p] = rng() % 3 == 0 ? -1 : rng() % 200;
+    subs[p] = hosts[p] >= 0 && rng() % 4 == 0 ? 2 * hosts[p] + rng() % 2 : -1;
+  }
+  Generation prev;
+  make_generation(engine, prev, ids, hosts, subs);
+  for (size_t p = 0; p < npart; p++) {
+    if (rng() % 3 == 0) {
+      hosts[p] = rng() % 3 == 0 ? -1 : rng() % 200;
+      subs[p] =
+          hosts[p] >= 0 && rng() % 4 == 0 ? 2 * hosts[p] + rng() % 2 : -1;
+    }
+  }
+  std::vector<size_t> order(npart);
+  for (size_t p = 0; p < npart; p++) {
+    order[p] = p;
+  }
+  std::shuffle(order.begin(), order.end(), rng);
+  std::vector<size_t> curr_ids(npart);
+  std::vector<int> curr_hosts(npart), curr_subs(npart);
+  for (size_t p = 0; p < npart; p++) {
+    curr_ids[p] = ids[order[p]];
+    curr_hosts[p] = hosts[order[p]];
+    curr_subs[p] = subs[order[p]];
+  }
+  Generation curr;
+  make_generation(engine, curr, curr_ids, curr_hosts, curr_subs);
+
+  /* Every pair sharing enough particles, counted one particle at a time. */
+  engine->link_threshold = 10;
+  std::map<std::pair<int64_t, int64_t>, size_t> shared;
+  for (size_t p = 0; p < npart; p++) {
+    size_t prev_p = order[p];
+    for (size_t d = 0; d < 2; d++) {
+      int64_t prog = prev.catalog.halo_id[d][prev_p];
+      int64_t desc = curr.catalog.halo_id[d][p];
+      if (prog != halo_null && desc != halo_null) {
+        shared[{prog, desc}]++;
+      }
+    }
+  }
+  std::map<std::pair<int64_t, int64_t>, size_t> expected;
+  for (const auto &pair : shared) {
+    if (pair.second >= 10) {
+      expected.insert(pair);
+    }
+  }
+
+  /* Most halos keep their main progenitor, and most pairs are cut. */
+  check(expected.size() > 500);
+  check(shared.size() > 10 * expected.size());
+
+  link_halos(engine, prev, curr);
+  std::map<std::pair<int64_t, int64_t>, size_t> links;
+  const HaloCatalog &catalog = curr.catalog;
+  for (size_t i = 0; i < catalog.nhalos; i++) {
+    for (size_t l = catalog.prog_offsets[i]; l < catalog.prog_offsets[i + 1];
+         l++) {
+      links[{catalog.progs[l], static_cast<int64_t>(i)}] =
+          catalog.prog_shared[l];
+    }
+  }
+  check(links == expected);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+  Engine *engine = test_engine(Parameters(), 4);
+  check_hand_built(engine);
+  check_random(engine);
+  return test_finish("test_linker");
+}
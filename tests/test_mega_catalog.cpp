@@ -0,0 +1,261 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of writing and mapping the binary halo
+ * catalogue (MegaCatalogWriter and MegaCatalog).
+ ******************************************************************************/
+
+/* Includes. */
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Local includes. */
+#include "generation.h"
+#include "mega_catalog.h"
+#include "testing.h"
+
+/** @brief Does mapping a catalogue fail?
+ *
+ * @param path The catalogue.
+ */
+static bool mapping_fails(const std::string &path) {
+  try {
+    MegaCatalog catalog(path);
+  } catch (std::runtime_error &e) {
+    return true;
+  }
+  return false;
+}
+
+/** @brief Does a column match the values written?
+ *
+ * @param catalog The catalogue.
+ * @param name The column's name.
+ * @param values The values written.
+ * @param ncomp The number of values in a row.
+ */
+template <typename T, typename A>
+static bool column_matches(const MegaCatalog &catalog, const std::string &name,
+                           const std::vector<T, A> &values, size_t ncomp = 1) {
+  size_t nrows;
+  const T *col = catalog.column<T>(name, &nrows, ncomp);
+  return col != nullptr && nrows * ncomp == values.size() &&
+         reinterpret_cast<uintptr_t>(col) % mega_catalog_align == 0 &&
+         std::equal(values.begin(), values.end(), col);
+}
+
+/** @brief Read a whole file.
+ *
+ * @param path The file.
+ */
+static std::string read_file(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), {});
+}
+
+/** @brief Columns of every kind come back as they were written, in place
+ * and aligned.
+ *
+ * @param dir The directory to write to.
+ */
+static void check_columns(const std::string &dir) {
+  std::string path = dir + "/columns.mega";
+  std::vector<int64_t> ints = {-3, 0, 7, INT64_MIN, INT64_MAX};
+  std::vector<uint32_t> uints = {1, 2, 3};
+  std::vector<float> floats = {0.5f, -1.25f, 3e7f, 0.0f, 1e-20f, 2.0f};
+  std::vector<double> vecs = {1.0, 2.0, 3.0, 4.0, 5.0, 6.0};
+  std::vector<enum halo_types> types = {host, substructure, host};
+  std::vector<size_t> none;
+
+  MegaCatalogWriter writer(path, 12, 5);
+  writer.addColumn("Ints", ints);
+  writer.addColumn("Uints", uints);
+  writer.addColumn("Floats", floats.data(), 3, 2);
+  writer.addColumn("Vectors", vecs, 3);
+  writer.addColumn("Types", types);
+  writer.addColumn("Empty", none);
+  bool too_long = false;
+  try {
+    writer.addColumn(std::string(mega_column_name_len, 'x'), ints);
+  } catch (std::runtime_error &e) {
+    too_long = true;
+  }
+  check(too_long);
+  writer.finish();
+  check(!std::filesystem::exists(path + ".tmp"));
+
+  MegaCatalog catalog(path);
+  check(catalog.snap() == 12);
+  check(catalog.nhalos() == 5);
+  check(catalog.header->ncolumns == 6);
+  check(catalog.header->nbytes == std::filesystem::file_size(path));
+  check(column_matches(catalog, "Ints", ints));
+  check(column_matches(catalog, "Uints", uints));
+  check(column_matches(catalog, "Floats", floats, 2));
+  check(column_matches(catalog, "Vectors", vecs, 3));
+  check(column_matches(catalog, "Types", types));
+
+  size_t nrows = 1;
+  check(catalog.column<size_t>("Empty", &nrows) != nullptr && nrows == 0);
+
+  /* A column that isn't there, and the wrong type for one that is. */
+  nrows = 1;
+  check(catalog.column<double>("Missing", &nrows) == nullptr && nrows == 0);
+  check(catalog.findColumn("Missing") == nullptr);
+  bool wrong_type = false;
+  try {
+    catalog.column<uint64_t>("Ints");
+  } catch (std::runtime_error &e) {
+    wrong_type = true;
+  }
+  check(wrong_type);
+  wrong_type = false;
+  try {
+    catalog.column<double>("Vectors");
+  } catch (std::runtime_error &e) {
+    wrong_type = true;
+  }
+  check(wrong_type);
+
+  /* Copying every column from the mapping gives the same file. */
+  std::string copy_path = dir + "/copy.mega";
+  MegaCatalogWriter copier(copy_path, catalog.snap(), catalog.nhalos());
+  for (uint64_t i = 0; i < catalog.header->ncolumns; i++) {
+    copier.copyColumn(catalog, catalog.columns[i]);
+  }
+  copier.finish();
+  check(read_file(copy_path) == read_file(path));
+}
+
+/** @brief A generation's catalogue comes back from its binary catalogue.
+ *
+ * @param engine The engine.
+ */
+static void check_generation(const Engine *engine) {
+
+  /* Two hosts, one with a subhalo, among six particles. */
+  std::vector<HaloBlock> blocks;
+  blocks.emplace_back(0);
+  int64_t a = blocks[0].append(host, 0, halo_null, 2, 4);
+  int64_t b = blocks[0].append(host, 0, halo_null, 4, 0);
+  int64_t b1 = blocks[0].append(substructure, 1, b, 2, 1);
+  std::vector<member_vector<int64_t>> part_halos(2);
+  part_halos[0] = {b, b, b, b, a, a};
+  part_halos[1] = {halo_null, b1, b1, halo_null, halo_null, halo_null};
+
+  Generation gen;
+  gen.snap = 3;
+  gen.npart = 6;
+  gen.part_ids = {60, 50, 40, 30, 20, 10};
+  HaloCatalog &catalog = gen.catalog;
+  catalog.compact(engine->threadpool, blocks, std::move(part_halos));
+  catalog.prog_offsets = {0, 2, 2, 3};
+  catalog.progs = {4, 1, 0};
+  catalog.prog_shared = {30, 12, 2};
+  catalog.desc_offsets = {0, 1, 2, 2};
+  catalog.descs = {0, 0};
+  catalog.desc_shared = {4, 1};
+
+  std::string path = engine->binaryPath(gen.snap);
+  gen.writeBinary(engine, path);
+  MegaCatalog mapped(path);
+  check(mapped.snap() == 3);
+  check(mapped.nhalos() == 3);
+  check(column_matches(mapped, "Type", catalog.type));
+  check(column_matches(mapped, "Depth", catalog.depth));
+  check(column_matches(mapped, "Parent", catalog.parent));
+  check(column_matches(mapped, "NumberOfParticles", catalog.npart));
+
+  /* The members' IDs, in particle order within each halo. */
+  check(column_matches(mapped, "ParticleIDs",
+                       std::vector<size_t>{60, 50, 40, 30, 20, 10, 50, 40}));
+  check(column_matches(mapped, "ParticleOffsets",
+                       std::vector<size_t>{0, 4, 6, 8}));
+  check(column_matches(mapped, "ProgenitorOffsets", catalog.prog_offsets));
+  check(column_matches(mapped, "Progenitors", catalog.progs));
+  check(column_matches(mapped, "ProgenitorSharedParts", catalog.prog_shared));
+  check(column_matches(mapped, "DescendantOffsets", catalog.desc_offsets));
+  check(column_matches(mapped, "Descendants", catalog.descs));
+  check(column_matches(mapped, "DescendantSharedParts", catalog.desc_shared));
+
+  /* Only on several ranks. */
+  check(mapped.findColumn("FirstHaloIndex") == nullptr);
+}
+
+/** @brief A missing, foreign or cut short catalogue can't be mapped.
+ *
+ * @param dir The directory to write to.
+ */
+static void check_bad_catalogs(const std::string &dir) {
+  std::string path = dir + "/bad.mega";
+  std::vector<double> values(100, 1.0);
+  MegaCatalogWriter writer(path, 0, 100);
+  writer.addColumn("Values", values);
+  writer.finish();
+  check(!mapping_fails(path));
+
+  size_t size = std::filesystem::file_size(path);
+  std::filesystem::resize_file(path, size - 8);
+  check(mapping_fails(path));
+  std::filesystem::resize_file(path, sizeof(MegaHeader) / 2);
+  check(mapping_fails(path));
+
+  /* A header from another version. */
+  std::filesystem::resize_file(path, 0);
+  writer.finish();
+  std::string contents = read_file(path);
+  uint64_t version = mega_catalog_version + 1;
+  std::memcpy(&contents[offsetof(MegaHeader, version)], &version,
+              sizeof(version));
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+  check(mapping_fails(path));
+
+  std::ofstream(path, std::ios::binary | std::ios::trunc)
+      << std::string(sizeof(MegaHeader), 'x');
+  check(mapping_fails(path));
+
+  std::filesystem::remove(path);
+  check(mapping_fails(path));
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+
+  std::filesystem::path dir =
+      std::filesystem::temp_directory_path() / "mega_test_catalog";
+  std::filesystem::create_directories(dir);
+  Parameters params;
+  params.setParameter("Output/output_dir", dir.string());
+  params.setParameter("Output/output_basename", std::string("test_"));
+  params.setParameter("Output/calculate_props", 0);
+  Engine *engine = test_engine(params);
+
+  check_columns(dir.string());
+  check_generation(engine);
+  check_bad_catalogs(dir.string());
+
+  std::filesystem::remove_all(dir);
+  return test_finish("test_mega_catalog");
+}
@@ -0,0 +1,94 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of the pipeline of snapshots (Pipeline),
+ * reading ahead of the halo finding into the slots it allows.
+ ******************************************************************************/
+
+/* Includes. */
+#include <deque>
+
+/* Local includes. */
+#include "pipeline.h"
+#include "testing.h"
+
+/* The snapshots run through the pipeline. */
+#define nsnaps_test 5
+
+/** @brief Run the snapshots through the pipeline, taking each snapshot
+ * before the one before the last is retired if reading ahead.
+ *
+ * The halo finding holds the previous snapshot until the current one has
+ * been linked to it, so the reader running ahead means the next snapshot is
+ * ready while both are still held (in a third slot). Without reading ahead
+ * the previous snapshot has to be retired first.
+ *
+ * @param engine The engine.
+ * @param read_ahead Should the reader run ahead?
+ */
+static void check_read_ahead(Engine *engine, bool read_ahead) {
+  Pipeline pipeline(engine);
+  check(pipeline.restored == nullptr && pipeline.first_snap == 0);
+
+  std::deque<Generation *> held;
+  size_t nwrong = 0;
+  for (int snap = 0; snap < nsnaps_test; snap++) {
+    if (!read_ahead && held.size() == 2) {
+      pipeline.retire(held.front());
+      held.pop_front();
+    }
+    Generation *gen = pipeline.next();
+    nwrong += gen->snap != snap;
+    held.push_back(gen);
+    if (held.size() == 3) {
+      pipeline.retire(held.front());
+      held.pop_front();
+    }
+  }
+  for (Generation *gen : held) {
+    pipeline.retire(gen);
+  }
+  check(nwrong == 0);
+
+  /* The slots are reused rather than made for every snapshot. */
+  check(pipeline.slots.size() == (read_ahead ? 3u : 2u));
+  pipeline.finish();
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+
+  /* Nothing to read or write, only the slots handed between the stages (out
+   * of core the halo finding reads the snapshots itself). */
+  Parameters params;
+  params.setParameter("Input/snapshot_count", nsnaps_test);
+  params.setParameter("Output/output_cataloges", 0);
+  params.setParameter("Output/write_checkpoints", 0);
+  Engine *engine = test_engine(params);
+  engine->out_of_core = 1;
+
+  /* By default the next snapshot is read while the halos of this one are
+   * found. */
+  check(engine->prefetch_depth == 1 && engine->max_generations == 3);
+  check_read_ahead(engine, true);
+
+  /* Without any prefetching only the current and previous are held. */
+  engine->max_generations = pipeline_min_slots;
+  check_read_ahead(engine, false);
+
+  return test_finish("test_pipeline");
+}
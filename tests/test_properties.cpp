@@ -0,0 +1,221 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of calculating halo properties
+ * (calculate_halo_properties) on halos whose properties are known exactly.
+ ******************************************************************************/
+
+/* Includes. */
+#include <cmath>
+#include <random>
+#include <vector>
+
+/* Local includes. */
+#include "constants.h"
+#include "domain.h"
+#include "generation.h"
+#include "properties.h"
+#include "testing.h"
+
+/* The size of the (periodic) box. */
+#define boxsize_test 100.0
+
+/**
+ * @brief A uniform sphere rotating rigidly about the z axis.
+ *
+ * The sphere is built from nshell shells of six particles, each shell the
+ * ends of a randomly oriented set of axes. Shell k has radius
+ * R ((k + 1) / nshell)^(1/3), so the mass within any shell is exactly that
+ * of a uniform sphere, and every shell's particles sum to nothing and to an
+ * isotropic second moment. So its properties are known exactly:
+ *   centre of mass: the centre, bulk velocity: the sphere's velocity,
+ *   velocity dispersion: omega sqrt(2/3 <r^2>),
+ *   angular momentum: 4/6 M omega <r^2> about z,
+ *   half mass radius: the radius of the middle shell (nshell is odd, so
+ *     half the mass is reached part way through it),
+ *   Vmax: sqrt(G M / R) at R.
+ */
+struct TestSphere {
+  double centre[3];
+  double vel[3];
+  double radius;
+  double omega;
+  double part_mass;
+  size_t nshell;
+};
+
+/** @brief Add a sphere's particles to a generation.
+ *
+ * @param sphere The sphere.
+ * @param rng The random numbers orienting the shells.
+ * @param gen The generation (with room for the particles).
+ * @param members The particles' indices in the generation (added to).
+ */
+static void add_sphere(const TestSphere &sphere, std::mt19937_64 &rng,
+                       Generation &gen, member_vector<size_t> &members) {
+  std::normal_distribution<double> normal;
+  for (size_t k = 0; k < sphere.nshell; k++) {
+    double r = sphere.radius *
+               std::cbrt(static_cast<double>(k + 1) / sphere.nshell);
+
+    /* A random rotation (from a random unit quaternion). */
+    double q[4];
+    double qnorm = 0;
+    for (int i = 0; i < 4; i++) {
+      q[i] = normal(rng);
+      qnorm += q[i] * q[i];
+    }
+    double s = 2 / qnorm;
+    double a = q[0], b = q[1], c = q[2], d = q[3];
+    double rot[3][3] = {
+        {1 - s * (c * c + d * d), s * (b * c - a * d), s * (b * d + a * c)},
+        {s * (b * c + a * d), 1 - s * (b * b + d * d), s * (c * d - a * b)},
+        {s * (b * d - a * c), s * (c * d + a * b), 1 - s * (b * b + c * c)}};
+
+    /* Both ends of each rotated axis. */
+    for (int axis = 0; axis < 3; axis++) {
+      for (int sign = -1; sign <= 1; sign += 2) {
+        double dx[3];
+        for (int i = 0; i < 3; i++) {
+          dx[i] = sign * r * rot[i][axis];
+        }
+        size_t p = gen.npart++;
+        DMParticle &part = gen.dark_matter[p];
+        part.id = p;
+        part.mass = sphere.part_mass;
+        for (int i = 0; i < 3; i++) {
+          part.pos[i] = sphere.centre[i] + dx[i];
+          part.pos[i] -= boxsize_test * std::floor(part.pos[i] / boxsize_test);
+        }
+        part.vel[0] = sphere.vel[0] - sphere.omega * dx[1];
+        part.vel[1] = sphere.vel[1] + sphere.omega * dx[0];
+        part.vel[2] = sphere.vel[2];
+        members.push_back(p);
+      }
+    }
+  }
+}
+
+/* Is a value within a relative tolerance of what's expected? */
+static bool close(double value, double expected) {
+  return std::fabs(value - expected) <= 1e-9 * std::fabs(expected);
+}
+
+/** @brief Check a halo's properties are those of its sphere.
+ *
+ * @param catalog The catalogue.
+ * @param ihalo The halo.
+ * @param sphere The sphere.
+ *
+ * @return Whether every property is right.
+ */
+static bool check_sphere(const HaloCatalog &catalog, size_t ihalo,
+                         const TestSphere &sphere) {
+
+  size_t npart = 6 * sphere.nshell;
+  double mass = npart * sphere.part_mass;
+  double mean_r2 = 0;
+  for (size_t k = 0; k < sphere.nshell; k++) {
+    mean_r2 += std::pow(static_cast<double>(k + 1) / sphere.nshell, 2.0 / 3);
+  }
+  mean_r2 *= sphere.radius * sphere.radius / sphere.nshell;
+  double jmag = 2.0 / 3 * mass * sphere.omega * mean_r2;
+
+  bool ok = close(catalog.mass[ihalo], mass);
+  for (int k = 0; k < 3; k++) {
+    double centre = sphere.centre[k] -
+                    boxsize_test * std::floor(sphere.centre[k] / boxsize_test);
+    ok &= std::fabs(catalog.x[3 * ihalo + k] - centre) < 1e-9;
+    ok &= std::fabs(catalog.v[3 * ihalo + k] - sphere.vel[k]) < 1e-9;
+  }
+  ok &= close(catalog.vel_disp[ihalo],
+              sphere.omega * std::sqrt(2.0 / 3 * mean_r2));
+  ok &= close(catalog.spin[ihalo],
+              jmag / (mass * std::sqrt(2 * grav_const * mass * sphere.radius)));
+  ok &= close(catalog.r_half[ihalo],
+              sphere.radius * std::cbrt((sphere.nshell + 1) /
+                                        (2.0 * sphere.nshell)));
+  ok &= close(catalog.vmax[ihalo],
+              std::sqrt(grav_const * mass / sphere.radius));
+  ok &= close(catalog.rmax[ihalo], sphere.radius);
+  return ok;
+}
+
+/** @brief Calculate the properties of one large sphere (split over the
+ * threads) and many small ones (done in batches), some straddling the box
+ * edges, and check them against the exact values.
+ *
+ * @param engine The engine.
+ */
+static void check_spheres(Engine *engine) {
+  std::mt19937_64 rng(27);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  /* The large sphere straddles two edges of the box. */
+  std::vector<TestSphere> spheres;
+  spheres.push_back({{0.3, 99.8, 50}, {120, -40, 15}, 2.0, 35, 0.01,
+                     (prop_large_halo_npart + 5) / 6 | 1});
+  for (int i = 0; i < 300; i++) {
+    TestSphere sphere;
+    for (int k = 0; k < 3; k++) {
+      sphere.centre[k] = boxsize_test * uniform(rng);
+      sphere.vel[k] = 200 * uniform(rng) - 100;
+    }
+    sphere.radius = 0.05 + 0.5 * uniform(rng);
+    /* Spinning fast enough that the dispersion isn't lost in the bulk
+     * velocity (it comes from <v^2> - V^2). */
+    sphere.omega = 10 + 90 * uniform(rng);
+    sphere.part_mass = 0.01 + uniform(rng);
+    sphere.nshell = 1 + 2 * (rng() % 200);
+    spheres.push_back(sphere);
+  }
+
+  size_t npart = 0;
+  for (const TestSphere &sphere : spheres) {
+    npart += 6 * sphere.nshell;
+  }
+  Generation gen;
+  gen.reserve(npart);
+  HaloCatalog &catalog = gen.catalog;
+  catalog.nhalos = spheres.size();
+  catalog.part_offsets.push_back(0);
+  for (const TestSphere &sphere : spheres) {
+    add_sphere(sphere, rng, gen, catalog.part_members);
+    catalog.npart.push_back(6 * sphere.nshell);
+    catalog.part_offsets.push_back(catalog.part_members.size());
+  }
+  check(catalog.npart[0] >= prop_large_halo_npart);
+  check(catalog.npart[1] < prop_large_halo_npart);
+  gen.attach(engine->domain);
+
+  calculate_halo_properties(engine, catalog);
+  size_t nwrong = 0;
+  for (size_t i = 0; i < spheres.size(); i++) {
+    nwrong += !check_sphere(catalog, i, spheres[i]);
+  }
+  check(nwrong == 0);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+  Engine *engine = test_engine(Parameters(), 4);
+  double box[3] = {boxsize_test, boxsize_test, boxsize_test};
+  engine->domain = new Domain(box, 1);
+  check(engine->prop_registry.props == prop_all);
+  check_spheres(engine);
+  return test_finish("test_properties");
+}
@@ -0,0 +1,158 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of the parallel radix sort (radix_sort).
+ ******************************************************************************/
+
+/* Includes. */
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+
+/* Local includes. */
+#include "radix_sort.h"
+#include "testing.h"
+
+/** @brief Check a sort matches a stable sort on the same bits of the keys.
+ *
+ * The payload is each element's original position, so equal keys have to
+ * keep their order.
+ *
+ * @param threadpool The threadpool.
+ * @param keys The keys to sort.
+ * @param min_key, max_key The key range passed to the sort.
+ * @param mask The bits the sort should order on.
+ * @param with_scratch Should the caller provide the scratch?
+ */
+template <typename K>
+static void check_sort(ThreadPool *threadpool, std::vector<K> keys,
+                       K min_key, K max_key, K mask, bool with_scratch) {
+
+  size_t n = keys.size();
+  std::vector<uint64_t> vals(n);
+  std::iota(vals.begin(), vals.end(), 0);
+
+  /* What it should come out as. */
+  std::vector<std::pair<K, uint64_t>> expected(n);
+  for (size_t i = 0; i < n; i++) {
+    expected[i] = {keys[i], vals[i]};
+  }
+  std::stable_sort(expected.begin(), expected.end(),
+                   [mask](const std::pair<K, uint64_t> &a,
+                          const std::pair<K, uint64_t> &b) {
+                     return (a.first & mask) < (b.first & mask);
+                   });
+
+  std::vector<K> key_scratch(with_scratch ? n : 0);
+  std::vector<uint64_t> val_scratch(with_scratch ? n : 0);
+  radix_sort<K, uint64_t>(threadpool, keys.data(), vals.data(), n,
+                          with_scratch ? key_scratch.data() : nullptr,
+                          with_scratch ? val_scratch.data() : nullptr,
+                          min_key, max_key);
+
+  size_t nwrong = 0;
+  for (size_t i = 0; i < n; i++) {
+    nwrong += keys[i] != expected[i].first || vals[i] != expected[i].second;
+  }
+  check(nwrong == 0);
+}
+
+/** @brief Sorting over the full range of the keys.
+ *
+ * @param threadpool The threadpool.
+ */
+static void check_full_range(ThreadPool *threadpool) {
+  std::mt19937_64 rng(1);
+
+  /* Enough elements to be split into several chunks, with plenty of
+   * repeats. */
+  size_t n = 5 * radix_min_chunk + 17;
+  std::vector<uint64_t> keys(n);
+  for (uint64_t &key : keys) {
+    key = rng() % 1000 * 0x0100010001000100ull;
+  }
+  check_sort<uint64_t>(threadpool, keys, 0, UINT64_MAX, UINT64_MAX, false);
+  check_sort<uint64_t>(threadpool, keys, 0, UINT64_MAX, UINT64_MAX, true);
+
+  /* Every bit in use, and narrower keys. */
+  std::vector<uint32_t> keys32(n);
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = rng();
+    keys32[i] = static_cast<uint32_t>(rng());
+  }
+  check_sort<uint64_t>(threadpool, keys, 0, UINT64_MAX, UINT64_MAX, false);
+  check_sort<uint32_t>(threadpool, keys32, 0, UINT32_MAX, UINT32_MAX, false);
+
+  /* Already sorted, reversed, and all the same. */
+  std::sort(keys.begin(), keys.end());
+  check_sort<uint64_t>(threadpool, keys, 0, UINT64_MAX, UINT64_MAX, false);
+  std::reverse(keys.begin(), keys.end());
+  check_sort<uint64_t>(threadpool, keys, 0, UINT64_MAX, UINT64_MAX, false);
+  std::fill(keys.begin(), keys.end(), 42);
+  check_sort<uint64_t>(threadpool, keys, 0, UINT64_MAX, UINT64_MAX, false);
+
+  /* Too few elements to need sorting. */
+  check_sort<uint64_t>(threadpool, {}, 0, UINT64_MAX, UINT64_MAX, false);
+  check_sort<uint64_t>(threadpool, {7}, 0, UINT64_MAX, UINT64_MAX, false);
+  check_sort<uint64_t>(threadpool, {9, 3}, 0, UINT64_MAX, UINT64_MAX, false);
+}
+
+/** @brief Sorting only the bits that differ within a key range.
+ *
+ * @param threadpool The threadpool.
+ */
+static void check_key_range(ThreadPool *threadpool) {
+  std::mt19937_64 rng(2);
+  size_t n = 3 * radix_min_chunk + 5;
+
+  /* Keys sharing their top bits, as IDs offset from a large first ID do,
+   * only take the passes over the bits below (an odd number here, so the
+   * result has to be copied back from the scratch). */
+  uint64_t base = 0xabcd000000000000ull;
+  std::vector<uint64_t> keys(n);
+  for (uint64_t &key : keys) {
+    key = base + rng() % (1ull << 20);
+  }
+  check_sort<uint64_t>(threadpool, keys, base, base + (1ull << 20) - 1,
+                       UINT64_MAX, false);
+  check_sort<uint64_t>(threadpool, keys, base, base + (1ull << 20) - 1,
+                       UINT64_MAX, true);
+
+  /* The passes above the range really are skipped: told the keys are below
+   * 2^16 the sort orders them on their bottom 16 bits alone (stably). */
+  for (uint64_t &key : keys) {
+    key = rng();
+  }
+  check_sort<uint64_t>(threadpool, keys, 0, 0xffff, 0xffff, false);
+
+  /* A pass where every key has the same digit is skipped too. */
+  for (uint64_t &key : keys) {
+    key = (rng() % 256) | 0x5500 | (rng() % 256) << 16;
+  }
+  check_sort<uint64_t>(threadpool, keys, 0, 0xffffff, UINT64_MAX, false);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+  ThreadPool threadpool(4);
+  check_full_range(&threadpool);
+  check_key_range(&threadpool);
+  return test_finish("test_radix_sort");
+}
@@ -0,0 +1,154 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of writing compressed datasets (HDF5Helper),
+ * read back with HDF5 alone.
+ ******************************************************************************/
+
+/* Includes. */
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "serial_io.h"
+#include "testing.h"
+
+/* The rows in a chunk. */
+#define chunk_rows_test 1000
+
+/** @brief Read a dataset back with the HDF5 C API, checking it's chunked
+ * with the filters HDF5 would have used.
+ *
+ * @param path The file.
+ * @param name The dataset.
+ * @param shuffled Should it be shuffled (multi-byte values)?
+ * @param values The values read (resized).
+ *
+ * @return Whether the dataset is stored as expected.
+ */
+template <typename T>
+static bool read_plain(const std::string &path, const std::string &name,
+                       bool shuffled, std::vector<T> &values) {
+  hid_t file = H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+  hid_t dataset = H5Dopen2(file, name.c_str(), H5P_DEFAULT);
+  hid_t space = H5Dget_space(dataset);
+  values.resize(H5Sget_simple_extent_npoints(space));
+  bool ok = H5Dread(dataset, h5_type<T>().getId(), H5S_ALL, H5S_ALL,
+                    H5P_DEFAULT, values.data()) >= 0;
+
+  /* Shuffled then deflated, as HDF5 applies them. */
+  hid_t plist = H5Dget_create_plist(dataset);
+  ok &= H5Pget_layout(plist) == H5D_CHUNKED;
+  int nfilters = H5Pget_nfilters(plist);
+  ok &= nfilters == (shuffled ? 2 : 1);
+  for (int f = 0; f < nfilters && ok; f++) {
+    unsigned flags;
+    size_t nvalues = 0;
+    H5Z_filter_t filter = H5Pget_filter2(plist, f, &flags, &nvalues, nullptr,
+                                         0, nullptr, nullptr);
+    ok &= filter == (shuffled && f == 0 ? H5Z_FILTER_SHUFFLE
+                                        : H5Z_FILTER_DEFLATE);
+  }
+
+  H5Pclose(plist);
+  H5Sclose(space);
+  H5Dclose(dataset);
+  H5Fclose(file);
+  return ok;
+}
+
+/** @brief Write compressed datasets of several types and shapes, then read
+ * them back with HDF5 and check every value.
+ *
+ * @param path The file.
+ * @param pool The threads compressing the chunks (nullptr for none).
+ */
+static void check_round_trip(const std::string &path, ThreadPool *pool) {
+
+  /* Many chunks (the last partial), part of a chunk, and a single row. */
+  std::vector<size_t> nrows = {123456, 567, 1};
+  {
+    HDF5Helper file(path, H5F_ACC_TRUNC);
+    file.setCompression(4, chunk_rows_test, pool);
+    for (size_t n : nrows) {
+      std::string group = "/Rows" + std::to_string(n);
+      check(file.createGroup(group));
+      std::vector<int64_t> ids(n);
+      std::vector<double> coords(3 * n);
+      std::vector<uint8_t> types(n);
+      for (size_t i = 0; i < n; i++) {
+        ids[i] = static_cast<int64_t>(i * 2654435761u) - 1000;
+        types[i] = static_cast<uint8_t>(i % 7);
+        for (int k = 0; k < 3; k++) {
+          coords[3 * i + k] = 0.001 * i + k;
+        }
+      }
+      check(file.writeDataset(group + "/IDs", ids));
+      check(file.writeDataset(group + "/Coordinates", coords, 3));
+      check(file.writeDataset(group + "/Types", types));
+    }
+    check(file.writeDataset("/Empty", std::vector<double>()));
+  }
+
+  for (size_t n : nrows) {
+    std::string group = "/Rows" + std::to_string(n);
+    std::vector<int64_t> ids;
+    std::vector<double> coords;
+    std::vector<uint8_t> types;
+    check(read_plain(path, group + "/IDs", true, ids));
+    check(read_plain(path, group + "/Coordinates", true, coords));
+    check(read_plain(path, group + "/Types", false, types));
+    check(ids.size() == n && coords.size() == 3 * n && types.size() == n);
+    size_t nwrong = 0;
+    for (size_t i = 0; i < n && ids.size() == n && coords.size() == 3 * n &&
+                       types.size() == n;
+         i++) {
+      nwrong += ids[i] != static_cast<int64_t>(i * 2654435761u) - 1000;
+      nwrong += types[i] != i % 7;
+      for (int k = 0; k < 3; k++) {
+        nwrong += coords[3 * i + k] != 0.001 * i + k;
+      }
+    }
+    check(nwrong == 0);
+  }
+
+  /* An empty dataset isn't chunked. */
+  HDF5Helper file(path);
+  std::vector<hsize_t> dims;
+  check(file.getDatasetDims("/Empty", dims) && dims.size() == 1 &&
+        dims[0] == 0);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+  std::filesystem::path dir =
+      std::filesystem::temp_directory_path() / "mega_test_serial_io";
+  std::filesystem::create_directories(dir);
+  std::string path = (dir / "compressed.hdf5").string();
+
+  /* On the writing thread alone, then on a pool (reused for a second file,
+   * as the pipeline reuses it for every output). */
+  check_round_trip(path, nullptr);
+  ThreadPool pool(4);
+  check_round_trip(path, &pool);
+  check_round_trip(path, &pool);
+
+  std::filesystem::remove_all(dir);
+  return test_finish("test_serial_io");
+}
@@ -0,0 +1,169 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This file contains the tests of reading datasets in slabs (read_slabs),
+ * straight from the file and through HDF5.
+ ******************************************************************************/
+
+/* Includes. */
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/* Local includes. */
+#include "generation.h"
+#include "slab_io.h"
+#include "testing.h"
+
+/* The rows in each dataset (several slabs, not a whole number of chunks). */
+#define nrows_test (2 * slab_rows + 12345)
+
+/* The rows in a chunk of the chunked datasets (slabs span chunks). */
+#define chunk_rows_test 1000
+
+/** @brief Write a dataset in chunks of whole rows, uncompressed.
+ *
+ * @param file The file.
+ * @param name The dataset.
+ * @param data The values (nrows * ncols of them).
+ * @param ncols The number of columns.
+ * @param nwritten The number of rows written (the rest are never allocated).
+ */
+template <typename T>
+static void write_chunked(HDF5Helper &file, const std::string &name,
+                          const T *data, hsize_t ncols, hsize_t nwritten) {
+  hsize_t dims[2] = {nrows_test, ncols};
+  hsize_t chunk[2] = {chunk_rows_test, ncols};
+  int rank = ncols > 1 ? 2 : 1;
+  H5::DataSpace space(rank, dims);
+  H5::DSetCreatPropList plist;
+  plist.setChunk(rank, chunk);
+  plist.setAllocTime(H5D_ALLOC_TIME_INCR);
+  H5::DataSet dataset =
+      file.file.createDataSet(name, h5_type<T>(), space, plist);
+
+  hsize_t start[2] = {0, 0}, count[2] = {nwritten, ncols};
+  H5::DataSpace mem_space(rank, count);
+  space.selectHyperslab(H5S_SELECT_SET, count, start);
+  dataset.write(data, h5_type<T>(), mem_space, space);
+}
+
+/** @brief Write the IDs and coordinates laid out in every way read.
+ *
+ * @param path The file.
+ */
+static void write_file(const std::string &path) {
+  std::vector<size_t> ids(nrows_test);
+  std::vector<double> coords(3 * nrows_test);
+  for (size_t i = 0; i < nrows_test; i++) {
+    ids[i] = 7 * i + 3;
+    for (int k = 0; k < 3; k++) {
+      coords[3 * i + k] = i + 0.25 * k;
+    }
+  }
+
+  HDF5Helper file(path, H5F_ACC_TRUNC);
+  check(file.createGroup("/Contiguous") && file.createGroup("/Chunked") &&
+        file.createGroup("/Compressed") && file.createGroup("/Partial"));
+  check(file.writeDataset("/Contiguous/ParticleIDs", ids));
+  check(file.writeDataset("/Contiguous/Coordinates", coords, 3));
+  write_chunked(file, "/Chunked/ParticleIDs", ids.data(), 1, nrows_test);
+  write_chunked(file, "/Chunked/Coordinates", coords.data(), 3, nrows_test);
+  write_chunked(file, "/Partial/ParticleIDs", ids.data(), 1, nrows_test / 2);
+  write_chunked(file, "/Partial/Coordinates", coords.data(), 3,
+                nrows_test / 2);
+  file.setCompression(4, chunk_rows_test);
+  check(file.writeDataset("/Compressed/ParticleIDs", ids));
+  check(file.writeDataset("/Compressed/Coordinates", coords, 3));
+}
+
+/** @brief Read some rows of a group's datasets into the fields of particles,
+ * and the IDs into an array of their own, checking every value.
+ *
+ * @param path The file.
+ * @param group The group.
+ * @param ranges The rows to read.
+ * @param ndirect The number of datasets that should be read directly.
+ */
+static void check_read(const std::string &path, const std::string &group,
+                       const std::vector<RowRange> &ranges, size_t ndirect) {
+  size_t nread = 0;
+  for (const RowRange &range : ranges) {
+    nread += range.count;
+  }
+  Generation gen;
+  gen.reserve(nread);
+  std::vector<size_t> ids(nread);
+
+  HDF5Helper file(path);
+  std::vector<SlabTarget> targets = {
+      {group + "/ParticleIDs", reinterpret_cast<char *>(&gen.dark_matter[0].id),
+       sizeof(DMParticle), 1, &h5_type<size_t>()},
+      {group + "/Coordinates",
+       reinterpret_cast<char *>(gen.dark_matter[0].pos), sizeof(DMParticle),
+       3, &h5_type<double>()},
+      {group + "/ParticleIDs", reinterpret_cast<char *>(ids.data()),
+       sizeof(size_t), 1, &h5_type<size_t>()}};
+  check(read_slabs(file, targets, ranges, 4) == ndirect);
+
+  /* Rows written only to the first half are read as zeros after it. */
+  bool partial = group == "/Partial";
+  size_t nwrong = 0, dest = 0;
+  for (const RowRange &range : ranges) {
+    for (size_t row = range.start; row < range.start + range.count; row++) {
+      bool written = !partial || row < nrows_test / 2;
+      const DMParticle &part = gen.dark_matter[dest];
+      nwrong += part.id != (written ? 7 * row + 3 : 0);
+      nwrong += ids[dest] != part.id;
+      for (int k = 0; k < 3; k++) {
+        nwrong += part.pos[k] != (written ? row + 0.25 * k : 0);
+      }
+      dest++;
+    }
+  }
+  check(nwrong == 0);
+}
+
+int main(int argc, char *argv[]) {
+  test_init(&argc, &argv);
+
+  std::filesystem::path dir =
+      std::filesystem::temp_directory_path() / "mega_test_slab_io";
+  std::filesystem::create_directories(dir);
+  std::string path = (dir / "slabs.hdf5").string();
+  write_file(path);
+
+  /* Everything, and runs starting and ending mid chunk. */
+  std::vector<RowRange> all = {{0, nrows_test}};
+  std::vector<RowRange> runs = {
+      {3, 1500}, {250000, 200000}, {nrows_test - 10, 10}};
+
+  /* Uncompressed datasets are read directly however they're stored, the
+   * rest through HDF5. */
+  for (const std::vector<RowRange> &ranges : {all, runs}) {
+    check_read(path, "/Contiguous", ranges, 3);
+    check_read(path, "/Chunked", ranges, 3);
+    check_read(path, "/Compressed", ranges, 0);
+    check_read(path, "/Partial", ranges, 0);
+  }
+
+  /* Only the chunks read need to have been written. */
+  check_read(path, "/Partial", {{10, nrows_test / 2 - 20}}, 3);
+
+  std::filesystem::remove_all(dir);
+  return test_finish("test_slab_io");
+}
@@ -0,0 +1,105 @@
+/*******************************************************************************
+ * This file is part of MEGA++.
+ * Copyright (c) 2023 Will Roper (w.roper@sussex.ac.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This header file contains the helpers shared by the unit tests. Each test
+ * is a program of its own (run by ctest) making a series of checks, and
+ * fails with a non-zero exit code if any of them do.
+ ******************************************************************************/
+#ifndef TESTING_H_
+#define TESTING_H_
+
+/* Includes */
+#include <cstdio>
+
+/* Local includes */
+#include "cmd_parser.h"
+#include "comms.h"
+#include "engine.h"
+#include "logging.h"
+#include "params.h"
+
+// Definition of the static instance pointer, this is required for the
+// singleton pattern (as in mega.cpp, every test being its own program).
+Logging *Logging::instance = nullptr;
+
+/* The number of checks failed so far. */
+inline int test_failures = 0;
+
+/* Check a condition, reporting it if it fails (and carrying on). */
+#define check(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,    \
+                   #cond);                                                     \
+      test_failures++;                                                         \
+    }                                                                          \
+  } while (0)
+
+/** @brief Start a test, only logging errors.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ */
+inline void test_init(int *argc, char ***argv) {
+  comms_init(argc, argv);
+  Logging::getInstance(ERROR);
+}
+
+/** @brief Make an engine for a test.
+ *
+ * Only the parameters every run needs are set on top of those given, the
+ * rest take their defaults. Nothing is read or written until the test asks.
+ * As in mega.cpp the engine lives until the program ends.
+ *
+ * @param params The parameters.
+ * @param nthreads The number of threads.
+ */
+inline Engine *test_engine(Parameters params, int nthreads = 2) {
+
+  /* Getting a parameter sets its default if it wasn't given. */
+  params.getParameter("Gravity/comoving_DM_softening", 0.01);
+  params.getParameter("Gravity/max_physical_DM_softening", 0.01);
+  params.getParameter("Input/snapshot_count", 1);
+  params.getParameter("Profiling/cpu_profiling", 0);
+  params.getParameter("Profiling/mem_profiling", 0);
+
+  CommandLineParser parser;
+  parser.AddOption(std::string("--verbose"), std::string("-v"), 0);
+  parser.AddOption(std::string("--threads"), std::string("-t"), nthreads);
+  parser.AddOption(std::string("--restart"), std::string("-r"), 0);
+  Engine *engine = new Engine(params, parser, Logging::getInstance());
+  engine->domain = nullptr;
+  return engine;
+}
+
+/** @brief Finish a test, reporting how it went.
+ *
+ * @param name The test.
+ *
+ * @return The exit code (non-zero if any check failed).
+ */
+inline int test_finish(const char *name) {
+  comms_finalize();
+  if (test_failures > 0) {
+    std::fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+    return 1;
+  }
+  std::printf("%s: passed\n", name);
+  return 0;
+}
+
+#endif // TESTING_H_